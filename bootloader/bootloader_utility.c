@@ -174,35 +174,212 @@ bool bootloader_utility_binary_is_valid(pi_device_t *flash, uint32_t flash_offse
     return is_valid;
 }
 
-static void load_segment(pi_device_t *flash, const uint32_t partition_offset, const bin_segment_t *segment)
-{
-    static PI_L2 uint8_t
-    l2_buffer[L2_BUFFER_SIZE];
+#if defined(CONFIG_BOOTLOADER_CHECK_VERIFIED_IMAGE)
+#define DIGEST_BUFFER_SIZE 1024
 
-//	int encrypted = conf.info.encrypted;
+/*
+ * An image written by a verified update is hashed again before its first
+ * boot, to check that it was not corrupted in the flash since then. This reads
+ * the whole image, so it is only done if enabled at build time, the digest
+ * computed by the updater is trusted otherwise.
+ */
+static bool bootloader_utility_image_digest_is_valid(pi_device_t *flash, const bootloader_state_t *bs,
+                                                     const ota_state_t *ota_state)
+{
+    const flash_partition_pos_t *pos;
+    MD5_CTX context;
+    uint8_t res[16];
+    uint8_t *buffer;
+    
+    if(ota_state->image_subtype != PI_PARTITION_SUBTYPE_APP_OTA_0 &&
+       ota_state->image_subtype != PI_PARTITION_SUBTYPE_APP_OTA_1)
+        return false;
     
-    bool isL2Section = segment->ptr >= 0x1C000000 && segment->ptr < 0x1D000000;
+    pos = &bs->ota[ota_state->image_subtype - PI_PARTITION_SUBTYPE_APP_OTA_0];
+    if(pos->offset == 0 || ota_state->image_size > pos->size)
+        return false;
     
-    if(isL2Section)
+    buffer = pi_l2_malloc(DIGEST_BUFFER_SIZE);
+    if(buffer == NULL)
+        return false;
+    
+    MD5_Init(&context);
+    for (uint32_t offset = 0; offset < ota_state->image_size; offset += DIGEST_BUFFER_SIZE)
     {
-        SSBL_TRC("Load segment to L2 memory at 0x%lX", segment->ptr);
-        pi_flash_read(flash, partition_offset + segment->start, (void *) segment->ptr, segment->size);
-    } else
+        uint32_t size = ota_state->image_size - offset;
+        if(size > DIGEST_BUFFER_SIZE)
+            size = DIGEST_BUFFER_SIZE;
+        
+        pi_flash_read(flash, pos->offset + offset, buffer, size);
+        MD5_Update(&context, buffer, size);
+    }
+    MD5_Final(res, &context);
+    
+    pi_l2_free(buffer, DIGEST_BUFFER_SIZE);
+    
+    return memcmp(res, ota_state->image_md5, sizeof(res)) == 0;
+}
+#endif
+
+#define LOADER_BUFFER_SIZE (L2_BUFFER_SIZE / 2)
+
+/*
+ * Segments going to L2 are read by the flash driver directly to their
+ * destination, they are all enqueued at once. The other ones are copied to
+ * FC TCDM through 2 L2 buffers, a chunk is copied while the next one is read.
+ * The reads are chained from their completion callbacks.
+ */
+typedef struct
+{
+    pi_device_t *flash;
+    uint32_t partition_offset;
+    const bin_segment_t *segments;
+    uint32_t nb_segments;
+    
+    uint8_t buffers[2][LOADER_BUFFER_SIZE];
+    uint8_t buffer;
+    uint32_t tcdm_segment;
+    uint32_t tcdm_offset;
+    uint32_t tcdm_size;
+    pi_task_t tcdm_task;
+    pi_task_t segment_tasks[MAX_NB_SEGMENT];
+    
+    uint32_t nb_pending;
+    pi_task_t *end_task;
+    uint32_t start_us;
+    uint32_t done_us[MAX_NB_SEGMENT];
+} segment_loader_t;
+
+static PI_L2 segment_loader_t loader;
+
+static bool is_l2_section(uint32_t ptr)
+{
+    return ptr >= 0x1C000000 && ptr < 0x1D000000;
+}
+
+static void segment_loader_segment_done(uint32_t index)
+{
+    loader.done_us[index] = pi_time_get_us();
+    loader.nb_pending--;
+    if(loader.nb_pending == 0)
+        pi_task_push(loader.end_task);
+}
+
+static void segment_loader_l2_done(void *arg)
+{
+    segment_loader_segment_done((uint32_t) (uintptr_t) arg);
+}
+
+static void segment_loader_tcdm_done(void *arg);
+
+// Read the next chunk of the segments going to FC TCDM, if any
+static void segment_loader_tcdm_read(void)
+{
+    const bin_segment_t *segment = NULL;
+    
+    while (loader.tcdm_segment < loader.nb_segments)
+    {
+        segment = loader.segments + loader.tcdm_segment;
+        if(!is_l2_section(segment->ptr) && loader.tcdm_offset < segment->size)
+            break;
+        loader.tcdm_segment++;
+        loader.tcdm_offset = 0;
+    }
+    
+    if(loader.tcdm_segment == loader.nb_segments)
+        return;
+    
+    loader.tcdm_size = segment->size - loader.tcdm_offset;
+    if(loader.tcdm_size > LOADER_BUFFER_SIZE)
+        loader.tcdm_size = LOADER_BUFFER_SIZE;
+    
+    pi_flash_read_async(loader.flash, loader.partition_offset + segment->start + loader.tcdm_offset,
+                        loader.buffers[loader.buffer], loader.tcdm_size,
+                        pi_task_callback(&loader.tcdm_task, segment_loader_tcdm_done, NULL));
+}
+
+static void segment_loader_tcdm_done(void *arg)
+{
+    uint32_t index = loader.tcdm_segment;
+    const bin_segment_t *segment = loader.segments + index;
+    uint8_t *buffer = loader.buffers[loader.buffer];
+    void *dest = (void *) (segment->ptr + loader.tcdm_offset);
+    uint32_t size = loader.tcdm_size;
+    bool segment_done;
+    
+    loader.tcdm_offset += size;
+    loader.buffer ^= 1;
+    segment_done = loader.tcdm_offset == segment->size;
+    
+    // The other buffer is free, start reading the next chunk before copying
+    segment_loader_tcdm_read();
+    
+    memcpy(dest, buffer, size);
+    
+    if(segment_done)
+        segment_loader_segment_done(index);
+}
+
+static void load_segments(pi_device_t *flash, const uint32_t partition_offset, const bin_segment_t *segments,
+                          uint32_t nb_segments)
+{
+    pi_task_t task;
+    int irq;
+    
+//	int encrypted = conf.info.encrypted;
+    
+    loader.flash = flash;
+    loader.partition_offset = partition_offset;
+    loader.segments = segments;
+    loader.nb_segments = nb_segments;
+    loader.buffer = 0;
+    loader.tcdm_segment = 0;
+    loader.tcdm_offset = 0;
+    loader.nb_pending = 1;
+    loader.end_task = pi_task_block(&task);
+    loader.start_us = pi_time_get_us();
+    
+    // The completion callbacks are held until every read is enqueued
+    irq = hal_irq_disable();
+    for (uint32_t i = 0; i < nb_segments; i++)
     {
+        const bin_segment_t *segment = segments + i;
+        
+        loader.done_us[i] = loader.start_us;
+        if(segment->size == 0)
+            continue;
         
-        SSBL_TRC("Load segment to FC TCDM memory at 0xlX (using a L2 buffer).", segment->ptr);
-        size_t remaining_size = segment->size;
-        while (remaining_size > 0)
+        loader.nb_pending++;
+        if(is_l2_section(segment->ptr))
+        {
+            SSBL_TRC("Load segment %u to L2 memory at 0x%lX", i, segment->ptr);
+            pi_flash_read_async(flash, partition_offset + segment->start, (void *) segment->ptr, segment->size,
+                                pi_task_callback(&loader.segment_tasks[i], segment_loader_l2_done, (void *) (uintptr_t) i));
+        }
+        else
         {
-            size_t iter_size = (remaining_size > L2_BUFFER_SIZE) ? L2_BUFFER_SIZE : remaining_size;
-            SSBL_TRC("Remaining size 0x%lX, it size %lu", remaining_size, iter_size);
-            pi_flash_read(flash, partition_offset + segment->start, l2_buffer, iter_size);
-            memcpy((void *) segment->ptr, (void *) l2_buffer, iter_size);
-            remaining_size -= iter_size;
+            SSBL_TRC("Load segment %u to FC TCDM memory at 0x%lX (using L2 buffers).", i, segment->ptr);
         }
     }
+    
+    segment_loader_tcdm_read();
+    
+    // Drop the reference held while the reads were enqueued
+    loader.nb_pending--;
+    if(loader.nb_pending == 0)
+        pi_task_push(loader.end_task);
+    hal_irq_restore(irq);
+    
+    pi_task_wait_on(&task);
 
 //	aes_unencrypt(area->ptr, area->size);
+    
+    for (uint32_t i = 0; i < nb_segments; i++)
+    {
+        SSBL_INF("Segment %u: 0x%lX bytes to 0x%lX, loaded after %lu us",
+                 i, segments[i].size, segments[i].ptr, loader.done_us[i] - loader.start_us);
+    }
+    SSBL_INF("Segments loaded in %lu us", pi_time_get_us() - loader.start_us);
 }
 
 pi_err_t bootloader_utility_boot_from_partition(pi_device_t *flash, const uint32_t partition_offset)
@@ -241,10 +418,9 @@ pi_err_t bootloader_utility_boot_from_partition(pi_device_t *flash, const uint32
             seg->start += 0x94;
             seg->size -= 0x94;
         }
-        
-        load_segment(flash, partition_offset, seg);
     }
     
+    load_segments(flash, partition_offset, bin_desc.segments, bin_desc.header.nb_segments);
     
     SSBL_TRC("Close flash");
     pi_flash_close(flash);
@@ -311,7 +487,8 @@ pi_partition_subtype_t bootloader_utility_get_boot_stable_partition(const bootlo
 pi_partition_subtype_t bootloader_utility_get_boot_partition(const flash_partition_table_t *table, const bootloader_state_t *bs)
 {
     pi_err_t rc;
-    ota_state_t *ota_state = NULL;
+    ota_state_t ota_state_l2;
+    ota_state_t *ota_state = &ota_state_l2;
     pi_partition_subtype_t subtype;
     
     SSBL_INF("Try to read OTA data from flash.");
@@ -336,6 +513,17 @@ pi_partition_subtype_t bootloader_utility_get_boot_partition(const flash_partiti
             return ota_state->stable;
         
         case PI_OTA_IMG_NEW:
+#if defined(CONFIG_BOOTLOADER_CHECK_VERIFIED_IMAGE)
+            if(ota_utility_image_is_verified(ota_state, ota_state->once) &&
+               !bootloader_utility_image_digest_is_valid(table->flash, bs, ota_state))
+            {
+                SSBL_ERR("New app differs from the verified update. Abort it and boot to the stable app.");
+                ota_state->state = PI_OTA_IMG_ABORTED;
+                ota_utility_write_ota_data(table, ota_state);
+                return bootloader_utility_get_boot_stable_partition(bs, ota_state);
+            }
+#endif
+            
             SSBL_INF("An update is available, try to upgrade app.");
             ota_state->state = PI_OTA_IMG_PENDING_VERIFY;
             ota_utility_write_ota_data(table, ota_state);
@@ -19,6 +19,7 @@
  */
 
 #include "bsp/flash.h"
+#include "bsp/partition.h"
 
 
 int pi_flash_open(struct pi_device *device)
@@ -30,6 +31,16 @@ int pi_flash_open(struct pi_device *device)
 }
 
 
+void pi_flash_close(struct pi_device *device)
+{
+  pi_flash_api_t *api = (pi_flash_api_t *)device->api;
+
+  // The device structure can be opened again with another flash
+  pi_partition_table_invalidate(device);
+  api->close(device);
+}
+
+
 void __flash_conf_init(struct pi_flash_conf *conf)
 {
 }
@@ -25,6 +25,27 @@
 
 #define SECTOR_SIZE (1<<18)
 
+// Period at which an on-going erase checks if it must be suspended for
+// waiting high priority reads
+#define HYPERFLASH_ERASE_TICK_US  2000
+// Period for checking if the flash is suspended after the suspend command
+#define HYPERFLASH_SUSPEND_POLL_US 20
+// Maximum number of reads executed while an operation is suspended, so that
+// it still makes progress
+#define HYPERFLASH_PREEMPT_MAX    8
+
+#if defined(PMSIS_DRIVERS) || defined(__PULPOS2__)
+#define HYPERFLASH_TASK_DATA(task) ((task)->data)
+#define HYPERFLASH_TASK_NEXT(task) ((task)->next)
+#else
+#define HYPERFLASH_TASK_DATA(task) ((task)->implem.data)
+#define HYPERFLASH_TASK_NEXT(task) ((task)->implem.next)
+#endif  /* PMSIS_DRIVERS */
+
+// Index of the task data where the priority of a waiting task is stored,
+// the task data belongs to the driver while the task is waiting
+#define STALL_TASK_PRIO_INDEX   6
+
 #define STALL_TASK_PROGRAM      0
 #define STALL_TASK_ERASE_CHIP   1
 #define STALL_TASK_ERASE_SECTOR 2
@@ -33,6 +54,12 @@
 #define STALL_TASK_READ         5
 #define STALL_TASK_READ_2D      6
 
+// Manufacturers whose hyperflash parts support erase suspend and resume
+static const uint16_t hyperflash_suspend_manufacturers[] = {
+  0x0001, // Cypress / Infineon
+  0x009D, // ISSI
+};
+
 typedef struct {
   struct pi_device hyper_device;
   // Used for communications with hyperflash through udma
@@ -70,6 +97,28 @@ typedef struct {
   uint32_t pending_erase_hyper_addr;
   uint32_t pending_erase_size;
 
+  // State of the on-going chip or sector erase, which is waited by ticks so
+  // that it can be suspended
+  uint32_t erase_addr;
+  int erase_suspendable;
+  uint32_t erase_elapsed_us;
+  uint32_t erase_next_poll_us;
+  uint32_t erase_poll_period_us;
+
+  // 1 if the part supports erase suspend and resume
+  int erase_suspend;
+
+  // Area modified by the on-going program or erase, that the reads going
+  // before it must not access
+  uint32_t op_start;
+  uint32_t op_end;
+
+  // Read executed while the on-going operation is paused, and what to call
+  // to continue the operation once the waiting reads are done
+  pi_task_t *preempt_task;
+  void (*preempt_resume)(void *arg);
+  int preempt_count;
+
 } hyperflash_t;
 
 
@@ -80,7 +129,7 @@ static void hyperflash_check_program(void *arg);
 
 static void hyperflash_erase_async(struct pi_device *device, uint32_t addr, int size, pi_task_t *task);
 
-static int hyperflash_stall_task(hyperflash_t *hyperflash, pi_task_t *task, uint32_t id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4);
+static int hyperflash_stall_task(hyperflash_t *hyperflash, pi_task_t *task, int prio, uint32_t id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4);
 
 static void hyperflash_handle_pending_task(void *arg);
 
@@ -88,6 +137,10 @@ static void hyperflash_erase_chip_async(struct pi_device *device, pi_task_t *tas
 
 static void hyperflash_erase_sector_async(struct pi_device *device, uint32_t addr, pi_task_t *task);
 
+static void hyperflash_preempt_next(void *arg);
+
+static void hyperflash_check_erase(void *arg);
+
 static void hyperflash_set_reg_exec(hyperflash_t *hyperflash, unsigned int addr, unsigned short value)
 {
   hyperflash->udma_buffer[0] = value;
@@ -120,6 +173,27 @@ static unsigned int hyperflash_get_status_reg(hyperflash_t *hyperflash)
 
 
 
+// Read the manufacturer ID from the ID-CFI address space to know if erases
+// can be suspended
+static int hyperflash_erase_suspend_supported(hyperflash_t *hyperflash)
+{
+  hyperflash_set_reg_exec(hyperflash, 0x555<<1, 0xAA);
+  hyperflash_set_reg_exec(hyperflash, 0x2AA<<1, 0x55);
+  hyperflash_set_reg_exec(hyperflash, 0x555<<1, 0x90);
+  uint16_t manufacturer = hyperflash_get_reg_exec(hyperflash, 0);
+  hyperflash_set_reg_exec(hyperflash, 0, 0xF0);
+
+  for (unsigned int i = 0; i < sizeof(hyperflash_suspend_manufacturers) / sizeof(hyperflash_suspend_manufacturers[0]); i++)
+  {
+    if (hyperflash_suspend_manufacturers[i] == manufacturer)
+      return 1;
+  }
+
+  return 0;
+}
+
+
+
 static int hyperflash_open(struct pi_device *device)
 {
   struct pi_hyperflash_conf *conf = (struct pi_hyperflash_conf *)device->config;
@@ -159,6 +233,10 @@ static int hyperflash_open(struct pi_device *device)
   hyperflash->erase_task = NULL;
   hyperflash->erase_waiting_first = NULL;
 
+  hyperflash->preempt_task = NULL;
+
+  hyperflash->erase_suspend = hyperflash_erase_suspend_supported(hyperflash);
+
   return 0;
 
 error:
@@ -198,7 +276,7 @@ static void hyperflash_reg_set_async(struct pi_device *device, uint32_t addr, ui
 {
   hyperflash_t *hyperflash = (hyperflash_t *)device->data;
 
-  if (hyperflash_stall_task(hyperflash, task, STALL_TASK_REG_SET, addr, (uint32_t)value, 0, 0, 0))
+  if (hyperflash_stall_task(hyperflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_REG_SET, addr, (uint32_t)value, 0, 0, 0))
     return;
 
   hyperflash_set_reg_exec(hyperflash, addr, *(uint16_t *)value);
@@ -212,7 +290,7 @@ static void hyperflash_reg_get_async(struct pi_device *device, uint32_t addr, ui
 {
   hyperflash_t *hyperflash = (hyperflash_t *)device->data;
 
-  if (hyperflash_stall_task(hyperflash, task, STALL_TASK_REG_GET, addr, (uint32_t)value, 0, 0, 0))
+  if (hyperflash_stall_task(hyperflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_REG_GET, addr, (uint32_t)value, 0, 0, 0))
     return;
 
   *(uint16_t *)value = hyperflash_get_reg_exec(hyperflash, addr);
@@ -222,11 +300,11 @@ static void hyperflash_reg_get_async(struct pi_device *device, uint32_t addr, ui
 
 
 
-static void hyperflash_read_async(struct pi_device *device, uint32_t addr, void *data, uint32_t size, pi_task_t *task)
+static void hyperflash_read_prio_async(struct pi_device *device, uint32_t addr, void *data, uint32_t size, int prio, pi_task_t *task)
 {
   hyperflash_t *hyperflash = (hyperflash_t *)device->data;
 
-  if (hyperflash_stall_task(hyperflash, task, STALL_TASK_READ, addr, (uint32_t)data, size, 0, 0))
+  if (hyperflash_stall_task(hyperflash, task, prio, STALL_TASK_READ, addr, (uint32_t)data, size, 0, 0))
     return;
 
   pi_hyper_read_async(&hyperflash->hyper_device, addr, data, size, pi_task_callback(&hyperflash->task, hyperflash_handle_pending_task, device));
@@ -234,11 +312,18 @@ static void hyperflash_read_async(struct pi_device *device, uint32_t addr, void
 
 
 
+static void hyperflash_read_async(struct pi_device *device, uint32_t addr, void *data, uint32_t size, pi_task_t *task)
+{
+  hyperflash_read_prio_async(device, addr, data, size, PI_FLASH_PRIO_NORMAL, task);
+}
+
+
+
 static void hyperflash_read_2d_async(struct pi_device *device, uint32_t addr, void *data, uint32_t size, uint32_t stride, uint32_t length, pi_task_t *task)
 {
   hyperflash_t *hyperflash = (hyperflash_t *)device->data;
 
-  if (hyperflash_stall_task(hyperflash, task, STALL_TASK_READ_2D, addr, (uint32_t)data, size, stride, length))
+  if (hyperflash_stall_task(hyperflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_READ_2D, addr, (uint32_t)data, size, stride, length))
   {
     return;
   }
@@ -371,57 +456,96 @@ static void hyperflash_handle_pending_erase_task(void *arg)
 
 
 
-static int hyperflash_stall_task(hyperflash_t *hyperflash, pi_task_t *task, uint32_t id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4)
+static inline int hyperflash_task_is_read(uint32_t id)
 {
-  uint32_t irq = disable_irq();
+  return id == STALL_TASK_READ || id == STALL_TASK_READ_2D;
+}
 
-#if defined(PMSIS_DRIVERS) || defined(__PULPOS2__)
-  if (hyperflash->pending_task != NULL)
-  {
-    task->data[0] = id;
-    task->data[1] = arg0;
-    task->data[2] = arg1;
-    task->data[3] = arg2;
-    task->data[4] = arg3;
-    task->data[5] = arg4;
-    task->next = NULL;
 
-    if (hyperflash->waiting_first)
-    {
-      hyperflash->waiting_last->next = task;
-    }
-    else
-    {
-      hyperflash->waiting_first = task;
-    }
 
-    hyperflash->waiting_last = task;
+// Get the flash area accessed by a waiting operation, which is the whole flash for the operations on registers
+static void hyperflash_task_area(uint32_t *data, uint32_t *start, uint32_t *end)
+{
+  *start = 0;
+  *end = 0xFFFFFFFF;
 
-    restore_irq(irq);
-    return 1;
+  switch (data[0])
+  {
+    case STALL_TASK_PROGRAM:
+    case STALL_TASK_READ:
+      *start = data[1];
+      *end = data[1] + data[3];
+      break;
+
+    case STALL_TASK_READ_2D:
+      *start = data[1];
+      *end = data[3] ? data[1] + (data[3] - 1) / data[5] * data[4] + data[5] : data[1];
+      break;
+
+    case STALL_TASK_ERASE_SECTOR:
+      *start = data[1] & ~(SECTOR_SIZE - 1);
+      *end = *start + SECTOR_SIZE;
+      break;
   }
-#else
+}
+
+
+
+// Tell if 2 operations must be executed in order, which is the case if one of them modifies the area accessed
+// by the other one
+static int hyperflash_task_conflict(uint32_t *data0, uint32_t *data1)
+{
+  if (hyperflash_task_is_read(data0[0]) && hyperflash_task_is_read(data1[0]))
+    return 0;
+
+  uint32_t start0, end0, start1, end1;
+  hyperflash_task_area(data0, &start0, &end0);
+  hyperflash_task_area(data1, &start1, &end1);
+
+  return start0 < end1 && start1 < end0;
+}
+
+
+
+// The waiting queue is sorted by priority, operations with the same priority stay in order. An operation is
+// also kept after the waiting ones accessing the same area if one of them modifies it.
+static int hyperflash_stall_task(hyperflash_t *hyperflash, pi_task_t *task, int prio, uint32_t id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4)
+{
+  uint32_t irq = disable_irq();
+
   if (hyperflash->pending_task != NULL)
   {
-    task->implem.data[0] = id;
-    task->implem.data[1] = arg0;
-    task->implem.data[2] = arg1;
-    task->implem.data[3] = arg2;
-    task->implem.data[4] = arg3;
-    task->implem.data[5] = arg4;
+    uint32_t *data = HYPERFLASH_TASK_DATA(task);
+    data[0] = id;
+    data[1] = arg0;
+    data[2] = arg1;
+    data[3] = arg2;
+    data[4] = arg3;
+    data[5] = arg4;
+    data[STALL_TASK_PRIO_INDEX] = prio;
+
+    pi_task_t *prev = NULL;
+    for (pi_task_t *current = hyperflash->waiting_first; current; current = HYPERFLASH_TASK_NEXT(current))
+    {
+      uint32_t *current_data = HYPERFLASH_TASK_DATA(current);
+      if ((int)current_data[STALL_TASK_PRIO_INDEX] >= prio || hyperflash_task_conflict(current_data, data))
+        prev = current;
+    }
+
+    pi_task_t *next = prev ? HYPERFLASH_TASK_NEXT(prev) : hyperflash->waiting_first;
 
-    if (hyperflash->waiting_first)
-      hyperflash->waiting_last->implem.next = task;
+    HYPERFLASH_TASK_NEXT(task) = next;
+    if (prev)
+      HYPERFLASH_TASK_NEXT(prev) = task;
     else
       hyperflash->waiting_first = task;
 
-    hyperflash->waiting_last = task;
-    task->implem.next = NULL;
+    if (next == NULL)
+      hyperflash->waiting_last = task;
 
     restore_irq(irq);
     return 1;
   }
-#endif  /* PMSIS_DRIVERS */
 
   hyperflash->pending_task = task;
 
@@ -431,6 +555,85 @@ static int hyperflash_stall_task(hyperflash_t *hyperflash, pi_task_t *task, uint
 
 
 
+// Return the first waiting operation if it is a high priority read which can go before the on-going
+// operation, as it does not access the modified area.
+static pi_task_t *hyperflash_preempting_read(hyperflash_t *hyperflash)
+{
+  pi_task_t *task = hyperflash->waiting_first;
+
+  if (task == NULL)
+    return NULL;
+
+  uint32_t *data = HYPERFLASH_TASK_DATA(task);
+  if (data[STALL_TASK_PRIO_INDEX] < PI_FLASH_PRIO_HIGH || !hyperflash_task_is_read(data[0]))
+    return NULL;
+
+  uint32_t start, end;
+  hyperflash_task_area(data, &start, &end);
+  if (start < hyperflash->op_end && hyperflash->op_start < end)
+    return NULL;
+
+  return task;
+}
+
+
+
+// Execute the high priority reads which are waiting while the on-going
+// operation is paused, and then call the specified function to continue it.
+// This must only be called when the internal task is not in use.
+static void hyperflash_preempt(struct pi_device *device, void (*resume)(void *arg))
+{
+  hyperflash_t *hyperflash = (hyperflash_t *)device->data;
+
+  hyperflash->preempt_resume = resume;
+  hyperflash->preempt_count = 0;
+  hyperflash_preempt_next(device);
+}
+
+
+
+static void hyperflash_preempt_next(void *arg)
+{
+  struct pi_device *device = (struct pi_device *)arg;
+  hyperflash_t *hyperflash = (hyperflash_t *)device->data;
+
+  if (hyperflash->preempt_task)
+  {
+    pi_task_enqueue(hyperflash->preempt_task);
+    hyperflash->preempt_task = NULL;
+  }
+
+  uint32_t irq = disable_irq();
+
+  pi_task_t *task = NULL;
+  if (hyperflash->preempt_count < HYPERFLASH_PREEMPT_MAX)
+    task = hyperflash_preempting_read(hyperflash);
+
+  if (task)
+    hyperflash->waiting_first = HYPERFLASH_TASK_NEXT(task);
+
+  restore_irq(irq);
+
+  if (task == NULL)
+  {
+    hyperflash->preempt_resume(device);
+    return;
+  }
+
+  hyperflash->preempt_task = task;
+  hyperflash->preempt_count++;
+
+  uint32_t *data = HYPERFLASH_TASK_DATA(task);
+  pi_task_t *done = pi_task_callback(&hyperflash->task, hyperflash_preempt_next, device);
+
+  if (data[0] == STALL_TASK_READ)
+    pi_hyper_read_async(&hyperflash->hyper_device, data[1], (void *)data[2], data[3], done);
+  else
+    pi_hyper_read_2d_async(&hyperflash->hyper_device, data[1], (void *)data[2], data[3], data[4], data[5], done);
+}
+
+
+
 static int hyperflash_stall_erase_task(hyperflash_t *hyperflash, pi_task_t *task, uint32_t id, uint32_t arg0, uint32_t arg1, uint32_t arg2)
 {
   uint32_t irq = disable_irq();
@@ -529,6 +732,11 @@ static void hyperflash_check_program(void *arg)
     // Typical buffer programming time is 475us
     pi_task_push_delayed_us(pi_task_callback(&hyperflash->task, hyperflash_check_program, device), 250);
   }
+  else if (hyperflash->pending_size && hyperflash_preempting_read(hyperflash))
+  {
+    // Let the high priority reads go between 2 buffers
+    hyperflash_preempt(device, hyperflash_program_resume);
+  }
   else
   {
     hyperflash_program_resume(device);
@@ -541,13 +749,16 @@ static void hyperflash_program_async(struct pi_device *device, uint32_t hyper_ad
 {
   hyperflash_t *hyperflash = (hyperflash_t *)device->data;
 
-  if (hyperflash_stall_task(hyperflash, task, STALL_TASK_PROGRAM, hyper_addr, (uint32_t)data, size, 0, 0))
+  if (hyperflash_stall_task(hyperflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_PROGRAM, hyper_addr, (uint32_t)data, size, 0, 0))
     return;
 
   hyperflash->pending_hyper_addr = hyper_addr;
   hyperflash->pending_data = (uint32_t)data;
   hyperflash->pending_size = size;
 
+  hyperflash->op_start = hyper_addr;
+  hyperflash->op_end = hyper_addr + size;
+
   hyperflash_program_resume(device);
 }
 
@@ -555,15 +766,91 @@ static void hyperflash_program_async(struct pi_device *device, uint32_t hyper_ad
 
 
 
+// Wait one tick of the on-going erase
+static void hyperflash_erase_wait(struct pi_device *device)
+{
+  hyperflash_t *hyperflash = (hyperflash_t *)device->data;
+
+  pi_task_push_delayed_us(pi_task_callback(&hyperflash->task, hyperflash_check_erase, device), HYPERFLASH_ERASE_TICK_US);
+}
+
+
+
+// Start waiting for an erase which has just been sent to the flash. The status is first checked after
+// the specified delay and then periodically.
+static void hyperflash_erase_start(struct pi_device *device, uint32_t addr, int suspendable, uint32_t first_poll_us, uint32_t poll_period_us)
+{
+  hyperflash_t *hyperflash = (hyperflash_t *)device->data;
+
+  hyperflash->erase_addr = addr;
+  hyperflash->erase_suspendable = suspendable;
+  hyperflash->erase_elapsed_us = 0;
+  hyperflash->erase_next_poll_us = first_poll_us;
+  hyperflash->erase_poll_period_us = poll_period_us;
+
+  hyperflash_erase_wait(device);
+}
+
+
+
+// Called once the waiting reads have been executed while the erase was suspended
+static void hyperflash_erase_restart(void *arg)
+{
+  struct pi_device *device = (struct pi_device *)arg;
+  hyperflash_t *hyperflash = (hyperflash_t *)device->data;
+
+  hyperflash_set_reg_exec(hyperflash, hyperflash->erase_addr, 0x30);
+
+  hyperflash_erase_wait(device);
+}
+
+
+
+// This callback is called after the erase has been asked to suspend, to check if the reads can start.
+static void hyperflash_check_suspend(void *arg)
+{
+  struct pi_device *device = (struct pi_device *)arg;
+  hyperflash_t *hyperflash = (hyperflash_t *)device->data;
+
+  if (((hyperflash_get_status_reg(hyperflash) >> 7) & 1) == 0)
+  {
+    pi_task_push_delayed_us(pi_task_callback(&hyperflash->task, hyperflash_check_suspend, device), HYPERFLASH_SUSPEND_POLL_US);
+  }
+  else
+  {
+    hyperflash_preempt(device, hyperflash_erase_restart);
+  }
+}
+
+
+
+// This callback is called at each tick of an erase operation. It suspends sector erases if high priority
+// reads are waiting and the part supports it, and checks the status periodically to know when the erase is done.
 static void hyperflash_check_erase(void *arg)
 {
   struct pi_device *device = (struct pi_device *)arg;
   hyperflash_t *hyperflash = (hyperflash_t *)device->data;
 
+  hyperflash->erase_elapsed_us += HYPERFLASH_ERASE_TICK_US;
+
+  if (hyperflash->erase_suspendable && hyperflash->erase_suspend && hyperflash_preempting_read(hyperflash))
+  {
+    hyperflash_set_reg_exec(hyperflash, hyperflash->erase_addr, 0xB0);
+    pi_task_push_delayed_us(pi_task_callback(&hyperflash->task, hyperflash_check_suspend, device), HYPERFLASH_SUSPEND_POLL_US);
+    return;
+  }
+
+  if (hyperflash->erase_elapsed_us < hyperflash->erase_next_poll_us)
+  {
+    hyperflash_erase_wait(device);
+    return;
+  }
+
   uint32_t reg_status = hyperflash_get_status_reg(hyperflash);
   if (((reg_status >> 7) & 1) == 0)
   {
-    pi_task_push_delayed_us(pi_task_callback(&hyperflash->task, hyperflash_check_erase, device), 100000);
+    hyperflash->erase_next_poll_us += hyperflash->erase_poll_period_us;
+    hyperflash_erase_wait(device);
   }
   else
   {
@@ -576,7 +863,7 @@ static void hyperflash_erase_chip_async(struct pi_device *device, pi_task_t *tas
 {
   hyperflash_t *hyperflash = (hyperflash_t *)device->data;
 
-  if (hyperflash_stall_task(hyperflash, task, STALL_TASK_ERASE_CHIP, 0, 0, 0, 0, 0))
+  if (hyperflash_stall_task(hyperflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_ERASE_CHIP, 0, 0, 0, 0, 0))
     return;
 
   // Enqueue command header synchronously as this should be quick
@@ -587,7 +874,11 @@ static void hyperflash_erase_chip_async(struct pi_device *device, pi_task_t *tas
   hyperflash_set_reg_exec(hyperflash, 0x2AA<<1, 0x55);
   hyperflash_set_reg_exec(hyperflash, 0x555<<1, 0x10);
 
-  pi_task_push_delayed_us(pi_task_callback(&hyperflash->task, hyperflash_check_erase, device), 100000);
+  hyperflash->op_start = 0;
+  hyperflash->op_end = 0xFFFFFFFF;
+
+  // Chip erase cannot be suspended
+  hyperflash_erase_start(device, 0, 0, 100000, 100000);
 }
 
 
@@ -595,7 +886,7 @@ static void hyperflash_erase_sector_async(struct pi_device *device, uint32_t add
 {
   hyperflash_t *hyperflash = (hyperflash_t *)device->data;
 
-  if (hyperflash_stall_task(hyperflash, task, STALL_TASK_ERASE_SECTOR, addr, 0, 0, 0, 0))
+  if (hyperflash_stall_task(hyperflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_ERASE_SECTOR, addr, 0, 0, 0, 0))
     return;
 
   // Enqueue command header synchronously as this should be quick
@@ -606,8 +897,11 @@ static void hyperflash_erase_sector_async(struct pi_device *device, uint32_t add
   hyperflash_set_reg_exec(hyperflash, 0x2AA<<1, 0x55);
   hyperflash_set_reg_exec(hyperflash, addr, 0x30);
 
+  hyperflash->op_start = addr & ~(SECTOR_SIZE - 1);
+  hyperflash->op_end = hyperflash->op_start + SECTOR_SIZE;
+
   // Typical sector erase time is 930ms but keep it short as this time is shorter or some platform
-  pi_task_push_delayed_us(pi_task_callback(&hyperflash->task, hyperflash_check_erase, device), 10000);
+  hyperflash_erase_start(device, addr, 1, 10000, 100000);
 }
 
 
@@ -776,6 +1070,7 @@ static pi_flash_api_t hyperflash_api = {
   .reg_get              = &hyperflash_reg_get,
   .copy                 = &hyperflash_copy,
   .copy_2d              = &hyperflash_copy_2d,
+  .read_prio_async      = &hyperflash_read_prio_async,
 };
 
 
@@ -0,0 +1,554 @@
+/*
+ * Copyright (C) 2019 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pmsis.h"
+#include "bsp/flash/simflash.h"
+
+#if defined(__riscv__)
+#error "simflash needs a POSIX host and can't be built for the target"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct {
+  uint8_t *image;
+  int fd;
+  uint32_t size;
+  uint32_t sector_size;
+  uint32_t page_size;
+  uint32_t flash_start;
+
+  uint32_t read_latency_us;
+  uint32_t read_bandwidth;
+  uint32_t program_time_us;
+  uint32_t program_bandwidth;
+  uint32_t erase_time_us;
+
+  // Operations are executed one after the other, this is the date at which
+  // the last one is done
+  uint32_t busy_until_us;
+
+  // Erase count of each sector
+  uint32_t *sector_erases;
+
+  struct pi_simflash_stats stats;
+} simflash_t;
+
+
+static void simflash_check_range(simflash_t *simflash, uint32_t addr, uint32_t size)
+{
+    if (addr > simflash->size || size > simflash->size - addr)
+    {
+        printf("[SIMFLASH] Access out of flash (addr: 0x%x, size: 0x%x, flash size: 0x%x)\n",
+            (unsigned int)addr, (unsigned int)size, (unsigned int)simflash->size);
+        abort();
+    }
+}
+
+
+static inline uint64_t simflash_transfer_time_us(uint32_t size, uint32_t bandwidth)
+{
+    if (bandwidth == 0)
+        return 0;
+
+    return ((uint64_t)size * 1000000 + bandwidth - 1) / bandwidth;
+}
+
+
+// Account the duration of an operation and notify the task once the flash
+// would have completed it, after the operations already queued
+static void simflash_complete(simflash_t *simflash, uint64_t duration_us, pi_task_t *task)
+{
+    simflash->stats.busy_time_us += duration_us;
+
+    uint32_t now = pi_time_get_us();
+    uint32_t start = (int32_t)(simflash->busy_until_us - now) > 0 ? simflash->busy_until_us : now;
+
+    simflash->busy_until_us = start + duration_us;
+
+    if (simflash->busy_until_us == now)
+        pi_task_push(task);
+    else
+        pi_task_push_delayed_us(task, simflash->busy_until_us - now);
+}
+
+
+static void simflash_read_exec(simflash_t *simflash, uint32_t addr, void *data, uint32_t size)
+{
+    simflash_check_range(simflash, addr, size);
+
+    memcpy(data, simflash->image + addr, size);
+
+    simflash->stats.nb_reads++;
+    simflash->stats.read_bytes += size;
+}
+
+
+static void simflash_program_exec(simflash_t *simflash, uint32_t addr, const void *data, uint32_t size)
+{
+    const uint8_t *src = (const uint8_t *)data;
+    uint8_t *dst = simflash->image + addr;
+
+    simflash_check_range(simflash, addr, size);
+
+    for (uint32_t i=0; i<size; i++)
+    {
+        // NOR cells can only go from 1 to 0 without an erase
+        if (src[i] & ~dst[i])
+            simflash->stats.program_conflicts++;
+
+        dst[i] &= src[i];
+    }
+
+    simflash->stats.nb_programs++;
+    simflash->stats.program_bytes += size;
+}
+
+
+static uint32_t simflash_nb_pages(simflash_t *simflash, uint32_t addr, uint32_t size)
+{
+    if (size == 0)
+        return 0;
+
+    uint32_t first = addr / simflash->page_size;
+    uint32_t last = (addr + size - 1) / simflash->page_size;
+
+    return last - first + 1;
+}
+
+
+static void simflash_erase_exec(simflash_t *simflash, uint32_t first_sector, uint32_t nb_sectors)
+{
+    for (uint32_t i=first_sector; i<first_sector + nb_sectors; i++)
+    {
+        memset(simflash->image + i * simflash->sector_size, 0xff, simflash->sector_size);
+
+        simflash->sector_erases[i]++;
+        if (simflash->sector_erases[i] > simflash->stats.max_sector_erases)
+            simflash->stats.max_sector_erases = simflash->sector_erases[i];
+    }
+
+    simflash->stats.nb_sector_erases += nb_sectors;
+}
+
+
+static int simflash_image_open(simflash_t *simflash, const char *path)
+{
+    if (path == NULL)
+    {
+        simflash->fd = -1;
+        simflash->image = mmap(NULL, simflash->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (simflash->image == MAP_FAILED)
+            return -1;
+
+        memset(simflash->image, 0xff, simflash->size);
+        return 0;
+    }
+
+    struct stat st;
+
+    simflash->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (simflash->fd < 0)
+        goto error0;
+
+    if (fstat(simflash->fd, &st))
+        goto error1;
+
+    if (st.st_size < simflash->size && ftruncate(simflash->fd, simflash->size))
+        goto error1;
+
+    simflash->image = mmap(NULL, simflash->size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, simflash->fd, 0);
+    if (simflash->image == MAP_FAILED)
+        goto error1;
+
+    // The part added to the image is in the erased state
+    if (st.st_size < simflash->size)
+        memset(simflash->image + st.st_size, 0xff, simflash->size - st.st_size);
+
+    return 0;
+
+error1:
+    close(simflash->fd);
+error0:
+    printf("[SIMFLASH] Failed to open flash image (path: %s)\n", path);
+    return -1;
+}
+
+
+static int simflash_open(struct pi_device *device)
+{
+    struct pi_simflash_conf *conf = (struct pi_simflash_conf *)device->config;
+
+    if (conf->sector_size == 0 || conf->page_size == 0 ||
+        conf->size % conf->sector_size)
+        goto error0;
+
+    simflash_t *simflash = (simflash_t *)pi_l2_malloc(sizeof(simflash_t));
+    if (simflash == NULL)
+        goto error0;
+
+    memset(simflash, 0, sizeof(simflash_t));
+
+    simflash->size = conf->size;
+    simflash->sector_size = conf->sector_size;
+    simflash->page_size = conf->page_size;
+    simflash->flash_start = conf->flash_start;
+    simflash->read_latency_us = conf->read_latency_us;
+    simflash->read_bandwidth = conf->read_bandwidth;
+    simflash->program_time_us = conf->program_time_us;
+    simflash->program_bandwidth = conf->program_bandwidth;
+    simflash->erase_time_us = conf->erase_time_us;
+
+    uint32_t erases_size = conf->size / conf->sector_size * sizeof(uint32_t);
+    simflash->sector_erases = (uint32_t *)pi_l2_malloc(erases_size);
+    if (simflash->sector_erases == NULL)
+        goto error1;
+
+    memset(simflash->sector_erases, 0, erases_size);
+
+    if (simflash_image_open(simflash, conf->path))
+        goto error2;
+
+    device->data = (void *)simflash;
+
+    return 0;
+
+error2:
+    pi_l2_free(simflash->sector_erases, erases_size);
+error1:
+    pi_l2_free(simflash, sizeof(simflash_t));
+error0:
+    return -1;
+}
+
+
+static void simflash_close(struct pi_device *device)
+{
+    simflash_t *simflash = (simflash_t *)device->data;
+
+    if (simflash->fd >= 0)
+    {
+        msync(simflash->image, simflash->size, MS_SYNC);
+        munmap(simflash->image, simflash->size);
+        close(simflash->fd);
+    }
+    else
+    {
+        munmap(simflash->image, simflash->size);
+    }
+
+    pi_l2_free(simflash->sector_erases, simflash->size / simflash->sector_size * sizeof(uint32_t));
+    pi_l2_free(simflash, sizeof(simflash_t));
+}
+
+
+static int32_t simflash_ioctl(struct pi_device *device, uint32_t cmd, void *arg)
+{
+    simflash_t *simflash = (simflash_t *)device->data;
+
+    switch (cmd)
+    {
+        case PI_FLASH_IOCTL_INFO:
+        {
+            struct pi_flash_info *flash_info = (struct pi_flash_info *)arg;
+            flash_info->sector_size = simflash->sector_size;
+            flash_info->flash_start = simflash->flash_start;
+            break;
+        }
+
+        case PI_FLASH_IOCTL_MAP:
+        {
+            struct pi_flash_map *map = (struct pi_flash_map *)arg;
+            simflash_check_range(simflash, map->addr, map->size);
+            map->ptr = simflash->image + map->addr;
+            break;
+        }
+    }
+    return 0;
+}
+
+
+static void simflash_read_async(struct pi_device *device, uint32_t addr, void *data, uint32_t size, pi_task_t *task)
+{
+    simflash_t *simflash = (simflash_t *)device->data;
+
+    simflash_read_exec(simflash, addr, data, size);
+
+    simflash_complete(simflash, simflash->read_latency_us +
+        simflash_transfer_time_us(size, simflash->read_bandwidth), task);
+}
+
+
+static void simflash_program_async(struct pi_device *device, uint32_t addr, const void *data, uint32_t size, pi_task_t *task)
+{
+    simflash_t *simflash = (simflash_t *)device->data;
+
+    simflash_program_exec(simflash, addr, data, size);
+
+    simflash_complete(simflash,
+        simflash_nb_pages(simflash, addr, size) * (uint64_t)simflash->program_time_us +
+        simflash_transfer_time_us(size, simflash->program_bandwidth), task);
+}
+
+
+static void simflash_erase_chip_async(struct pi_device *device, pi_task_t *task)
+{
+    simflash_t *simflash = (simflash_t *)device->data;
+    uint32_t nb_sectors = simflash->size / simflash->sector_size;
+
+    simflash_erase_exec(simflash, 0, nb_sectors);
+
+    simflash_complete(simflash, nb_sectors * (uint64_t)simflash->erase_time_us, task);
+}
+
+
+static void simflash_erase_async(struct pi_device *device, uint32_t addr, int size, pi_task_t *task)
+{
+    simflash_t *simflash = (simflash_t *)device->data;
+
+    if (size <= 0)
+    {
+        pi_task_push(task);
+        return;
+    }
+
+    // Like the other flashes, all the sectors overlapping the area are erased
+    uint32_t first = addr / simflash->sector_size;
+    uint32_t last = (addr + size + simflash->sector_size - 1) / simflash->sector_size;
+
+    simflash_check_range(simflash, first * simflash->sector_size,
+        (last - first) * simflash->sector_size);
+
+    simflash_erase_exec(simflash, first, last - first);
+
+    simflash_complete(simflash, (last - first) * (uint64_t)simflash->erase_time_us, task);
+}
+
+
+static void simflash_erase_sector_async(struct pi_device *device, uint32_t addr, pi_task_t *task)
+{
+    simflash_t *simflash = (simflash_t *)device->data;
+
+    simflash_erase_async(device, addr / simflash->sector_size * simflash->sector_size, 1, task);
+}
+
+
+static void simflash_reg_set_async(struct pi_device *device, uint32_t addr, uint8_t *value, pi_task_t *task)
+{
+    pi_task_push(task);
+}
+
+
+static void simflash_reg_get_async(struct pi_device *device, uint32_t addr, uint8_t *value, pi_task_t *task)
+{
+    *value = 0;
+    pi_task_push(task);
+}
+
+
+static int simflash_copy_async(struct pi_device *device, uint32_t flash_addr, void *buffer, uint32_t size, int ext2loc, pi_task_t *task)
+{
+    if (ext2loc)
+        simflash_read_async(device, flash_addr, buffer, size, task);
+    else
+        simflash_program_async(device, flash_addr, buffer, size, task);
+
+    return 0;
+}
+
+
+static int simflash_copy_2d_async(struct pi_device *device, uint32_t flash_addr, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int ext2loc, pi_task_t *task)
+{
+    simflash_t *simflash = (simflash_t *)device->data;
+    uint8_t *data = (uint8_t *)buffer;
+    uint32_t nb_pages = 0;
+
+    if (length == 0)
+        return -1;
+
+    // The buffer is contiguous while lines of length bytes are taken every
+    // stride bytes in the flash
+    for (uint32_t done = 0; done < size; done += length)
+    {
+        uint32_t iter_size = size - done < length ? size - done : length;
+
+        if (ext2loc)
+        {
+            simflash_read_exec(simflash, flash_addr, data + done, iter_size);
+        }
+        else
+        {
+            simflash_program_exec(simflash, flash_addr, data + done, iter_size);
+            nb_pages += simflash_nb_pages(simflash, flash_addr, iter_size);
+        }
+
+        flash_addr += stride;
+    }
+
+    if (ext2loc)
+        simflash_complete(simflash, simflash->read_latency_us +
+            simflash_transfer_time_us(size, simflash->read_bandwidth), task);
+    else
+        simflash_complete(simflash, nb_pages * (uint64_t)simflash->program_time_us +
+            simflash_transfer_time_us(size, simflash->program_bandwidth), task);
+
+    return 0;
+}
+
+
+static int simflash_read(struct pi_device *device, uint32_t addr, void *data, uint32_t size)
+{
+    pi_task_t task;
+    simflash_read_async(device, addr, data, size, pi_task_block(&task));
+    pi_task_wait_on(&task);
+    return 0;
+}
+
+
+static int simflash_program(struct pi_device *device, uint32_t addr, const void *data, uint32_t size)
+{
+    pi_task_t task;
+    simflash_program_async(device, addr, data, size, pi_task_block(&task));
+    pi_task_wait_on(&task);
+    return 0;
+}
+
+
+static int simflash_erase_chip(struct pi_device *device)
+{
+    pi_task_t task;
+    simflash_erase_chip_async(device, pi_task_block(&task));
+    pi_task_wait_on(&task);
+    return 0;
+}
+
+
+static int simflash_erase_sector(struct pi_device *device, uint32_t addr)
+{
+    pi_task_t task;
+    simflash_erase_sector_async(device, addr, pi_task_block(&task));
+    pi_task_wait_on(&task);
+    return 0;
+}
+
+
+static int simflash_erase(struct pi_device *device, uint32_t addr, int size)
+{
+    pi_task_t task;
+    simflash_erase_async(device, addr, size, pi_task_block(&task));
+    pi_task_wait_on(&task);
+    return 0;
+}
+
+
+static int simflash_reg_set(struct pi_device *device, uint32_t addr, uint8_t *value)
+{
+    return 0;
+}
+
+
+static int simflash_reg_get(struct pi_device *device, uint32_t addr, uint8_t *value)
+{
+    *value = 0;
+    return 0;
+}
+
+
+static int simflash_copy(struct pi_device *device, uint32_t flash_addr, void *buffer, uint32_t size, int ext2loc)
+{
+    pi_task_t task;
+    simflash_copy_async(device, flash_addr, buffer, size, ext2loc, pi_task_block(&task));
+    pi_task_wait_on(&task);
+    return 0;
+}
+
+
+static int simflash_copy_2d(struct pi_device *device, uint32_t flash_addr, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int ext2loc)
+{
+    pi_task_t task;
+    if (simflash_copy_2d_async(device, flash_addr, buffer, size, stride, length, ext2loc, pi_task_block(&task)))
+        return -1;
+    pi_task_wait_on(&task);
+    return 0;
+}
+
+
+void pi_simflash_stats_get(struct pi_device *device, struct pi_simflash_stats *stats)
+{
+    simflash_t *simflash = (simflash_t *)device->data;
+    *stats = simflash->stats;
+}
+
+
+uint32_t pi_simflash_sector_erase_count(struct pi_device *device, uint32_t addr)
+{
+    simflash_t *simflash = (simflash_t *)device->data;
+
+    simflash_check_range(simflash, addr, 0);
+
+    return simflash->sector_erases[addr / simflash->sector_size];
+}
+
+
+static pi_flash_api_t simflash_api =
+{
+    .open                 = &simflash_open,
+    .close                = &simflash_close,
+    .ioctl                = &simflash_ioctl,
+    .read_async           = &simflash_read_async,
+    .program_async        = &simflash_program_async,
+    .erase_chip_async     = &simflash_erase_chip_async,
+    .erase_sector_async   = &simflash_erase_sector_async,
+    .erase_async          = &simflash_erase_async,
+    .reg_set_async        = &simflash_reg_set_async,
+    .reg_get_async        = &simflash_reg_get_async,
+    .copy_async           = &simflash_copy_async,
+    .copy_2d_async        = &simflash_copy_2d_async,
+    .read                 = &simflash_read,
+    .program              = &simflash_program,
+    .erase_chip           = &simflash_erase_chip,
+    .erase_sector         = &simflash_erase_sector,
+    .erase                = &simflash_erase,
+    .reg_set              = &simflash_reg_set,
+    .reg_get              = &simflash_reg_get,
+    .copy                 = &simflash_copy,
+    .copy_2d              = &simflash_copy_2d,
+};
+
+
+void pi_simflash_conf_init(struct pi_simflash_conf *conf)
+{
+    conf->flash.api = &simflash_api;
+    conf->path = NULL;
+    conf->size = 16*1024*1024;
+    conf->sector_size = 1<<12;
+    conf->page_size = 256;
+    conf->flash_start = 0;
+    conf->read_latency_us = 0;
+    conf->read_bandwidth = 0;
+    conf->program_time_us = 0;
+    conf->program_bandwidth = 0;
+    conf->erase_time_us = 0;
+    __flash_conf_init(&conf->flash);
+}
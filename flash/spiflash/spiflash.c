@@ -44,10 +44,16 @@
 #define QSPIF_QPI_FAST_READ_CMD ((uint8_t)0x0B)
 #define QSPIF_QIO_FAST_READ_CMD ((uint8_t)0xEB)
 #define QSPIF_QO_FAST_READ_CMD  ((uint8_t)0x6B)
+#define QSPIF_QIO_DTR_READ_CMD  ((uint8_t)0xED)
 #define QSPIF_PAGE_PROG_CMD     ((uint8_t)0x02)
 #define QSPIF_QIO_PAGE_PROG_CMD ((uint8_t)0x38)
 #define QSPIF_ERASE_SECTOR_CMD  ((uint8_t)0x20)
 #define QSPIF_READ_STATUS_CMD   ((uint8_t)0x05)
+#define QSPIF_READ_ID_CMD       ((uint8_t)0x9F)
+#define QSPIF_SUSPEND_CMD       ((uint8_t)0x75)
+#define QSPIF_RESUME_CMD        ((uint8_t)0x7A)
+#define QSPIF_MX_SUSPEND_CMD    ((uint8_t)0xB0)
+#define QSPIF_MX_RESUME_CMD     ((uint8_t)0x30)
 
 #define QSPIF_WR_PROLOGUE_SIZE 0x4
 
@@ -108,6 +114,110 @@
 #define SPI_LINES_FLAG PI_SPI_LINES_SINGLE
 #endif
 
+// Once the typical program or erase time has elapsed, the status is polled
+// with this fraction of the typical time as period
+#define SPIFLASH_POLL_DIVIDER   8
+#define SPIFLASH_POLL_MIN_US    20
+
+// Range of the read sizes measured by pi_spiflash_read_bench
+#define SPIFLASH_BENCH_MIN_SIZE (1<<10)
+#define SPIFLASH_BENCH_MAX_SIZE (1<<20)
+
+#define READ_MODE(mode) PI_SPIFLASH_READ_MODE(PI_SPIFLASH_READ_MODE_##mode)
+
+#define READ_MODES_SPI  (READ_MODE(1_1_1) | READ_MODE(1_1_4) | READ_MODE(1_4_4))
+#define READ_MODES_QPI  (READ_MODE(4_4_4))
+#define READ_MODES_DTR  (READ_MODE(1_4_4_DTR) | READ_MODE(4_4_4_DTR))
+
+// Read modes which can be used with the current interface configuration.
+// The SPI interface has no DTR support, and once the flash has been
+// switched to QPI mode, all transfers must be on 4 lines.
+// The default mode is used when none of them is supported by the flash, it
+// is the one the interface always used before the flash could be probed.
+#if defined(SINGLE_LINE)
+#define SPIFLASH_ITF_READ_MODES READ_MODE(1_1_1)
+#define SPIFLASH_ITF_DEFAULT_READ_MODE PI_SPIFLASH_READ_MODE_1_1_1
+#elif defined(SPI_FLASH_USE_QUAD_IO)
+#define SPIFLASH_ITF_READ_MODES READ_MODES_SPI
+#define SPIFLASH_ITF_DEFAULT_READ_MODE PI_SPIFLASH_READ_MODE_1_4_4
+#else
+#define SPIFLASH_ITF_READ_MODES READ_MODES_QPI
+#define SPIFLASH_ITF_DEFAULT_READ_MODE PI_SPIFLASH_READ_MODE_1_4_4
+#endif
+
+typedef struct {
+  uint8_t cmd;
+  uint8_t cmd_quad;         // Command sent on 4 lines
+  uint8_t addr_quad;        // Address sent on 4 lines
+  uint8_t dummy_cycles;     // Dummy cycles for MX25 parts, the others use the
+                            // read parameters programmed at open, 0 if the
+                            // command has no dummy cycles
+  uint32_t data_lines;
+} spiflash_read_mode_t;
+
+static const spiflash_read_mode_t spiflash_read_modes[PI_SPIFLASH_READ_MODE_NB] = {
+  [PI_SPIFLASH_READ_MODE_1_1_1]     = { QSPIF_READ_CMD,          0, 0, 0, PI_SPI_LINES_SINGLE },
+  [PI_SPIFLASH_READ_MODE_1_1_4]     = { QSPIF_QO_FAST_READ_CMD,  0, 0, 6, PI_SPI_LINES_QUAD },
+  [PI_SPIFLASH_READ_MODE_1_4_4]     = { QSPIF_QIO_FAST_READ_CMD, 0, 1, 4, PI_SPI_LINES_QUAD },
+  [PI_SPIFLASH_READ_MODE_4_4_4]     = { QSPIF_QIO_FAST_READ_CMD, 1, 1, 4, PI_SPI_LINES_QUAD },
+  [PI_SPIFLASH_READ_MODE_1_4_4_DTR] = { QSPIF_QIO_DTR_READ_CMD,  0, 1, 6, PI_SPI_LINES_QUAD },
+  [PI_SPIFLASH_READ_MODE_4_4_4_DTR] = { QSPIF_QIO_DTR_READ_CMD,  1, 1, 6, PI_SPI_LINES_QUAD },
+};
+
+// Read modes from the fastest to the slowest, the first one supported by
+// the flash, the interface and the configuration is selected at open
+static const uint8_t spiflash_read_modes_order[] = {
+  PI_SPIFLASH_READ_MODE_4_4_4_DTR, PI_SPIFLASH_READ_MODE_1_4_4_DTR,
+  PI_SPIFLASH_READ_MODE_4_4_4, PI_SPIFLASH_READ_MODE_1_4_4,
+  PI_SPIFLASH_READ_MODE_1_1_4, PI_SPIFLASH_READ_MODE_1_1_1,
+};
+
+typedef struct {
+  uint32_t jedec_id;        // Manufacturer and memory type IDs, capacity ID is ignored
+  uint32_t program_time_us; // Typical page program time
+  uint32_t erase_time_us;   // Typical 4KB sector erase time
+  uint32_t read_modes;      // Supported read modes
+  uint8_t suspend_cmd;      // Erase suspend command, 0 if not supported
+  uint8_t resume_cmd;       // Erase resume command
+} spiflash_part_t;
+
+// Typical timings and read modes of the supported parts, from their datasheets
+static const spiflash_part_t spiflash_parts[] = {
+  { 0x9D6000, 200, 70000, READ_MODES_SPI | READ_MODES_QPI | READ_MODES_DTR,      QSPIF_SUSPEND_CMD, QSPIF_RESUME_CMD },       // ISSI IS25LP
+  { 0x9D7000, 200, 70000, READ_MODES_SPI | READ_MODES_QPI | READ_MODES_DTR,      QSPIF_SUSPEND_CMD, QSPIF_RESUME_CMD },       // ISSI IS25WP
+  { 0xC22000, 600, 40000, READ_MODES_SPI | READ_MODES_QPI | READ_MODE(1_4_4_DTR), QSPIF_MX_SUSPEND_CMD, QSPIF_MX_RESUME_CMD }, // Macronix MX25L
+  { 0xC22500, 250, 30000, READ_MODES_SPI | READ_MODES_QPI,                       QSPIF_MX_SUSPEND_CMD, QSPIF_MX_RESUME_CMD }, // Macronix MX25U
+  { 0xC22800, 850, 40000, READ_MODES_SPI,                                        QSPIF_MX_SUSPEND_CMD, QSPIF_MX_RESUME_CMD }, // Macronix MX25R
+  { 0xEF4000, 400, 45000, READ_MODES_SPI,                                        QSPIF_SUSPEND_CMD, QSPIF_RESUME_CMD },       // Winbond W25Q
+  { 0xEF6000, 400, 45000, READ_MODES_SPI | READ_MODES_QPI,                       QSPIF_SUSPEND_CMD, QSPIF_RESUME_CMD },       // Winbond W25Q-W
+  { 0x016000, 300, 45000, READ_MODES_SPI | READ_MODES_QPI | READ_MODES_DTR,      QSPIF_SUSPEND_CMD, QSPIF_RESUME_CMD },       // Cypress S25FL-L
+};
+
+// Used for unknown parts, conservative enough for most of them. Erases are
+// not suspended as the command is not known.
+static const spiflash_part_t spiflash_default_part = { 0, 700, 50000, READ_MODES_SPI | READ_MODES_QPI, 0, 0 };
+
+// Period at which an on-going erase checks if it must be suspended for
+// waiting high priority reads
+#define SPIFLASH_ERASE_TICK_US  2000
+// Period for checking if the flash is suspended after the suspend command
+#define SPIFLASH_SUSPEND_POLL_US 20
+// Maximum number of reads executed while an operation is suspended, so that
+// it still makes progress
+#define SPIFLASH_PREEMPT_MAX    8
+
+#if defined(PMSIS_DRIVERS)
+#define SPIFLASH_TASK_DATA(task) ((task)->data)
+#define SPIFLASH_TASK_NEXT(task) ((task)->next)
+#else
+#define SPIFLASH_TASK_DATA(task) ((task)->implem.data)
+#define SPIFLASH_TASK_NEXT(task) ((task)->implem.next)
+#endif  /* PMSIS_DRIVERS */
+
+// Index of the task data where the priority of a waiting task is stored,
+// the task data belongs to the driver while the task is waiting
+#define STALL_TASK_PRIO_INDEX   6
+
 #define STALL_TASK_PROGRAM      0
 #define STALL_TASK_ERASE_CHIP   1
 #define STALL_TASK_ERASE_SECTOR 2
@@ -115,6 +225,7 @@
 #define STALL_TASK_REG_GET      4
 #define STALL_TASK_READ         5
 #define STALL_TASK_READ_2D      6
+#define STALL_TASK_ERASE        7
 
 typedef struct {
   struct pi_device qspi_dev;
@@ -125,6 +236,24 @@ typedef struct {
   uint32_t cmd_buf[2];
   uint32_t status_reg[(STATUS_REG_SIZE/4)+1];
   uint32_t configure_reg[(CONFIGURE_REG_SIZE/4)+1];
+  uint32_t jedec_id;
+
+  // Selected read mode and the lines used for its data
+  int read_mode;
+  uint32_t read_lines;
+
+  // Typical operation times, used to know when to poll the status
+  uint32_t program_time_us;
+  uint32_t erase_time_us;
+
+  // Erase suspend and resume commands of the part, suspend_cmd is 0 if the
+  // erases can't be suspended
+  uint32_t suspend_cmd;
+  uint32_t resume_cmd;
+
+  // Task used for the write enable sent before each page program, which is
+  // enqueued together with the program itself
+  pi_task_t wren_task;
 
   // Waiting que
   // Task used for internal FSM scheduling for common operations
@@ -143,6 +272,22 @@ typedef struct {
   // Task to be enqueued when the on-going operation is done
   pi_task_t *pending_task;
 
+  // State of the on-going sector erase, which is waited by ticks so that it
+  // can be suspended
+  uint32_t erase_elapsed_us;
+  uint32_t erase_next_poll_us;
+
+  // Area modified by the on-going program or erase, that the reads going
+  // before it must not access
+  uint32_t op_start;
+  uint32_t op_end;
+
+  // Read executed while the on-going operation is paused, and what to call
+  // to continue the operation once the waiting reads are done
+  pi_task_t *preempt_task;
+  void (*preempt_resume)(void *arg);
+  int preempt_count;
+
 } spi_flash_t;
 
 
@@ -163,6 +308,8 @@ static void spiflash_program_async(struct pi_device *device, uint32_t addr,
 
 static void spiflash_check_program(void *arg);
 
+static void spiflash_program_done(void *arg);
+
 static void spiflash_erase_chip_async(struct pi_device *device, pi_task_t *task);
 
 static void spiflash_erase_sector_async(struct pi_device *device, uint32_t addr, pi_task_t *task);
@@ -185,6 +332,16 @@ static int spiflash_copy_2d_async(struct pi_device *device, uint32_t flash_addr,
 
 static void spiflash_erase_resume(void *arg);
 
+static void spiflash_check_erase(void *arg);
+
+static void spiflash_preempt_next(void *arg);
+
+static void spiflash_read_exec(spi_flash_t *spiflash, uint32_t addr, void *data,
+        uint32_t size, pi_task_t *done);
+
+static void spiflash_read_2d_exec(spi_flash_t *spiflash, uint32_t addr, void *data,
+        uint32_t size, uint32_t stride, uint32_t length, pi_task_t *done);
+
 static int spiflash_copy_async(struct pi_device *device, uint32_t flash_addr,
         void *buffer, uint32_t size, int ext2loc, pi_task_t *task);
 
@@ -324,6 +481,101 @@ static void wait_wip(spi_flash_t *flash_dev)
     } while(get_wip(flash_dev));
 }
 
+static uint32_t spiflash_read_jedec_id(spi_flash_t *flash_dev)
+{
+    uint8_t *cmd_buf = (uint8_t*)flash_dev->cmd_buf;
+    uint8_t *id = (uint8_t*)flash_dev->ucode_buffer;
+    pi_device_t *qspi_dev = &flash_dev->qspi_dev;
+
+    // This is done before the flash is configured, it is still in SPI mode
+    cmd_buf[0] = QSPIF_READ_ID_CMD;
+    pi_spi_send(qspi_dev, (void*)&cmd_buf[0], 1*8,
+            PI_SPI_LINES_SINGLE | PI_SPI_CS_KEEP);
+    pi_spi_receive(qspi_dev, (void*)id, 3*8,
+            PI_SPI_LINES_SINGLE | PI_SPI_CS_AUTO);
+
+    return (id[0] << 16) | (id[1] << 8) | id[2];
+}
+
+static const spiflash_part_t *spiflash_part_get(uint32_t jedec_id)
+{
+    for (unsigned int i=0; i<sizeof(spiflash_parts)/sizeof(spiflash_part_t); i++)
+    {
+        if ((jedec_id & 0xFFFF00) == spiflash_parts[i].jedec_id)
+        {
+            return &spiflash_parts[i];
+        }
+    }
+
+    return &spiflash_default_part;
+}
+
+static void spiflash_timing_init(spi_flash_t *flash_dev,
+        struct pi_spiflash_conf *flash_conf, const spiflash_part_t *part)
+{
+    flash_dev->program_time_us = flash_conf->program_time_us ?
+        flash_conf->program_time_us : part->program_time_us;
+    flash_dev->erase_time_us = flash_conf->erase_time_us ?
+        flash_conf->erase_time_us : part->erase_time_us;
+}
+
+// Returns the fastest read mode from the specified mask, or -1 if it is empty
+static int spiflash_read_mode_select(uint32_t modes)
+{
+    for (unsigned int i=0; i<sizeof(spiflash_read_modes_order); i++)
+    {
+        if (modes & PI_SPIFLASH_READ_MODE(spiflash_read_modes_order[i]))
+        {
+            return spiflash_read_modes_order[i];
+        }
+    }
+
+    return -1;
+}
+
+// Install the receive ucode used by all reads for the specified mode
+static int spiflash_read_mode_set(spi_flash_t *flash_dev, int read_mode)
+{
+    const spiflash_read_mode_t *mode = &spiflash_read_modes[read_mode];
+    uint32_t ucode[4];
+    int ucode_size = 3*4;
+
+#ifndef MX25
+    int dummy_cycles = mode->dummy_cycles ? DUMMY_CYCLES : 0;
+#else
+    int dummy_cycles = mode->dummy_cycles;
+#endif
+
+    ucode[0] = SPI_UCODE_CMD_SEND_CMD(mode->cmd, 8, mode->cmd_quad);
+    ucode[1] = SPI_UCODE_CMD_SEND_ADDR(24, mode->addr_quad);
+    if (dummy_cycles)
+    {
+        ucode[3] = SPI_CMD_DUMMY(dummy_cycles);
+        ucode_size = 4*4;
+    }
+
+    uint8_t *receive_ucode = pi_spi_receive_ucode_set(&flash_dev->qspi_dev, (uint8_t *)ucode, ucode_size);
+    if (receive_ucode == NULL)
+    {
+        return -1;
+    }
+
+    pi_spi_receive_ucode_set_addr_info(&flash_dev->qspi_dev, receive_ucode + 2*4 + 1, 3);
+
+    flash_dev->read_mode = read_mode;
+    flash_dev->read_lines = mode->data_lines;
+
+    return 0;
+}
+
+// Period for polling the status once the typical time of an operation has
+// elapsed
+static inline uint32_t spiflash_poll_period(uint32_t typical_us)
+{
+    uint32_t period = typical_us / SPIFLASH_POLL_DIVIDER;
+    return period < SPIFLASH_POLL_MIN_US ? SPIFLASH_POLL_MIN_US : period;
+}
+
 static inline void pi_qpi_flash_conf_spi(struct pi_spi_conf *conf,
         struct pi_spiflash_conf *flash_conf)
 {
@@ -384,23 +636,27 @@ static int spiflash_open(struct pi_device *bsp_flash_dev)
 
     pi_spi_send_ucode_set_addr_info(&flash_dev->qspi_dev, send_ucode + 2*4 + 1, 3);
 
-#ifndef SINGLE_LINE  // quad line
-    ucode[0] = SPI_UCODE_CMD_SEND_CMD(QSPIF_QIO_FAST_READ_CMD, 8, 0);
-    ucode[1] = SPI_UCODE_CMD_SEND_ADDR(24, 1);
-    ucode[3] = SPI_CMD_DUMMY(DUMMY_CYCLES);
-    uint8_t *receive_ucode = pi_spi_receive_ucode_set(&flash_dev->qspi_dev, (uint8_t *)ucode, 4*4);
-#else               // single line
-    ucode[0] = SPI_UCODE_CMD_SEND_CMD(QSPIF_READ_CMD, 8, 0);
-    ucode[1] = SPI_UCODE_CMD_SEND_ADDR(24, 0);
-    uint8_t *receive_ucode = pi_spi_receive_ucode_set(&flash_dev->qspi_dev, (uint8_t *)ucode, 3*4);
-#endif
+    // Probe the part to get its timings and pick the fastest read mode
+    // it supports
+    flash_dev->jedec_id = spiflash_read_jedec_id(flash_dev);
+    const spiflash_part_t *part = spiflash_part_get(flash_dev->jedec_id);
 
-    if (receive_ucode == NULL)
+    spiflash_timing_init(flash_dev, flash_conf, part);
+
+    flash_dev->suspend_cmd = part->suspend_cmd;
+    flash_dev->resume_cmd = part->resume_cmd;
+
+    int read_mode = spiflash_read_mode_select(flash_conf->read_modes &
+        part->read_modes & SPIFLASH_ITF_READ_MODES);
+    if (read_mode < 0)
     {
-        goto error1;
+        read_mode = SPIFLASH_ITF_DEFAULT_READ_MODE;
     }
 
-    pi_spi_receive_ucode_set_addr_info(&flash_dev->qspi_dev, receive_ucode + 2*4 + 1, 3);
+    if (spiflash_read_mode_set(flash_dev, read_mode))
+    {
+        goto error1;
+    }
 
     qpi_flash_pre_config(flash_dev);
 
@@ -595,6 +851,10 @@ static void spiflash_handle_pending_task(void *arg)
         {
             spiflash_erase_sector_async(device, task->data[1], task);
         }
+        else if (task->data[0] == STALL_TASK_ERASE)
+        {
+            spiflash_erase_async(device, task->data[1], task->data[2], task);
+        }
         else if (task->data[0] == STALL_TASK_REG_SET)
         {
             spiflash_reg_set_async(device, task->data[1], (uint8_t *)task->data[2], task);
@@ -624,6 +884,10 @@ static void spiflash_handle_pending_task(void *arg)
         {
             spiflash_erase_sector_async(device, task->implem.data[1], task);
         }
+        else if (task->implem.data[0] == STALL_TASK_ERASE)
+        {
+            spiflash_erase_async(device, task->implem.data[1], task->implem.data[2], task);
+        }
         else if (task->implem.data[0] == STALL_TASK_REG_SET)
         {
             spiflash_reg_set_async(device, task->implem.data[1], (uint8_t *)task->implem.data[2], task);
@@ -638,67 +902,179 @@ static void spiflash_handle_pending_task(void *arg)
         }
         else if (task->implem.data[0] == STALL_TASK_READ_2D)
         {
-            spiflash_copy_2d_async(device, task->implem.data[1], (void *)task->implem.data[2], task->implem.data[3], 1, task->implem.data[4], task->implem.data[5], task);
+            spiflash_copy_2d_async(device, task->implem.data[1], (void *)task->implem.data[2], task->implem.data[3], task->implem.data[4], task->implem.data[5], 1, task);
         }
     #endif  /* PMSIS_DRIVERS */
     }
 }
 
 
+static inline int spiflash_task_is_read(uint32_t id)
+{
+    return id == STALL_TASK_READ || id == STALL_TASK_READ_2D;
+}
+
+
+// Get the flash area accessed by a waiting operation, which is the whole
+// flash for the operations on registers
+static void spiflash_task_area(uint32_t *data, uint32_t *start, uint32_t *end)
+{
+    *start = 0;
+    *end = 0xFFFFFFFF;
+
+    switch (data[0])
+    {
+        case STALL_TASK_PROGRAM:
+        case STALL_TASK_READ:
+            *start = data[1];
+            *end = data[1] + data[3];
+            break;
+
+        case STALL_TASK_READ_2D:
+            *start = data[1];
+            *end = data[3] ? data[1] + (data[3] - 1) / data[5] * data[4] + data[5] : data[1];
+            break;
+
+        case STALL_TASK_ERASE_SECTOR:
+            *start = data[1] & ~(SECTOR_SIZE - 1);
+            *end = *start + SECTOR_SIZE;
+            break;
+
+        case STALL_TASK_ERASE:
+            *start = data[1] & ~(SECTOR_SIZE - 1);
+            *end = data[1] + data[2];
+            break;
+    }
+}
+
+
+// Tell if 2 operations must be executed in order, which is the case if one of
+// them modifies the area accessed by the other one
+static int spiflash_task_conflict(uint32_t *data0, uint32_t *data1)
+{
+    if (spiflash_task_is_read(data0[0]) && spiflash_task_is_read(data1[0]))
+        return 0;
+
+    uint32_t start0, end0, start1, end1;
+    spiflash_task_area(data0, &start0, &end0);
+    spiflash_task_area(data1, &start1, &end1);
+
+    return start0 < end1 && start1 < end0;
+}
+
+
 // This is called to check if an operation is already pending. If so the new one is enqueued, and 1 is returned.
 // Otherwise, the specified task is registered to be triggered at the end of the operation and 0 is returned.
-static int spiflash_stall_task(spi_flash_t *spiflash, pi_task_t *task, uint32_t id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4)
+// An operation is enqueued after the waiting ones with the same or a higher priority, and after the ones
+// accessing the same area if one of them modifies it, so that it always sees the flash content as it was issued.
+static int spiflash_stall_task(spi_flash_t *spiflash, pi_task_t *task, int prio, uint32_t id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4)
 {
-    #if defined(PMSIS_DRIVERS)
     if (spiflash->pending_task != NULL)
     {
-        task->data[0] = id;
-        task->data[1] = arg0;
-        task->data[2] = arg1;
-        task->data[3] = arg2;
-        task->data[4] = arg3;
-        task->data[5] = arg4;
-        task->next = NULL;
-
-        if (spiflash->waiting_first)
+        uint32_t *data = SPIFLASH_TASK_DATA(task);
+        data[0] = id;
+        data[1] = arg0;
+        data[2] = arg1;
+        data[3] = arg2;
+        data[4] = arg3;
+        data[5] = arg4;
+        data[STALL_TASK_PRIO_INDEX] = prio;
+
+        pi_task_t *prev = NULL;
+        for (pi_task_t *current = spiflash->waiting_first; current; current = SPIFLASH_TASK_NEXT(current))
         {
-        spiflash->waiting_last->next = task;
+            uint32_t *current_data = SPIFLASH_TASK_DATA(current);
+            if ((int)current_data[STALL_TASK_PRIO_INDEX] >= prio || spiflash_task_conflict(current_data, data))
+                prev = current;
         }
+
+        pi_task_t *next = prev ? SPIFLASH_TASK_NEXT(prev) : spiflash->waiting_first;
+
+        SPIFLASH_TASK_NEXT(task) = next;
+        if (prev)
+            SPIFLASH_TASK_NEXT(prev) = task;
         else
-        {
-        spiflash->waiting_first = task;
-        }
+            spiflash->waiting_first = task;
 
-        spiflash->waiting_last = task;
+        if (next == NULL)
+            spiflash->waiting_last = task;
 
         return 1;
     }
-    #else
 
-    if (spiflash->pending_task != NULL)
-    {
-        task->implem.data[0] = id;
-        task->implem.data[1] = arg0;
-        task->implem.data[2] = arg1;
-        task->implem.data[3] = arg2;
-        task->implem.data[4] = arg3;
-        task->implem.data[5] = arg4;
+    spiflash->pending_task = task;
 
-        if (spiflash->waiting_first)
-        spiflash->waiting_last->implem.next = task;
-        else
-        spiflash->waiting_first = task;
+  return 0;
+}
 
-        spiflash->waiting_last = task;
-        task->implem.next = NULL;
 
-        return 1;
+// Return the first waiting operation if it is a high priority read which can
+// go before the on-going operation, as it does not access the modified area.
+static pi_task_t *spiflash_preempting_read(spi_flash_t *spiflash)
+{
+    pi_task_t *task = spiflash->waiting_first;
+
+    if (task == NULL)
+        return NULL;
+
+    uint32_t *data = SPIFLASH_TASK_DATA(task);
+    if (data[STALL_TASK_PRIO_INDEX] < PI_FLASH_PRIO_HIGH || !spiflash_task_is_read(data[0]))
+        return NULL;
+
+    uint32_t start, end;
+    spiflash_task_area(data, &start, &end);
+    if (start < spiflash->op_end && spiflash->op_start < end)
+        return NULL;
+
+    return task;
+}
+
+
+// Execute the high priority reads which are waiting while the on-going
+// operation is paused, and then call the specified function to continue it.
+// This must only be called when the internal task is not in use.
+static void spiflash_preempt(struct pi_device *device, void (*resume)(void *arg))
+{
+    spi_flash_t *spiflash = (spi_flash_t *)device->data;
+
+    spiflash->preempt_resume = resume;
+    spiflash->preempt_count = 0;
+    spiflash_preempt_next(device);
+}
+
+
+static void spiflash_preempt_next(void *arg)
+{
+    struct pi_device *device = (struct pi_device *)arg;
+    spi_flash_t *spiflash = (spi_flash_t *)device->data;
+
+    if (spiflash->preempt_task)
+    {
+        pi_task_push(spiflash->preempt_task);
+        spiflash->preempt_task = NULL;
     }
-    #endif  /* PMSIS_DRIVERS */
 
-    spiflash->pending_task = task;
+    pi_task_t *task = NULL;
+    if (spiflash->preempt_count < SPIFLASH_PREEMPT_MAX)
+        task = spiflash_preempting_read(spiflash);
 
-  return 0;
+    if (task == NULL)
+    {
+        spiflash->preempt_resume(device);
+        return;
+    }
+
+    spiflash->waiting_first = SPIFLASH_TASK_NEXT(task);
+    spiflash->preempt_task = task;
+    spiflash->preempt_count++;
+
+    uint32_t *data = SPIFLASH_TASK_DATA(task);
+    pi_task_t *done = pi_task_callback(&spiflash->task, spiflash_preempt_next, device);
+
+    if (data[0] == STALL_TASK_READ)
+        spiflash_read_exec(spiflash, data[1], (void *)data[2], data[3], done);
+    else
+        spiflash_read_2d_exec(spiflash, data[1], (void *)data[2], data[3], data[4], data[5], done);
 }
 
 
@@ -731,26 +1107,43 @@ static void spiflash_program_resume(void *arg)
         spiflash->pending_size -= iter_size;
 
         // any write/erase op must be preceeded by a WRITE ENABLE op,
-        // with full CS cycling
-        pi_spi_send(&spiflash->qspi_dev, (void*)g_write_enable, 8,
-                SPI_LINES_FLAG | PI_SPI_CS_AUTO);
+        // with full CS cycling. It is enqueued together with the program so
+        // that both are executed back to back without waking us up.
+        pi_spi_send_async(&spiflash->qspi_dev, (void*)g_write_enable, 8,
+                SPI_LINES_FLAG | PI_SPI_CS_AUTO, pi_task_block(&spiflash->wren_task));
 
 #ifndef SINGLE_LINE       // quad line
         // The SPI copy has been configured with proper ucode already, no need to take care
         pi_spi_copy_async(&spiflash->qspi_dev, flash_addr, (void *)data, iter_size,
             PI_SPI_COPY_LOC2EXT | PI_SPI_CS_AUTO | PI_SPI_LINES_QUAD,
-            pi_task_callback(&spiflash->task, spiflash_check_program, device));
+            pi_task_callback(&spiflash->task, spiflash_program_done, device));
 #else                     // single line
         // The SPI copy has been configured with proper ucode already, no need to take care
         pi_spi_copy_async(&spiflash->qspi_dev, flash_addr, (void *)data, iter_size,
             PI_SPI_COPY_LOC2EXT | PI_SPI_CS_AUTO | PI_SPI_LINES_SINGLE,
-            pi_task_callback(&spiflash->task, spiflash_check_program, device));
+            pi_task_callback(&spiflash->task, spiflash_program_done, device));
 #endif
     }
 }
 
 
-// This callback is called either once a program operation is done or after a specific delay (to wait for program
+// This callback is called once a page has been sent to the flash. The flash
+// cannot be done before the typical program time so just wait for it.
+static void spiflash_program_done(void *arg)
+{
+    struct pi_device *device = (struct pi_device *)arg;
+    spi_flash_t *spiflash = (spi_flash_t *)device->data;
+
+    // The write enable was enqueued before the page and the transfers are
+    // executed in order, so this does not block, it just releases its task
+    pi_task_wait_on(&spiflash->wren_task);
+
+    pi_task_push_delayed_us(pi_task_callback(&spiflash->task, spiflash_check_program, device),
+        spiflash->program_time_us);
+}
+
+
+// This callback is called after a specific delay (to wait for program
 // completion in flash) to check if the current program operation can be resumed.
 static void spiflash_check_program(void *arg)
 {
@@ -759,7 +1152,13 @@ static void spiflash_check_program(void *arg)
 
     if (get_wip(spiflash))
     {
-        pi_task_push_delayed_us(pi_task_callback(&spiflash->task, spiflash_check_program, device), 5000);
+        pi_task_push_delayed_us(pi_task_callback(&spiflash->task, spiflash_check_program, device),
+            spiflash_poll_period(spiflash->program_time_us));
+    }
+    else if (spiflash->pending_size && spiflash_preempting_read(spiflash))
+    {
+        // Let the high priority reads go between 2 pages
+        spiflash_preempt(device, spiflash_program_resume);
     }
     else
     {
@@ -772,31 +1171,48 @@ static void spiflash_program_async(struct pi_device *device, uint32_t flash_addr
 {
     spi_flash_t *spiflash = (spi_flash_t *)device->data;
 
-    if (spiflash_stall_task(spiflash, task, STALL_TASK_PROGRAM, flash_addr, (uint32_t)data, size, 0, 0))
+    if (spiflash_stall_task(spiflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_PROGRAM, flash_addr, (uint32_t)data, size, 0, 0))
         return;
 
     spiflash->pending_flash_addr = flash_addr;
     spiflash->pending_data = (uint32_t)data;
     spiflash->pending_size = size;
 
+    spiflash->op_start = flash_addr;
+    spiflash->op_end = flash_addr + size;
+
     spiflash_program_resume(device);
 }
 
 
-static void spiflash_read_async(struct pi_device *device, uint32_t addr, void *data, uint32_t size, pi_task_t *task)
+static void spiflash_read_exec(spi_flash_t *spiflash, uint32_t addr, void *data, uint32_t size, pi_task_t *done)
+{
+    // The SPI copy has been configured with proper ucode already, no need to take care
+    pi_spi_copy_async(&spiflash->qspi_dev, addr, data, size, PI_SPI_COPY_EXT2LOC | PI_SPI_CS_AUTO | spiflash->read_lines, done);
+}
+
+
+static void spiflash_read_2d_exec(spi_flash_t *spiflash, uint32_t addr, void *data, uint32_t size, uint32_t stride, uint32_t length, pi_task_t *done)
+{
+    pi_spi_copy_2d_async(&spiflash->qspi_dev, addr, data, size, stride, length,
+            PI_SPI_COPY_EXT2LOC | PI_SPI_CS_AUTO | spiflash->read_lines, done);
+}
+
+
+static void spiflash_read_prio_async(struct pi_device *device, uint32_t addr, void *data, uint32_t size, int prio, pi_task_t *task)
 {
     spi_flash_t *spiflash = (spi_flash_t *)device->data;
 
-    if (spiflash_stall_task(spiflash, task, STALL_TASK_READ, addr, (uint32_t)data, size, 0, 0))
+    if (spiflash_stall_task(spiflash, task, prio, STALL_TASK_READ, addr, (uint32_t)data, size, 0, 0))
         return;
 
-#ifndef SINGLE_LINE       // quad line
-    // The SPI copy has been configured with proper ucode already, no need to take care
-    pi_spi_copy_async(&spiflash->qspi_dev, addr, data, size, PI_SPI_COPY_EXT2LOC | PI_SPI_CS_AUTO | PI_SPI_LINES_QUAD, pi_task_callback(&spiflash->task, spiflash_handle_pending_task, device));
-#else                     // single_line
-    // The SPI copy has been configured with proper ucode already, no need to take care
-    pi_spi_copy_async(&spiflash->qspi_dev, addr, data, size, PI_SPI_COPY_EXT2LOC | PI_SPI_CS_AUTO | PI_SPI_LINES_SINGLE, pi_task_callback(&spiflash->task, spiflash_handle_pending_task, device));
-#endif
+    spiflash_read_exec(spiflash, addr, data, size, pi_task_callback(&spiflash->task, spiflash_handle_pending_task, device));
+}
+
+
+static void spiflash_read_async(struct pi_device *device, uint32_t addr, void *data, uint32_t size, pi_task_t *task)
+{
+    spiflash_read_prio_async(device, addr, data, size, PI_FLASH_PRIO_NORMAL, task);
 }
 
 
@@ -805,7 +1221,7 @@ static void spiflash_erase_chip_async(struct pi_device *device, pi_task_t *task)
     spi_flash_t *spiflash = (spi_flash_t *)device->data;
     pi_device_t *qspi_dev = &spiflash->qspi_dev;
 
-    if (spiflash_stall_task(spiflash, task, STALL_TASK_ERASE_CHIP, 0, 0, 0, 0, 0))
+    if (spiflash_stall_task(spiflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_ERASE_CHIP, 0, 0, 0, 0, 0))
         return;
 
     pi_spi_send(qspi_dev, (void*)g_write_enable, 8,
@@ -818,16 +1234,77 @@ static void spiflash_erase_chip_async(struct pi_device *device, pi_task_t *task)
 
 
 
-// This callback is called either once aan erase operation is done or after a specific delay (to wait for erase
-// completion in flash) to check if the current erase operation can be resumed.
-static void spiflash_check_erase(void *arg)
+// Wait one tick of the on-going sector erase
+static void spiflash_erase_wait(struct pi_device *device)
+{
+    spi_flash_t *spiflash = (spi_flash_t *)device->data;
+
+    pi_task_push_delayed_us(pi_task_callback(&spiflash->task, spiflash_check_erase, device),
+        SPIFLASH_ERASE_TICK_US);
+}
+
+
+// Called once the waiting reads have been executed while the erase was
+// suspended
+static void spiflash_erase_restart(void *arg)
+{
+    struct pi_device *device = (struct pi_device *)arg;
+    spi_flash_t *spiflash = (spi_flash_t *)device->data;
+
+    pi_spi_send(&spiflash->qspi_dev, (void*)&spiflash->resume_cmd, 8,
+            SPI_LINES_FLAG | PI_SPI_CS_AUTO);
+
+    spiflash_erase_wait(device);
+}
+
+
+// This callback is called after the erase has been asked to suspend, to check
+// if the reads can start.
+static void spiflash_check_suspend(void *arg)
 {
     struct pi_device *device = (struct pi_device *)arg;
     spi_flash_t *spiflash = (spi_flash_t *)device->data;
 
     if (get_wip(spiflash))
     {
-        pi_task_push_delayed_us(pi_task_callback(&spiflash->task, spiflash_check_erase, device), 5000);
+        pi_task_push_delayed_us(pi_task_callback(&spiflash->task, spiflash_check_suspend, device),
+            SPIFLASH_SUSPEND_POLL_US);
+    }
+    else
+    {
+        spiflash_preempt(device, spiflash_erase_restart);
+    }
+}
+
+
+// This callback is called at each tick of an erase operation. It suspends the
+// erase if high priority reads are waiting and the part supports it, and checks
+// after the typical erase time if the erase is done so that the current erase
+// operation can be resumed. Otherwise the reads go once the sector is erased.
+static void spiflash_check_erase(void *arg)
+{
+    struct pi_device *device = (struct pi_device *)arg;
+    spi_flash_t *spiflash = (spi_flash_t *)device->data;
+
+    spiflash->erase_elapsed_us += SPIFLASH_ERASE_TICK_US;
+
+    if (spiflash->suspend_cmd && spiflash_preempting_read(spiflash))
+    {
+        pi_spi_send(&spiflash->qspi_dev, (void*)&spiflash->suspend_cmd, 8,
+                SPI_LINES_FLAG | PI_SPI_CS_AUTO);
+        pi_task_push_delayed_us(pi_task_callback(&spiflash->task, spiflash_check_suspend, device),
+            SPIFLASH_SUSPEND_POLL_US);
+        return;
+    }
+
+    if (spiflash->erase_elapsed_us < spiflash->erase_next_poll_us)
+    {
+        spiflash_erase_wait(device);
+    }
+    else if (get_wip(spiflash))
+    {
+        spiflash->erase_next_poll_us += spiflash_poll_period(spiflash->erase_time_us);
+        spiflash_erase_wait(device);
     }
     else
     {
@@ -853,8 +1330,10 @@ static void spiflash_erase_sector_exec(struct pi_device *device, uint32_t addr)
     pi_spi_send(qspi_dev, (void*)cmd_buf, 8*QSPIF_ERASE_SIZE,
             SPI_LINES_FLAG | PI_SPI_CS_AUTO);
 
-    // Typical sector erase time is 930ms
-    pi_task_push_delayed_us(pi_task_callback(&spiflash->task, spiflash_check_erase, device), 5000);
+    // Don't check before the typical sector erase time
+    spiflash->erase_elapsed_us = 0;
+    spiflash->erase_next_poll_us = spiflash->erase_time_us;
+    spiflash_erase_wait(device);
 }
 
 
@@ -864,12 +1343,15 @@ static void spiflash_erase_sector_async(struct pi_device *device, uint32_t addr,
     spi_flash_t *spiflash = (spi_flash_t *)device->data;
     pi_device_t *qspi_dev = &spiflash->qspi_dev;
 
-    if (spiflash_stall_task(spiflash, task, STALL_TASK_ERASE_SECTOR, addr, 0, 0, 0, 0))
+    if (spiflash_stall_task(spiflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_ERASE_SECTOR, addr, 0, 0, 0, 0))
         return;
 
     spiflash->pending_flash_addr = addr & ~(SECTOR_SIZE - 1);
     spiflash->pending_size = SECTOR_SIZE;
 
+    spiflash->op_start = spiflash->pending_flash_addr;
+    spiflash->op_end = spiflash->op_start + SECTOR_SIZE;
+
     spiflash_erase_resume(device);
 }
 
@@ -886,6 +1368,11 @@ static void spiflash_erase_resume(void *arg)
     {
         spiflash_handle_pending_task(device);
     }
+    else if (spiflash_preempting_read(spiflash))
+    {
+        // Let the high priority reads go between 2 sectors
+        spiflash_preempt(device, spiflash_erase_resume);
+    }
     else
     {
         unsigned int iter_size = SECTOR_SIZE - (spiflash->pending_flash_addr & (SECTOR_SIZE - 1));
@@ -906,7 +1393,7 @@ static void spiflash_erase_async(struct pi_device *device, uint32_t addr, int si
 {
     spi_flash_t *spiflash = (spi_flash_t *)device->data;
 
-    if (spiflash_stall_task(spiflash, task, STALL_TASK_ERASE_SECTOR, addr, size, 0, 0, 0))
+    if (spiflash_stall_task(spiflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_ERASE, addr, size, 0, 0, 0))
     {
         return;
     }
@@ -914,6 +1401,9 @@ static void spiflash_erase_async(struct pi_device *device, uint32_t addr, int si
     spiflash->pending_flash_addr = addr;
     spiflash->pending_size = size;
 
+    spiflash->op_start = addr & ~(SECTOR_SIZE - 1);
+    spiflash->op_end = addr + size;
+
     spiflash_erase_resume(device);
 }
 
@@ -922,7 +1412,7 @@ static void spiflash_reg_set_async(struct pi_device *device, uint32_t addr, uint
 {
     spi_flash_t *spiflash = (spi_flash_t *)device->data;
 
-    if (spiflash_stall_task(spiflash, task, STALL_TASK_REG_SET, addr, (uint32_t)value, 0, 0, 0))
+    if (spiflash_stall_task(spiflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_REG_SET, addr, (uint32_t)value, 0, 0, 0))
         return;
 
     spiflash_set_reg_exec(spiflash, addr, *(uint16_t *)value);
@@ -936,7 +1426,7 @@ static void spiflash_reg_get_async(struct pi_device *device, uint32_t addr, uint
 {
     spi_flash_t *spiflash = (spi_flash_t *)device->data;
 
-    if (spiflash_stall_task(spiflash, task, STALL_TASK_REG_GET, addr, (uint32_t)value, 0, 0, 0))
+    if (spiflash_stall_task(spiflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_REG_GET, addr, (uint32_t)value, 0, 0, 0))
         return;
 
     *(uint16_t *)value = spiflash_get_reg_exec(spiflash, addr);
@@ -966,8 +1456,10 @@ static int spiflash_copy_2d_async(struct pi_device *device, uint32_t flash_addr,
     if (!ext2loc)
         return -1;
 
-    pi_spi_copy_2d_async(&spiflash->qspi_dev, flash_addr, buffer, size, stride, length,
-            PI_SPI_COPY_EXT2LOC | PI_SPI_CS_AUTO | PI_SPI_LINES_QUAD,
+    if (spiflash_stall_task(spiflash, task, PI_FLASH_PRIO_NORMAL, STALL_TASK_READ_2D, flash_addr, (uint32_t)buffer, size, stride, length))
+        return 0;
+
+    spiflash_read_2d_exec(spiflash, flash_addr, buffer, size, stride, length,
             pi_task_callback(&spiflash->task, spiflash_handle_pending_task, device));
 
     return 0;
@@ -995,11 +1487,78 @@ static pi_flash_api_t spiflash_api = {
   .reg_get              = &spiflash_reg_get,
   .copy                 = &spiflash_copy,
   .copy_2d              = &spiflash_copy_2d,
+  .read_prio_async      = &spiflash_read_prio_async,
 };
 
+int pi_spiflash_read_mode_get(struct pi_device *device)
+{
+    spi_flash_t *spiflash = (spi_flash_t *)device->data;
+    return spiflash->read_mode;
+}
+
+
+int pi_spiflash_read_bench(struct pi_spiflash_conf *conf, uint32_t flash_addr,
+        void *buffer, uint32_t buffer_size, struct pi_spiflash_read_bench *results,
+        int nb_results)
+{
+    uint32_t read_modes = conf->read_modes;
+    int nb = 0;
+    int err = 0;
+
+    for (int mode=0; mode<PI_SPIFLASH_READ_MODE_NB && nb<nb_results; mode++)
+    {
+        if (!(read_modes & PI_SPIFLASH_READ_MODE(mode)))
+        {
+            continue;
+        }
+
+        struct pi_device flash;
+        conf->read_modes = PI_SPIFLASH_READ_MODE(mode);
+        pi_open_from_conf(&flash, conf);
+        if (pi_flash_open(&flash))
+        {
+            err = -1;
+            break;
+        }
+
+        // The driver falls back to another mode if this one is not supported
+        if (pi_spiflash_read_mode_get(&flash) == mode)
+        {
+            for (uint32_t size=SPIFLASH_BENCH_MIN_SIZE; size<=SPIFLASH_BENCH_MAX_SIZE && nb<nb_results; size*=4)
+            {
+                uint32_t start = pi_time_get_us();
+
+                for (uint32_t done=0; done<size; done+=buffer_size)
+                {
+                    uint32_t iter_size = size - done < buffer_size ? size - done : buffer_size;
+                    pi_flash_read(&flash, flash_addr + done, buffer, iter_size);
+                }
+
+                uint32_t time_us = pi_time_get_us() - start;
+
+                results[nb].read_mode = mode;
+                results[nb].size = size;
+                results[nb].time_us = time_us;
+                results[nb].throughput = time_us ? (uint32_t)((uint64_t)size * 1000 / time_us) : 0;
+                nb++;
+            }
+        }
+
+        pi_flash_close(&flash);
+    }
+
+    conf->read_modes = read_modes;
+
+    return err ? err : nb;
+}
+
+
 void pi_spiflash_conf_init(struct pi_spiflash_conf *conf)
 {
     conf->flash.api = &spiflash_api;
+    conf->program_time_us = 0;
+    conf->erase_time_us = 0;
+    conf->read_modes = PI_SPIFLASH_READ_MODES_ALL;
     bsp_spiflash_conf_init(conf);
     __flash_conf_init(&conf->flash);
     // try to reach max freq on gapoc_a
@@ -18,9 +18,30 @@
  * Authors: Germain Haugou, GreenWaves Technologies (germain.haugou@greenwaves-technologies.com)
  */
 
+#include <string.h>
+
 #include "pmsis.h"
 #include "bsp/fs.h"
 
+static inline uint32_t *__pi_fs_task_data(pi_task_t *task)
+{
+  #if defined(__PULP_OS__)
+  return (uint32_t *)task->implem.data;
+  #else
+  return (uint32_t *)task->data;
+  #endif  /* __PULP_OS__ */
+}
+
+// A copy returns 0 once it is enqueued. The layers completing it later, like
+// the read-ahead or the LFS worker, report a failure in the task, whose result
+// must be cleared before the copy is started.
+static inline int32_t __pi_fs_copy_result(int32_t result, pi_task_t *task)
+{
+  if (result == 0 && (int32_t)__pi_fs_task_data(task)[0] < 0)
+    return -1;
+  return result;
+}
+
 // Default FS config init
 //
 // Default FS config init
@@ -39,27 +60,32 @@ void pi_fs_conf_init(struct pi_fs_conf *conf)
 }
 
 
-int32_t pi_fs_mount(struct pi_device *device)
+static pi_fs_api_t *__pi_fs_api_get(struct pi_fs_conf *conf)
 {
-  struct pi_fs_conf *conf = (struct pi_fs_conf *)device->config;
-  pi_fs_api_t *api = conf->api;
+  if (conf->api)
+    return conf->api;
 
-  if (api == NULL)
+  switch (conf->type)
   {
-    switch (conf->type)
-    {
-      case PI_FS_READ_ONLY:
-        api = &__pi_read_fs_api;
-        break;
+    case PI_FS_READ_ONLY:
+      return &__pi_read_fs_api;
 
-      case PI_FS_HOST:
-        api = &__pi_host_fs_api;
-        break;
+    case PI_FS_HOST:
+      return &__pi_host_fs_api;
 
-      default:
-        return -1;
-    }
+    default:
+      return NULL;
   }
+}
+
+
+int32_t pi_fs_mount(struct pi_device *device)
+{
+  struct pi_fs_conf *conf = (struct pi_fs_conf *)device->config;
+  pi_fs_api_t *api = __pi_fs_api_get(conf);
+
+  if (api == NULL)
+    return -1;
 
   device->api = (struct pi_device_api *)api;
 
@@ -67,6 +93,28 @@ int32_t pi_fs_mount(struct pi_device *device)
 }
 
 
+int32_t pi_fs_mount_async(struct pi_device *device, pi_task_t *task)
+{
+  struct pi_fs_conf *conf = (struct pi_fs_conf *)device->config;
+  pi_fs_api_t *api = __pi_fs_api_get(conf);
+
+  if (api == NULL)
+    return -1;
+
+  device->api = (struct pi_device_api *)api;
+
+  if (api->mount_async)
+    return api->mount_async(device, task);
+
+  // File-systems without asynchronous mount are mounted synchronously and
+  // the task is pushed immediately.
+  __pi_fs_task_data(task)[0] = api->mount(device);
+  pi_task_push(task);
+
+  return 0;
+}
+
+
 void pi_fs_unmount(struct pi_device *device)
 {
   pi_fs_api_t *api = (pi_fs_api_t *)(device->api);
@@ -79,13 +127,644 @@ pi_fs_file_t *pi_fs_open(struct pi_device *device, const char *file_name, int fl
   return api->open(device, file_name, flags);
 }
 
+int32_t pi_fs_stat(struct pi_device *device, const char *file_name, uint32_t *size)
+{
+  pi_fs_api_t *api = (pi_fs_api_t *)(device->api);
+
+  if (api->stat)
+    return api->stat(device, file_name, size);
+
+  // File-systems without lookup get the size from the file handle
+  pi_fs_file_t *file = api->open(device, file_name, PI_FS_FLAGS_READ);
+  if (file == NULL)
+    return -1;
+
+  *size = file->size;
+  pi_fs_close(file);
+  return 0;
+}
+
+
+// Read-ahead engine.
+// When enabled on a file, this layer owns the file position and serves the
+// reads from a ring of prefetch buffers, which contain consecutive windows of
+// the file starting from the head buffer. Only one backend read is on-going at
+// the same time, the next window is loaded when it completes.
+// All the accesses to the file are queued as requests in the read-ahead
+// context and handled in order. Reads are served from the buffers, the other
+// accesses are forwarded to the backend one at a time once no window is being
+// loaded, and drop the buffers if they modify the file. The backend file
+// position is only moved when needed, it is tracked to avoid useless seeks.
+
+#define READAHEAD_BUFFER_LOADING 0
+#define READAHEAD_BUFFER_READY   1
+
+#define READAHEAD_REQ_READ        0
+#define READAHEAD_REQ_DIRECT_READ 1
+#define READAHEAD_REQ_WRITE       2
+#define READAHEAD_REQ_COPY        3
+#define READAHEAD_REQ_COPY_2D     4
+
+// Backend position not known, for example after a copy
+#define READAHEAD_NO_OFFSET 0xffffffff
+
+typedef struct {
+  uint8_t *data;
+  uint32_t offset;
+  uint32_t size;
+  uint8_t state;
+} pi_fs_readahead_buffer_t;
+
+typedef struct pi_fs_readahead_req_s pi_fs_readahead_req_t;
+
+struct pi_fs_readahead_req_s {
+  pi_fs_readahead_req_t *next;
+  pi_task_t *task;
+  uint8_t type;
+  uint8_t *buffer;
+  uint32_t size;
+  uint32_t remaining;
+  uint32_t offset;
+  uint32_t stride;
+  uint32_t length;
+  int32_t ext2loc;
+  int32_t result;
+};
+
+struct pi_fs_readahead_s {
+  uint8_t *data;
+  uint32_t window_size;
+  uint32_t depth;
+  uint32_t head;
+  uint32_t count;
+  uint32_t offset;
+  uint32_t last_end;
+  uint32_t end;
+  uint32_t fetch_offset;
+  uint32_t fetch_size;
+  uint32_t backend_offset;
+  uint8_t sequential;
+  uint8_t loading;
+  uint8_t discard;
+  uint8_t busy;
+  pi_task_t fetch_task;
+  pi_task_t op_task;
+  pi_task_t *close_task;
+  pi_fs_readahead_req_t *reqs_first;
+  pi_fs_readahead_req_t *reqs_last;
+  pi_fs_readahead_req_t *free_reqs;
+  pi_fs_readahead_buffer_t buffers[];
+};
+
+static void __pi_fs_readahead_fetch(pi_fs_file_t *file);
+
+// Drop all the prefetched data. In case a window is being loaded, it is
+// kept as the only buffer until the transfer is done and then dropped.
+static void __pi_fs_readahead_reset(pi_fs_readahead_t *ra, uint32_t offset)
+{
+  if (ra->loading)
+  {
+    ra->head = (ra->head + ra->count - 1) % ra->depth;
+    ra->count = 1;
+    ra->discard = 1;
+  }
+  else
+  {
+    ra->count = 0;
+  }
+
+  ra->fetch_offset = offset;
+}
+
+static void __pi_fs_readahead_release_head(pi_fs_readahead_t *ra)
+{
+  ra->head = (ra->head + 1) % ra->depth;
+  ra->count--;
+}
+
+static pi_fs_readahead_req_t *__pi_fs_readahead_req_alloc(pi_fs_readahead_t *ra, pi_task_t *task)
+{
+  pi_fs_readahead_req_t *req = ra->free_reqs;
+
+  if (req)
+    ra->free_reqs = req->next;
+  else
+    req = pi_l2_malloc(sizeof(pi_fs_readahead_req_t));
+
+  if (req == NULL)
+  {
+    // Notify the failure as the backends do
+    __pi_fs_task_data(task)[0] = (uint32_t)-1;
+    pi_task_push(task);
+    return NULL;
+  }
+
+  req->next = NULL;
+  req->task = task;
+  return req;
+}
+
+// Remove the head request and notify its task with the result
+static void __pi_fs_readahead_req_end(pi_fs_readahead_t *ra)
+{
+  pi_fs_readahead_req_t *req = ra->reqs_first;
+  pi_task_t *task = req->task;
+
+  ra->reqs_first = req->next;
+  __pi_fs_task_data(task)[0] = req->result;
+
+  req->next = ra->free_reqs;
+  ra->free_reqs = req;
+
+  pi_task_push(task);
+}
+
+// Move the backend position to the one needed by the next access
+static int32_t __pi_fs_readahead_seek(pi_fs_file_t *file, uint32_t offset)
+{
+  pi_fs_readahead_t *ra = file->readahead;
+
+  if (ra->backend_offset == offset)
+    return 0;
+
+  if (file->api->seek(file, offset))
+    return -1;
+
+  ra->backend_offset = offset;
+  return 0;
+}
+
+static void __pi_fs_readahead_op_done(void *arg);
+
+// Forward an access other than a read to the backend. The windows are
+// dropped if the file is modified, no window is being loaded at this point.
+static void __pi_fs_readahead_op_start(pi_fs_file_t *file, pi_fs_readahead_req_t *req)
+{
+  pi_fs_readahead_t *ra = file->readahead;
+  pi_task_t *task = pi_task_callback(&ra->op_task, __pi_fs_readahead_op_done, (void *)file);
+
+  if (req->type == READAHEAD_REQ_WRITE || (req->type >= READAHEAD_REQ_COPY && !req->ext2loc))
+    __pi_fs_readahead_reset(ra, ra->fetch_offset);
+
+  ra->busy = 1;
+
+  switch (req->type)
+  {
+    case READAHEAD_REQ_DIRECT_READ:
+    case READAHEAD_REQ_WRITE:
+      if (__pi_fs_readahead_seek(file, req->offset))
+      {
+        req->result = -1;
+        pi_task_push(task);
+        return;
+      }
+
+      if (req->type == READAHEAD_REQ_WRITE)
+        req->result = file->api->write(file, req->buffer, req->size, task);
+      else
+        req->result = file->api->direct_read(file, req->buffer, req->size, task);
+
+      if (req->result >= 0)
+        ra->backend_offset += req->result;
+      else
+        ra->backend_offset = READAHEAD_NO_OFFSET;
+      break;
+
+    case READAHEAD_REQ_COPY:
+      ra->backend_offset = READAHEAD_NO_OFFSET;
+      __pi_fs_task_data(task)[0] = 0;
+      req->result = file->api->copy(file, req->offset, req->buffer, req->size, req->ext2loc, task);
+      break;
+
+    case READAHEAD_REQ_COPY_2D:
+      ra->backend_offset = READAHEAD_NO_OFFSET;
+      __pi_fs_task_data(task)[0] = 0;
+      req->result = file->api->copy_2d(file, req->offset, req->buffer, req->size, req->stride, req->length, req->ext2loc, task);
+      break;
+  }
+}
+
+// Serve the queued requests, in order, until one must wait for a window or
+// for the backend
+static void __pi_fs_readahead_process(pi_fs_file_t *file)
+{
+  pi_fs_readahead_t *ra = file->readahead;
+  pi_fs_readahead_req_t *req;
+
+  while (!ra->busy && (req = ra->reqs_first) != NULL)
+  {
+    if (req->type != READAHEAD_REQ_READ)
+    {
+      if (ra->loading)
+        break;
+      __pi_fs_readahead_op_start(file, req);
+      continue;
+    }
+
+    uint32_t offset = req->offset;
+
+    if (req->remaining && offset >= ra->end)
+    {
+      // End of file was found while prefetching, the read is truncated
+      req->result -= req->remaining;
+      req->remaining = 0;
+    }
+
+    if (req->remaining == 0)
+    {
+      __pi_fs_readahead_req_end(ra);
+      continue;
+    }
+
+    if (ra->count == 0)
+    {
+      __pi_fs_readahead_reset(ra, offset);
+      break;
+    }
+
+    pi_fs_readahead_buffer_t *buffer = &ra->buffers[ra->head];
+
+    if (buffer->state == READAHEAD_BUFFER_LOADING)
+    {
+      // Either the data is being loaded or a dropped window is still
+      // being loaded, in both cases wait for the end of the transfer.
+      if (!ra->discard && (offset < buffer->offset || offset >= buffer->offset + ra->fetch_size))
+        __pi_fs_readahead_reset(ra, offset);
+      break;
+    }
+
+    if (offset < buffer->offset)
+    {
+      __pi_fs_readahead_reset(ra, offset);
+      break;
+    }
+
+    uint32_t buffer_end = buffer->offset + buffer->size;
+
+    if (offset >= buffer_end)
+    {
+      __pi_fs_readahead_release_head(ra);
+      continue;
+    }
+
+    uint32_t iter_size = buffer_end - offset;
+    if (iter_size > req->remaining)
+      iter_size = req->remaining;
+
+    memcpy(req->buffer, &buffer->data[offset - buffer->offset], iter_size);
+
+    req->buffer += iter_size;
+    req->remaining -= iter_size;
+    req->offset += iter_size;
+
+    if (offset + iter_size == buffer_end)
+      __pi_fs_readahead_release_head(ra);
+  }
+
+  __pi_fs_readahead_fetch(file);
+}
+
+static void __pi_fs_readahead_fetch_done(void *arg)
+{
+  pi_fs_file_t *file = (pi_fs_file_t *)arg;
+  pi_fs_readahead_t *ra = file->readahead;
+  int32_t result = (int32_t)__pi_fs_task_data(&ra->fetch_task)[0];
+
+  ra->loading = 0;
+
+  if (result < 0)
+  {
+    // Handled as an end of file, the pending reads are truncated
+    result = 0;
+    ra->backend_offset = READAHEAD_NO_OFFSET;
+  }
+
+  if (ra->discard)
+  {
+    ra->discard = 0;
+    __pi_fs_readahead_release_head(ra);
+  }
+  else
+  {
+    pi_fs_readahead_buffer_t *buffer = &ra->buffers[(ra->head + ra->count - 1) % ra->depth];
+    buffer->state = READAHEAD_BUFFER_READY;
+    buffer->size = result;
+
+    // Short read, the file is smaller than expected
+    if ((uint32_t)result < ra->fetch_size)
+      ra->end = buffer->offset + result;
+  }
+
+  if (ra->close_task)
+  {
+    pi_task_push(ra->close_task);
+    return;
+  }
+
+  __pi_fs_readahead_process(file);
+}
+
+static void __pi_fs_readahead_op_done(void *arg)
+{
+  pi_fs_file_t *file = (pi_fs_file_t *)arg;
+  pi_fs_readahead_t *ra = file->readahead;
+  pi_fs_readahead_req_t *req = ra->reqs_first;
+
+  ra->busy = 0;
+
+  if (req->type >= READAHEAD_REQ_COPY)
+    req->result = __pi_fs_copy_result(req->result, &ra->op_task);
+
+  if (req->type == READAHEAD_REQ_WRITE || (req->type >= READAHEAD_REQ_COPY && !req->ext2loc))
+  {
+    // The size was extended when the write was queued, take the actual one
+    // and give back the position if nothing was queued after a short write
+    ra->end = file->size;
+    if (req->type == READAHEAD_REQ_WRITE && req->next == NULL && req->result != (int32_t)req->size)
+    {
+      ra->offset = req->offset + (req->result > 0 ? req->result : 0);
+      ra->last_end = ra->offset;
+    }
+  }
+
+  __pi_fs_readahead_req_end(ra);
+
+  if (ra->close_task)
+  {
+    pi_task_push(ra->close_task);
+    return;
+  }
+
+  __pi_fs_readahead_process(file);
+}
+
+// Load the next window if a buffer is free. As long as the accesses are not
+// sequential, only the window needed by the pending read is loaded. Nothing
+// is loaded while another access is waiting for the backend.
+static void __pi_fs_readahead_fetch(pi_fs_file_t *file)
+{
+  pi_fs_readahead_t *ra = file->readahead;
+  uint32_t max_count = ra->sequential ? ra->depth : 1;
+
+  if (ra->loading || ra->busy || ra->count >= max_count || ra->fetch_offset >= ra->end)
+    return;
+
+  if (ra->reqs_first && ra->reqs_first->type != READAHEAD_REQ_READ)
+    return;
+
+  pi_fs_readahead_buffer_t *buffer = &ra->buffers[(ra->head + ra->count) % ra->depth];
+  uint32_t size = ra->end - ra->fetch_offset;
+  if (size > ra->window_size)
+    size = ra->window_size;
+
+  if (__pi_fs_readahead_seek(file, ra->fetch_offset))
+  {
+    // The window can't be reached, this is handled as the end of file
+    ra->end = ra->fetch_offset;
+    __pi_fs_readahead_process(file);
+    return;
+  }
+
+  buffer->state = READAHEAD_BUFFER_LOADING;
+  buffer->offset = ra->fetch_offset;
+  buffer->size = 0;
+
+  ra->count++;
+  ra->loading = 1;
+  ra->fetch_size = size;
+  ra->fetch_offset += size;
+
+  int32_t result = file->api->read(file, buffer->data, size, pi_task_callback(&ra->fetch_task, __pi_fs_readahead_fetch_done, (void *)file));
+  if (result >= 0)
+    ra->backend_offset += result;
+  else
+    ra->backend_offset = READAHEAD_NO_OFFSET;
+}
+
+static void __pi_fs_readahead_push(pi_fs_file_t *file, pi_fs_readahead_req_t *req)
+{
+  pi_fs_readahead_t *ra = file->readahead;
+
+  if (ra->reqs_first)
+    ra->reqs_last->next = req;
+  else
+    ra->reqs_first = req;
+  ra->reqs_last = req;
+
+  __pi_fs_readahead_process(file);
+}
+
+// Take a read or a direct read at the current position, the size is
+// truncated to the end of the file as known now
+static int32_t __pi_fs_readahead_read(pi_fs_file_t *file, uint8_t type, void *buffer, uint32_t size, pi_task_t *task)
+{
+  pi_fs_readahead_t *ra = file->readahead;
+  pi_fs_readahead_req_t *req = __pi_fs_readahead_req_alloc(ra, task);
+  if (req == NULL)
+    return -1;
+
+  uint32_t real_size = size;
+  if (ra->offset >= ra->end)
+    real_size = 0;
+  else if (ra->offset + size > ra->end)
+    real_size = ra->end - ra->offset;
+
+  ra->sequential = ra->offset == ra->last_end;
+
+  req->type = type;
+  req->buffer = (uint8_t *)buffer;
+  req->size = real_size;
+  req->remaining = real_size;
+  req->offset = ra->offset;
+  req->result = real_size;
+
+  ra->offset += real_size;
+  ra->last_end = ra->offset;
+
+  __pi_fs_readahead_push(file, req);
+
+  return real_size;
+}
+
+static int32_t __pi_fs_readahead_write(pi_fs_file_t *file, void *buffer, uint32_t size, pi_task_t *task)
+{
+  pi_fs_readahead_t *ra = file->readahead;
+  pi_fs_readahead_req_t *req = __pi_fs_readahead_req_alloc(ra, task);
+  if (req == NULL)
+    return -1;
+
+  req->type = READAHEAD_REQ_WRITE;
+  req->buffer = (uint8_t *)buffer;
+  req->size = size;
+  req->offset = ra->offset;
+  req->result = -1;
+
+  // The next queued accesses see the file as if the write was done
+  ra->offset += size;
+  ra->last_end = ra->offset;
+  if (ra->offset > ra->end)
+    ra->end = ra->offset;
+
+  __pi_fs_readahead_push(file, req);
+
+  return size;
+}
+
+static int32_t __pi_fs_readahead_copy(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc, pi_task_t *task)
+{
+  pi_fs_readahead_t *ra = file->readahead;
+  pi_fs_readahead_req_t *req = __pi_fs_readahead_req_alloc(ra, task);
+  if (req == NULL)
+    return -1;
+
+  req->type = length ? READAHEAD_REQ_COPY_2D : READAHEAD_REQ_COPY;
+  req->buffer = (uint8_t *)buffer;
+  req->size = size;
+  req->offset = index;
+  req->stride = stride;
+  req->length = length;
+  req->ext2loc = ext2loc;
+  req->result = -1;
+
+  __pi_fs_readahead_push(file, req);
+
+  return 0;
+}
+
+int32_t pi_fs_readahead_enable(pi_fs_file_t *file, uint32_t window_size, uint32_t depth)
+{
+  if (file->readahead || window_size == 0 || depth == 0 || file->api->tell == NULL)
+    return -1;
+
+  uint32_t ra_size = sizeof(pi_fs_readahead_t) + depth * sizeof(pi_fs_readahead_buffer_t);
+  pi_fs_readahead_t *ra = pi_l2_malloc(ra_size);
+  if (ra == NULL)
+    return -1;
+
+  ra->data = pi_l2_malloc(window_size * depth);
+  if (ra->data == NULL)
+  {
+    pi_l2_free(ra, ra_size);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < depth; i++)
+  {
+    ra->buffers[i].data = &ra->data[i * window_size];
+  }
+
+  // Reading continues from the current position
+  uint32_t offset = file->api->tell(file);
+
+  ra->window_size = window_size;
+  ra->depth = depth;
+  ra->head = 0;
+  ra->count = 0;
+  ra->offset = offset;
+  ra->last_end = offset;
+  ra->end = file->size;
+  ra->fetch_offset = offset;
+  ra->backend_offset = offset;
+  ra->sequential = 1;
+  ra->loading = 0;
+  ra->discard = 0;
+  ra->busy = 0;
+  ra->close_task = NULL;
+  ra->reqs_first = NULL;
+  ra->free_reqs = NULL;
+
+  file->readahead = ra;
+
+  return 0;
+}
+
+void pi_fs_readahead_disable(pi_fs_file_t *file)
+{
+  pi_fs_readahead_t *ra = file->readahead;
+  if (ra == NULL)
+    return;
+
+  // The backend is still writing into the buffers or executing an access,
+  // wait until it is done
+  if (ra->loading || ra->busy)
+  {
+    pi_task_t task;
+    ra->close_task = pi_task_block(&task);
+    pi_task_wait_on(&task);
+  }
+
+  // Give back the current position to the backend
+  __pi_fs_readahead_seek(file, ra->offset);
+
+  file->readahead = NULL;
+
+  while (ra->free_reqs)
+  {
+    pi_fs_readahead_req_t *req = ra->free_reqs;
+    ra->free_reqs = req->next;
+    pi_l2_free(req, sizeof(pi_fs_readahead_req_t));
+  }
+
+  pi_l2_free(ra->data, ra->window_size * ra->depth);
+  pi_l2_free(ra, sizeof(pi_fs_readahead_t) + ra->depth * sizeof(pi_fs_readahead_buffer_t));
+}
+
 void pi_fs_close(pi_fs_file_t *file)
 {
+  pi_fs_readahead_disable(file);
+  pi_fs_munmap(file);
   return file->api->close(file);
 }
 
+int32_t pi_fs_mmap(pi_fs_file_t *file, void **ptr, uint32_t *size)
+{
+  if (file->mmap_ptr == NULL)
+  {
+    // Try to get a pointer directly to the device, and fallback to a copy in
+    // L2 which stays there until the file is unmapped.
+    if (file->api->mmap == NULL || file->api->mmap(file, &file->mmap_ptr))
+    {
+      if (file->size == 0)
+        return -1;
+
+      void *buffer = pi_l2_malloc(file->size);
+      if (buffer == NULL)
+        return -1;
+
+      if (pi_fs_copy(file, 0, buffer, file->size, 1))
+      {
+        pi_l2_free(buffer, file->size);
+        return -1;
+      }
+
+      file->mmap_ptr = buffer;
+      file->mmap_pinned = 1;
+    }
+    else
+    {
+      file->mmap_pinned = 0;
+    }
+  }
+
+  *ptr = file->mmap_ptr;
+  *size = file->size;
+
+  return 0;
+}
+
+void pi_fs_munmap(pi_fs_file_t *file)
+{
+  if (file->mmap_ptr && file->mmap_pinned)
+    pi_l2_free(file->mmap_ptr, file->size);
+
+  file->mmap_ptr = NULL;
+}
+
 int32_t pi_fs_read_async(pi_fs_file_t *file, void *buffer, uint32_t size, pi_task_t *task)
 {
+  if (file->readahead)
+    return __pi_fs_readahead_read(file, READAHEAD_REQ_READ, buffer, size, task);
+
   return file->api->read(file, buffer, size, task);
 }
 
@@ -99,6 +778,9 @@ int32_t pi_fs_read(pi_fs_file_t *file, void *buffer, uint32_t size)
 
 int32_t pi_fs_write_async(pi_fs_file_t *file, void *buffer, uint32_t size, pi_task_t *task)
 {
+  if (file->readahead)
+    return __pi_fs_readahead_write(file, buffer, size, task);
+
   return file->api->write(file, buffer, size, task);
 }
 
@@ -110,302 +792,609 @@ int32_t pi_fs_write(pi_fs_file_t *file, void *buffer, uint32_t size)
   return result;
 }
 
-int32_t pi_fs_direct_read_async(pi_fs_file_t *file, void *buffer, uint32_t size, pi_task_t *task)
+int32_t pi_fs_direct_read_async(pi_fs_file_t *file, void *buffer, uint32_t size, pi_task_t *task)
+{
+  if (file->readahead)
+    return __pi_fs_readahead_read(file, READAHEAD_REQ_DIRECT_READ, buffer, size, task);
+
+  return file->api->direct_read(file, buffer, size, task);
+}
+
+int32_t pi_fs_direct_read(pi_fs_file_t *file, void *buffer, uint32_t size)
+{
+  pi_task_t task;
+  int result = pi_fs_direct_read_async(file, buffer, size, pi_task_block(&task));
+  pi_task_wait_on(&task);
+  return result;
+}
+
+int32_t pi_fs_copy_async(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, int32_t ext2loc, pi_task_t *task)
+{
+  if (file->readahead)
+    return __pi_fs_readahead_copy(file, index, buffer, size, 0, 0, ext2loc, task);
+
+  return file->api->copy(file, index, buffer, size, ext2loc, task);
+}
+
+int32_t pi_fs_copy(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, int32_t ext2loc)
+{
+  pi_task_t task;
+  pi_task_block(&task);
+  __pi_fs_task_data(&task)[0] = 0;
+  int result = pi_fs_copy_async(file, index, buffer, size, ext2loc, &task);
+  pi_task_wait_on(&task);
+  return __pi_fs_copy_result(result, &task);
+}
+
+int32_t pi_fs_copy_2d_async(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc, pi_task_t *task)
+{
+  if (file->readahead)
+    return __pi_fs_readahead_copy(file, index, buffer, size, stride, length ? length : size, ext2loc, task);
+
+  return file->api->copy_2d(file, index, buffer, size, stride, length, ext2loc, task);
+}
+
+int32_t pi_fs_copy_2d(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc)
+{
+  pi_task_t task;
+  pi_task_block(&task);
+  __pi_fs_task_data(&task)[0] = 0;
+  int result = pi_fs_copy_2d_async(file, index, buffer, size, stride, length, ext2loc, &task);
+  pi_task_wait_on(&task);
+  return __pi_fs_copy_result(result, &task);
+}
+
+
+// Vectored reads.
+// The requests of a file are queued and executed one after the other, using
+// the task data to store the request state:
+//   data[0]: result, data[1]: segments, data[2]: number of segments,
+//   data[3]: index of the next segment, data[4]: next task.
+// Each step merges the segments contiguous both in the file and in memory and
+// executes them with a single backend copy.
+
+static void __pi_fs_readv_step(pi_fs_file_t *file);
+
+static void __pi_fs_readv_done(void *arg)
+{
+  pi_fs_file_t *file = (pi_fs_file_t *)arg;
+
+  if ((int32_t)__pi_fs_task_data(&file->readv_task)[0] < 0)
+  {
+    // The copy of the segments failed, the request is aborted
+    uint32_t *data = __pi_fs_task_data(file->readv_first);
+    data[0] = (uint32_t)-1;
+    data[3] = data[2];
+  }
+
+  __pi_fs_readv_step(file);
+}
+
+static void __pi_fs_readv_step(pi_fs_file_t *file)
+{
+  pi_task_t *task;
+
+  while ((task = file->readv_first) != NULL)
+  {
+    uint32_t *data = __pi_fs_task_data(task);
+    pi_fs_iovec_t *iov = (pi_fs_iovec_t *)data[1];
+    uint32_t nb_iov = data[2];
+    uint32_t index = data[3];
+
+    if (index == nb_iov)
+    {
+      file->readv_first = (pi_task_t *)data[4];
+      pi_task_push(task);
+      continue;
+    }
+
+    uint32_t offset = iov[index].offset;
+    uint8_t *buffer = (uint8_t *)iov[index].buffer;
+    uint32_t size = iov[index].size;
+
+    for (index++; index < nb_iov; index++)
+    {
+      if (iov[index].offset != offset + size || (uint8_t *)iov[index].buffer != buffer + size)
+        break;
+      size += iov[index].size;
+    }
+
+    data[3] = index;
+
+    pi_task_t *copy_task = pi_task_callback(&file->readv_task, __pi_fs_readv_done, (void *)file);
+    __pi_fs_task_data(copy_task)[0] = 0;
+
+    if (pi_fs_copy_async(file, offset, buffer, size, 1, copy_task))
+    {
+      // The copy failed, its task is still pushed and the request is aborted
+      // once it is handled
+      __pi_fs_task_data(copy_task)[0] = (uint32_t)-1;
+    }
+
+    return;
+  }
+}
+
+int32_t pi_fs_readv_async(pi_fs_file_t *file, pi_fs_iovec_t *iov, uint32_t nb_iov, pi_task_t *task)
+{
+  uint32_t *data = __pi_fs_task_data(task);
+
+  if (iov == NULL && nb_iov)
+    return -1;
+
+  data[0] = 0;
+  data[1] = (uint32_t)iov;
+  data[2] = nb_iov;
+  data[3] = 0;
+  data[4] = 0;
+
+  int is_first = file->readv_first == NULL;
+
+  if (is_first)
+    file->readv_first = task;
+  else
+    __pi_fs_task_data(file->readv_last)[4] = (uint32_t)task;
+  file->readv_last = task;
+
+  if (is_first)
+    __pi_fs_readv_step(file);
+
+  return 0;
+}
+
+int32_t pi_fs_readv(pi_fs_file_t *file, pi_fs_iovec_t *iov, uint32_t nb_iov)
+{
+  pi_task_t task;
+  if (pi_fs_readv_async(file, iov, nb_iov, pi_task_block(&task)))
+    return -1;
+  pi_task_wait_on(&task);
+  return (int32_t)__pi_fs_task_data(&task)[0];
+}
+
+int32_t pi_fs_seek(pi_fs_file_t *file, unsigned int offset)
+{
+  pi_fs_readahead_t *ra = file->readahead;
+
+  if (ra)
+  {
+    // The backend position is only moved by the next access, the windows
+    // are dropped and loaded again from the new position
+    if (offset > ra->end)
+      return -1;
+
+    ra->offset = offset;
+    __pi_fs_readahead_reset(ra, offset);
+    return 0;
+  }
+
+  return file->api->seek(file, offset);
+}
+
+
+/*
+ * Cluster requests which can block, like opening, closing or looking up a
+ * file, are not executed by the FC event receiving them, as the flash accesses
+ * they do wait for events which would be handled only once it returns. They
+ * are queued to a worker shared by all the file-systems instead.
+ */
+#define __PI_CL_FS_WORKER_OPEN   0
+#define __PI_CL_FS_WORKER_STAT   1
+#define __PI_CL_FS_WORKER_CLOSE  2
+
+#ifndef PI_CL_FS_WORKER_PRIORITY
+#define PI_CL_FS_WORKER_PRIORITY 2
+#endif
+
+// The requests are linked through their callback, which is not used anymore
+// once they are received on the FC side
+static pi_cl_fs_req_t *__pi_cl_fs_worker_first;
+static pi_cl_fs_req_t *__pi_cl_fs_worker_last;
+#if defined(__FREERTOS__)
+static void *__pi_cl_fs_worker;
+static pi_sem_t __pi_cl_fs_worker_sem;
+#else
+static uint8_t __pi_cl_fs_worker_busy;
+static pi_task_t __pi_cl_fs_worker_task;
+#endif
+
+static void __pi_cl_fs_worker_exec(pi_cl_fs_req_t *req)
+{
+  switch (req->op)
+  {
+    case __PI_CL_FS_WORKER_OPEN:
+    {
+      uint32_t nb_opened = 0;
+
+      for (uint32_t i = 0; i < req->open.nb_paths; i++)
+      {
+        req->open.files[i] = pi_fs_open(req->open.device, req->open.paths[i], req->open.flags);
+        if (req->open.files[i])
+          nb_opened++;
+      }
+
+      req->open.result = nb_opened == req->open.nb_paths ? 0 : -1;
+      break;
+    }
+
+    case __PI_CL_FS_WORKER_STAT:
+      req->open.result = pi_fs_stat(req->open.device, req->open.path, req->open.size);
+      break;
+
+    case __PI_CL_FS_WORKER_CLOSE:
+      pi_fs_close(req->file);
+      req->rw.result = 0;
+      break;
+  }
+
+  cl_notify_task_done(&(req->rw.done), req->rw.cid);
+}
+
+static pi_cl_fs_req_t *__pi_cl_fs_worker_pop(void)
 {
-  return file->api->direct_read(file, buffer, size, task);
+  int irq = hal_irq_disable();
+  pi_cl_fs_req_t *req = __pi_cl_fs_worker_first;
+  __pi_cl_fs_worker_first = (pi_cl_fs_req_t *)req->callback.next;
+  hal_irq_restore(irq);
+  return req;
 }
 
-int32_t pi_fs_direct_read(pi_fs_file_t *file, void *buffer, uint32_t size)
-{
-  pi_task_t task;
-  int result = pi_fs_direct_read_async(file, buffer, size, pi_task_block(&task));
-  pi_task_wait_on(&task);
-  return result;
-}
+#if defined(__FREERTOS__)
 
-int32_t pi_fs_copy_async(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, int32_t ext2loc, pi_task_t *task)
+/*
+ * The worker is a thread blocked on the semaphore, which is given once per
+ * queued request. The flash accesses only block this thread.
+ */
+static void __pi_cl_fs_worker_entry(void *arg)
 {
-  return file->api->copy(file, index, buffer, size, ext2loc, task);
+  while (1)
+  {
+    pi_sem_take(&__pi_cl_fs_worker_sem);
+    __pi_cl_fs_worker_exec(__pi_cl_fs_worker_pop());
+  }
 }
 
-int32_t pi_fs_copy(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, int32_t ext2loc)
+// The thread is created with the first request and then kept
+static int __pi_cl_fs_worker_start(void)
 {
-  pi_task_t task;
-  int result = pi_fs_copy_async(file, index, buffer, size, ext2loc, pi_task_block(&task));
-  pi_task_wait_on(&task);
-  return result;
+  if (__pi_cl_fs_worker)
+    return 0;
+
+  if (pi_sem_init(&__pi_cl_fs_worker_sem))
+    return -1;
+
+  __pi_cl_fs_worker = pmsis_task_create(__pi_cl_fs_worker_entry, NULL, "cl_fs", PI_CL_FS_WORKER_PRIORITY);
+  if (__pi_cl_fs_worker == NULL)
+  {
+    pi_sem_deinit(&__pi_cl_fs_worker_sem);
+    return -1;
+  }
+
+  return 0;
 }
 
-int32_t pi_fs_copy_2d_async(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc, pi_task_t *task)
+#else
+
+/*
+ * Without threads, the worker is an event executing one request at a time,
+ * the same way as the LFS worker, so that the other events are handled
+ * between two requests.
+ */
+static void __pi_cl_fs_worker_run(void *arg)
 {
-  return file->api->copy_2d(file, index, buffer, size, stride, length, ext2loc, task);
+  __pi_cl_fs_worker_exec(__pi_cl_fs_worker_pop());
+
+  int irq = hal_irq_disable();
+  uint8_t busy = __pi_cl_fs_worker_first != NULL;
+  __pi_cl_fs_worker_busy = busy;
+  hal_irq_restore(irq);
+
+  if (busy)
+  {
+    pi_task_push(pi_task_callback(&__pi_cl_fs_worker_task, __pi_cl_fs_worker_run, NULL));
+  }
 }
 
-int32_t pi_fs_copy_2d(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc)
+#endif
+
+static void __pi_cl_fs_worker_push(pi_cl_fs_req_t *req)
 {
-  pi_task_t task;
-  int result = pi_fs_copy_2d_async(file, index, buffer, size, stride, length, ext2loc, pi_task_block(&task));
-  pi_task_wait_on(&task);
-  return result;
+#if defined(__FREERTOS__)
+  if (__pi_cl_fs_worker_start())
+  {
+    req->rw.result = -1;
+    cl_notify_task_done(&(req->rw.done), req->rw.cid);
+    return;
+  }
+#endif
+
+  req->callback.next = NULL;
+
+  int irq = hal_irq_disable();
+  if (__pi_cl_fs_worker_first)
+    __pi_cl_fs_worker_last->callback.next = (void *)req;
+  else
+    __pi_cl_fs_worker_first = req;
+  __pi_cl_fs_worker_last = req;
+#if !defined(__FREERTOS__)
+  uint8_t start = !__pi_cl_fs_worker_busy;
+  __pi_cl_fs_worker_busy = 1;
+#endif
+  hal_irq_restore(irq);
+
+#if defined(__FREERTOS__)
+  pi_sem_give(&__pi_cl_fs_worker_sem);
+#else
+  if (start)
+  {
+    pi_task_push(pi_task_callback(&__pi_cl_fs_worker_task, __pi_cl_fs_worker_run, NULL));
+  }
+#endif
 }
 
-int32_t pi_fs_seek(pi_fs_file_t *file, unsigned int offset)
+static void __pi_cl_fs_worker_req(void *_req)
 {
-  return file->api->seek(file, offset);
+  __pi_cl_fs_worker_push((pi_cl_fs_req_t *)_req);
 }
 
 
 #if !defined(PMSIS_DRIVERS)
 
-void __pi_cl_fs_req_exec(void *req);
+/*
+ * Cluster requests are sent to the FC through callbacks, which only add them
+ * to the pending list of the file-system. A single event then dispatches all
+ * the requests received since it was scheduled, so that several requests are
+ * handled per FC wakeup. The requests of a file are executed in order as
+ * they depend on its current position, while requests on different files are
+ * in flight at the same time, each one with its own completion task.
+ */
+#define __PI_CL_FS_REQ_READ         0
+#define __PI_CL_FS_REQ_WRITE        1
+#define __PI_CL_FS_REQ_DIRECT_READ  2
+#define __PI_CL_FS_REQ_SEEK         3
+#define __PI_CL_FS_REQ_COPY         4
+#define __PI_CL_FS_REQ_READV        5
+#define __PI_CL_FS_REQ_CLOSE        6
+
+static void __pi_cl_fs_req_exec(pi_cl_fs_req_t *req);
 
-void __pi_cl_fs_req_done(void *_req)
+static void __pi_cl_fs_req_end(pi_cl_fs_req_t *req)
 {
-  pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
   pi_fs_file_t *file = req->file;
-  pi_fs_data_t *fs = req->file->fs_data;
-  pi_task_t *task = &fs->cl_req_task;
-  #if defined(__PULP_OS__)
-  req->rw.result = task->implem.data[0];
-  #else
-  req->rw.result = task->data[0];
-  #endif  /* __PULP_OS__ */
+  pi_cl_fs_req_t *next = (pi_cl_fs_req_t *)req->callback.next;
+
+  // The request can be reused by the cluster as soon as it is notified
+  file->cl_reqs_first = next;
   cl_notify_task_done(&(req->rw.done), req->rw.cid);
 
-  fs->cluster_reqs_first = (void *)req->callback.next;
-  req = fs->cluster_reqs_first;
-  if (req)
+  if (next)
   {
-    __pi_cl_fs_req_exec(req);
+    __pi_cl_fs_req_exec(next);
   }
 }
 
-void __pi_cl_fs_req_exec(void *_req)
+static void __pi_cl_fs_req_done(void *_req)
 {
-    pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
-    pi_fs_file_t *file = req->file;
-    pi_fs_data_t *fs = req->file->fs_data;
-    if (req->rw.write)
-    {
-        req->rw.result = pi_fs_write_async(file, req->rw.buffer, req->rw.size, pi_task_callback(&fs->cl_req_task, __pi_cl_fs_req_done, (void *)req));
-    }
-    else
-    {
-      if (req->rw.direct)
-      {
-          req->rw.result = pi_fs_direct_read_async(file, req->rw.buffer, req->rw.size, pi_task_callback(&fs->cl_req_task, __pi_cl_fs_req_done, (void *)req));
-      }
+  pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
+
+  if (req->op == __PI_CL_FS_REQ_COPY)
+  {
+    req->copy.result = __pi_fs_copy_result(req->copy.result, &req->task);
+  }
+  else
+  {
+    req->rw.result = __pi_fs_task_data(&req->task)[0];
+  }
+
+  __pi_cl_fs_req_end(req);
+}
+
+static void __pi_cl_fs_req_exec(pi_cl_fs_req_t *req)
+{
+  pi_fs_file_t *file = req->file;
+  pi_task_t *task = pi_task_callback(&req->task, __pi_cl_fs_req_done, (void *)req);
+
+  switch (req->op)
+  {
+    case __PI_CL_FS_REQ_READ:
+      req->rw.result = pi_fs_read_async(file, req->rw.buffer, req->rw.size, task);
+      break;
+
+    case __PI_CL_FS_REQ_WRITE:
+      req->rw.result = pi_fs_write_async(file, req->rw.buffer, req->rw.size, task);
+      break;
+
+    case __PI_CL_FS_REQ_DIRECT_READ:
+      req->rw.result = pi_fs_direct_read_async(file, req->rw.buffer, req->rw.size, task);
+      break;
+
+    case __PI_CL_FS_REQ_SEEK:
+      req->rw.result = pi_fs_seek(file, req->rw.offset);
+      __pi_cl_fs_req_end(req);
+      break;
+
+    case __PI_CL_FS_REQ_COPY:
+      // The task is pushed even if the copy fails, the request ends there
+      __pi_fs_task_data(task)[0] = 0;
+      if (req->copy.length)
+        req->copy.result = pi_fs_copy_2d_async(file, req->copy.index, req->copy.buffer, req->copy.size, req->copy.stride, req->copy.length, req->copy.ext2loc, task);
       else
+        req->copy.result = pi_fs_copy_async(file, req->copy.index, req->copy.buffer, req->copy.size, req->copy.ext2loc, task);
+      break;
+
+    case __PI_CL_FS_REQ_READV:
+      if (pi_fs_readv_async(file, req->readv.iov, req->readv.nb_iov, task))
       {
-          req->rw.result = pi_fs_read_async(file, req->rw.buffer, req->rw.size, pi_task_callback(&fs->cl_req_task, __pi_cl_fs_req_done, (void *)req));
+        req->readv.result = -1;
+        __pi_cl_fs_req_end(req);
       }
-    }
+      break;
+
+    case __PI_CL_FS_REQ_CLOSE:
+      // This is the last request of the file, which is closed by the worker
+      file->cl_reqs_first = NULL;
+      req->op = __PI_CL_FS_WORKER_CLOSE;
+      __pi_cl_fs_worker_push(req);
+      break;
+  }
 }
 
-
-void __pi_cl_fs_req(void *_req)
+static void __pi_cl_fs_req_dispatch(void *arg)
 {
-    pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
-    pi_fs_data_t *fs = req->file->fs_data;
+  pi_fs_data_t *fs = (pi_fs_data_t *)arg;
 
-    int is_first = fs->cluster_reqs_first == NULL;
+  int irq = hal_irq_disable();
+  pi_cl_fs_req_t *req = fs->cluster_reqs_first;
+  fs->cluster_reqs_first = NULL;
+  hal_irq_restore(irq);
 
-    if (is_first)
-      fs->cluster_reqs_first = req;
-    else
-      fs->cluster_reqs_last->callback.next = (void *)req;
+  while (req)
+  {
+    pi_cl_fs_req_t *next = (pi_cl_fs_req_t *)req->callback.next;
+    pi_fs_file_t *file = req->file;
+    int is_first = file->cl_reqs_first == NULL;
 
-    fs->cluster_reqs_last = req;
+    // Queue it behind the requests of the same file
     req->callback.next = NULL;
+    if (is_first)
+      file->cl_reqs_first = req;
+    else
+      file->cl_reqs_last->callback.next = (void *)req;
+    file->cl_reqs_last = req;
 
     if (is_first)
     {
-      pi_task_push(pi_task_callback(&fs->cl_req_task, __pi_cl_fs_req_exec, _req));
+      __pi_cl_fs_req_exec(req);
     }
+
+    req = next;
+  }
+}
+
+static void __pi_cl_fs_req(void *_req)
+{
+  pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
+  pi_fs_data_t *fs = req->file->fs_data;
+
+  req->callback.next = NULL;
+
+  int irq = hal_irq_disable();
+  int is_first = fs->cluster_reqs_first == NULL;
+
+  if (is_first)
+    fs->cluster_reqs_first = req;
+  else
+    fs->cluster_reqs_last->callback.next = (void *)req;
+
+  fs->cluster_reqs_last = req;
+  hal_irq_restore(irq);
+
+  // The dispatch is already scheduled if the list was not empty
+  if (is_first)
+  {
+    pi_task_push(pi_task_callback(&fs->cl_req_task, __pi_cl_fs_req_dispatch, (void *)fs));
+  }
+}
+
+static void __pi_cl_fs_req_send(pi_fs_file_t *file, pi_cl_fs_req_t *req, uint8_t op)
+{
+  req->file = file;
+  req->op = op;
+  req->rw.cid = pi_cluster_id();
+  req->rw.done = 0;
+
+  pi_cl_send_callback_to_fc(pi_callback(&(req->callback), __pi_cl_fs_req, (void *)req));
 }
 
 
 void pi_cl_fs_read(pi_fs_file_t *file, void *buffer, uint32_t size, pi_cl_fs_req_t *req)
 {
-    req->file = file;
     req->rw.buffer = buffer;
     req->rw.size = size;
-    req->rw.cid = pi_cluster_id();
-    req->rw.done = 0;
-    req->rw.write = 0;
-    req->rw.direct = 0;
     req->rw.result = -1;
 
-    pi_cl_send_callback_to_fc(pi_callback(&(req->callback), __pi_cl_fs_req, (void *)req));
+    __pi_cl_fs_req_send(file, req, __PI_CL_FS_REQ_READ);
 }
 
 
 void pi_cl_fs_write(pi_fs_file_t *file, void *buffer, uint32_t size,
   pi_cl_fs_req_t *req)
 {
-    req->file = file;
     req->rw.buffer = buffer;
     req->rw.size = size;
-    req->rw.cid = pi_cluster_id();
-    req->rw.done = 0;
-    req->rw.direct = 0;
-    req->rw.write = 1;
+    req->rw.result = -1;
 
-    pi_cl_send_callback_to_fc(pi_callback(&(req->callback), __pi_cl_fs_req, (void *)req));
+    __pi_cl_fs_req_send(file, req, __PI_CL_FS_REQ_WRITE);
 }
 
 
 void pi_cl_fs_direct_read(pi_fs_file_t *file, void *buffer, uint32_t size, pi_cl_fs_req_t *req)
 {
-    req->file = file;
     req->rw.buffer = buffer;
     req->rw.size = size;
-    req->rw.cid = pi_cluster_id();
-    req->rw.done = 0;
-    req->rw.direct = 1;
     req->rw.result = -1;
-    req->rw.write = 0;
-
-    pi_cl_send_callback_to_fc(pi_callback(&(req->callback), __pi_cl_fs_req, (void *)req));
-}
-
-void __pi_cl_fs_seek_req_exec(void *_req)
-{
-    pi_cl_fs_req_t *req = _req;
-    pi_fs_file_t *file = req->file;
-    pi_fs_data_t *fs = req->file->fs_data;
-    req->rw.result = pi_fs_seek(req->file, req->rw.offset);
-    cl_notify_task_done(&(req->rw.done), req->rw.cid);
-
-    fs->cluster_reqs_first = (void *)req->callback.next;
-    req = fs->cluster_reqs_first;
-    if (req)
-    {
-      __pi_cl_fs_seek_req_exec(_req);
-    }
-}
-
-void __pi_cl_fs_seek_req(void *_req)
-{
-    pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
-    pi_fs_data_t *fs = req->file->fs_data;
 
-    int is_first = fs->cluster_reqs_first == NULL;
-
-    if (is_first)
-      fs->cluster_reqs_first = req;
-    else
-      fs->cluster_reqs_last->callback.next = (void *)req;
-
-    fs->cluster_reqs_last = req;
-    req->callback.next = NULL;
-
-    if (is_first)
-    {
-      pi_task_push(pi_task_callback(&fs->cl_req_task, __pi_cl_fs_seek_req_exec, _req));
-    }
+    __pi_cl_fs_req_send(file, req, __PI_CL_FS_REQ_DIRECT_READ);
 }
 
 
 void pi_cl_fs_seek(pi_fs_file_t *file, uint32_t offset, pi_cl_fs_req_t *req)
 {
-    req->file = file;
     req->rw.offset = offset;
-    req->rw.cid = pi_cluster_id();
-    req->rw.done = 0;
-
-    pi_cl_send_callback_to_fc(pi_callback(&(req->callback), __pi_cl_fs_seek_req, (void *)req));
-}
-
-
-void __pi_cl_fs_copy_req_exec(void *_req);
-
-
-void __pi_cl_fs_copy_req_done(void *_req)
-{
-    pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
-    pi_fs_file_t *file = req->file;
-    pi_fs_data_t *fs = req->file->fs_data;
-    pi_task_t *task = &fs->cl_req_task;
-
-    cl_notify_task_done(&(req->copy.done), req->copy.cid);
-
-    int irq = hal_irq_disable();
-
-    fs->cluster_reqs_first = (void *)req->callback.next;
-    req = fs->cluster_reqs_first;
-    hal_irq_restore(irq);
-    if (req)
-    {
-      __pi_cl_fs_copy_req_exec(req);
-    }
-}
-
-void __pi_cl_fs_copy_req_exec(void *_req)
-{
-    pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
-    pi_fs_file_t *file = req->file;
-    pi_fs_data_t *fs = req->file->fs_data;
-
-    if (req->copy.length)
-      req->copy.result = pi_fs_copy_2d_async(req->file, req->copy.index, req->copy.buffer, req->copy.size, req->copy.stride, req->copy.length, req->copy.ext2loc, pi_task_callback(&fs->cl_req_task, __pi_cl_fs_copy_req_done, (void *)req));
-    else
-      req->copy.result = pi_fs_copy_async(req->file, req->copy.index, req->copy.buffer, req->copy.size, req->copy.ext2loc, pi_task_callback(&fs->cl_req_task, __pi_cl_fs_copy_req_done, (void *)req));
-
-    if (req->copy.result)
-      __pi_cl_fs_copy_req_done(_req);
-}
-
-
-void __pi_cl_fs_copy_req(void *_req)
-{
-    pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
-    pi_fs_data_t *fs = req->file->fs_data;
-
-    int is_first = fs->cluster_reqs_first == NULL;
-
-    if (is_first)
-      fs->cluster_reqs_first = req;
-    else
-      fs->cluster_reqs_last->callback.next = (void *)req;
-
-    fs->cluster_reqs_last = req;
-    req->callback.next = NULL;
+    req->rw.result = -1;
 
-    if (is_first)
-    {
-      pi_task_push(pi_task_callback(&fs->cl_req_task, __pi_cl_fs_copy_req_exec, _req));
-    }
+    __pi_cl_fs_req_send(file, req, __PI_CL_FS_REQ_SEEK);
 }
 
 
 void pi_cl_fs_copy(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, int32_t ext2loc, pi_cl_fs_req_t *req)
 {
-  req->file = file;
   req->copy.index = index;
   req->copy.buffer = buffer;
   req->copy.size = size;
   req->copy.ext2loc = ext2loc;
   req->copy.length = 0;
-  req->copy.done = 0;
-  req->copy.cid = pi_cluster_id();
 
-  pi_cl_send_callback_to_fc(pi_callback(&(req->callback), __pi_cl_fs_copy_req, (void *)req));
+  __pi_cl_fs_req_send(file, req, __PI_CL_FS_REQ_COPY);
 }
 
 void pi_cl_fs_copy_2d(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc, pi_cl_fs_req_t *req)
 {
-  req->file = file;
   req->copy.index = index;
   req->copy.buffer = buffer;
   req->copy.size = size;
   req->copy.stride = stride;
   req->copy.length = length;
   req->copy.ext2loc = ext2loc;
-  req->copy.done = 0;
-  req->copy.cid = pi_cluster_id();
 
-  pi_cl_send_callback_to_fc(pi_callback(&(req->callback), __pi_cl_fs_copy_req, (void *)req));
+  __pi_cl_fs_req_send(file, req, __PI_CL_FS_REQ_COPY);
+}
+
+
+void pi_cl_fs_readv(pi_fs_file_t *file, pi_fs_iovec_t *iov, uint32_t nb_iov, pi_cl_fs_req_t *req)
+{
+  req->readv.iov = iov;
+  req->readv.nb_iov = nb_iov;
+  req->readv.result = -1;
+
+  __pi_cl_fs_req_send(file, req, __PI_CL_FS_REQ_READV);
+}
+
+void pi_cl_fs_close(pi_fs_file_t *file, pi_cl_fs_req_t *req)
+{
+  req->rw.result = -1;
+
+  __pi_cl_fs_req_send(file, req, __PI_CL_FS_REQ_CLOSE);
+}
+
+// Requests which are not attached to a file go directly to the worker
+static void __pi_cl_fs_send_worker(pi_cl_fs_req_t *req, uint8_t op)
+{
+  req->op = op;
+  req->rw.cid = pi_cluster_id();
+  req->rw.done = 0;
+  req->rw.result = -1;
+
+  pi_cl_send_callback_to_fc(pi_callback(&(req->callback), __pi_cl_fs_worker_req, (void *)req));
 }
 
 #else
@@ -511,19 +1500,19 @@ void pi_cl_fs_seek(pi_fs_file_t *file, uint32_t offset, pi_cl_fs_req_t *req)
 void __pi_cl_fs_copy_req_done(void *_req)
 {
     pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
+    req->copy.result = __pi_fs_copy_result(req->copy.result, &req->task);
     cl_notify_task_done(&(req->copy.done), req->copy.cid);
 }
 
 void __pi_cl_fs_copy_req(void *_req)
 {
   pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
+  // The task is pushed even if the copy fails, the request ends there
+  __pi_fs_task_data(&req->task)[0] = 0;
   if (req->copy.length)
     req->copy.result = pi_fs_copy_2d_async(req->file, req->copy.index, req->copy.buffer, req->copy.size, req->copy.stride, req->copy.length, req->copy.ext2loc, pi_task_callback(&req->task, __pi_cl_fs_copy_req_done, (void *)req));
   else
     req->copy.result = pi_fs_copy_async(req->file, req->copy.index, req->copy.buffer, req->copy.size, req->copy.ext2loc, pi_task_callback(&req->task, __pi_cl_fs_copy_req_done, (void *)req));
-
-  if (req->copy.result)
-    __pi_cl_fs_copy_req_done(_req);
 }
 
 
@@ -556,5 +1545,89 @@ void pi_cl_fs_copy_2d(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t
   pi_cl_send_task_to_fc(&(req->task));
 }
 
+void __pi_cl_fs_readv_req_done(void *_req)
+{
+    pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
+    #if defined(__PULP_OS__)
+    req->readv.result = req->task.implem.data[0];
+    #else
+    req->readv.result = req->task.data[0];
+    #endif  /* __PULP_OS__ */
+    cl_notify_task_done(&(req->readv.done), req->readv.cid);
+}
+
+void __pi_cl_fs_readv_req(void *_req)
+{
+  pi_cl_fs_req_t *req = (pi_cl_fs_req_t *)_req;
+  if (pi_fs_readv_async(req->file, req->readv.iov, req->readv.nb_iov, pi_task_callback(&req->task, __pi_cl_fs_readv_req_done, (void *)req)))
+  {
+    req->readv.result = -1;
+    cl_notify_task_done(&(req->readv.done), req->readv.cid);
+  }
+}
+
+void pi_cl_fs_readv(pi_fs_file_t *file, pi_fs_iovec_t *iov, uint32_t nb_iov, pi_cl_fs_req_t *req)
+{
+  req->file = file;
+  req->readv.iov = iov;
+  req->readv.nb_iov = nb_iov;
+  req->readv.done = 0;
+  req->readv.result = -1;
+  req->readv.cid = pi_cluster_id();
+  pi_task_callback(&req->task, __pi_cl_fs_readv_req, (void *) req);
+  pi_cl_send_task_to_fc(&(req->task));
+}
+
+static void __pi_cl_fs_send_worker(pi_cl_fs_req_t *req, uint8_t op)
+{
+  req->op = op;
+  req->rw.cid = pi_cluster_id();
+  req->rw.done = 0;
+  req->rw.result = -1;
+
+  pi_task_callback(&req->task, __pi_cl_fs_worker_req, (void *)req);
+  pi_cl_send_task_to_fc(&(req->task));
+}
+
+void pi_cl_fs_close(pi_fs_file_t *file, pi_cl_fs_req_t *req)
+{
+  req->file = file;
+
+  __pi_cl_fs_send_worker(req, __PI_CL_FS_WORKER_CLOSE);
+}
+
+
+#endif
+
+
+void pi_cl_fs_open(struct pi_device *device, const char *path, int flags, pi_fs_file_t **file, pi_cl_fs_req_t *req)
+{
+  req->open.device = device;
+  req->open.path = path;
+  req->open.paths = &req->open.path;
+  req->open.nb_paths = 1;
+  req->open.flags = flags;
+  req->open.files = file;
+
+  __pi_cl_fs_send_worker(req, __PI_CL_FS_WORKER_OPEN);
+}
+
+void pi_cl_fs_open_batch(struct pi_device *device, const char **paths, uint32_t nb_paths, int flags, pi_fs_file_t **files, pi_cl_fs_req_t *req)
+{
+  req->open.device = device;
+  req->open.paths = paths;
+  req->open.nb_paths = nb_paths;
+  req->open.flags = flags;
+  req->open.files = files;
+
+  __pi_cl_fs_send_worker(req, __PI_CL_FS_WORKER_OPEN);
+}
+
+void pi_cl_fs_stat(struct pi_device *device, const char *path, uint32_t *size, pi_cl_fs_req_t *req)
+{
+  req->open.device = device;
+  req->open.path = path;
+  req->open.size = size;
 
-#endif
\ No newline at end of file
+  __pi_cl_fs_send_worker(req, __PI_CL_FS_WORKER_STAT);
+}
@@ -29,6 +29,7 @@ static pi_fs_data_t bsp_fs_data;
 typedef struct {
   pi_fs_file_t header;
   int fd;
+  uint32_t offset;
 } pi_host_fs_file_t;
 
 static int32_t __pi_host_fs_mount(struct pi_device *device)
@@ -51,15 +52,26 @@ static pi_fs_file_t *__pi_host_fs_open(struct pi_device *device, const char *fil
   // The possible values are specified in openocd in src/target/semihosting_common.c
   file->fd = semihost_open(file_name, flags == PI_FS_FLAGS_WRITE ? 6 : flags == PI_FS_FLAGS_APPEND ? 8 : 0);
   if (file->fd == -1)
-    return NULL;
+    goto error1;
 
   file->header.api = (pi_fs_api_t *)device->api;
   file->header.data = file;
   file->header.fs = device;
   file->header.fs_data = &bsp_fs_data;
+  file->header.readahead = NULL;
+  file->header.readv_first = NULL;
+  file->header.cl_reqs_first = NULL;
+  file->header.mmap_ptr = NULL;
+  file->offset = 0;
+
+  // The file size is needed by the read-ahead to know where to stop
+  int size = semihost_flen(file->fd);
+  file->header.size = size < 0 ? 0 : size;
 
   return (pi_fs_file_t *)file;
 
+error1:
+  pmsis_l2_malloc_free(file, sizeof(pi_host_fs_file_t));
 error:
   return NULL;
 }
@@ -71,10 +83,28 @@ static void __pi_host_fs_close(pi_fs_file_t *arg)
   pmsis_l2_malloc_free(file, sizeof(pi_host_fs_file_t));
 }
 
+// Semihosting accesses are synchronous, these return the number of bytes
+// transferred and the asynchronous variants only notify the task
+static int __pi_host_fs_read(pi_host_fs_file_t *file, void *buffer, uint32_t size)
+{
+  int result = size - semihost_read(file->fd, buffer, size);
+  file->offset += result;
+  return result;
+}
+
+static int __pi_host_fs_write(pi_host_fs_file_t *file, void *buffer, uint32_t size)
+{
+  int result = size - semihost_write(file->fd, buffer, size);
+  file->offset += result;
+  if (file->offset > file->header.size)
+    file->header.size = file->offset;
+  return result;
+}
+
 static int32_t __pi_host_fs_read_async(pi_fs_file_t *arg, void *buffer, uint32_t size, pi_task_t *task)
 {
   pi_host_fs_file_t *file = (pi_host_fs_file_t *)arg;
-  int result = size - semihost_read(file->fd, buffer, size);
+  int result = __pi_host_fs_read(file, buffer, size);
   #if defined(__PULP_OS__)
   task->implem.data[0] = result;
   #else
@@ -87,7 +117,7 @@ static int32_t __pi_host_fs_read_async(pi_fs_file_t *arg, void *buffer, uint32_t
 static int32_t __pi_host_fs_direct_read_async(pi_fs_file_t *arg, void *buffer, uint32_t size, pi_task_t *task)
 {
   pi_host_fs_file_t *file = (pi_host_fs_file_t *)arg;
-  int result = size - semihost_read(file->fd, buffer, size);
+  int result = __pi_host_fs_read(file, buffer, size);
   #if defined(__PULP_OS__)
   task->implem.data[0] = result;
   #else
@@ -100,8 +130,13 @@ static int32_t __pi_host_fs_direct_read_async(pi_fs_file_t *arg, void *buffer, u
 static int32_t __pi_host_fs_write_async(pi_fs_file_t *arg, void *buffer, uint32_t size, pi_task_t *task)
 {
   pi_host_fs_file_t *file = (pi_host_fs_file_t *)arg;
-  int result = size - semihost_write(file->fd, buffer, size);
+  int result = __pi_host_fs_write(file, buffer, size);
 
+  #if defined(__PULP_OS__)
+  task->implem.data[0] = result;
+  #else
+  task->data[0] = result;
+  #endif  /* __PULP_OS__ */
   pi_task_push(task);
   return result;
 }
@@ -109,51 +144,74 @@ static int32_t __pi_host_fs_write_async(pi_fs_file_t *arg, void *buffer, uint32_
 static int32_t __pi_host_fs_seek(pi_fs_file_t *arg, unsigned int offset)
 {
   pi_host_fs_file_t *file = (pi_host_fs_file_t *)arg;
-  return semihost_seek(file->fd, offset);
+  if (semihost_seek(file->fd, offset))
+    return -1;
+  file->offset = offset;
+  return 0;
+}
+
+static uint32_t __pi_host_fs_tell(pi_fs_file_t *arg)
+{
+  pi_host_fs_file_t *file = (pi_host_fs_file_t *)arg;
+  return file->offset;
+}
+
+static int32_t __pi_host_fs_copy_end(pi_task_t *task, int result)
+{
+  // The task is always pushed, even when the copy fails, as the synchronous
+  // wrappers wait for it
+  #if defined(__PULP_OS__)
+  task->implem.data[0] = result;
+  #else
+  task->data[0] = result;
+  #endif  /* __PULP_OS__ */
+  pi_task_push(task);
+  return result;
 }
 
 static int32_t __pi_host_fs_copy_async(pi_fs_file_t *arg, uint32_t index, void *buffer, uint32_t size, int32_t ext2loc, pi_task_t *task)
 {
+  pi_host_fs_file_t *file = (pi_host_fs_file_t *)arg;
+  int result;
+
   if (__pi_host_fs_seek(arg, index))
-    return -1;
+    return __pi_host_fs_copy_end(task, -1);
 
   if (ext2loc)
-    return __pi_host_fs_read_async(arg, buffer, size, task);
+    result = __pi_host_fs_read(file, buffer, size);
   else
-    return __pi_host_fs_write_async(arg, buffer, size, task);
+    result = __pi_host_fs_write(file, buffer, size);
+
+  return __pi_host_fs_copy_end(task, result == (int)size ? 0 : -1);
 }
 
-static int32_t __pi_host_fs_copy_2d_async(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc, pi_task_t *task)
+static int32_t __pi_host_fs_copy_2d_async(pi_fs_file_t *arg, uint32_t index, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc, pi_task_t *task)
 {
+  pi_host_fs_file_t *file = (pi_host_fs_file_t *)arg;
   unsigned int chunk;
   for (chunk=0; chunk<size; chunk+=length)
   {
     if (length > size)
       length = size;
 
-    if (__pi_host_fs_seek(file, index))
-      goto error;
+    if (__pi_host_fs_seek(arg, index))
+      return __pi_host_fs_copy_end(task, -1);
 
     if (ext2loc)
     {
-      if (pi_fs_read(file, buffer, length) != (int)length)
-        goto error;
+      if (__pi_host_fs_read(file, buffer, length) != (int)length)
+        return __pi_host_fs_copy_end(task, -1);
     }
     else
     {
-      if (pi_fs_write(file, buffer, length) != (int)length)
-        goto error;
+      if (__pi_host_fs_write(file, buffer, length) != (int)length)
+        return __pi_host_fs_copy_end(task, -1);
     }
 
     buffer = ((char *)buffer) + length;
     index += stride;
   }
-  pi_task_push(task);
-  return 0;
-
-error:
-  pi_task_push(task);
-  return -1;
+  return __pi_host_fs_copy_end(task, 0);
 }
 
 pi_fs_api_t __pi_host_fs_api = {
@@ -165,6 +223,7 @@ pi_fs_api_t __pi_host_fs_api = {
   .direct_read = __pi_host_fs_direct_read_async,
   .write = __pi_host_fs_write_async,
   .seek = __pi_host_fs_seek,
+  .tell = __pi_host_fs_tell,
   .copy = __pi_host_fs_copy_async,
   .copy_2d = __pi_host_fs_copy_2d_async
 };
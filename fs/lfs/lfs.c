@@ -1476,6 +1476,7 @@ static int lfs_dir_compact(lfs_t *lfs,
 
     // increment revision count
     dir->rev += 1;
+    lfs->compactions += 1;
     if (lfs->cfg->block_cycles > 0 &&
             (dir->rev % (lfs->cfg->block_cycles+1) == 0)) {
         if (lfs_pair_cmp(dir->pair, (const lfs_block_t[2]){0, 1}) == 0) {
@@ -1627,6 +1628,7 @@ static int lfs_dir_compact(lfs_t *lfs,
 relocate:
         // commit was corrupted, drop caches and prepare to relocate block
         relocated = true;
+        lfs->relocations += 1;
         lfs_cache_drop(lfs, &lfs->pcache);
         if (!exhausted) {
             LFS_DEBUG("Bad block at %"PRIx32, dir->pair[1]);
@@ -3069,6 +3071,71 @@ lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file) {
 }
 
 
+static void lfs_file_extent_init(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t index, struct lfs_file_extent *extent) {
+    // first data byte of a block, after its skip-list pointers
+    lfs_off_t b = lfs->cfg->block_size - 2*4;
+    extent->index = index;
+    extent->off = (index == 0) ? 0 : 4*(lfs_ctz(index)+1);
+    extent->pos = b*index + 4*lfs_popc(index) + extent->off;
+    extent->size = lfs_min(lfs->cfg->block_size - extent->off,
+            file->ctz.size - extent->pos);
+}
+
+int lfs_file_extent(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t pos, struct lfs_file_extent *extent) {
+    LFS_TRACE("lfs_file_extent(%p, %p, %"PRIu32", %p)",
+            (void*)lfs, (void*)file, pos, (void*)extent);
+    LFS_ASSERT(file->flags & LFS_F_OPENED);
+    if ((file->flags & (LFS_F_INLINE | LFS_F_WRITING)) ||
+            pos >= file->ctz.size) {
+        LFS_TRACE("lfs_file_extent -> %d", LFS_ERR_INVAL);
+        return LFS_ERR_INVAL;
+    }
+
+    lfs_off_t off = pos;
+    lfs_off_t index = lfs_ctz_index(lfs, &off);
+    int err = lfs_ctz_find(lfs, NULL, &file->cache,
+            file->ctz.head, file->ctz.size,
+            pos, &extent->block, &off);
+    if (err) {
+        LFS_TRACE("lfs_file_extent -> %d", err);
+        return err;
+    }
+
+    lfs_file_extent_init(lfs, file, index, extent);
+    LFS_TRACE("lfs_file_extent -> %d", 0);
+    return 0;
+}
+
+int lfs_file_extent_prev(lfs_t *lfs, lfs_file_t *file,
+        struct lfs_file_extent *extent) {
+    LFS_TRACE("lfs_file_extent_prev(%p, %p, %p)",
+            (void*)lfs, (void*)file, (void*)extent);
+    LFS_ASSERT(file->flags & LFS_F_OPENED);
+    if (extent->index == 0) {
+        LFS_TRACE("lfs_file_extent_prev -> %d", LFS_ERR_INVAL);
+        return LFS_ERR_INVAL;
+    }
+
+    // the first pointer of a block is the previous block
+    lfs_block_t head;
+    int err = lfs_bd_read(lfs,
+            NULL, &file->cache, sizeof(head),
+            extent->block, 0, &head, sizeof(head));
+    if (err) {
+        LFS_TRACE("lfs_file_extent_prev -> %d", err);
+        return err;
+    }
+
+    extent->block = lfs_fromle32(head);
+    LFS_ASSERT(extent->block >= 2 && extent->block <= lfs->cfg->block_count);
+    lfs_file_extent_init(lfs, file, extent->index - 1, extent);
+    LFS_TRACE("lfs_file_extent_prev -> %d", 0);
+    return 0;
+}
+
+
 /// General fs operations ///
 int lfs_stat(lfs_t *lfs, const char *path, struct lfs_info *info) {
     LFS_TRACE("lfs_stat(%p, \"%s\", %p)", (void*)lfs, path, (void*)info);
@@ -3458,6 +3525,8 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->root[1] = LFS_BLOCK_NULL;
     lfs->mlist = NULL;
     lfs->seed = 0;
+    lfs->compactions = 0;
+    lfs->relocations = 0;
     lfs->gstate = (struct lfs_gstate){0};
     lfs->gpending = (struct lfs_gstate){0};
     lfs->gdelta = (struct lfs_gstate){0};
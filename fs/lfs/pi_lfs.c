@@ -27,6 +27,60 @@
 #include "bsp/fs/pi_lfs.h"
 #include "bsp/flash.h"
 
+/*
+ * Default geometry, see pi_lfs_geometry_init
+ */
+#define PI_LFS_READ_SIZE            4
+#define PI_LFS_PROG_SIZE            4
+#define PI_LFS_CACHE_SIZE           1024
+#define PI_LFS_CACHE_BLOCK_RATIO    64
+#define PI_LFS_LOOKAHEAD_MIN_SIZE   16
+#define PI_LFS_LOOKAHEAD_MAX_SIZE   64
+#define PI_LFS_BLOCK_CYCLES         100
+
+// "LFSS", identifies the file of saved statistics
+#define PI_LFS_STATS_MAGIC          0x5353464c
+
+#ifndef PI_LFS_WORKER_PRIORITY
+#define PI_LFS_WORKER_PRIORITY 2
+#endif
+
+/*
+ * Requests executed by the worker
+ */
+#define PI_LFS_REQ_READ     0
+#define PI_LFS_REQ_WRITE    1
+#define PI_LFS_REQ_SEEK     2
+#define PI_LFS_REQ_COPY     3
+#define PI_LFS_REQ_COPY_2D  4
+#define PI_LFS_REQ_CLOSE    5
+// Requests allocated by the caller, which waits for them
+#define PI_LFS_REQ_BARRIER  6
+#define PI_LFS_REQ_STOP     7
+
+typedef struct pi_lfs_req_s {
+    struct pi_lfs_req_s *next;
+    uint8_t op;
+    pi_fs_file_t *file;
+    void *buffer;
+    uint32_t size;
+    uint32_t index;
+    uint32_t stride;
+    uint32_t length;
+    int32_t ext2loc;
+    pi_task_t *task;
+} pi_lfs_req_t;
+
+/*
+ * Saved statistics, followed by the erase count of each block if they are
+ * tracked.
+ */
+typedef struct pi_lfs_stats_record_s {
+    uint32_t magic;
+    uint32_t block_count;
+    struct pi_lfs_stats stats;
+} pi_lfs_stats_record_t;
+
 typedef struct pi_lfs_t {
     lfs_t lfs;
     struct lfs_config config;
@@ -34,8 +88,40 @@ typedef struct pi_lfs_t {
     uint32_t partition_offset;
     size_t partition_size;
     pi_fs_data_t fs_data;
+    
+    /*
+     * Telemetry, the compactions and relocations since the mount are counted
+     * by LittleFS and added when the statistics are returned.
+     */
+    struct pi_lfs_stats stats;
+    uint32_t *erase_counts;
+    const char *stats_path;
+    
+    /*
+     * Asynchronous mode, the file-system is only accessed by the worker,
+     * which executes the queued requests in order.
+     */
+    uint8_t async;
+    pi_lfs_req_t *reqs_first;
+    pi_lfs_req_t *reqs_last;
+#if defined(__FREERTOS__)
+    void *worker;
+    pi_sem_t worker_sem;
+#else
+    uint8_t worker_busy;
+    pi_task_t worker_task;
+#endif
 } pi_lfs_t;
 
+/*
+ * The position is the one the file will have once all its queued requests
+ * are executed, so that the size of a read can be returned when it is queued.
+ */
+typedef struct pi_lfs_file_t {
+    lfs_file_t lfs_file;
+    uint32_t position;
+} pi_lfs_file_t;
+
 pi_fs_api_t pi_lfs_api;
 
 static int lfs_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
@@ -48,6 +134,7 @@ static int lfs_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off
     pi_flash_read(pi_lfs->flash,
                   pi_lfs->partition_offset + block * c->block_size + off,
                   buffer, size);
+    pi_lfs->stats.flash_read_bytes += size;
     return 0;
 }
 
@@ -61,6 +148,7 @@ static int lfs_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off
     pi_flash_program(pi_lfs->flash,
                      pi_lfs->partition_offset + block * c->block_size + off,
                      buffer, size);
+    pi_lfs->stats.flash_program_bytes += size;
     return 0;
 }
 
@@ -71,8 +159,17 @@ static int lfs_erase(const struct lfs_config *c, lfs_block_t block)
     if(block * c->block_size + c->block_size > pi_lfs->partition_offset + pi_lfs->partition_size)
         return LFS_ERR_IO;
     
-    pi_flash_erase_sector(pi_lfs->flash,
-                          pi_lfs->partition_offset + block * c->block_size);
+    // Blocks may span several sectors
+    pi_flash_erase(pi_lfs->flash,
+                   pi_lfs->partition_offset + block * c->block_size, c->block_size);
+    
+    pi_lfs->stats.nb_erases++;
+    if(pi_lfs->erase_counts)
+    {
+        uint32_t count = ++pi_lfs->erase_counts[block];
+        if(count > pi_lfs->stats.max_block_erases)
+            pi_lfs->stats.max_block_erases = count;
+    }
     return 0;
 }
 
@@ -81,7 +178,533 @@ static int lfs_sync(const struct lfs_config *c)
     return 0;
 }
 
-static void init_lfs_config(struct lfs_config *lfs_config, pi_lfs_t *pi_lfs, const size_t sector_size)
+static int32_t pi_lfs_file_read(pi_fs_file_t *file, void *buffer, uint32_t size)
+{
+    pi_lfs_t *pi_lfs = file->fs->data;
+    int32_t rc;
+    
+    rc = lfs_file_read(&pi_lfs->lfs, file->data, buffer, size);
+    if(rc > 0) pi_lfs->stats.read_bytes += rc;
+    
+    return rc;
+}
+
+static int32_t pi_lfs_file_write(pi_fs_file_t *file, void *buffer, uint32_t size)
+{
+    pi_lfs_t *pi_lfs = file->fs->data;
+    int32_t rc;
+    
+    rc = lfs_file_write(&pi_lfs->lfs, file->data, buffer, size);
+    if(rc > 0) pi_lfs->stats.write_bytes += rc;
+    
+    return rc;
+}
+
+static int32_t pi_lfs_file_seek(pi_fs_file_t *file, unsigned int offset)
+{
+    pi_lfs_t *pi_lfs = file->fs->data;
+    int32_t rc;
+    
+    rc = lfs_file_seek(&pi_lfs->lfs, file->data, offset, LFS_SEEK_SET);
+    
+    return (rc < 0) ? -1 : 0;
+}
+
+/*
+ * 2D read done directly from the flash. The blocks of the file are resolved
+ * once, from the last one to the first one as littlefs links them backward,
+ * and the rows fully contained in a block are transferred with a single 2D
+ * flash copy. Returns 1 if the transfer can't be done this way, in which case
+ * it must be done row by row through littlefs.
+ */
+static int32_t pi_lfs_file_read_2d(pi_lfs_t *pi_lfs, lfs_file_t *lfs_file, uint32_t index, void *buffer,
+                                   uint32_t size, uint32_t stride, uint32_t length)
+{
+    lfs_t *lfs = &pi_lfs->lfs;
+    struct lfs_file_extent extent;
+    
+    if(size == 0 || length == 0 || stride < length) return 1;
+    
+    int32_t rows = (size + length - 1) / length;
+    uint32_t last_length = size - (rows - 1) * length;
+    uint32_t end = index + (rows - 1) * stride + last_length;
+    
+    // Rows going beyond the end of the file are shortened by littlefs
+    if(end > (uint32_t) lfs_file_size(lfs, lfs_file)) return 1;
+    
+    if(lfs_file_extent(lfs, lfs_file, end - 1, &extent) < 0) return 1;
+    
+    while (1)
+    {
+        uint32_t start = extent.pos < index ? index : extent.pos;
+        uint32_t stop = extent.pos + extent.size < end ? extent.pos + extent.size : end;
+        uint32_t base = pi_lfs->partition_offset + extent.block * pi_lfs->config.block_size + extent.off - extent.pos;
+        
+        // Rows overlapping the extent
+        int32_t first = (start - index) / stride;
+        int32_t last = (stop - 1 - index) / stride;
+        if(start - index - first * stride >= length) first++;
+        
+        // Rows fully inside the extent, they must all have the same length
+        int32_t full_first = (start - index + stride - 1) / stride;
+        int32_t full_last = last;
+        if(full_last == rows - 1 && last_length != length) full_last--;
+        else if(index + full_last * stride + length > stop) full_last--;
+        
+        for (int32_t row = first; row <= last;)
+        {
+            uint32_t row_start = index + row * stride;
+            void *row_buffer = buffer + row * length;
+            
+            if(row >= full_first && row <= full_last)
+            {
+                uint32_t count = full_last - row + 1;
+                
+                if(count == 1)
+                {
+                    pi_flash_copy(pi_lfs->flash, base + row_start, row_buffer, length, 1);
+                } else
+                {
+                    pi_flash_copy_2d(pi_lfs->flash, base + row_start, row_buffer, count * length, stride,
+                                     length, 1);
+                }
+                row += count;
+            } else
+            {
+                uint32_t row_end = row_start + (row == rows - 1 ? last_length : length);
+                uint32_t copy_start = row_start < start ? start : row_start;
+                uint32_t copy_end = row_end > stop ? stop : row_end;
+                
+                pi_flash_copy(pi_lfs->flash, base + copy_start, row_buffer + copy_start - row_start,
+                              copy_end - copy_start, 1);
+                row++;
+            }
+        }
+        
+        if(extent.pos <= index)
+        {
+            pi_lfs->stats.flash_read_bytes += size;
+            return 0;
+        }
+        
+        if(lfs_file_extent_prev(lfs, lfs_file, &extent) < 0) return -1;
+    }
+}
+
+/*
+ * Copies access the file at the given index, the current position is
+ * restored once they are done.
+ */
+static int32_t
+pi_lfs_file_copy_2d(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, uint32_t stride,
+                    uint32_t length, int32_t ext2loc)
+{
+    int32_t rc;
+    pi_lfs_t *pi_lfs = file->fs->data;
+    lfs_t *lfs = &pi_lfs->lfs;
+    lfs_file_t *lfs_file = file->data;
+    lfs_soff_t position = lfs_file_tell(lfs, lfs_file);
+    uint32_t size_total = size;
+    
+    if(ext2loc)
+    {
+        rc = pi_lfs_file_read_2d(pi_lfs, lfs_file, index, buffer, size, stride, length);
+        if(rc == 0) pi_lfs->stats.read_bytes += size;
+        if(rc <= 0) return rc;
+    }
+    
+    rc = lfs_file_seek(lfs, lfs_file, index, LFS_SEEK_SET);
+    if(rc < 0) return -1;
+    
+    while (size > 0)
+    {
+        size_t loop_length = (size >= length) ? length : size;
+        
+        if(ext2loc)
+        {
+            rc = lfs_file_read(lfs, lfs_file, buffer, loop_length);
+        } else
+        {
+            rc = lfs_file_write(lfs, lfs_file, buffer, loop_length);
+        }
+        
+        if(rc < 0) break;
+        
+        size -= loop_length;
+        buffer += length;
+        
+        if(size == 0) break;
+        
+        rc = lfs_file_seek(lfs, lfs_file, stride - length, LFS_SEEK_CUR);
+        if(rc < 0) break;
+    }
+    
+    if(lfs_file_seek(lfs, lfs_file, position, LFS_SEEK_SET) < 0 || rc < 0) return -1;
+    
+    if(ext2loc)
+        pi_lfs->stats.read_bytes += size_total;
+    else
+        pi_lfs->stats.write_bytes += size_total;
+    
+    return 0;
+}
+
+static int32_t pi_lfs_req_exec(pi_lfs_req_t *req)
+{
+    pi_fs_file_t *file = req->file;
+    
+    switch (req->op)
+    {
+        case PI_LFS_REQ_READ:
+            return pi_lfs_file_read(file, req->buffer, req->size);
+        
+        case PI_LFS_REQ_WRITE:
+            return pi_lfs_file_write(file, req->buffer, req->size);
+        
+        case PI_LFS_REQ_SEEK:
+            return pi_lfs_file_seek(file, req->index);
+        
+        case PI_LFS_REQ_COPY:
+            return pi_lfs_file_copy_2d(file, req->index, req->buffer, req->size, req->size, req->size,
+                                       req->ext2loc);
+        
+        case PI_LFS_REQ_COPY_2D:
+            return pi_lfs_file_copy_2d(file, req->index, req->buffer, req->size, req->stride, req->length,
+                                       req->ext2loc);
+        
+        case PI_LFS_REQ_CLOSE:
+        {
+            pi_lfs_t *pi_lfs = file->fs->data;
+            lfs_file_close(&pi_lfs->lfs, file->data);
+            pi_fc_l1_free(file->data, sizeof(pi_lfs_file_t));
+            pi_fc_l1_free(file, sizeof(pi_fs_file_t));
+            return 0;
+        }
+        
+        default:
+            return 0;
+    }
+}
+
+static pi_lfs_req_t *pi_lfs_req_alloc(uint8_t op, pi_fs_file_t *file, void *buffer, uint32_t size, pi_task_t *task)
+{
+    pi_lfs_req_t *req = pi_l2_malloc(sizeof(pi_lfs_req_t));
+    if(req == NULL) return NULL;
+    
+    req->op = op;
+    req->file = file;
+    req->buffer = buffer;
+    req->size = size;
+    req->task = task;
+    
+    return req;
+}
+
+static void pi_lfs_req_done(pi_lfs_req_t *req, int32_t rc)
+{
+    pi_task_t *task = req->task;
+    
+    if(req->op < PI_LFS_REQ_BARRIER)
+    {
+        pi_l2_free(req, sizeof(pi_lfs_req_t));
+    }
+    
+    if(task)
+    {
+        #if defined(__PULP_OS__)
+        task->implem.data[0] = rc;
+        #else
+        task->data[0] = rc;
+        #endif  /* __PULP_OS__ */
+        pi_task_push(task);
+    }
+}
+
+static pi_lfs_req_t *pi_lfs_req_pop(pi_lfs_t *pi_lfs)
+{
+    int irq = hal_irq_disable();
+    pi_lfs_req_t *req = pi_lfs->reqs_first;
+    pi_lfs->reqs_first = req->next;
+    hal_irq_restore(irq);
+    return req;
+}
+
+#if defined(__FREERTOS__)
+
+/*
+ * The worker is a thread blocked on the semaphore, which is given once per
+ * queued request. The flash accesses only block this thread.
+ */
+static void pi_lfs_worker_entry(void *arg)
+{
+    pi_lfs_t *pi_lfs = (pi_lfs_t *) arg;
+    
+    while (1)
+    {
+        pi_sem_take(&pi_lfs->worker_sem);
+        
+        pi_lfs_req_t *req = pi_lfs_req_pop(pi_lfs);
+        uint8_t stop = req->op == PI_LFS_REQ_STOP;
+        
+        pi_lfs_req_done(req, pi_lfs_req_exec(req));
+        
+        if(stop)
+        {
+            vTaskDelete(NULL);
+        }
+    }
+}
+
+#else
+
+/*
+ * Without threads, the worker is an event executing one request at a time,
+ * so that the caller goes on until it waits for an event and other events
+ * can be handled between two requests.
+ */
+static void pi_lfs_worker_run(void *arg)
+{
+    pi_lfs_t *pi_lfs = (pi_lfs_t *) arg;
+    
+    pi_lfs_req_t *req = pi_lfs_req_pop(pi_lfs);
+    
+    pi_lfs_req_done(req, pi_lfs_req_exec(req));
+    
+    // The worker stops once the queue is empty, so that no event is pending
+    // when the file-system is unmounted
+    int irq = hal_irq_disable();
+    uint8_t busy = pi_lfs->reqs_first != NULL;
+    pi_lfs->worker_busy = busy;
+    hal_irq_restore(irq);
+    
+    if(busy)
+    {
+        pi_task_push(pi_task_callback(&pi_lfs->worker_task, pi_lfs_worker_run, pi_lfs));
+    }
+}
+
+#endif
+
+static void pi_lfs_req_enqueue(pi_lfs_t *pi_lfs, pi_lfs_req_t *req)
+{
+    req->next = NULL;
+    
+    int irq = hal_irq_disable();
+    if(pi_lfs->reqs_first)
+        pi_lfs->reqs_last->next = req;
+    else
+        pi_lfs->reqs_first = req;
+    pi_lfs->reqs_last = req;
+#if !defined(__FREERTOS__)
+    uint8_t start = !pi_lfs->worker_busy;
+    pi_lfs->worker_busy = 1;
+#endif
+    hal_irq_restore(irq);
+    
+#if defined(__FREERTOS__)
+    pi_sem_give(&pi_lfs->worker_sem);
+#else
+    if(start)
+    {
+        pi_task_push(pi_task_callback(&pi_lfs->worker_task, pi_lfs_worker_run, pi_lfs));
+    }
+#endif
+}
+
+/*
+ * Wait until the queued requests are executed, before accessing the
+ * file-system from the caller.
+ */
+static void pi_lfs_barrier(pi_lfs_t *pi_lfs)
+{
+    pi_lfs_req_t req;
+    pi_task_t task;
+    
+    if(!pi_lfs->async)
+        return;
+    
+    req.op = PI_LFS_REQ_BARRIER;
+    req.task = pi_task_block(&task);
+    pi_lfs_req_enqueue(pi_lfs, &req);
+    pi_task_wait_on(&task);
+}
+
+static int pi_lfs_worker_start(pi_lfs_t *pi_lfs)
+{
+    pi_lfs->reqs_first = NULL;
+    
+#if defined(__FREERTOS__)
+    if(pi_sem_init(&pi_lfs->worker_sem))
+        return -1;
+    
+    pi_lfs->worker = pmsis_task_create(pi_lfs_worker_entry, pi_lfs, "lfs", PI_LFS_WORKER_PRIORITY);
+    if(pi_lfs->worker == NULL)
+    {
+        pi_sem_deinit(&pi_lfs->worker_sem);
+        return -1;
+    }
+#else
+    pi_lfs->worker_busy = 0;
+#endif
+    
+    return 0;
+}
+
+static void pi_lfs_worker_stop(pi_lfs_t *pi_lfs)
+{
+#if defined(__FREERTOS__)
+    pi_lfs_req_t req;
+    pi_task_t task;
+    
+    req.op = PI_LFS_REQ_STOP;
+    req.task = pi_task_block(&task);
+    pi_lfs_req_enqueue(pi_lfs, &req);
+    pi_task_wait_on(&task);
+    
+    pi_sem_deinit(&pi_lfs->worker_sem);
+#else
+    pi_lfs_barrier(pi_lfs);
+#endif
+}
+
+static void pi_lfs_stats_add(struct pi_lfs_stats *stats, const struct pi_lfs_stats *other)
+{
+    stats->read_bytes += other->read_bytes;
+    stats->write_bytes += other->write_bytes;
+    stats->flash_read_bytes += other->flash_read_bytes;
+    stats->flash_program_bytes += other->flash_program_bytes;
+    stats->nb_erases += other->nb_erases;
+    stats->nb_compactions += other->nb_compactions;
+    stats->nb_relocations += other->nb_relocations;
+    if(other->max_block_erases > stats->max_block_erases)
+        stats->max_block_erases = other->max_block_erases;
+}
+
+/*
+ * The saved statistics are added to the ones counted since the beginning of
+ * the mount. The erase counts are dropped if the geometry changed.
+ */
+static void pi_lfs_stats_load(pi_lfs_t *pi_lfs)
+{
+    lfs_t *lfs = &pi_lfs->lfs;
+    lfs_file_t file;
+    pi_lfs_stats_record_t record;
+    uint32_t counts[16];
+    
+    if(lfs_file_open(lfs, &file, pi_lfs->stats_path, LFS_O_RDONLY) < 0) return;
+    
+    if(lfs_file_read(lfs, &file, &record, sizeof(record)) == sizeof(record)
+       && record.magic == PI_LFS_STATS_MAGIC)
+    {
+        pi_lfs_stats_add(&pi_lfs->stats, &record.stats);
+        
+        if(pi_lfs->erase_counts && record.block_count == pi_lfs->config.block_count)
+        {
+            for (uint32_t block = 0; block < record.block_count;)
+            {
+                uint32_t nb_counts = record.block_count - block;
+                if(nb_counts > sizeof(counts) / sizeof(counts[0]))
+                    nb_counts = sizeof(counts) / sizeof(counts[0]);
+                
+                if(lfs_file_read(lfs, &file, counts, nb_counts * sizeof(uint32_t))
+                   != (lfs_ssize_t) (nb_counts * sizeof(uint32_t)))
+                    break;
+                
+                for (uint32_t i = 0; i < nb_counts; i++, block++)
+                {
+                    uint32_t count = pi_lfs->erase_counts[block] + counts[i];
+                    pi_lfs->erase_counts[block] = count;
+                    if(count > pi_lfs->stats.max_block_erases)
+                        pi_lfs->stats.max_block_erases = count;
+                }
+            }
+        }
+    }
+    
+    lfs_file_close(lfs, &file);
+}
+
+static int32_t pi_lfs_stats_write(pi_lfs_t *pi_lfs)
+{
+    lfs_t *lfs = &pi_lfs->lfs;
+    lfs_file_t file;
+    pi_lfs_stats_record_t record;
+    lfs_ssize_t rc;
+    
+    if(pi_lfs->stats_path == NULL) return -1;
+    
+    record.magic = PI_LFS_STATS_MAGIC;
+    record.block_count = pi_lfs->erase_counts ? pi_lfs->config.block_count : 0;
+    record.stats = pi_lfs->stats;
+    record.stats.nb_compactions += lfs->compactions;
+    record.stats.nb_relocations += lfs->relocations;
+    
+    if(lfs_file_open(lfs, &file, pi_lfs->stats_path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) < 0)
+        return -1;
+    
+    rc = lfs_file_write(lfs, &file, &record, sizeof(record));
+    if(rc >= 0 && record.block_count)
+    {
+        rc = lfs_file_write(lfs, &file, pi_lfs->erase_counts, record.block_count * sizeof(uint32_t));
+    }
+    
+    if(lfs_file_close(lfs, &file) < 0) rc = -1;
+    
+    return (rc < 0) ? -1 : 0;
+}
+
+/*
+ * Fill the geometry parameters left to 0 with values derived from the flash
+ * sector size and the partition size, and check that they are compatible.
+ */
+static int pi_lfs_geometry_init(struct pi_lfs_conf *geometry, const size_t sector_size, const size_t partition_size)
+{
+    if(geometry->block_size == 0)
+        geometry->block_size = sector_size;
+    if(geometry->read_size == 0)
+        geometry->read_size = PI_LFS_READ_SIZE;
+    if(geometry->prog_size == 0)
+        geometry->prog_size = PI_LFS_PROG_SIZE;
+    if(geometry->block_cycles == 0)
+        geometry->block_cycles = PI_LFS_BLOCK_CYCLES;
+    
+    // Big blocks get a bigger cache to reduce the number of transfers,
+    // small ones are fully cached
+    if(geometry->cache_size == 0)
+    {
+        geometry->cache_size = geometry->block_size / PI_LFS_CACHE_BLOCK_RATIO;
+        if(geometry->cache_size < PI_LFS_CACHE_SIZE)
+            geometry->cache_size = PI_LFS_CACHE_SIZE;
+        if(geometry->cache_size > geometry->block_size)
+            geometry->cache_size = geometry->block_size;
+    }
+    
+    // The lookahead buffer is a bitmap of the blocks, it covers the whole
+    // partition if it is not too big
+    if(geometry->lookahead_size == 0)
+    {
+        uint32_t block_count = partition_size / geometry->block_size;
+        geometry->lookahead_size = ((block_count + 63) / 64) * 8;
+        if(geometry->lookahead_size < PI_LFS_LOOKAHEAD_MIN_SIZE)
+            geometry->lookahead_size = PI_LFS_LOOKAHEAD_MIN_SIZE;
+        if(geometry->lookahead_size > PI_LFS_LOOKAHEAD_MAX_SIZE)
+            geometry->lookahead_size = PI_LFS_LOOKAHEAD_MAX_SIZE;
+    }
+    
+    if(geometry->block_size % sector_size
+       || geometry->cache_size % geometry->read_size
+       || geometry->cache_size % geometry->prog_size
+       || geometry->block_size % geometry->cache_size
+       || geometry->lookahead_size % 8
+       || partition_size / geometry->block_size < 2)
+    {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static void init_lfs_config(struct lfs_config *lfs_config, pi_lfs_t *pi_lfs, const struct pi_lfs_conf *geometry)
 {
     memset(lfs_config, 0, sizeof(struct lfs_config));
     
@@ -100,20 +723,20 @@ static void init_lfs_config(struct lfs_config *lfs_config, pi_lfs_t *pi_lfs, con
     lfs_config->sync = lfs_sync;
     
     /*
-     * LittleFS default configuration
+     * LittleFS configuration
      * They can be override by LFS header
      */
-    lfs_config->read_size = 4;
-    lfs_config->prog_size = 4;
-    lfs_config->block_cycles = 100;
-    lfs_config->block_size = sector_size;
-    lfs_config->block_count = pi_lfs->partition_size / sector_size;
+    lfs_config->read_size = geometry->read_size;
+    lfs_config->prog_size = geometry->prog_size;
+    lfs_config->block_cycles = geometry->block_cycles;
+    lfs_config->block_size = geometry->block_size;
+    lfs_config->block_count = pi_lfs->partition_size / geometry->block_size;
     
     /*
      * Buffers configurations
      */
-    lfs_config->cache_size = 1024;
-    lfs_config->lookahead_size = 16; // 16 * 8 blocks
+    lfs_config->cache_size = geometry->cache_size;
+    lfs_config->lookahead_size = geometry->lookahead_size;
 }
 
 static int32_t pi_lfs_mount(struct pi_device *device)
@@ -121,6 +744,7 @@ static int32_t pi_lfs_mount(struct pi_device *device)
     pi_err_t rc;
     enum lfs_error lfs_rc;
     struct pi_flash_info flash_info;
+    struct pi_lfs_conf geometry;
     struct pi_fs_conf *fs_conf = (struct pi_fs_conf *) device->config;
     pi_partition_table_t partitionTable = NULL;
     const pi_partition_t *lfs_partition = NULL;
@@ -156,6 +780,7 @@ static int32_t pi_lfs_mount(struct pi_device *device)
     device->data = pi_lfs;
     
     pi_lfs->flash = fs_conf->flash;
+    pi_lfs->erase_counts = NULL;
     
     /*
      * To optimize flash access from Little FS,
@@ -174,9 +799,49 @@ static int32_t pi_lfs_mount(struct pi_device *device)
     pi_flash_ioctl(pi_lfs->flash, PI_FLASH_IOCTL_INFO, &flash_info);
 //    printf("%s: Flash block size %lx\n", __func__, flash_info.sector_size);
     
-    init_lfs_config(&pi_lfs->config, pi_lfs, flash_info.sector_size);
+    // The geometry can only be specified through a LFS configuration, it is
+    // derived from the flash otherwise
+    pi_lfs_conf_init(&geometry);
+    if(fs_conf->api == &pi_lfs_api)
+    {
+        geometry = *(struct pi_lfs_conf *) fs_conf;
+    }
+    
+    if(pi_lfs_geometry_init(&geometry, flash_info.sector_size, pi_lfs->partition_size))
+    {
+        pi_lfs->config.read_buffer = NULL;
+        pi_lfs->config.prog_buffer = NULL;
+        pi_lfs->config.lookahead_buffer = NULL;
+        rc = PI_ERR_INVALID_ARG;
+        goto mount_error;
+    }
+    
+    init_lfs_config(&pi_lfs->config, pi_lfs, &geometry);
+    
+    memset(&pi_lfs->stats, 0, sizeof(pi_lfs->stats));
+    pi_lfs->stats_path = geometry.stats_path;
+    if(geometry.stats)
+    {
+        pi_lfs->erase_counts = pi_l2_malloc(pi_lfs->config.block_count * sizeof(uint32_t));
+        if(pi_lfs->erase_counts == NULL)
+        {
+            pi_lfs->config.read_buffer = NULL;
+            pi_lfs->config.prog_buffer = NULL;
+            pi_lfs->config.lookahead_buffer = NULL;
+            rc = PI_ERR_L2_NO_MEM;
+            goto mount_error;
+        }
+        memset(pi_lfs->erase_counts, 0, pi_lfs->config.block_count * sizeof(uint32_t));
+    }
     
     pi_lfs->fs_data.cluster_reqs_first = NULL;
+    
+    // The asynchronous mode can only be specified through a LFS configuration
+    pi_lfs->async = 0;
+    if(fs_conf->api == &pi_lfs_api)
+    {
+        pi_lfs->async = ((struct pi_lfs_conf *) fs_conf)->async;
+    }
 
     // Little FS buffers allocation
     pi_lfs->config.read_buffer = pi_l2_malloc(pi_lfs->config.cache_size);
@@ -210,6 +875,11 @@ static int32_t pi_lfs_mount(struct pi_device *device)
         } else
         {
             lfs_rc = lfs_format(&pi_lfs->lfs, &pi_lfs->config);
+            if(lfs_rc == LFS_ERR_OK)
+            {
+                // Formatting leaves the file-system unmounted
+                lfs_rc = lfs_mount(&pi_lfs->lfs, &pi_lfs->config);
+            }
             if(lfs_rc != LFS_ERR_OK)
             {
                 rc = PI_ERR_INVALID_STATE;
@@ -218,6 +888,18 @@ static int32_t pi_lfs_mount(struct pi_device *device)
         }
     }
     
+    if(pi_lfs->stats_path)
+    {
+        pi_lfs_stats_load(pi_lfs);
+    }
+    
+    if(pi_lfs->async && pi_lfs_worker_start(pi_lfs))
+    {
+        lfs_unmount(&pi_lfs->lfs);
+        rc = PI_ERR_NO_MEM;
+        goto mount_error;
+    }
+    
     return PI_OK;
     
     mount_error:
@@ -229,20 +911,24 @@ static int32_t pi_lfs_mount(struct pi_device *device)
     {
         pi_partition_table_free(partitionTable);
     }
-    if(pi_lfs->config.read_buffer)
-    {
-        pi_l2_free(pi_lfs->config.read_buffer, pi_lfs->config.cache_size);
-    }
-    if(pi_lfs->config.prog_buffer)
-    {
-        pi_l2_free(pi_lfs->config.prog_buffer, pi_lfs->config.cache_size);
-    }
-    if(pi_lfs->config.lookahead_buffer)
-    {
-        pi_l2_free(pi_lfs->config.lookahead_buffer, pi_lfs->config.lookahead_size);
-    }
     if(pi_lfs)
     {
+        if(pi_lfs->config.read_buffer)
+        {
+            pi_l2_free(pi_lfs->config.read_buffer, pi_lfs->config.cache_size);
+        }
+        if(pi_lfs->config.prog_buffer)
+        {
+            pi_l2_free(pi_lfs->config.prog_buffer, pi_lfs->config.cache_size);
+        }
+        if(pi_lfs->config.lookahead_buffer)
+        {
+            pi_l2_free(pi_lfs->config.lookahead_buffer, pi_lfs->config.lookahead_size);
+        }
+        if(pi_lfs->erase_counts)
+        {
+            pi_l2_free(pi_lfs->erase_counts, pi_lfs->config.block_count * sizeof(uint32_t));
+        }
         pi_l2_free(pi_lfs, sizeof(pi_lfs_t));
     }
     return rc;
@@ -255,6 +941,17 @@ static void pi_lfs_unmount(struct pi_device *device)
     if(!pi_lfs)
         return;
     
+    // Closes and writes which are still queued are executed first
+    if(pi_lfs->async)
+    {
+        pi_lfs_worker_stop(pi_lfs);
+    }
+    
+    if(pi_lfs->stats_path)
+    {
+        pi_lfs_stats_write(pi_lfs);
+    }
+    
     lfs_unmount(&pi_lfs->lfs);
     
     if(pi_lfs->config.read_buffer)
@@ -263,6 +960,8 @@ static void pi_lfs_unmount(struct pi_device *device)
         pi_l2_free(pi_lfs->config.prog_buffer, pi_lfs->config.cache_size);
     if(pi_lfs->config.lookahead_buffer)
         pi_l2_free(pi_lfs->config.lookahead_buffer, pi_lfs->config.lookahead_size);
+    if(pi_lfs->erase_counts)
+        pi_l2_free(pi_lfs->erase_counts, pi_lfs->config.block_count * sizeof(uint32_t));
     pi_l2_free(pi_lfs, sizeof(pi_lfs_t));
     device->data = NULL;
 }
@@ -271,7 +970,7 @@ static pi_fs_file_t *pi_lfs_open(struct pi_device *device, const char *file, int
 {
     enum lfs_error rc = LFS_ERR_OK;
     pi_fs_file_t *pi_file = NULL;
-    lfs_file_t *lfs_file = NULL;
+    pi_lfs_file_t *lfs_file = NULL;
     pi_lfs_t *pi_lfs = device->data;
     lfs_t *lfs = &pi_lfs->lfs;
     int lfs_flags = LFS_O_RDONLY;
@@ -281,49 +980,112 @@ static pi_fs_file_t *pi_lfs_open(struct pi_device *device, const char *file, int
         lfs_flags = LFS_O_CREAT | LFS_O_RDWR;
     }
     
-    lfs_file = pi_fc_l1_malloc(sizeof(lfs_file_t));
+    lfs_file = pi_fc_l1_malloc(sizeof(pi_lfs_file_t));
     if(lfs_file == NULL) return NULL;
     
-    rc = lfs_file_open(lfs, lfs_file, file, lfs_flags);
+    pi_lfs_barrier(pi_lfs);
+    
+    rc = lfs_file_open(lfs, &lfs_file->lfs_file, file, lfs_flags);
     if(rc != LFS_ERR_OK) goto error;
     
     pi_file = pi_fc_l1_malloc(sizeof(*pi_file));
     if(pi_file == NULL) goto error;
     
+    lfs_file->position = 0;
+    
     pi_file->data = lfs_file;
     pi_file->fs = device;
     pi_file->api = &pi_lfs_api;
-    pi_file->size = lfs_file_size(lfs, lfs_file);
+    pi_file->size = lfs_file_size(lfs, &lfs_file->lfs_file);
     pi_file->fs_data = &pi_lfs->fs_data;
+    pi_file->readahead = NULL;
+    pi_file->readv_first = NULL;
+    pi_file->cl_reqs_first = NULL;
+    pi_file->mmap_ptr = NULL;
     
     return pi_file;
     
     error:
-    if(pi_file) pi_fc_l1_free(pi_file, sizeof(*pi_file));
-    if(lfs_file) pi_fc_l1_free(lfs_file, sizeof(lfs_file_t));
+    if(rc == LFS_ERR_OK) lfs_file_close(lfs, &lfs_file->lfs_file);
+    if(lfs_file) pi_fc_l1_free(lfs_file, sizeof(pi_lfs_file_t));
     return NULL;
 }
 
+static int32_t pi_lfs_stat(struct pi_device *device, const char *file, uint32_t *size)
+{
+    pi_lfs_t *pi_lfs = device->data;
+    struct lfs_info info;
+    
+    pi_lfs_barrier(pi_lfs);
+    
+    if(lfs_stat(&pi_lfs->lfs, file, &info) != LFS_ERR_OK || info.type != LFS_TYPE_REG)
+        return -1;
+    
+    *size = info.size;
+    return 0;
+}
+
 static void pi_lfs_close(pi_fs_file_t *file)
 {
     pi_lfs_t *pi_lfs = file->fs->data;
-    lfs_t *lfs = &pi_lfs->lfs;
-    lfs_file_t *lfs_file = file->data;
+    pi_lfs_req_t req;
     
-    lfs_file_close(lfs, lfs_file);
+    if(pi_lfs->async)
+    {
+        // The file is closed by the worker, after its pending requests
+        pi_lfs_req_t *close_req = pi_lfs_req_alloc(PI_LFS_REQ_CLOSE, file, NULL, 0, NULL);
+        if(close_req)
+        {
+            pi_lfs_req_enqueue(pi_lfs, close_req);
+            return;
+        }
+        
+        pi_lfs_barrier(pi_lfs);
+    }
     
-    pi_fc_l1_free(file, sizeof(pi_fs_file_t));
-    pi_fc_l1_free(lfs_file, sizeof(lfs_file_t));
+    req.op = PI_LFS_REQ_CLOSE;
+    req.file = file;
+    pi_lfs_req_exec(&req);
+}
+
+// The task is always pushed, even when the access fails, as the synchronous
+// wrappers wait for it
+static int32_t pi_lfs_task_error(pi_task_t *task)
+{
+    #if defined(__PULP_OS__)
+    task->implem.data[0] = -1;
+    #else
+    task->data[0] = -1;
+    #endif  /* __PULP_OS__ */
+    pi_task_push(task);
+    return -1;
 }
 
 static int32_t pi_lfs_read_async(pi_fs_file_t *file, void *buffer, uint32_t size, pi_task_t *task)
 {
     size_t rc;
     pi_lfs_t *pi_lfs = file->fs->data;
-    lfs_t *lfs = &pi_lfs->lfs;
-    lfs_file_t *lfs_file = file->data;
+    pi_lfs_file_t *lfs_file = file->data;
     
-    rc = lfs_file_read(lfs, lfs_file, buffer, size);
+    if(pi_lfs->async)
+    {
+        pi_lfs_req_t *req = pi_lfs_req_alloc(PI_LFS_REQ_READ, file, buffer, size, task);
+        if(req == NULL) return pi_lfs_task_error(task);
+        
+        // The read is truncated by LFS at the end of the file
+        rc = 0;
+        if(lfs_file->position < file->size)
+        {
+            rc = file->size - lfs_file->position;
+            if(rc > size) rc = size;
+        }
+        lfs_file->position += rc;
+        
+        pi_lfs_req_enqueue(pi_lfs, req);
+        return rc;
+    }
+    
+    rc = pi_lfs_file_read(file, buffer, size);
     #if defined(__PULP_OS__)
     task->implem.data[0] = rc;
     #else
@@ -336,19 +1098,37 @@ static int32_t pi_lfs_read_async(pi_fs_file_t *file, void *buffer, uint32_t size
 
 static int32_t pi_lfs_direct_read_async(pi_fs_file_t *file, void *buffer, uint32_t size, pi_task_t *task)
 {
-    pi_task_push(task);
-    return -1;
+    return pi_lfs_task_error(task);
 }
 
 static int32_t pi_lfs_write_async(pi_fs_file_t *file, void *buffer, uint32_t size, pi_task_t *task)
 {
     size_t rc;
     pi_lfs_t *pi_lfs = file->fs->data;
-    lfs_t *lfs = &pi_lfs->lfs;
-    lfs_file_t *lfs_file = file->data;
+    pi_lfs_file_t *lfs_file = file->data;
     
-    rc = lfs_file_write(lfs, lfs_file, buffer, size);
-    file->size = lfs_file_size(lfs, lfs_file);
+    if(pi_lfs->async)
+    {
+        pi_lfs_req_t *req = pi_lfs_req_alloc(PI_LFS_REQ_WRITE, file, buffer, size, task);
+        if(req == NULL) return pi_lfs_task_error(task);
+        
+        // The size is updated now for the next queued requests. The actual
+        // number of bytes written is returned through the task.
+        lfs_file->position += size;
+        if(lfs_file->position > file->size)
+            file->size = lfs_file->position;
+        
+        pi_lfs_req_enqueue(pi_lfs, req);
+        return size;
+    }
+    
+    rc = pi_lfs_file_write(file, buffer, size);
+    file->size = lfs_file_size(&pi_lfs->lfs, &lfs_file->lfs_file);
+    #if defined(__PULP_OS__)
+    task->implem.data[0] = rc;
+    #else
+    task->data[0] = rc;
+    #endif  /* __PULP_OS__ */
     
     pi_task_push(task);
     
@@ -357,14 +1137,33 @@ static int32_t pi_lfs_write_async(pi_fs_file_t *file, void *buffer, uint32_t siz
 
 static int32_t pi_lfs_seek(pi_fs_file_t *file, unsigned int offset)
 {
-    int32_t rc;
     pi_lfs_t *pi_lfs = file->fs->data;
-    lfs_t *lfs = &pi_lfs->lfs;
-    lfs_file_t *lfs_file = file->data;
+    pi_lfs_file_t *lfs_file = file->data;
     
-    rc = lfs_file_seek(lfs, lfs_file, offset, LFS_SEEK_SET);
+    if(pi_lfs->async)
+    {
+        // Seeks are ordered with the other requests of the file
+        pi_lfs_req_t *req = pi_lfs_req_alloc(PI_LFS_REQ_SEEK, file, NULL, 0, NULL);
+        if(req == NULL) return -1;
+        
+        req->index = offset;
+        lfs_file->position = offset;
+        pi_lfs_req_enqueue(pi_lfs, req);
+        return 0;
+    }
     
-    return (rc < 0) ? -1 : 0;
+    return pi_lfs_file_seek(file, offset);
+}
+
+static uint32_t pi_lfs_tell(pi_fs_file_t *file)
+{
+    pi_lfs_t *pi_lfs = file->fs->data;
+    pi_lfs_file_t *lfs_file = file->data;
+    
+    if(pi_lfs->async)
+        return lfs_file->position;
+    
+    return lfs_file_tell(&pi_lfs->lfs, &lfs_file->lfs_file);
 }
 
 static int32_t
@@ -372,24 +1171,33 @@ pi_lfs_copy_async(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t siz
 {
     int32_t rc;
     pi_lfs_t *pi_lfs = file->fs->data;
-    lfs_t *lfs = &pi_lfs->lfs;
-    lfs_file_t *lfs_file = file->data;
+    pi_lfs_file_t *lfs_file = file->data;
     
-    rc = lfs_file_seek(lfs, lfs_file, index, LFS_SEEK_SET);
-    if(rc < 0) return -1;
-    
-    if(ext2loc)
+    if(pi_lfs->async)
     {
-        rc = lfs_file_read(lfs, lfs_file, buffer, size);
-    } else
+        pi_lfs_req_t *req = pi_lfs_req_alloc(PI_LFS_REQ_COPY, file, buffer, size, task);
+        if(req == NULL) return pi_lfs_task_error(task);
+        
+        req->index = index;
+        req->ext2loc = ext2loc;
+        if(!ext2loc && index + size > file->size)
+            file->size = index + size;
+        
+        pi_lfs_req_enqueue(pi_lfs, req);
+        return 0;
+    }
+    
+    rc = pi_lfs_file_copy_2d(file, index, buffer, size, size, size, ext2loc);
+    if(rc < 0) return pi_lfs_task_error(task);
+    
+    if(!ext2loc)
     {
-        rc = lfs_file_write(lfs, lfs_file, buffer, size);
-        file->size = lfs_file_size(lfs, lfs_file);
+        file->size = lfs_file_size(&pi_lfs->lfs, &lfs_file->lfs_file);
     }
     
     pi_task_push(task);
     
-    return (rc < 0) ? -1 : 0;
+    return 0;
 }
 
 static int32_t
@@ -398,37 +1206,35 @@ pi_lfs_copy_2d_async(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t
 {
     int32_t rc;
     pi_lfs_t *pi_lfs = file->fs->data;
-    lfs_t *lfs = &pi_lfs->lfs;
-    lfs_file_t *lfs_file = file->data;
+    pi_lfs_file_t *lfs_file = file->data;
     
-    rc = lfs_file_seek(lfs, lfs_file, index, LFS_SEEK_SET);
-    if(rc < 0) return -1;
-    
-    while (size > 0)
+    if(pi_lfs->async)
     {
-        size_t loop_length = (size >= length) ? length : size;
+        pi_lfs_req_t *req = pi_lfs_req_alloc(PI_LFS_REQ_COPY_2D, file, buffer, size, task);
+        if(req == NULL) return pi_lfs_task_error(task);
         
-        if(ext2loc)
+        req->index = index;
+        req->stride = stride;
+        req->length = length;
+        req->ext2loc = ext2loc;
+        if(!ext2loc && size > 0)
         {
-            rc = lfs_file_read(lfs, lfs_file, buffer, loop_length);
-        } else
-        {
-            rc = lfs_file_write(lfs, lfs_file, buffer, loop_length);
+            uint32_t nb_lines = (size + length - 1) / length;
+            uint32_t end = index + (nb_lines - 1) * stride + (size - (nb_lines - 1) * length);
+            if(end > file->size)
+                file->size = end;
         }
         
-        if(rc < 0) return -1;
-        
-        index += stride;
-        size -= loop_length;
-        buffer += length;
-        
-        rc = lfs_file_seek(lfs, lfs_file, stride - length, LFS_SEEK_CUR);
-        if(rc < 0) return -1;
+        pi_lfs_req_enqueue(pi_lfs, req);
+        return 0;
     }
     
+    rc = pi_lfs_file_copy_2d(file, index, buffer, size, stride, length, ext2loc);
+    if(rc < 0) return pi_lfs_task_error(task);
+    
     if(!ext2loc)
     {
-        file->size = lfs_file_size(lfs, lfs_file);
+        file->size = lfs_file_size(&pi_lfs->lfs, &lfs_file->lfs_file);
     }
     
     pi_task_push(task);
@@ -444,6 +1250,8 @@ pi_fs_api_t pi_lfs_api = {
         .direct_read = pi_lfs_direct_read_async,
         .write = pi_lfs_write_async,
         .seek = pi_lfs_seek,
+        .tell = pi_lfs_tell,
+        .stat = pi_lfs_stat,
         .copy = pi_lfs_copy_async,
         .copy_2d = pi_lfs_copy_2d_async
 };
@@ -453,13 +1261,52 @@ lfs_t *pi_lfs_get_native_lfs(pi_device_t *device)
     pi_lfs_t *pi_lfs;
     
     pi_lfs = (pi_lfs_t *) device->data;
+    pi_lfs_barrier(pi_lfs);
     return &pi_lfs->lfs;
 }
 
+void pi_lfs_stats_get(pi_device_t *device, struct pi_lfs_stats *stats)
+{
+    pi_lfs_t *pi_lfs = (pi_lfs_t *) device->data;
+    
+    pi_lfs_barrier(pi_lfs);
+    *stats = pi_lfs->stats;
+    stats->nb_compactions += pi_lfs->lfs.compactions;
+    stats->nb_relocations += pi_lfs->lfs.relocations;
+}
+
+uint32_t pi_lfs_block_erase_count(pi_device_t *device, uint32_t block)
+{
+    pi_lfs_t *pi_lfs = (pi_lfs_t *) device->data;
+    
+    pi_lfs_barrier(pi_lfs);
+    if(pi_lfs->erase_counts == NULL || block >= pi_lfs->config.block_count)
+        return 0;
+    
+    return pi_lfs->erase_counts[block];
+}
+
+int32_t pi_lfs_stats_save(pi_device_t *device)
+{
+    pi_lfs_t *pi_lfs = (pi_lfs_t *) device->data;
+    
+    pi_lfs_barrier(pi_lfs);
+    return pi_lfs_stats_write(pi_lfs);
+}
+
 
 void pi_lfs_conf_init(struct pi_lfs_conf *conf)
 {
     pi_fs_conf_init(&conf->fs);
     conf->fs.type = PI_FS_LFS;
     conf->fs.api = &pi_lfs_api;
+    conf->async = 0;
+    conf->read_size = 0;
+    conf->prog_size = 0;
+    conf->block_size = 0;
+    conf->cache_size = 0;
+    conf->lookahead_size = 0;
+    conf->block_cycles = 0;
+    conf->stats = 0;
+    conf->stats_path = NULL;
 }
@@ -27,11 +27,47 @@
 #include "bsp/partition.h"
 
 #define READ_FS_THRESHOLD            16
-#define READ_FS_THRESHOLD_BLOCK      128
-#define READ_FS_THRESHOLD_BLOCK_FULL (READ_FS_THRESHOLD_BLOCK + 8)
 
+#define READ_FS_CACHE_NB_LINES       8
+#define READ_FS_CACHE_LINE_SIZE      128
+#define READ_FS_CACHE_NB_WAYS        2
 
-typedef struct {
+#define READ_FS_CACHE_INVALID_TAG    0xFFFFFFFF
+
+#define READ_FS_INDEX_EMPTY          0xFFFFFFFF
+
+#define READ_FS_DESC_CACHE_SIZE      8
+#define READ_FS_SCAN_CHUNK_SIZE      256
+
+// Files written on the device are described by header extensions, which are
+// appended after the files of the image. Each batch of files starts on a
+// sector boundary with a link giving where its extension is. The link is
+// programmed last, so that a batch is visible only once it is complete.
+#define READ_FS_EXT_MAGIC            0x58534652
+#define READ_FS_EXT_LINK_SIZE        16
+
+#define READ_FS_ALIGN(x, align)      (((x) + (align) - 1) / (align) * (align))
+
+// Mount steps. Each step is executed once the flash access started by the
+// previous one is done.
+#define READ_FS_MOUNT_TABLE          0
+#define READ_FS_MOUNT_PARTITION      1
+#define READ_FS_MOUNT_HEADER         2
+#define READ_FS_MOUNT_INFO           3
+#define READ_FS_MOUNT_SCAN           4
+#define READ_FS_MOUNT_LINK           5
+#define READ_FS_MOUNT_EXT            6
+
+#if defined(__PULP_OS__)
+#define READ_FS_TASK_DATA(task) ((task)->implem.data)
+#define READ_FS_TASK_NEXT(task) ((task)->implem.next)
+#else
+#define READ_FS_TASK_DATA(task) ((task)->data)
+#define READ_FS_TASK_NEXT(task) ((task)->next)
+#endif  /* __PULP_OS__ */
+
+
+typedef struct pi_read_fs_file_s {
     pi_fs_file_t fs_file;
     unsigned int offset;
     unsigned int addr;
@@ -40,17 +76,76 @@ typedef struct {
     pi_task_t step_event;
     unsigned int pending_buffer;
     unsigned int pending_size;
-    unsigned char *cache;
-    unsigned int cache_addr;
-    uint8_t *header;
-    int header_size;
+    struct pi_read_fs_pending_s *pending;
+    uint32_t extent_size;
     uint32_t first_read_size;
+    struct pi_read_fs_file_s *cache_waiting_next;
 } pi_read_fs_file_t;
 
 
+// One line of the FS-wide block cache. The tag is the flash address of the
+// first byte of the line, or READ_FS_CACHE_INVALID_TAG if the line is empty.
+typedef struct {
+    uint32_t tag;
+    uint32_t last_use;
+} pi_read_fs_cache_line_t;
+
+// Set-associative block cache shared by all the files of a mounted FS.
+// Only one line refill can be on-going at the same time. Files missing the
+// cache during a refill are queued and resumed once the refill is done.
+typedef struct {
+    uint8_t *data;
+    pi_read_fs_cache_line_t *lines;
+    uint32_t nb_lines;
+    uint32_t nb_ways;
+    uint32_t nb_sets;
+    uint32_t line_size;
+    uint32_t stamp;
+    uint32_t hits;
+    uint32_t misses;
+    pi_read_fs_cache_line_t *fill_line;
+    uint32_t fill_tag;
+    pi_read_fs_file_t *fill_file;
+    pi_read_fs_file_t *waiting_first;
+    pi_read_fs_file_t *waiting_last;
+} pi_read_fs_cache_t;
+
+
+// Entry of the open-addressing hash table built at mount time to find a file
+// descriptor from its path. The offset is the byte offset of the descriptor
+// in the header, or its partition address if the header is loaded lazily, or
+// READ_FS_INDEX_EMPTY if the entry is free.
+typedef struct {
+    uint32_t hash;
+    uint32_t offset;
+} pi_read_fs_index_entry_t;
+
+
+// Entry of the descriptor cache used when the header is loaded lazily. The
+// descriptor is at its flash alignment inside the buffer, or the entry is
+// free if the buffer is NULL.
+typedef struct {
+    uint32_t addr;
+    uint32_t last_use;
+    uint32_t *buffer;
+    uint32_t buffer_size;
+    struct pi_fs_desc_s *desc;
+} pi_read_fs_desc_cache_entry_t;
+
+
+// Descriptor of a file which has been written and closed, waiting for the
+// next commit to be added to the file-system
+typedef struct pi_read_fs_pending_s {
+    struct pi_read_fs_pending_s *next;
+    uint32_t desc_size;
+    uint32_t desc[];
+} pi_read_fs_pending_t;
+
+
 typedef struct pi_fs_l2_s {
     uint32_t pi_fs_size;
     uint32_t reserved1;
+    uint32_t ext_link[READ_FS_EXT_LINK_SIZE / 4];
 } pi_fs_l2_t;
 
 typedef struct pi_fs_s {
@@ -68,12 +163,56 @@ typedef struct pi_fs_s {
     pi_task_t event;
     int error;
     uint32_t free_flash_area;
-    pi_read_fs_file_t *last_created_file;
     pi_fs_data_t fs_data;
+    pi_read_fs_cache_t cache;
+    pi_read_fs_index_entry_t *index;
+    uint32_t index_size;
+    uint32_t pi_fs_info_size;
+    uint32_t partition_size;
+    uint32_t sector_size;
+    // Header extension being loaded during mount
+    uint32_t *ext_buffer;
+    uint32_t ext_addr;
+    uint32_t ext_size;
+    // Files being written. The batch base is the address of the link of the
+    // current batch, or 0 if there is none. Extents are allocated from
+    // alloc_ptr and the flash is erased on demand up to erased_until.
+    // The writes are programmed one at a time from the write queue.
+    uint32_t write_extent_size;
+    uint32_t batch_base;
+    uint32_t alloc_ptr;
+    uint32_t erased_until;
+    pi_task_t write_task;
+    pi_task_t *write_first;
+    pi_task_t *write_last;
+    pi_task_t *drain_task;
+    int nb_writers;
+    pi_read_fs_pending_t *pending_first;
+    pi_read_fs_pending_t *pending_last;
+    uint32_t pending_desc_size;
+    int nb_pending;
+    // Partition table being loaded during mount
+    pi_partition_table_t partition_table;
+    pi_err_t partition_status;
+    // Header loaded lazily. Only the index is resident, the descriptors are
+    // read on demand through the descriptor cache. During mount, the header
+    // and its extensions are streamed through the scan buffer, scan_left
+    // being -1 until the number of descriptors of the region is read.
+    int lazy;
+    uint8_t *scan_buffer;
+    uint32_t scan_buffer_size;
+    uint32_t scan_buffer_addr;
+    uint32_t scan_buffer_valid;
+    uint32_t scan_addr;
+    uint32_t scan_end;
+    int scan_left;
+    pi_read_fs_desc_cache_entry_t *desc_cache;
+    uint32_t desc_cache_size;
+    uint32_t desc_cache_stamp;
 } pi_read_fs_t;
 
 
-typedef struct {
+typedef struct pi_fs_desc_s {
     unsigned int addr;
     unsigned int size;
     unsigned int path_size;
@@ -119,67 +258,682 @@ static inline void __pi_fs_error(int error)
 #endif
 
 
+static void __pi_read_fs_try_read(void *arg);
+
+
+static int __pi_read_fs_cache_init(pi_read_fs_cache_t *cache, struct pi_fs_conf *conf)
+{
+    cache->nb_lines = READ_FS_CACHE_NB_LINES;
+    cache->line_size = READ_FS_CACHE_LINE_SIZE;
+    cache->nb_ways = READ_FS_CACHE_NB_WAYS;
+
+    // The cache geometry can only be specified through a ReadFS configuration,
+    // a generic FS configuration just gets the default one.
+    if (conf->api == &__pi_read_fs_api)
+    {
+        struct pi_readfs_conf *readfs_conf = (struct pi_readfs_conf *) conf;
+        cache->nb_lines = readfs_conf->cache_nb_lines;
+        cache->line_size = readfs_conf->cache_line_size;
+        cache->nb_ways = readfs_conf->cache_nb_ways;
+    }
+
+    // Lines must be big enough to handle the 8 bytes alignment constraints of
+    // the flash transfers and must be a power of 2 to quickly find the tag.
+    if (cache->line_size < 8 || (cache->line_size & (cache->line_size - 1)))
+        return -1;
+
+    if (cache->nb_ways == 0 || cache->nb_lines == 0 || cache->nb_lines % cache->nb_ways)
+        return -1;
+
+    cache->nb_sets = cache->nb_lines / cache->nb_ways;
+    cache->stamp = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->fill_line = NULL;
+    cache->fill_file = NULL;
+    cache->waiting_first = NULL;
+
+    cache->lines = pmsis_l2_malloc(cache->nb_lines * sizeof(pi_read_fs_cache_line_t));
+    if (cache->lines == NULL)
+        return -1;
+
+    cache->data = pmsis_l2_malloc(cache->nb_lines * cache->line_size);
+    if (cache->data == NULL)
+    {
+        pmsis_l2_malloc_free(cache->lines, cache->nb_lines * sizeof(pi_read_fs_cache_line_t));
+        cache->lines = NULL;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < cache->nb_lines; i++)
+    {
+        cache->lines[i].tag = READ_FS_CACHE_INVALID_TAG;
+        cache->lines[i].last_use = 0;
+    }
+
+    return 0;
+}
+
+
+static void __pi_read_fs_cache_deinit(pi_read_fs_cache_t *cache)
+{
+    if (cache->data)
+        pmsis_l2_malloc_free(cache->data, cache->nb_lines * cache->line_size);
+    if (cache->lines)
+        pmsis_l2_malloc_free(cache->lines, cache->nb_lines * sizeof(pi_read_fs_cache_line_t));
+}
+
+
+static void __pi_read_fs_cache_invalidate(pi_read_fs_cache_t *cache)
+{
+    for (uint32_t i = 0; i < cache->nb_lines; i++)
+    {
+        cache->lines[i].tag = READ_FS_CACHE_INVALID_TAG;
+    }
+
+    // Make sure an on-going refill does not validate stale data
+    cache->fill_tag = READ_FS_CACHE_INVALID_TAG;
+}
+
+
+// Returns the cache line containing the specified flash address, or NULL if it
+// is not in the cache
+static pi_read_fs_cache_line_t *__pi_read_fs_cache_lookup(pi_read_fs_cache_t *cache, uint32_t addr)
+{
+    uint32_t tag = addr & ~(cache->line_size - 1);
+    uint32_t set = (tag / cache->line_size) % cache->nb_sets;
+    pi_read_fs_cache_line_t *line = &cache->lines[set * cache->nb_ways];
+
+    for (uint32_t i = 0; i < cache->nb_ways; i++, line++)
+    {
+        if (line->tag == tag)
+        {
+            line->last_use = ++cache->stamp;
+            return line;
+        }
+    }
+
+    return NULL;
+}
+
+
+// Returns the least recently used line of the set where the specified flash
+// address must be stored
+static pi_read_fs_cache_line_t *__pi_read_fs_cache_victim(pi_read_fs_cache_t *cache, uint32_t addr)
+{
+    uint32_t tag = addr & ~(cache->line_size - 1);
+    uint32_t set = (tag / cache->line_size) % cache->nb_sets;
+    pi_read_fs_cache_line_t *line = &cache->lines[set * cache->nb_ways];
+    pi_read_fs_cache_line_t *victim = line;
+
+    for (uint32_t i = 0; i < cache->nb_ways; i++, line++)
+    {
+        if (line->tag == READ_FS_CACHE_INVALID_TAG)
+            return line;
+
+        if (line->last_use < victim->last_use)
+            victim = line;
+    }
+
+    return victim;
+}
+
+
+static inline uint8_t *__pi_read_fs_cache_line_data(pi_read_fs_cache_t *cache, pi_read_fs_cache_line_t *line)
+{
+    return &cache->data[(line - cache->lines) * cache->line_size];
+}
+
+
+// Called when the file which triggered a cache refill is resumed, to validate
+// the line and resume the files which were waiting for the refill
+static void __pi_read_fs_cache_fill_done(pi_read_fs_cache_t *cache)
+{
+    cache->fill_line->tag = cache->fill_tag;
+    cache->fill_line->last_use = ++cache->stamp;
+    cache->fill_line = NULL;
+    cache->fill_file = NULL;
+
+    pi_read_fs_file_t *file = cache->waiting_first;
+    cache->waiting_first = NULL;
+
+    while (file)
+    {
+        pi_read_fs_file_t *next = file->cache_waiting_next;
+        pi_task_push(pi_task_callback(&file->step_event, __pi_read_fs_try_read, (void *) file));
+        file = next;
+    }
+}
+
+
+// FNV-1a hash of a file path
+static uint32_t __pi_read_fs_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+// Allocate the file index with at least twice as many entries as files, so
+// that probe sequences stay short. If there is not enough memory, the index is
+// just not used and files are looked-up by walking the header.
+static void __pi_read_fs_index_alloc(pi_read_fs_t *fs, int nb_comps)
+{
+    uint32_t size = 1;
+    while (size < (uint32_t) nb_comps * 2)
+        size <<= 1;
+
+    if (fs->index)
+    {
+        pmsis_l2_malloc_free(fs->index, fs->index_size * sizeof(pi_read_fs_index_entry_t));
+    }
+
+    fs->index = pmsis_l2_malloc(size * sizeof(pi_read_fs_index_entry_t));
+    if (fs->index == NULL)
+        return;
+
+    fs->index_size = size;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        fs->index[i].offset = READ_FS_INDEX_EMPTY;
+    }
+}
+
+
+static void __pi_read_fs_index_add(pi_read_fs_t *fs, uint32_t hash, uint32_t offset)
+{
+    uint32_t mask = fs->index_size - 1;
+    uint32_t i = hash & mask;
+
+    while (fs->index[i].offset != READ_FS_INDEX_EMPTY)
+        i = (i + 1) & mask;
+
+    fs->index[i].hash = hash;
+    fs->index[i].offset = offset;
+}
+
+
+// Make sure the index can hold the specified number of files. When it is
+// enlarged, the entries are moved using their stored hash, so that the
+// descriptors do not need to be read again.
+static int __pi_read_fs_index_reserve(pi_read_fs_t *fs, uint32_t nb_comps)
+{
+    pi_read_fs_index_entry_t *index = fs->index;
+    uint32_t index_size = fs->index_size;
+    uint32_t size = 1;
+    while (size < nb_comps * 2)
+        size <<= 1;
+
+    if (index && size <= index_size)
+        return 0;
+
+    fs->index = pmsis_l2_malloc(size * sizeof(pi_read_fs_index_entry_t));
+    if (fs->index == NULL)
+    {
+        fs->index = index;
+        return -1;
+    }
+
+    fs->index_size = size;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        fs->index[i].offset = READ_FS_INDEX_EMPTY;
+    }
+
+    if (index)
+    {
+        for (uint32_t i = 0; i < index_size; i++)
+        {
+            if (index[i].offset != READ_FS_INDEX_EMPTY)
+                __pi_read_fs_index_add(fs, index[i].hash, index[i].offset);
+        }
+        pmsis_l2_malloc_free(index, index_size * sizeof(pi_read_fs_index_entry_t));
+    }
+
+    return 0;
+}
+
+
+static void __pi_read_fs_desc_cache_free(pi_read_fs_t *fs)
+{
+    for (uint32_t i = 0; i < fs->desc_cache_size; i++)
+    {
+        pi_read_fs_desc_cache_entry_t *entry = &fs->desc_cache[i];
+        if (entry->buffer)
+            pmsis_l2_malloc_free(entry->buffer, entry->buffer_size);
+    }
+    pmsis_l2_malloc_free(fs->desc_cache, fs->desc_cache_size * sizeof(pi_read_fs_desc_cache_entry_t));
+}
+
+
+// Read from flash the descriptor at the specified partition address into a
+// cache entry. Flash transfers must be 8 bytes aligned, so the fixed part is
+// read first to get the size of the path.
+static int __pi_read_fs_desc_load(pi_read_fs_t *fs, pi_read_fs_desc_cache_entry_t *entry, uint32_t addr)
+{
+    uint32_t start = addr & ~7;
+    uint32_t size = READ_FS_ALIGN(addr + sizeof(pi_fs_desc_t), 8) - start;
+
+    if (entry->buffer)
+    {
+        pmsis_l2_malloc_free(entry->buffer, entry->buffer_size);
+        entry->buffer = NULL;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        uint32_t *buffer = pmsis_l2_malloc(size);
+        if (buffer == NULL)
+            return -1;
+
+        pi_flash_read(fs->flash, fs->partition_offset + start, buffer, size);
+
+        pi_fs_desc_t *desc = (pi_fs_desc_t *) ((uint8_t *) buffer + addr - start);
+        uint32_t desc_end = addr + sizeof(pi_fs_desc_t) + desc->path_size;
+
+        if (desc_end > fs->partition_size)
+        {
+            pmsis_l2_malloc_free(buffer, size);
+            return -1;
+        }
+
+        if (READ_FS_ALIGN(desc_end, 8) - start <= size)
+        {
+            entry->addr = addr;
+            entry->buffer = buffer;
+            entry->buffer_size = size;
+            entry->desc = desc;
+            return 0;
+        }
+
+        pmsis_l2_malloc_free(buffer, size);
+        size = READ_FS_ALIGN(desc_end, 8) - start;
+    }
+
+    return -1;
+}
+
+
+// Returns the descriptor at the specified partition address, from the
+// descriptor cache or from flash in the least recently used entry
+static pi_fs_desc_t *__pi_read_fs_desc_get(pi_read_fs_t *fs, uint32_t addr)
+{
+    pi_read_fs_desc_cache_entry_t *victim = &fs->desc_cache[0];
+
+    for (uint32_t i = 0; i < fs->desc_cache_size; i++)
+    {
+        pi_read_fs_desc_cache_entry_t *entry = &fs->desc_cache[i];
+
+        if (entry->buffer && entry->addr == addr)
+        {
+            entry->last_use = ++fs->desc_cache_stamp;
+            return entry->desc;
+        }
+
+        if (victim->buffer && (entry->buffer == NULL || entry->last_use < victim->last_use))
+            victim = entry;
+    }
+
+    if (__pi_read_fs_desc_load(fs, victim, addr))
+        return NULL;
+
+    victim->last_use = ++fs->desc_cache_stamp;
+    return victim->desc;
+}
+
+
+static pi_fs_desc_t *__pi_read_fs_index_find(pi_read_fs_t *fs, const char *file_name)
+{
+    uint32_t hash = __pi_read_fs_hash(file_name);
+    uint32_t mask = fs->index_size - 1;
+    uint32_t i = hash & mask;
+
+    while (fs->index[i].offset != READ_FS_INDEX_EMPTY)
+    {
+        if (fs->index[i].hash == hash)
+        {
+            pi_fs_desc_t *desc;
+            if (fs->lazy)
+                desc = __pi_read_fs_desc_get(fs, fs->index[i].offset);
+            else
+                desc = (pi_fs_desc_t *) ((uint32_t) fs->pi_fs_info + fs->index[i].offset);
+
+            if (desc && strcmp(desc->name, file_name) == 0)
+                return desc;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+
+// Index the descriptors of the header and returns the last one, or NULL if
+// there is none
+static pi_fs_desc_t *__pi_read_fs_index_build(pi_read_fs_t *fs)
+{
+    unsigned int *pi_fs_info = fs->pi_fs_info;
+    int nb_comps = *pi_fs_info++;
+    pi_fs_desc_t *desc = NULL;
+
+    fs->nb_comps = nb_comps;
+    __pi_read_fs_index_alloc(fs, nb_comps);
+
+    for (int i = 0; i < nb_comps; i++)
+    {
+        desc = (pi_fs_desc_t *) pi_fs_info;
+        if(fs->index) __pi_read_fs_index_add(fs, __pi_read_fs_hash(desc->name),
+                                             (uint32_t) desc - (uint32_t) fs->pi_fs_info);
+        pi_fs_info = (unsigned int *) ((unsigned int) pi_fs_info + sizeof(pi_fs_desc_t) + desc->path_size);
+    }
+
+    return desc;
+}
+
+
+// Append the descriptors of a header extension to the header and index
+// them. The extension starts with its number of descriptors, like the header.
+static int __pi_read_fs_info_append(pi_read_fs_t *fs, uint32_t *ext, uint32_t ext_size)
+{
+    uint32_t size = fs->pi_fs_info_size + ext_size - 4;
+    unsigned int *pi_fs_info = pmsis_l2_malloc(size);
+    if(pi_fs_info == NULL) return -1;
+
+    // The header may be padded, the descriptors are copied after the last
+    // one and the padding is moved at the end
+    uint8_t *current = (uint8_t *) fs->pi_fs_info + 4;
+    for (int i = 0; i < fs->nb_comps; i++)
+    {
+        pi_fs_desc_t *desc = (pi_fs_desc_t *) current;
+        current += sizeof(pi_fs_desc_t) + desc->path_size;
+    }
+    uint32_t used = current - (uint8_t *) fs->pi_fs_info;
+
+    memcpy(pi_fs_info, fs->pi_fs_info, used);
+    memcpy((uint8_t *) pi_fs_info + used, &ext[1], ext_size - 4);
+    pi_fs_info[0] += ext[0];
+
+    pmsis_l2_malloc_free(fs->pi_fs_info, fs->pi_fs_info_size);
+    fs->pi_fs_info = pi_fs_info;
+    fs->pi_fs_info_size = size;
+
+    __pi_read_fs_index_build(fs);
+
+    return 0;
+}
+
+
+// Index the descriptors of a header extension which has been written at the
+// specified partition address, when the header is loaded lazily
+static int __pi_read_fs_index_ext(pi_read_fs_t *fs, uint32_t *ext, uint32_t ext_addr)
+{
+    if(__pi_read_fs_index_reserve(fs, fs->nb_comps + ext[0])) return -1;
+
+    uint8_t *current = (uint8_t *) &ext[1];
+    for (uint32_t i = 0; i < ext[0]; i++)
+    {
+        pi_fs_desc_t *desc = (pi_fs_desc_t *) current;
+        __pi_read_fs_index_add(fs, __pi_read_fs_hash(desc->name), ext_addr + (current - (uint8_t *) ext));
+        current += sizeof(pi_fs_desc_t) + desc->path_size;
+    }
+
+    fs->nb_comps += ext[0];
+
+    return 0;
+}
+
+
+static void __pi_read_fs_pending_free(pi_read_fs_t *fs)
+{
+    pi_read_fs_pending_t *pending = fs->pending_first;
+    while (pending)
+    {
+        pi_read_fs_pending_t *next = pending->next;
+        pmsis_l2_malloc_free(pending, sizeof(pi_read_fs_pending_t) + pending->desc_size);
+        pending = next;
+    }
+
+    fs->pending_first = NULL;
+    fs->pending_desc_size = 0;
+    fs->nb_pending = 0;
+}
+
+
 static void __pi_fs_free(pi_read_fs_t *fs)
 {
     if(fs != NULL)
     {
-        if(fs->pi_fs_info) pmsis_l2_malloc_free(fs->pi_fs_info, fs->pi_fs_l2->pi_fs_size);
+        __pi_read_fs_cache_deinit(&fs->cache);
+        __pi_read_fs_pending_free(fs);
+        if(fs->index) pmsis_l2_malloc_free(fs->index, fs->index_size * sizeof(pi_read_fs_index_entry_t));
+        if(fs->pi_fs_info) pmsis_l2_malloc_free(fs->pi_fs_info, fs->pi_fs_info_size);
+        if(fs->ext_buffer) pmsis_l2_malloc_free(fs->ext_buffer, fs->ext_size);
+        if(fs->scan_buffer) pmsis_l2_malloc_free(fs->scan_buffer, fs->scan_buffer_size);
+        if(fs->desc_cache) __pi_read_fs_desc_cache_free(fs);
         if(fs->pi_fs_l2) pmsis_l2_malloc_free(fs->pi_fs_l2, sizeof(pi_fs_l2_t));
         pmsis_l2_malloc_free(fs, sizeof(pi_read_fs_t));
     }
 }
 
 
-// This function can be called to do all the required asynchronous steps to mount a FS.
-// This can execute in 2 ways:
-//   - No event is given in which case each call is synchronous and the call
-//     to this function will just do all steps in one shot
-//   - An event is given in which case, the function will just execute one asynchronous
-//     step and will continue with the next step once it is called again by the event
-//     execution
+static void __pi_fs_mount_step(void *arg);
+
+
+static inline pi_task_t *__pi_read_fs_mount_task(pi_read_fs_t *fs, int step)
+{
+    fs->mount_step = step;
+    return pi_task_callback(&fs->step_event, __pi_fs_mount_step, (void *) fs);
+}
+
+
+// Start reading the region of the header or of a header extension which
+// starts at the specified partition address, through the scan buffer
+static void __pi_read_fs_scan_load(pi_read_fs_t *fs, uint32_t addr)
+{
+    uint32_t buffer_addr = addr & ~7;
+    uint32_t size = READ_FS_ALIGN(fs->scan_end, 8) - buffer_addr;
+
+    if(size > fs->scan_buffer_size)
+        size = fs->scan_buffer_size;
+
+    fs->scan_buffer_addr = buffer_addr;
+    fs->scan_buffer_valid = size;
+    pi_flash_read_async(fs->flash, fs->partition_offset + buffer_addr, fs->scan_buffer, size,
+                        __pi_read_fs_mount_task(fs, READ_FS_MOUNT_SCAN));
+}
+
+
+static void __pi_read_fs_scan_start(pi_read_fs_t *fs, uint32_t start, uint32_t end)
+{
+    fs->scan_addr = start;
+    fs->scan_end = end;
+    fs->scan_left = -1;
+    // The files of the header are before the end of its last descriptor
+    // while the ones of an extension are before the extension
+    if(fs->free_flash_area < end)
+        fs->free_flash_area = end;
+    __pi_read_fs_scan_load(fs, start);
+}
+
+
+// Index the descriptors of the scan buffer. Returns 1 if the next part of the
+// region is being loaded, 0 if the whole region is indexed or -1 in case of
+// error.
+static int __pi_read_fs_scan(pi_read_fs_t *fs)
+{
+    if(fs->scan_left < 0)
+    {
+        if(fs->scan_addr + 4 > fs->scan_end) return -1;
+
+        uint32_t nb_comps = *(uint32_t *) &fs->scan_buffer[fs->scan_addr - fs->scan_buffer_addr];
+        if(__pi_read_fs_index_reserve(fs, fs->nb_comps + nb_comps)) return -1;
+
+        fs->scan_left = nb_comps;
+        fs->scan_addr += 4;
+    }
+
+    while (fs->scan_left > 0)
+    {
+        uint32_t offset = fs->scan_addr - fs->scan_buffer_addr;
+
+        if(fs->scan_addr + sizeof(pi_fs_desc_t) > fs->scan_end) return -1;
+        if(offset + sizeof(pi_fs_desc_t) > fs->scan_buffer_valid) break;
+
+        pi_fs_desc_t *desc = (pi_fs_desc_t *) &fs->scan_buffer[offset];
+        uint32_t desc_size = sizeof(pi_fs_desc_t) + desc->path_size;
+
+        if(fs->scan_addr + desc_size > fs->scan_end) return -1;
+        if(offset + desc_size > fs->scan_buffer_valid)
+        {
+            // Descriptors bigger than the buffer need a bigger one, including
+            // the alignment of their start
+            uint32_t size = READ_FS_ALIGN(desc_size + 8, 8);
+            if(size > fs->scan_buffer_size)
+            {
+                pmsis_l2_malloc_free(fs->scan_buffer, fs->scan_buffer_size);
+                fs->scan_buffer = pmsis_l2_malloc(size);
+                if(fs->scan_buffer == NULL) return -1;
+                fs->scan_buffer_size = size;
+            }
+            break;
+        }
+
+        __pi_read_fs_index_add(fs, __pi_read_fs_hash(desc->name), fs->scan_addr);
+
+        if(desc->addr + desc->size > fs->free_flash_area)
+            fs->free_flash_area = desc->addr + desc->size;
+
+        fs->nb_comps++;
+        fs->scan_left--;
+        fs->scan_addr += desc_size;
+    }
+
+    if(fs->scan_left == 0) return 0;
+
+    __pi_read_fs_scan_load(fs, fs->scan_addr);
+
+    return 1;
+}
+
+
+// Read the link which may be at the beginning of the sector following the
+// free area, to find the next header extension
+static int __pi_read_fs_ext_probe(pi_read_fs_t *fs)
+{
+    uint32_t link_addr = READ_FS_ALIGN(fs->free_flash_area, fs->sector_size);
+
+    if(link_addr + READ_FS_EXT_LINK_SIZE > fs->partition_size) return -1;
+
+    fs->ext_addr = link_addr;
+    pi_flash_read_async(fs->flash, fs->partition_offset + link_addr, fs->pi_fs_l2->ext_link,
+                        READ_FS_EXT_LINK_SIZE, __pi_read_fs_mount_task(fs, READ_FS_MOUNT_LINK));
+
+    return 0;
+}
+
+
+static int __pi_read_fs_ext_link_valid(pi_read_fs_t *fs)
+{
+    uint32_t *link = fs->pi_fs_l2->ext_link;
+    uint32_t link_addr = fs->ext_addr;
+
+    return link[0] == READ_FS_EXT_MAGIC && link[3] == ~(link[0] ^ link[1] ^ link[2]) &&
+           link[1] >= link_addr + READ_FS_EXT_LINK_SIZE && link[2] >= 4 &&
+           link[1] + link[2] <= fs->partition_size;
+}
+
+
+// Called at the end of the mount to notify the user task. The file-system is
+// freed in case of error.
+static void __pi_read_fs_mount_end(pi_read_fs_t *fs, int error)
+{
+    pi_task_t *task = fs->pending_event;
+
+    if(fs->scan_buffer)
+    {
+        pmsis_l2_malloc_free(fs->scan_buffer, fs->scan_buffer_size);
+        fs->scan_buffer = NULL;
+    }
+
+    if(error)
+        __pi_fs_free(fs);
+
+    #if defined(__PULP_OS__)
+    task->implem.data[0] = error;
+    #else
+    task->data[0] = error;
+    #endif  /* __PULP_OS__ */
+    pi_task_push(task);
+}
+
+
+// This function executes all the asynchronous steps needed to mount a FS.
+// Each step starts a flash access whose termination calls this function again
+// to execute the next step, which is stored in fs->mount_step.
 static void __pi_fs_mount_step(void *arg)
 {
     pi_read_fs_t *fs = (pi_read_fs_t *) arg;
-    const pi_partition_table_t partition_table = NULL;
     const pi_partition_t *readfs_partition = NULL;
-    pi_err_t rc;
     
-    // Each asynchronous step is given fs->step_event which is an intermediate event
-    // to reenqueue this function and do everything asynchronously.
-    // It can also be NULL to do everything synchronously
     switch (fs->mount_step)
     {
-        case 1:
+        case READ_FS_MOUNT_TABLE:
+            
+            // Load the partition table to find the readfs partition
+            if(pi_partition_table_load_async(fs->flash, &fs->partition_table, &fs->partition_status,
+                                             __pi_read_fs_mount_task(fs, READ_FS_MOUNT_PARTITION)) != PI_OK)
+                goto error;
+            break;
+        
+        case READ_FS_MOUNT_PARTITION:
             
-            // Try to open readfs partition
-            rc = pi_partition_table_load(fs->flash, &partition_table);
-            if(rc != PI_OK) goto error;
+            if(fs->partition_status != PI_OK) goto error;
             
-            readfs_partition = pi_partition_find_first(partition_table, PI_PARTITION_TYPE_DATA,
+            readfs_partition = pi_partition_find_first(fs->partition_table, PI_PARTITION_TYPE_DATA,
                                                        PI_PARTITION_SUBTYPE_DATA_READFS, fs->partition_name);
             
             if(readfs_partition == NULL)
             {
-                pi_partition_table_free(partition_table);
+                pi_partition_table_free(fs->partition_table);
                 goto error;
             }
             
             fs->partition_offset = pi_partition_get_flash_offset(readfs_partition);
+            fs->partition_size = pi_partition_get_size(readfs_partition);
             
             pi_partition_close(readfs_partition);
-            pi_partition_table_free(partition_table);
-            fs->mount_step++;
+            pi_partition_table_free(fs->partition_table);
         
             // Read the header size at the first header word
             pi_flash_read_async(fs->flash, fs->partition_offset, &fs->pi_fs_l2->pi_fs_size, 8,
-                                pi_task_callback(&fs->step_event, __pi_fs_mount_step, (void *) arg));
+                                __pi_read_fs_mount_task(fs, READ_FS_MOUNT_HEADER));
             break;
         
-        case 3:
+        case READ_FS_MOUNT_HEADER:
         {
+            int pi_fs_size = ((fs->pi_fs_l2->pi_fs_size + 7) & ~7);
+            int pi_fs_offset = fs->partition_offset;
+            fs->pi_fs_info_size = pi_fs_size;
+            
+            if(fs->lazy)
+            {
+                // Only index the descriptors, by streaming the header
+                fs->scan_buffer_size = READ_FS_SCAN_CHUNK_SIZE;
+                fs->scan_buffer = pmsis_l2_malloc(fs->scan_buffer_size);
+                if(fs->scan_buffer == NULL) goto error;
+                
+                fs->nb_comps = 0;
+                fs->free_flash_area = 0;
+                __pi_read_fs_scan_start(fs, 8, 8 + pi_fs_size);
+                break;
+            }
+            
             // Allocate roon for the file-system header and read it
-            int pi_fs_size = ((fs->pi_fs_l2->pi_fs_size + 7) & ~7);
-            int pi_fs_offset = fs->partition_offset;
             fs->pi_fs_info = pmsis_l2_malloc(pi_fs_size);
             if(fs->pi_fs_info == NULL)
             {
@@ -187,44 +941,83 @@ static void __pi_fs_mount_step(void *arg)
                 goto error;
             }
             pi_flash_read_async(fs->flash, pi_fs_offset + 8, (void *) fs->pi_fs_info, pi_fs_size,
-                                pi_task_callback(&fs->step_event, __pi_fs_mount_step, (void *) arg));
+                                __pi_read_fs_mount_task(fs, READ_FS_MOUNT_INFO));
         }
             break;
         
-        case 4:
+        case READ_FS_MOUNT_INFO:
         {
-            // Get information about the file system from the header
-            unsigned int *pi_fs_info = fs->pi_fs_info;
-            int nb_comps = *pi_fs_info++;
-            
-            // Find the file in the file-system
-            pi_fs_desc_t *desc = NULL;
-            int i;
-            for (i = 0; i < nb_comps; i++)
-            {
-                desc = (pi_fs_desc_t *) pi_fs_info;
-                pi_fs_info = (unsigned int *) ((unsigned int) pi_fs_info + sizeof(pi_fs_desc_t) + desc->path_size);
-            }
+            // Index the descriptors and find the end of the last file
+            pi_fs_desc_t *desc = __pi_read_fs_index_build(fs);
             
             if(desc == NULL)
-                fs->free_flash_area = (uint32_t) pi_fs_info;
+                fs->free_flash_area = 8 + fs->pi_fs_info_size;
             else
                 fs->free_flash_area = desc->addr + desc->size;
             
-            fs->last_created_file = NULL;
+            if(__pi_read_fs_ext_probe(fs))
+                goto done;
+        }
+            break;
+        
+        case READ_FS_MOUNT_SCAN:
+        {
+            int err = __pi_read_fs_scan(fs);
+            if(err < 0) goto error;
+            
+            // Look for the next extension once the region is indexed
+            if(err == 0 && __pi_read_fs_ext_probe(fs))
+                goto done;
+        }
+            break;
+        
+        case READ_FS_MOUNT_LINK:
+        {
+            // Stop at the first sector which does not start with a valid link,
+            // this is where the next files will be written
+            if(!__pi_read_fs_ext_link_valid(fs))
+                goto done;
+            
+            fs->ext_addr = fs->pi_fs_l2->ext_link[1];
+            fs->ext_size = fs->pi_fs_l2->ext_link[2];
+            
+            if(fs->lazy)
+            {
+                __pi_read_fs_scan_start(fs, fs->ext_addr, fs->ext_addr + fs->ext_size);
+                break;
+            }
+            
+            fs->ext_buffer = pmsis_l2_malloc(fs->ext_size);
+            if(fs->ext_buffer == NULL) goto error;
+            
+            pi_flash_read_async(fs->flash, fs->partition_offset + fs->ext_addr, fs->ext_buffer, fs->ext_size,
+                                __pi_read_fs_mount_task(fs, READ_FS_MOUNT_EXT));
+        }
+            break;
+        
+        case READ_FS_MOUNT_EXT:
+        {
+            int err = __pi_read_fs_info_append(fs, fs->ext_buffer, fs->ext_size);
+            pmsis_l2_malloc_free(fs->ext_buffer, fs->ext_size);
+            fs->ext_buffer = NULL;
+            if(err) goto error;
             
-            fs->error = 0;
-            pi_task_push(fs->pending_event);
+            // Look for the next extension
+            fs->free_flash_area = fs->ext_addr + fs->ext_size;
+            if(__pi_read_fs_ext_probe(fs))
+                goto done;
         }
+            break;
     }
     
-    fs->mount_step++;
+    return;
     
+    done:
+    __pi_read_fs_mount_end(fs, 0);
     return;
     
     error:
-    fs->error = -1;
-    pi_task_push(fs->pending_event);
+    __pi_read_fs_mount_end(fs, -1);
 }
 
 static void __pi_read_fs_unmount(struct pi_device *device)
@@ -233,13 +1026,16 @@ static void __pi_read_fs_unmount(struct pi_device *device)
     
     pi_read_fs_t *fs = (pi_read_fs_t *) device->data;
     
+    // Files closed since the last commit are added now
+    pi_readfs_commit(device);
+    
     __pi_fs_free(fs);
     
     //pi_irq_restore(irq);
 }
 
 
-static int32_t __pi_read_fs_mount(struct pi_device *device)
+static int32_t __pi_read_fs_mount_async(struct pi_device *device, pi_task_t *task)
 {
     
     struct pi_fs_conf *conf = (struct pi_fs_conf *) device->config;
@@ -248,41 +1044,75 @@ static int32_t __pi_read_fs_mount(struct pi_device *device)
     // need to lock a mutex as this is a FS creation so no one can access this object
     // at the same time and we can also safely mount several time the same device
     // at the same time as this is protected by the functions called from here.
-    // Moreover it is important to not block imterrupts as this function can last
-    // a long time due to flash access in case of synchronous mode.
     
     //pi_trace(pi_trace_DEV_CTRL, "[FS] Mounting file-system (device: %s)\n", dev_name);
     
     pi_read_fs_t *fs = pmsis_l2_malloc(sizeof(pi_read_fs_t));
     if(fs == NULL) goto error;
     
-    pi_task_t task;
-    
     // Initialize all fields where something needs to be closed in case of error
     fs->pi_fs_l2 = NULL;
     fs->pi_fs_info = NULL;
+    fs->cache.data = NULL;
+    fs->cache.lines = NULL;
+    fs->index = NULL;
+    fs->index_size = 0;
+    fs->ext_buffer = NULL;
+    fs->scan_buffer = NULL;
+    fs->desc_cache = NULL;
+    fs->pending_first = NULL;
     fs->flash = conf->flash;
     fs->fs_data.cluster_reqs_first = NULL;
+    fs->batch_base = 0;
+    fs->nb_writers = 0;
+    fs->write_first = NULL;
+    fs->drain_task = NULL;
+    fs->pending_desc_size = 0;
+    fs->nb_pending = 0;
+    
+    struct pi_flash_info flash_info;
+    pi_flash_ioctl(fs->flash, PI_FLASH_IOCTL_INFO, &flash_info);
+    fs->sector_size = flash_info.sector_size;
+    
+    // Write extents and lazy header can only be specified through a ReadFS
+    // configuration, a generic FS configuration loads the whole header.
+    fs->write_extent_size = 0;
+    fs->lazy = 0;
+    fs->desc_cache_size = 0;
+    if (conf->api == &__pi_read_fs_api)
+    {
+        struct pi_readfs_conf *readfs_conf = (struct pi_readfs_conf *) conf;
+        fs->write_extent_size = readfs_conf->write_extent_size;
+        fs->lazy = readfs_conf->header_mode == PI_READFS_HEADER_LAZY;
+        fs->desc_cache_size = readfs_conf->desc_cache_size;
+    }
     
     fs->pi_fs_l2 = pmsis_l2_malloc(sizeof(pi_fs_l2_t));
     if(fs->pi_fs_l2 == NULL) goto error;
     
-    fs->mount_step = 1;
-    fs->pi_fs_info = NULL;
-    fs->pending_event = pi_task_block(&task);
+    if(__pi_read_fs_cache_init(&fs->cache, conf)) goto error;
+    
+    if(fs->lazy)
+    {
+        // A descriptor is needed at least to compare its name during open
+        if(fs->desc_cache_size == 0)
+            fs->desc_cache_size = 1;
+        
+        fs->desc_cache = pmsis_l2_malloc(fs->desc_cache_size * sizeof(pi_read_fs_desc_cache_entry_t));
+        if(fs->desc_cache == NULL) goto error;
+        
+        memset(fs->desc_cache, 0, fs->desc_cache_size * sizeof(pi_read_fs_desc_cache_entry_t));
+        fs->desc_cache_stamp = 0;
+    }
+    
+    fs->pending_event = task;
     fs->partition_name = conf->partition_name;
+    fs->mount_step = READ_FS_MOUNT_TABLE;
     
     device->data = (void *) fs;
     
-    // This function will take care of either blocking the thread if we are in blocking mode
-    // or will just execute it asynchronously
     __pi_fs_mount_step((void *) fs);
     
-    pi_task_wait_on(&task);
-    
-    if(fs->error)
-        goto error;
-    
     return 0;
     
     error:
@@ -292,91 +1122,337 @@ static int32_t __pi_read_fs_mount(struct pi_device *device)
 }
 
 
-static pi_fs_file_t *__pi_read_fs_open(struct pi_device *device, const char *file_name, int flags)
+static int32_t __pi_read_fs_mount(struct pi_device *device)
+{
+    pi_task_t task;
+    
+    if(__pi_read_fs_mount_async(device, pi_task_block(&task)))
+        return -1;
+    
+    pi_task_wait_on(&task);
+    
+    #if defined(__PULP_OS__)
+    return task.implem.data[0];
+    #else
+    return task.data[0];
+    #endif  /* __PULP_OS__ */
+}
+
+
+static void __pi_read_fs_file_init(struct pi_device *device, pi_read_fs_file_t *file)
 {
     pi_read_fs_t *fs = (pi_read_fs_t *) device->data;
-    pi_read_fs_file_t *file;
     
-    if(flags == PI_FS_FLAGS_WRITE)
+    file->fs_file.api = (pi_fs_api_t *) device->api;
+    file->fs_file.data = file;
+    file->fs_file.fs = device;
+    file->fs_file.fs_data = &fs->fs_data;
+    file->fs_file.readahead = NULL;
+    file->fs_file.readv_first = NULL;
+    file->fs_file.cl_reqs_first = NULL;
+    file->fs_file.mmap_ptr = NULL;
+}
+
+
+// Make sure the flash is erased up to the specified partition address, by
+// erasing the sectors after the ones already erased for the current batch
+static void __pi_read_fs_erase_to(pi_read_fs_t *fs, uint32_t addr)
+{
+    if(addr > fs->erased_until)
     {
-        if(fs->last_created_file)
-            return NULL;
-        
-        file = pmsis_l2_malloc(sizeof(pi_read_fs_file_t));
-        if(file == NULL) return NULL;
-        
-        // Reserve enough room to store file path, addr and size
-        int str_len = strlen(file_name);
-        
-        int header_size = ((str_len + 7) & ~0x7) + 12;
-        
-        uint8_t *header = pmsis_l2_malloc(header_size);
-        if(header == NULL)
-        {
-            pi_l2_free(file, sizeof(pi_read_fs_file_t));
-            return NULL;
-        }
-        
-        file->header = header;
-        file->header_size = header_size;
-        
-        memcpy(&file->header[12], file_name, str_len);
-        *(uint32_t *) &file->header[8] = str_len;
-        
-        file->addr = fs->free_flash_area + header_size;
-        
-        file->fs_file.size = 0;
-        file->offset = 0;
-        file->cache_addr = -1;
+        uint32_t end = READ_FS_ALIGN(addr, fs->sector_size);
+        pi_flash_erase(fs->flash, fs->partition_offset + fs->erased_until, end - fs->erased_until);
+        fs->erased_until = end;
+    }
+}
+
+
+static void __pi_read_fs_write_next(void *arg);
+
+// Called when the first write of the queue is programmed, to notify it with
+// the number of bytes written and continue with the next one
+static void __pi_read_fs_write_done(void *arg)
+{
+    pi_read_fs_t *fs = (pi_read_fs_t *) arg;
+    pi_task_t *task = fs->write_first;
+    uint32_t *data = READ_FS_TASK_DATA(task);
+    
+    fs->write_first = READ_FS_TASK_NEXT(task);
+    data[0] = data[2];
+    pi_task_push(task);
+    
+    if(fs->write_first == NULL && fs->drain_task)
+    {
+        pi_task_t *drain_task = fs->drain_task;
+        fs->drain_task = NULL;
+        pi_task_push(drain_task);
+        return;
+    }
+    
+    __pi_read_fs_write_next(fs);
+}
+
+// Program the first write of the queue, after erasing the sectors it needs
+// if they are not yet erased, so that the caller is never blocked
+static void __pi_read_fs_write_next(void *arg)
+{
+    pi_read_fs_t *fs = (pi_read_fs_t *) arg;
+    pi_task_t *task = fs->write_first;
+    
+    if(task == NULL) return;
+    
+    uint32_t *data = READ_FS_TASK_DATA(task);
+    uint32_t end = data[0] + data[2] - fs->partition_offset;
+    
+    if(end > fs->erased_until)
+    {
+        uint32_t erase_addr = fs->erased_until;
+        fs->erased_until = READ_FS_ALIGN(end, fs->sector_size);
+        pi_flash_erase_async(fs->flash, fs->partition_offset + erase_addr, fs->erased_until - erase_addr,
+                             pi_task_callback(&fs->write_task, __pi_read_fs_write_next, (void *) fs));
+        return;
+    }
+    
+    pi_flash_program_async(fs->flash, data[0], (void *) data[1], data[2],
+                           pi_task_callback(&fs->write_task, __pi_read_fs_write_done, (void *) fs));
+}
+
+// Enqueue a write, its parameters are stored in its task until it is programmed
+static void __pi_read_fs_write_enqueue(pi_read_fs_t *fs, uint32_t addr, void *buffer, uint32_t size, pi_task_t *task)
+{
+    uint32_t *data = READ_FS_TASK_DATA(task);
+    data[0] = addr;
+    data[1] = (uint32_t) buffer;
+    data[2] = size;
+    
+    READ_FS_TASK_NEXT(task) = NULL;
+    if(fs->write_first)
+    {
+        READ_FS_TASK_NEXT(fs->write_last) = task;
+        fs->write_last = task;
+        return;
+    }
+    
+    fs->write_first = task;
+    fs->write_last = task;
+    __pi_read_fs_write_next(fs);
+}
+
+
+// Wait until all the queued writes are programmed
+static void __pi_read_fs_write_drain(pi_read_fs_t *fs)
+{
+    pi_task_t task;
+    
+    int irq = hal_irq_disable();
+    if(fs->write_first == NULL)
+    {
+        hal_irq_restore(irq);
+        return;
+    }
+    fs->drain_task = pi_task_block(&task);
+    hal_irq_restore(irq);
+    
+    pi_task_wait_on(&task);
+}
+
+
+pi_fs_file_t *pi_readfs_open_write(struct pi_device *device, const char *file_name, uint32_t max_size)
+{
+    pi_read_fs_t *fs = (pi_read_fs_t *) device->data;
+    
+    // A new batch starts on the sector following the last files, with room
+    // for its link
+    if(fs->batch_base == 0)
+    {
+        uint32_t batch_base = READ_FS_ALIGN(fs->free_flash_area, fs->sector_size);
+        if(batch_base + READ_FS_EXT_LINK_SIZE > fs->partition_size) return NULL;
         
-        fs->last_created_file = file;
+        fs->batch_base = batch_base;
+        fs->alloc_ptr = batch_base + READ_FS_EXT_LINK_SIZE;
+        fs->erased_until = batch_base;
+    }
+    
+    // Extents are aligned like the files of the image, so that they can be
+    // transferred directly
+    uint32_t addr = READ_FS_ALIGN(fs->alloc_ptr, 8);
+    if(addr >= fs->partition_size) return NULL;
+    
+    if(max_size == 0)
+        max_size = fs->partition_size - addr;
+    else if(max_size > fs->partition_size - addr)
+        return NULL;
+    
+    int str_len = strlen(file_name);
+    uint32_t path_size = READ_FS_ALIGN(str_len + 1, 4);
+    uint32_t desc_size = sizeof(pi_fs_desc_t) + path_size;
+    
+    pi_read_fs_file_t *file = pmsis_l2_malloc(sizeof(pi_read_fs_file_t));
+    if(file == NULL) goto error0;
+    
+    pi_read_fs_pending_t *pending = pmsis_l2_malloc(sizeof(pi_read_fs_pending_t) + desc_size);
+    if(pending == NULL) goto error1;
+    
+    pi_fs_desc_t *desc = (pi_fs_desc_t *) pending->desc;
+    pending->desc_size = desc_size;
+    desc->addr = addr;
+    desc->size = 0;
+    desc->path_size = path_size;
+    memset(desc->name, 0, path_size);
+    memcpy(desc->name, file_name, str_len);
+    
+    file->pending = pending;
+    file->extent_size = max_size;
+    file->fs_file.size = 0;
+    file->offset = 0;
+    file->addr = fs->partition_offset + addr;
+    
+    fs->alloc_ptr = addr + max_size;
+    fs->nb_writers++;
+    
+    __pi_read_fs_file_init(device, file);
+    
+    return &file->fs_file;
+    
+    error1:
+    pmsis_l2_malloc_free(file, sizeof(pi_read_fs_file_t));
+    error0:
+    return NULL;
+}
+
+
+int32_t pi_readfs_commit(struct pi_device *device)
+{
+    pi_read_fs_t *fs = (pi_read_fs_t *) device->data;
+    
+    if(fs->nb_writers) return -1;
+    
+    // The extension must only be linked once the data of the files is in
+    // the flash
+    __pi_read_fs_write_drain(fs);
+    
+    if(fs->pending_first == NULL) return 0;
+    
+    // Build the header extension with all the descriptors
+    uint32_t ext_size = READ_FS_ALIGN(4 + fs->pending_desc_size, 8);
+    uint32_t ext_addr = READ_FS_ALIGN(fs->alloc_ptr, 8);
+    if(ext_addr + ext_size > fs->partition_size) return -1;
+    
+    uint32_t *ext = pmsis_l2_malloc(ext_size);
+    if(ext == NULL) return -1;
+    
+    memset(ext, 0, ext_size);
+    ext[0] = fs->nb_pending;
+    uint8_t *current = (uint8_t *) &ext[1];
+    for (pi_read_fs_pending_t *pending = fs->pending_first; pending; pending = pending->next)
+    {
+        memcpy(current, pending->desc, pending->desc_size);
+        current += pending->desc_size;
+    }
+    
+    __pi_read_fs_erase_to(fs, ext_addr + ext_size);
+    pi_flash_program(fs->flash, fs->partition_offset + ext_addr, ext, ext_size);
+    
+    // Now that everything is in the flash, the link makes the whole batch
+    // visible at once
+    uint32_t *link = fs->pi_fs_l2->ext_link;
+    link[0] = READ_FS_EXT_MAGIC;
+    link[1] = ext_addr;
+    link[2] = ext_size;
+    link[3] = ~(link[0] ^ link[1] ^ link[2]);
+    pi_flash_program(fs->flash, fs->partition_offset + fs->batch_base, link, READ_FS_EXT_LINK_SIZE);
+    
+    int err;
+    if(fs->lazy)
+        err = __pi_read_fs_index_ext(fs, ext, ext_addr);
+    else
+        err = __pi_read_fs_info_append(fs, ext, ext_size);
+    pmsis_l2_malloc_free(ext, ext_size);
+    
+    __pi_read_fs_pending_free(fs);
+    fs->free_flash_area = ext_addr + ext_size;
+    fs->batch_base = 0;
+    
+    // The cache may contain the erased content of the areas just written
+    __pi_read_fs_cache_invalidate(&fs->cache);
+    
+    return err;
+}
+
+
+// Find the descriptor of a committed file
+static pi_fs_desc_t *__pi_read_fs_find(pi_read_fs_t *fs, const char *file_name)
+{
+    pi_fs_desc_t *desc = NULL;
+    if(fs->index)
+    {
+        desc = __pi_read_fs_index_find(fs, file_name);
     } else
     {
-        // No need to mask interrupts, as the file-system is read-only
-        // its structure cannot change
-        
-        //pi_trace(pi_trace_FS, "[FS] Opening file (name: %s)\n", file_name);
-        
-        // Get information about the file system from the header
+        // No index, walk the descriptors from the header
         unsigned int *pi_fs_info = fs->pi_fs_info;
         int nb_comps = *pi_fs_info++;
-        
-        // Find the file in the file-system
-        pi_fs_desc_t *desc = NULL;
         int i;
         for (i = 0; i < nb_comps; i++)
         {
-            desc = (pi_fs_desc_t *) pi_fs_info;
-            if(strcmp(desc->name, file_name) == 0) break;
-            pi_fs_info = (unsigned int *) ((unsigned int) pi_fs_info + sizeof(pi_fs_desc_t) + desc->path_size);
+            pi_fs_desc_t *current = (pi_fs_desc_t *) pi_fs_info;
+            if(strcmp(current->name, file_name) == 0)
+            {
+                desc = current;
+                break;
+            }
+            pi_fs_info = (unsigned int *) ((unsigned int) pi_fs_info + sizeof(pi_fs_desc_t) + current->path_size);
         }
-        
-        // Leave if the file is not found
-        if(i == nb_comps) goto error;
-        
-        // Now allocate the file descriptor and fills it
-        file = pmsis_l2_malloc(sizeof(pi_read_fs_file_t));
-        if(file == NULL) goto error;
-        
-        file->cache = pmsis_l2_malloc(READ_FS_THRESHOLD_BLOCK_FULL);
-        if(file->cache == NULL) goto error1;
-        
-        file->header = NULL;
-        file->offset = 0;
-        file->fs_file.size = desc->size;
-        file->addr = desc->addr + fs->partition_offset;
-        file->cache_addr = -1;
     }
     
-    file->fs_file.api = (pi_fs_api_t *) device->api;
-    file->fs_file.data = file;
-    file->fs_file.fs = device;
-    file->fs_file.fs_data = &fs->fs_data;
+    return desc;
+}
+
+
+static int32_t __pi_read_fs_stat(struct pi_device *device, const char *file_name, uint32_t *size)
+{
+    pi_read_fs_t *fs = (pi_read_fs_t *) device->data;
+    pi_fs_desc_t *desc = __pi_read_fs_find(fs, file_name);
+    
+    if(desc == NULL) return -1;
+    
+    *size = desc->size;
+    return 0;
+}
+
+
+static pi_fs_file_t *__pi_read_fs_open(struct pi_device *device, const char *file_name, int flags)
+{
+    pi_read_fs_t *fs = (pi_read_fs_t *) device->data;
+    pi_read_fs_file_t *file;
+    
+    if(flags == PI_FS_FLAGS_WRITE)
+        return pi_readfs_open_write(device, file_name, fs->write_extent_size);
+    
+    // No need to mask interrupts, as the file-system is read-only
+    // its structure cannot change
+    
+    //pi_trace(pi_trace_FS, "[FS] Opening file (name: %s)\n", file_name);
+    
+    // Find the file in the file-system
+    pi_fs_desc_t *desc = __pi_read_fs_find(fs, file_name);
+    
+    // Leave if the file is not found
+    if(desc == NULL) goto error;
+    
+    // Now allocate the file descriptor and fills it
+    file = pmsis_l2_malloc(sizeof(pi_read_fs_file_t));
+    if(file == NULL) goto error;
+    
+    file->pending = NULL;
+    file->offset = 0;
+    file->fs_file.size = desc->size;
+    file->addr = desc->addr + fs->partition_offset;
+    
+    __pi_read_fs_file_init(device, file);
 
     return &file->fs_file;
     
-    error1:
-    pmsis_l2_malloc_free(file, sizeof(pi_read_fs_file_t));
     error:
     return NULL;
 }
@@ -386,20 +1462,32 @@ static void __pi_read_fs_close(pi_fs_file_t *_file)
     pi_read_fs_file_t *file = (pi_read_fs_file_t *) _file;
     
     //printf("[FS] Closing file (file: %p)\n", file);
-    if(file->header == NULL)
-    {
-        pmsis_l2_malloc_free(file->cache, READ_FS_THRESHOLD_BLOCK_FULL);
-        pmsis_l2_malloc_free((void *) file, sizeof(pi_read_fs_file_t));
-    } else
+    if(file->pending != NULL)
     {
+        // The file is added to the file-system by the next commit
         pi_read_fs_t *fs = (pi_read_fs_t *) file->fs_file.fs->data;
-        *(uint32_t *) &file->header[0] = file->addr;
-        *(uint32_t *) &file->header[4] = file->fs_file.size;
-        pi_flash_program(fs->flash, file->addr - file->header_size, (void *) file->header, file->header_size);
-        pi_l2_free((void *) file->header, file->header_size);
-        pi_l2_free((void *) file, sizeof(pi_read_fs_file_t));
+        pi_read_fs_pending_t *pending = file->pending;
+        ((pi_fs_desc_t *) pending->desc)->size = file->fs_file.size;
+        
+        pending->next = NULL;
+        if(fs->pending_first)
+            fs->pending_last->next = pending;
+        else
+            fs->pending_first = pending;
+        fs->pending_last = pending;
+        fs->pending_desc_size += pending->desc_size;
+        fs->nb_pending++;
+        fs->nb_writers--;
+        
+        // The extent of the last file is shrunk to what was written, so that
+        // the rest is available to the next files and to the header extension
+        uint32_t addr = file->addr - fs->partition_offset;
+        if(addr + file->extent_size == fs->alloc_ptr)
+            fs->alloc_ptr = addr + file->fs_file.size;
     }
     
+    pmsis_l2_malloc_free((void *) file, sizeof(pi_read_fs_file_t));
+    
 }
 
 
@@ -413,42 +1501,67 @@ static int __pi_fs_read_block(pi_read_fs_t *fs, unsigned int addr, unsigned int
     return size;
 }
 
-// Reads a block from cache, whose size is inferior to READ_FS_THRESHOLD
-static int __pi_fs_read_from_cache(pi_read_fs_file_t *file, unsigned int buffer, unsigned int addr, int size)
+// Reads a block from a cache line, which must fully contain the block
+static int __pi_fs_read_from_cache(pi_read_fs_t *fs, pi_read_fs_cache_line_t *line, unsigned int buffer, unsigned int addr, int size)
 {
     //printf("[FS] Read from cache (buffer: 0x%x, addr: 0x%x, size: 0x%x)\n", buffer, addr, size);
     
-    pi_read_fs_t *fs = (pi_read_fs_t *) file->fs_file.fs->data;
-    
-    memcpy((void *) buffer, &file->cache[addr - file->cache_addr], size);
+    memcpy((void *) buffer, &__pi_read_fs_cache_line_data(&fs->cache, line)[addr - line->tag], size);
     
     return size;
     
 }
 
-// Reads a block from cache, whose size is inferior to READ_FS_THRESHOLD,
-// with no alignment constraint.
-// If the data is not in the cache, it is loaded fron FS
-// and then it copied from the cache to the buffer
+// Reads a block through the cache, with no alignment constraint.
+// The size is truncated to the end of the cache line containing the address.
+// If the line is not in the cache, it is loaded from FS and 0 is returned with
+// the pending flag set. The caller must then retry once the event is triggered.
 static int
 __pi_fs_read_cached(pi_read_fs_file_t *file, unsigned int buffer, unsigned int addr, unsigned int size, int *pending,
                     pi_task_t *event)
 {
     //printf("[FS] Read cached (buffer: 0x%x, addr: 0x%x, size: 0x%x)\n", buffer, addr, size);
     
-    if(size > READ_FS_THRESHOLD_BLOCK_FULL - (addr & 0x7)) size = READ_FS_THRESHOLD_BLOCK_FULL - (addr & 0x7);
-    
     pi_read_fs_t *fs = (pi_read_fs_t *) file->fs_file.fs->data;
+    pi_read_fs_cache_t *cache = &fs->cache;
+    
+    unsigned int line_offset = addr & (cache->line_size - 1);
+    if(size > cache->line_size - line_offset) size = cache->line_size - line_offset;
+    
+    pi_read_fs_cache_line_t *line = __pi_read_fs_cache_lookup(cache, addr);
+    if(line)
+    {
+        cache->hits++;
+        return __pi_fs_read_from_cache(fs, line, buffer, addr, size);
+    }
+    
+    *pending = 1;
     
-    if(addr < file->cache_addr || addr + size > file->cache_addr + READ_FS_THRESHOLD_BLOCK_FULL)
+    // Only one refill at a time, the file will be resumed when it is done
+    if(cache->fill_file)
     {
-        file->cache_addr = addr & ~0x7;
-        __pi_fs_read_block(fs, file->cache_addr, (int) file->cache, READ_FS_THRESHOLD_BLOCK_FULL, event);
-        *pending = 1;
+        file->cache_waiting_next = NULL;
+        if(cache->waiting_first)
+            cache->waiting_last->cache_waiting_next = file;
+        else
+            cache->waiting_first = file;
+        cache->waiting_last = file;
         return 0;
     }
     
-    return __pi_fs_read_from_cache(file, buffer, addr, size);
+    cache->misses++;
+    
+    // The line is kept invalid until the refill is done, so that it cannot be
+    // hit by other files
+    line = __pi_read_fs_cache_victim(cache, addr);
+    line->tag = READ_FS_CACHE_INVALID_TAG;
+    cache->fill_line = line;
+    cache->fill_tag = addr - line_offset;
+    cache->fill_file = file;
+    
+    __pi_fs_read_block(fs, cache->fill_tag, (unsigned int) __pi_read_fs_cache_line_data(cache, line), cache->line_size, event);
+    
+    return 0;
 }
 
 int
@@ -466,11 +1579,14 @@ __pi_fs_read(pi_read_fs_file_t *file, unsigned int buffer, unsigned int addr, in
     if(use_cache) return __pi_fs_read_cached(file, buffer, addr, size, pending, event);
     
     // Cache hit
-    if(size <= READ_FS_THRESHOLD_BLOCK_FULL &&
-       addr >= file->cache_addr &&
-       addr + size < file->cache_addr + READ_FS_THRESHOLD_BLOCK_FULL)
+    if(size <= fs->cache.line_size - (addr & (fs->cache.line_size - 1)))
     {
-        return __pi_fs_read_from_cache(file, buffer, addr, size);
+        pi_read_fs_cache_line_t *line = __pi_read_fs_cache_lookup(&fs->cache, addr);
+        if(line)
+        {
+            fs->cache.hits++;
+            return __pi_fs_read_from_cache(fs, line, buffer, addr, size);
+        }
     }
     
     // Now this is the case where we can transfer part of the buffer directly from the FS to the L2
@@ -478,7 +1594,7 @@ __pi_fs_read(pi_read_fs_file_t *file, unsigned int buffer, unsigned int addr, in
     int prefix_size = addr & 0x7;
     if(prefix_size)
     {
-        prefix_size = 4 - prefix_size;
+        prefix_size = 8 - prefix_size;
         //printf("[FS] Reading block prefix (buffer: 0x%x, addr: 0x%x, size: 0x%x)\n", buffer, addr, prefix_size);
         int read_size = __pi_fs_read_cached(file, buffer, addr, prefix_size, pending, event);
         if(*pending) return read_size;
@@ -493,7 +1609,7 @@ __pi_fs_read(pi_read_fs_file_t *file, unsigned int buffer, unsigned int addr, in
     __pi_fs_read_block(fs, addr, buffer, block_size, event);
     *pending = 1;
     
-    return block_size;
+    return block_size + prefix_size;
 }
 
 static int32_t __pi_read_fs_write(pi_fs_file_t *_file, void *buffer, uint32_t size, pi_task_t *task)
@@ -501,17 +1617,29 @@ static int32_t __pi_read_fs_write(pi_fs_file_t *_file, void *buffer, uint32_t si
     pi_read_fs_t *fs = (pi_read_fs_t *) _file->fs->data;
     pi_read_fs_file_t *file = (pi_read_fs_file_t *) _file;
     
+    // Only the files opened for writing can be written, the task is still
+    // notified with the error
+    if(file->pending == NULL)
+    {
+        READ_FS_TASK_DATA(task)[0] = (uint32_t) -1;
+        pi_task_push(task);
+        return -1;
+    }
+    
+    // The file can grow up to the end of its extent
     int real_size = size;
     unsigned int addr = file->addr + file->offset;
-    if(file->offset + size > file->fs_file.size)
+    if(file->offset + size > file->extent_size)
     {
-        real_size = file->fs_file.size - file->offset;
+        real_size = file->extent_size - file->offset;
     }
     file->offset += real_size;
+    if(file->offset > file->fs_file.size)
+        file->fs_file.size = file->offset;
     
-    pi_flash_program_async(fs->flash, addr, (void *) buffer, real_size, task);
+    __pi_read_fs_write_enqueue(fs, addr, buffer, real_size, task);
     
-    return 0;
+    return real_size;
 }
 
 static int32_t __pi_read_fs_seek(pi_fs_file_t *_file, unsigned int offset)
@@ -527,6 +1655,12 @@ static int32_t __pi_read_fs_seek(pi_fs_file_t *_file, unsigned int offset)
     return -1;
 }
 
+static uint32_t __pi_read_fs_tell(pi_fs_file_t *_file)
+{
+    pi_read_fs_file_t *file = (pi_read_fs_file_t *) _file;
+    return file->offset;
+}
+
 // This function can be called to do all the required asynchronous steps to mount a FS.
 // This can execute in 2 ways:
 //   - No event is given in which case each call is synchronous and the call
@@ -537,9 +1671,14 @@ static int32_t __pi_read_fs_seek(pi_fs_file_t *_file, unsigned int offset)
 static void __pi_read_fs_try_read(void *arg)
 {
     pi_read_fs_file_t *file = (pi_read_fs_file_t *) arg;
+    pi_read_fs_t *fs = (pi_read_fs_t *) file->fs_file.fs->data;
     
     int pending = 0;
     
+    // We are resumed after a cache refill, the line can now be used
+    if(fs->cache.fill_file == file)
+        __pi_read_fs_cache_fill_done(&fs->cache);
+    
     if(file->pending_size == 0)
     {
         #if defined(__PULP_OS__)
@@ -663,6 +1802,22 @@ __pi_read_fs_copy_2d_async(pi_fs_file_t *_file, uint32_t index, void *buffer, ui
 }
 
 
+static int32_t __pi_read_fs_mmap(pi_fs_file_t *_file, void **ptr)
+{
+    pi_read_fs_file_t *file = (pi_read_fs_file_t *) _file;
+    pi_read_fs_t *fs = (pi_read_fs_t *) file->fs_file.fs->data;
+    struct pi_flash_map map = { .addr=file->addr, .size=file->fs_file.size, .ptr=NULL };
+
+    // Files being written are not yet in their final state in the flash
+    if(file->pending != NULL) return -1;
+
+    pi_flash_ioctl(fs->flash, PI_FLASH_IOCTL_MAP, &map);
+    if(map.ptr == NULL) return -1;
+
+    *ptr = map.ptr;
+    return 0;
+}
+
 
 pi_fs_api_t __pi_read_fs_api = {
     .mount = __pi_read_fs_mount,
@@ -673,8 +1828,12 @@ pi_fs_api_t __pi_read_fs_api = {
     .direct_read = __pi_read_fs_direct_read_async,
     .write = __pi_read_fs_write,
     .seek = __pi_read_fs_seek,
+    .tell = __pi_read_fs_tell,
+    .stat = __pi_read_fs_stat,
     .copy = __pi_read_fs_copy_async,
-    .copy_2d = __pi_read_fs_copy_2d_async
+    .copy_2d = __pi_read_fs_copy_2d_async,
+    .mmap = __pi_read_fs_mmap,
+    .mount_async = __pi_read_fs_mount_async
 };
 
 void pi_readfs_conf_init(struct pi_readfs_conf *conf)
@@ -682,4 +1841,24 @@ void pi_readfs_conf_init(struct pi_readfs_conf *conf)
     pi_fs_conf_init(&conf->fs);
     conf->fs.type = PI_FS_READ_ONLY;
     conf->fs.api = &__pi_read_fs_api;
+    conf->cache_nb_lines = READ_FS_CACHE_NB_LINES;
+    conf->cache_line_size = READ_FS_CACHE_LINE_SIZE;
+    conf->cache_nb_ways = READ_FS_CACHE_NB_WAYS;
+    conf->write_extent_size = 0;
+    conf->header_mode = PI_READFS_HEADER_EAGER;
+    conf->desc_cache_size = READ_FS_DESC_CACHE_SIZE;
+}
+
+void pi_readfs_cache_stats_get(struct pi_device *device, struct pi_readfs_cache_stats *stats)
+{
+    pi_read_fs_t *fs = (pi_read_fs_t *) device->data;
+    stats->hits = fs->cache.hits;
+    stats->misses = fs->cache.misses;
+}
+
+void pi_readfs_cache_stats_reset(struct pi_device *device)
+{
+    pi_read_fs_t *fs = (pi_read_fs_t *) device->data;
+    fs->cache.hits = 0;
+    fs->cache.misses = 0;
 }
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DELTA_UPDATER_H
+#define DELTA_UPDATER_H
+
+#include "pmsis.h"
+#include "bsp/fs.h"
+#include "bsp/updater.h"
+
+/**
+ * @brief Delta updater, rebuilding an application image from the stable one and a patch.
+ *
+ * The new image is written to the next OTA partition through the streaming updater. It is built by reading the
+ * stable partition and applying the operations of the patch, which is pushed by chunks from any source. Only a
+ * buffer for the stable image and the ring of the updater are allocated, whatever the size of the image or of
+ * the patch.
+ *
+ * A patch is a delta_header followed by operations, each one is a delta_op producing the next op.size bytes of the
+ * new image, followed by op.size bytes of payload for DELTA_OP_ADD and DELTA_OP_DATA. All fields are little endian.
+ */
+typedef struct delta_updater_s delta_updater_t;
+
+#define DELTA_MAGIC   0x544c4447 // "GDLT"
+#define DELTA_VERSION 1
+
+/**
+ * @brief Operations of a patch.
+ */
+typedef enum
+{
+    DELTA_OP_COPY = 0, //!< Copy op.size bytes of the stable image from op.offset.
+    DELTA_OP_ADD = 1,  //!< Add op.size bytes of payload to the bytes of the stable image from op.offset.
+    DELTA_OP_DATA = 2, //!< Write op.size bytes of payload, op.offset is unused.
+} delta_op_type_t;
+
+typedef struct
+{
+    uint32_t magic;          //!< DELTA_MAGIC.
+    uint32_t version;        //!< DELTA_VERSION.
+    uint32_t source_size;    //!< Size of the stable image the patch applies to.
+    uint8_t source_md5[16];  //!< MD5 digest of the stable image.
+    uint32_t target_size;    //!< Size of the new image.
+    uint8_t target_md5[16];  //!< MD5 digest of the new image.
+} delta_header_t;
+
+typedef struct
+{
+    uint32_t type;   //!< One of delta_op_type_t.
+    uint32_t offset; //!< Offset in the stable image.
+    uint32_t size;   //!< Number of bytes of the new image produced by the operation.
+} delta_op_t;
+
+struct delta_updater_conf
+{
+    struct updater_conf updater; /*!< Configuration of the updater writing the new image, its image size and digest
+        are taken from the patch header. */
+    uint32_t buffer_size;        /*!< Size of the buffer used to read the stable image, 0 for the default of 1KB. */
+};
+
+struct delta_updater_stats
+{
+    uint32_t patch_size;   /*!< Number of patch bytes pushed to the delta updater. */
+    uint32_t copied_size;  /*!< Number of bytes of the new image copied from the stable one. */
+    uint32_t added_size;   /*!< Number of bytes of the new image added to the stable one. */
+    uint32_t data_size;    /*!< Number of bytes of the new image taken from the patch. */
+    uint8_t source_hashed; /*!< 1 if the stable image was hashed to check it, 0 if its recorded digest was used. */
+};
+
+/**
+ * @brief Initialize a delta updater configuration with default values.
+ * @param conf The configuration to initialize.
+ */
+void delta_updater_conf_init(struct delta_updater_conf *conf);
+
+/**
+ * @brief Start a delta update of the next OTA partition from the stable one.
+ * @param delta Where to store the new delta updater.
+ * @param flash The flash device containing the partitions.
+ * @param conf The delta updater configuration.
+ * @return PI_OK on success, PI_ERR_NOT_FOUND if the stable partition is not found or PI_ERR_L2_NO_MEM if the delta
+ * updater can't be allocated.
+ */
+pi_err_t delta_updater_open(delta_updater_t **delta, pi_device_t *flash, const struct delta_updater_conf *conf);
+
+/**
+ * @brief Push a chunk of the patch.
+ *
+ * The stable image is checked against the digest of the patch header when the header is received. The operations
+ * are applied as their payload is received, the data buffer can be reused once this returns.
+ * @param delta The delta updater.
+ * @param data The chunk data.
+ * @param size The chunk size.
+ * @return PI_OK on success, PI_ERR_INVALID_CRC if the stable image differs from the one of the patch,
+ * PI_ERR_INVALID_ARG if the patch is malformed, or the first error of the update.
+ */
+pi_err_t delta_updater_write(delta_updater_t *delta, const void *data, uint32_t size);
+
+/**
+ * @brief Finish a delta update and free the delta updater.
+ * @param delta The delta updater.
+ * @param commit If not 0, the partition is set as boot partition once the whole image is programmed.
+ * @return PI_OK on success, PI_ERR_INVALID_ARG if the patch is truncated, PI_ERR_INVALID_CRC if the digest of the new
+ * image differs from the one of the patch, or the first error of the update.
+ */
+pi_err_t delta_updater_close(delta_updater_t *delta, uint8_t commit);
+
+/**
+ * @brief Get the statistics of a delta update.
+ * @param delta The delta updater.
+ * @param stats Where to store the statistics.
+ */
+void delta_updater_stats_get(delta_updater_t *delta, struct delta_updater_stats *stats);
+
+pi_err_t delta_update_from_fs(pi_device_t *flash, pi_device_t *fs, const char *patch_path);
+
+#endif //DELTA_UPDATER_H
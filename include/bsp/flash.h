@@ -59,9 +59,14 @@ struct pi_flash_conf {
  *
  */
 typedef enum {
-  PI_FLASH_IOCTL_INFO   /*!< Command for getting flash information. The argument
+  PI_FLASH_IOCTL_INFO,  /*!< Command for getting flash information. The argument
     must be a pointer to a variable of type struct pi_flash_info so that the
     call is returning information there. */
+  PI_FLASH_IOCTL_MAP    /*!< Command for getting a pointer through which a
+    flash area can be directly accessed by the cores, on flashes mapped in
+    the memory space. The argument must be a pointer to a variable of type
+    struct pi_flash_map, which gives the area to be mapped. The pointer is
+    left to NULL if the area cannot be directly accessed. */
 } pi_flash_ioctl_e;
 
 /** \struct pi_flash_info
@@ -76,6 +81,38 @@ struct pi_flash_info {
     reserved for runtime usage and should not be accessed. */
 };
 
+/** \struct pi_flash_map
+ * \brief Parameter for PI_FLASH_IOCTL_MAP command.
+ *
+ * The area is given by addr and size, and the pointer to it is returned in
+ * ptr, which must be set to NULL by the caller. Content accessed through
+ * this pointer is only valid as long as the area is not programmed or
+ * erased.
+ */
+struct pi_flash_map {
+  uint32_t addr;        /*!< Flash address of the area. */
+  uint32_t size;        /*!< Size in bytes of the area. */
+  void *ptr;            /*!< Pointer to the area, or NULL if the flash does
+    not support direct accesses. */
+};
+
+/** \enum pi_flash_prio_e
+ * \brief Scheduling priority of a flash operation.
+ *
+ * Operations waiting for the flash are executed by decreasing priority and
+ * in order for the same priority. High priority reads are also allowed to go
+ * before an on-going erase or program, which is then paused between two
+ * pages or sectors, or suspended if the flash supports it.
+ * All operations have a normal priority, except the reads enqueued with
+ * pi_flash_read_prio_async. A read never goes before a program or an erase
+ * of the same area enqueued before it.
+ */
+typedef enum {
+  PI_FLASH_PRIO_LOW    = 0, /*!< Background operation. */
+  PI_FLASH_PRIO_NORMAL = 1, /*!< Normal operation. */
+  PI_FLASH_PRIO_HIGH   = 2  /*!< Latency critical operation. */
+} pi_flash_prio_e;
+
 /** \brief Open a flash device.
  *
  * This function must be called before the flash device can be used.
@@ -97,10 +134,11 @@ int pi_flash_open(struct pi_device *device);
  * not needed anymore, in order to free all allocated resources. Once this
  * function is called, the device is not accessible anymore and must be opened
  * again before being used.
+ * The partition table cached for this device is dropped.
  *
  * \param device    The device structure of the device to close.
  */
-static inline void pi_flash_close(struct pi_device *device);
+void pi_flash_close(struct pi_device *device);
 
 /** \brief Control device.
  *
@@ -277,6 +315,25 @@ static inline void pi_flash_erase(struct pi_device *device, uint32_t pi_flash_ad
 static inline void pi_flash_read_async(struct pi_device *device,
   uint32_t pi_flash_addr, void *data, uint32_t size, pi_task_t *task);
 
+/** \brief Enqueue an asynchronous read copy to the flash with a priority.
+ *
+ * This is the same as pi_flash_read_async, except that the read is scheduled
+ * with the specified priority instead of the normal one. On flashes which do
+ * not support priorities, this is a normal read.
+ *
+ * \param device      The device descriptor of the flash chip on which to do
+ *   the copy.
+ * \param pi_flash_addr  The address of the copy in the flash.
+ * \param data        The address of the copy in the processor.
+ * \param size        The size in bytes of the copy.
+ * \param prio        The priority of the read.
+ * \param task        The task used to notify the end of transfer.
+   See the documentation of pi_task_t for more details.
+ */
+static inline void pi_flash_read_prio_async(struct pi_device *device,
+  uint32_t pi_flash_addr, void *data, uint32_t size, pi_flash_prio_e prio,
+  pi_task_t *task);
+
 /** \brief Enqueue an asynchronous write copy to the flash (from processor
  * to flash).
  *
@@ -380,15 +437,11 @@ typedef struct __pi_flash_api_t {
   int (*reg_get)(struct pi_device *device, uint32_t pi_flash_addr, uint8_t *value);
   int (*copy)(struct pi_device *device, uint32_t pi_flash_addr, void *buffer, uint32_t size, int ext2loc);
   int (*copy_2d)(struct pi_device *device, uint32_t pi_flash_addr, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int ext2loc);
+  // optional, NULL if the flash does not support priorities
+  void (*read_prio_async)(struct pi_device *device, uint32_t pi_flash_addr, void *data, uint32_t size, int prio, pi_task_t *task);
 } pi_flash_api_t;
 
 
-static inline void pi_flash_close(struct pi_device *device)
-{
-  pi_flash_api_t *api = (pi_flash_api_t *)device->api;
-  api->close(device);
-}
-
 static inline int32_t pi_flash_ioctl(struct pi_device *device, uint32_t cmd, void *arg)
 {
   pi_flash_api_t *api = (pi_flash_api_t *)device->api;
@@ -425,6 +478,15 @@ static inline void pi_flash_read_async(struct pi_device *device, uint32_t pi_fla
   api->read_async(device, pi_flash_addr, data, size, task);
 }
 
+static inline void pi_flash_read_prio_async(struct pi_device *device, uint32_t pi_flash_addr, void *data, uint32_t size, pi_flash_prio_e prio, pi_task_t *task)
+{
+  pi_flash_api_t *api = (pi_flash_api_t *)device->api;
+  if (api->read_prio_async)
+    api->read_prio_async(device, pi_flash_addr, data, size, prio, task);
+  else
+    api->read_async(device, pi_flash_addr, data, size, task);
+}
+
 static inline void pi_flash_read(struct pi_device *device, uint32_t pi_flash_addr, void *data, uint32_t size)
 {
   pi_flash_api_t *api = (pi_flash_api_t *)device->api;
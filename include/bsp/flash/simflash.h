@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2019 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __BSP__FLASH__SIMFLASH_H__
+#define __BSP__FLASH__SIMFLASH_H__
+
+#include "bsp/flash.h"
+
+/**
+ * @addtogroup Flash
+ * @{
+ */
+
+/**
+ * @defgroup simflash simflash
+ *
+ * Simulated NOR flash for POSIX hosts, stored in a memory-mapped image file.
+ *
+ * Programs can only clear bits and erases set the whole sector to 0xFF, as
+ * on a real NOR flash. Operations are executed one after the other and
+ * their completion is delayed according to the configured latencies and
+ * bandwidths, so that the storage stack can be benchmarked and fuzzed
+ * without a board.
+ */
+
+/**
+ * @addtogroup simflash
+ * @{
+ */
+
+/**@{*/
+
+/** \struct pi_simflash_conf
+ * \brief simflash configuration structure.
+ *
+ * This structure is used to pass the desired simflash configuration to the
+ * runtime when opening the device.
+ */
+struct pi_simflash_conf
+{
+  struct pi_flash_conf flash;   /*!< Generic flash configuration. */
+  const char *path;             /*!< Path of the flash image. It is created
+    or extended with erased sectors if it is smaller than the flash. NULL to
+    use an anonymous image, which is lost when the device is closed. */
+  size_t size;                  /*!< Size of the simulated flash. */
+  size_t sector_size;           /*!< Erase sector size. */
+  size_t page_size;             /*!< Program page size. */
+  uint32_t flash_start;         /*!< Start address returned by
+    PI_FLASH_IOCTL_INFO. */
+  uint32_t read_latency_us;     /*!< Latency of each read. */
+  uint32_t read_bandwidth;      /*!< Read bandwidth in bytes/s, 0 for no
+    limit. */
+  uint32_t program_time_us;     /*!< Program time of each page. */
+  uint32_t program_bandwidth;   /*!< Bandwidth in bytes/s for sending
+    the data to program, 0 for no limit. */
+  uint32_t erase_time_us;       /*!< Erase time of each sector. */
+};
+
+/** \struct pi_simflash_stats
+ * \brief simflash statistics.
+ *
+ * Counters accumulated since the device was opened, returned by
+ * pi_simflash_stats_get.
+ */
+struct pi_simflash_stats
+{
+  uint64_t read_bytes;          /*!< Number of bytes read. */
+  uint64_t program_bytes;       /*!< Number of bytes programmed. */
+  uint32_t nb_reads;            /*!< Number of reads. */
+  uint32_t nb_programs;         /*!< Number of programs. */
+  uint32_t nb_sector_erases;    /*!< Number of erased sectors. */
+  uint32_t max_sector_erases;   /*!< Highest erase count of a sector. */
+  uint32_t program_conflicts;   /*!< Number of programmed bytes which tried
+    to set bits to 1 without an erase. Such bits are left to 0. */
+  uint64_t busy_time_us;        /*!< Time the flash spent executing
+    operations, according to the configured timings. */
+};
+
+/** \brief Initialize a simflash configuration with default values.
+ *
+ * The default geometry is a 16MB flash with 4KB sectors and 256 bytes
+ * pages, with no latency.
+ *
+ * \param conf A pointer to the simflash configuration.
+ */
+void pi_simflash_conf_init(struct pi_simflash_conf *conf);
+
+/** \brief Get the simflash statistics.
+ *
+ * \param device The device structure of the opened simflash.
+ * \param stats  Where to store the statistics.
+ */
+void pi_simflash_stats_get(struct pi_device *device,
+  struct pi_simflash_stats *stats);
+
+/** \brief Get the number of times a sector has been erased.
+ *
+ * \param device The device structure of the opened simflash.
+ * \param addr   An address inside the sector.
+ * \return The erase count of the sector.
+ */
+uint32_t pi_simflash_sector_erase_count(struct pi_device *device,
+  uint32_t addr);
+
+//!@}
+
+/**
+ * @} end of simflash
+ */
+
+/**
+ * @} end of Flash
+ */
+
+#endif
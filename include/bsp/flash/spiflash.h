@@ -37,6 +37,28 @@
 
 /**@{*/
 
+/** \enum pi_spiflash_read_mode_e
+ * \brief Read modes of the spiflash.
+ *
+ * The name gives the number of lines used for the command, the address and
+ * the data.
+ */
+typedef enum {
+  PI_SPIFLASH_READ_MODE_1_1_1     = 0, /*!< Read on a single line. */
+  PI_SPIFLASH_READ_MODE_1_1_4     = 1, /*!< Quad output fast read. */
+  PI_SPIFLASH_READ_MODE_1_4_4     = 2, /*!< Quad I/O fast read. */
+  PI_SPIFLASH_READ_MODE_4_4_4     = 3, /*!< Fast read in QPI mode. */
+  PI_SPIFLASH_READ_MODE_1_4_4_DTR = 4, /*!< Quad I/O DTR fast read. */
+  PI_SPIFLASH_READ_MODE_4_4_4_DTR = 5, /*!< DTR fast read in QPI mode. */
+  PI_SPIFLASH_READ_MODE_NB
+} pi_spiflash_read_mode_e;
+
+/** \brief Mask of a read mode, for the read_modes configuration field. */
+#define PI_SPIFLASH_READ_MODE(mode) (1 << (mode))
+
+/** \brief Mask of all read modes. */
+#define PI_SPIFLASH_READ_MODES_ALL ((1 << PI_SPIFLASH_READ_MODE_NB) - 1)
+
 /** \struct spiflash_conf
  * \brief spiflash configuration structure.
  *
@@ -51,6 +73,28 @@ struct pi_spiflash_conf
   size_t size;                  /*!< Size of the connected flash.*/
   size_t sector_size;           /*!< Sector size of the connected flash.*/
   uint32_t baudrate;            /*!< baudrate of the underlying interface. */
+  uint32_t program_time_us;     /*!< Typical page program time in
+    microseconds, used to schedule the status polling. 0 to take it from the
+    driver timing table, according to the flash JEDEC ID. */
+  uint32_t erase_time_us;       /*!< Typical sector erase time in
+    microseconds. 0 to take it from the driver timing table. */
+  uint32_t read_modes;          /*!< Mask of the read modes which can be
+    used. The driver selects at open the fastest one which is supported by
+    both the interface and the flash, as detected from its JEDEC ID. If there
+    is none, the default read of the interface is used, quad I/O or single
+    line. */
+};
+
+/** \struct pi_spiflash_read_bench
+ * \brief Throughput of the reads of one size in one read mode.
+ */
+struct pi_spiflash_read_bench
+{
+  int read_mode;                /*!< Read mode, from pi_spiflash_read_mode_e. */
+  uint32_t size;                /*!< Number of bytes read. */
+  uint32_t time_us;             /*!< Time taken by the read in microseconds. */
+  uint32_t throughput;          /*!< Throughput in KB/s (1000 bytes per
+    second). */
 };
 
 /** \brief Initialize an spiflash configuration with default values.
@@ -62,6 +106,37 @@ struct pi_spiflash_conf
  */
 void pi_spiflash_conf_init(struct pi_spiflash_conf *conf);
 
+/** \brief Get the read mode selected when the spiflash was opened.
+ *
+ * This can be used together with the read_modes configuration field to
+ * measure the throughput of each mode supported by the flash.
+ *
+ * \param device The device structure of the opened spiflash.
+ * \return The read mode, from pi_spiflash_read_mode_e.
+ */
+int pi_spiflash_read_mode_get(struct pi_device *device);
+
+/** \brief Measure the read throughput of each read mode.
+ *
+ * For each read mode of the read_modes configuration field which is
+ * supported by both the interface and the flash, the flash is opened in this
+ * mode and reads from 1KB to 1MB, with the size multiplied by 4 each time,
+ * are timed. Reads bigger than the buffer are done as consecutive reads of
+ * the buffer size. The flash must not be already opened.
+ *
+ * \param conf        The spiflash configuration, read_modes gives the modes
+ *   to measure and is restored before returning.
+ * \param flash_addr  The flash address where the reads start.
+ * \param buffer      The buffer where the data are read.
+ * \param buffer_size The size of the buffer.
+ * \param results     Where to store the results, one per mode and size.
+ * \param nb_results  The maximum number of results to store.
+ * \return The number of results stored, or -1 if the flash can't be opened.
+ */
+int pi_spiflash_read_bench(struct pi_spiflash_conf *conf, uint32_t flash_addr,
+  void *buffer, uint32_t buffer_size, struct pi_spiflash_read_bench *results,
+  int nb_results);
+
 //!@}
 
 /**
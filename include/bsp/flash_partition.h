@@ -90,6 +90,18 @@ void flash_partition_print_partition_table(const flash_partition_table_t *table)
  */
 pi_err_t flash_partition_table_load(pi_device_t *flash, const flash_partition_table_t **table, uint8_t *nbr_of_entries);
 
+/**
+ * @brief Asynchronously loads, verifies and allocates a copy of the partition table of given flash.
+ *
+ * @param flash The flash device pointer where the partition table is stored.
+ * @param table in case the status is PI_OK when the task is pushed, this double pointer will contain a newly allocated partition table.
+ * @param status Where the result of the load is stored before the task is pushed, with the same codes as flash_partition_table_load.
+ * @param task The task pushed when the load is done.
+ * @return PI_OK if the load was started, PI_ERR_INVALID_ARG or PI_ERR_L2_NO_MEM otherwise, in which case the task is not pushed.
+ */
+pi_err_t flash_partition_table_load_async(pi_device_t *flash, const flash_partition_table_t **table,
+                                          pi_err_t *status, pi_task_t *task);
+
 void flash_partition_table_free(const flash_partition_table_t *table);
 
 const flash_partition_info_t *
@@ -33,9 +33,9 @@ typedef struct __pi_fs_api_t pi_fs_api_t;
  * The file-system driver provides support for accessing files on a flash. The
  * following file-systems are available:
  *  - Read-only file system. This file-system is very basic but quite-convenient
- *    to have access to input data. The open operation does not scale well when
- *    having lots of file so this file-system should only be used with few
- *    files.
+ *    to have access to input data. Files are indexed by a hash table built
+ *    when the file-system is mounted so that opening a file does not depend on
+ *    the number of files.
  *
  */
 
@@ -95,6 +95,18 @@ struct pi_fs_conf {
     internal runtime usage. */
 };
 
+/** \struct pi_fs_iovec_t
+ * \brief Segment of a vectored read.
+ *
+ * This structure describes one segment of a vectored read, i.e. an area of
+ * the file to be copied to a chip memory location.
+ */
+typedef struct {
+  uint32_t offset;  /*!< Offset in the file where to start reading. */
+  void *buffer;     /*!< Memory location where the data must be copied. */
+  uint32_t size;    /*!< Size in bytes of the segment. */
+} pi_fs_iovec_t;
+
 /** \brief FS file structure.
  *
  * This structure is used by the runtime to store information about a file.
@@ -133,6 +145,26 @@ void pi_fs_conf_init(struct pi_fs_conf *conf);
  */
 int32_t pi_fs_mount(struct pi_device *device);
 
+/** \brief Mount a file-system asynchronously.
+ *
+ * This function implements the same feature as pi_fs_mount but the end of
+ * the mount is notified with a task, so that the flash accesses needed to
+ * find the partition and load the file-system metadata do not block the
+ * caller.
+ * The result, 0 if successful or -1 if there was an error, is returned
+ * through the task, in the same way as for pi_fs_read_async.
+ * File-systems which can only be mounted synchronously are mounted during
+ * the call and the task is pushed immediately.
+ *
+ * \param device    A pointer to the device structure of the device to open.
+ *   This structure is allocated by the called and must be kept alive until the
+ *   device is closed.
+ * \param task      The task used to notify the end of the mount.
+ * \return          0 if the mount was successfully started, -1 otherwise, in
+ *   which case the task is not pushed.
+ */
+int32_t pi_fs_mount_async(struct pi_device *device, pi_task_t *task);
+
 /** \brief Unmount a mounted file-system.
  *
  * This function can be called to close a mounted file-system once it is not
@@ -166,6 +198,19 @@ pi_fs_file_t *pi_fs_open(struct pi_device *device, const char *file, int flags);
  */
 void pi_fs_close(pi_fs_file_t *file);
 
+/** \brief Get the size of a file.
+ *
+ * This gives the size of a file without opening it, the file-system only
+ * looks up its metadata when it supports it.
+ * The caller is blocked until the operation is finished.
+ *
+ * \param device    The device structure of the FS containing the file.
+ * \param file      The path to the file.
+ * \param size      Where to store the size of the file.
+ * \return          0 if the size was retrieved or -1 if the file is not found.
+ */
+int32_t pi_fs_stat(struct pi_device *device, const char *file, uint32_t *size);
+
 /** \brief Read data from a file.
  *
  * This function can be called to read data from an opened file. The data is
@@ -406,6 +451,110 @@ int32_t pi_fs_copy_2d_async(pi_fs_file_t *file, uint32_t index, void *buffer,
   uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc,
   pi_task_t *task);
 
+/** \brief Read several segments of a file.
+ *
+ * This function can be called to read a list of segments from an opened file,
+ * each segment being specified by its offset in the file, the memory location
+ * where it must be copied and its size. The current position is not used.
+ * Consecutive segments which are contiguous both in the file and in memory are
+ * merged into a single transfer.
+ * The caller is blocked until all the segments are read.
+ * Depending on the chip, there may be some restrictions on the memory which
+ * can be used. Check the chip-specific documentation for more details.
+ *
+ * \param file      The handle of the file where to read data.
+ * \param iov       The array of segments to read.
+ * \param nb_iov    The number of segments.
+ * \return          0 if the operation was successful, -1 otherwise.
+ */
+int32_t pi_fs_readv(pi_fs_file_t *file, pi_fs_iovec_t *iov, uint32_t nb_iov);
+
+/** \brief Read several segments of a file asynchronously.
+ *
+ * This function implements the same feature as pi_fs_readv but the
+ * termination of the whole list is notified with a single task.
+ * The array of segments must be kept alive until the task is triggered.
+ * The result, 0 if successful or -1 if one of the segments could not be read,
+ * is returned through the task, in the same way as for pi_fs_read_async.
+ *
+ * \param file      The handle of the file where to read data.
+ * \param iov       The array of segments to read.
+ * \param nb_iov    The number of segments.
+ * \param task      The task used to notify the end of transfer.
+ * \return          0 if the operation was successfully enqueued, -1
+ *   otherwise.
+ */
+int32_t pi_fs_readv_async(pi_fs_file_t *file, pi_fs_iovec_t *iov,
+  uint32_t nb_iov, pi_task_t *task);
+
+/** \brief Map a file in memory.
+ *
+ * This function can be called on a file opened for reading to get a pointer
+ * to its whole content, for example for constant tables which are accessed
+ * in place.
+ * If the file-system is on a flash which is mapped in the memory space, the
+ * returned pointer is directly in the flash and no copy is done. Otherwise
+ * the file is copied into an L2 buffer which stays allocated until the file
+ * is unmapped.
+ * Mapping an already mapped file returns the same pointer. The content is
+ * read-only and must not be accessed anymore once the file is unmapped or
+ * closed.
+ *
+ * \param file      The handle of the file.
+ * \param ptr       Where to store the pointer to the file content.
+ * \param size      Where to store the size of the file content.
+ * \return          0 if the operation was successful, -1 otherwise.
+ */
+int32_t pi_fs_mmap(pi_fs_file_t *file, void **ptr, uint32_t *size);
+
+/** \brief Unmap a file.
+ *
+ * This function releases the mapping done with pi_fs_mmap, which frees the
+ * L2 copy if the file could not be directly accessed. It is also done when
+ * the file is closed.
+ *
+ * \param file      The handle of the file.
+ */
+void pi_fs_munmap(pi_fs_file_t *file);
+
+/** \brief Enable read-ahead on a file.
+ *
+ * This function can be called on a file opened for reading to activate
+ * sequential read-ahead. Once enabled, the calls to pi_fs_read_async and
+ * pi_fs_read are served from a ring of prefetch buffers, and as long as the
+ * file is read sequentially, the next windows are loaded in the background
+ * while the application processes the current one.
+ * Any seek breaks the sequential detection, in which case only the window
+ * containing the requested data is loaded until the accesses become
+ * sequential again.
+ * Reading continues from the current position of the file.
+ * While read-ahead is enabled, all the accesses to the file, including writes,
+ * direct reads and copies, are queued and executed in order with the
+ * background transfers. Their result is also returned in the task, and the
+ * prefetched data is dropped by any seek or any access modifying the file.
+ * The buffers are allocated in L2 memory.
+ *
+ * \param file      The handle of the file.
+ * \param window_size The size in bytes of each prefetch buffer, which is
+ *   also the size of each transfer done in the background.
+ * \param depth     The number of prefetch buffers.
+ * \return          0 if the operation was successful, -1 otherwise, for
+ *   example if the file-system does not report the current position.
+ */
+int32_t pi_fs_readahead_enable(pi_fs_file_t *file, uint32_t window_size,
+  uint32_t depth);
+
+/** \brief Disable read-ahead on a file.
+ *
+ * This function can be called to stop read-ahead on a file and free the
+ * prefetch buffers. It waits for the on-going background transfer, if any.
+ * It must not be called while a read is still pending on the file. The current
+ * position is preserved.
+ *
+ * \param file      The handle of the file.
+ */
+void pi_fs_readahead_disable(pi_fs_file_t *file);
+
 /** \brief Read data from a file from cluster side.
  *
  * This function implements the same feature as pi_fs_read but can be called
@@ -547,6 +696,91 @@ void pi_cl_fs_copy_2d(pi_fs_file_t *file, uint32_t index, void *buffer,
   uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc,
   pi_cl_fs_req_t *req);
 
+/** \brief Read several segments of a file from cluster side.
+ *
+ * This function implements the same feature as pi_fs_readv but can be called
+ * from cluster side in order to expose the feature on the cluster.
+ * This operation is asynchronous and its termination is managed through the
+ * request structure. The array of segments must be kept alive until the
+ * request is finished.
+ *
+ * \param file      The handle of the file where to read data.
+ * \param iov       The array of segments to read.
+ * \param nb_iov    The number of segments.
+ * \param req       The request structure used for termination.
+ */
+void pi_cl_fs_readv(pi_fs_file_t *file, pi_fs_iovec_t *iov, uint32_t nb_iov,
+  pi_cl_fs_req_t *req);
+
+/** \brief Open a file from cluster side.
+ *
+ * This function implements the same feature as pi_fs_open but can be called
+ * from cluster side in order to expose the feature on the cluster.
+ * This operation is asynchronous and its termination is managed through the
+ * request structure. The path must be kept alive until the request is
+ * finished. pi_cl_fs_wait returns 0 if the file was opened or -1 if there
+ * was an error.
+ *
+ * \param device    The device structure of the mounted file-system.
+ * \param path      The path of the file to open.
+ * \param flags     Optional flags to configure how the file is opened.
+ * \param file      Where to store the handle of the opened file, or NULL if
+ *   it could not be opened.
+ * \param req       The request structure used for termination.
+ */
+void pi_cl_fs_open(struct pi_device *device, const char *path, int flags,
+  pi_fs_file_t **file, pi_cl_fs_req_t *req);
+
+/** \brief Open several files from cluster side.
+ *
+ * This opens all the files with a single request, which costs one round-trip
+ * to the fabric controller instead of one per file.
+ * This operation is asynchronous and its termination is managed through the
+ * request structure. The arrays and paths must be kept alive until the
+ * request is finished. pi_cl_fs_wait returns 0 if all the files were opened
+ * or -1 if at least one of them could not be opened.
+ *
+ * \param device    The device structure of the mounted file-system.
+ * \param paths     The array of paths of the files to open.
+ * \param nb_paths  The number of files to open.
+ * \param flags     Optional flags to configure how the files are opened.
+ * \param files     The array where to store the handles of the opened files,
+ *   an entry is NULL if the file could not be opened.
+ * \param req       The request structure used for termination.
+ */
+void pi_cl_fs_open_batch(struct pi_device *device, const char **paths,
+  uint32_t nb_paths, int flags, pi_fs_file_t **files, pi_cl_fs_req_t *req);
+
+/** \brief Close a file from cluster side.
+ *
+ * This function implements the same feature as pi_fs_close but can be called
+ * from cluster side in order to expose the feature on the cluster.
+ * The file is closed once the requests previously enqueued on it are
+ * finished, no other request can be enqueued on it afterwards.
+ * This operation is asynchronous and its termination is managed through the
+ * request structure.
+ *
+ * \param file      The handle of the file to close.
+ * \param req       The request structure used for termination.
+ */
+void pi_cl_fs_close(pi_fs_file_t *file, pi_cl_fs_req_t *req);
+
+/** \brief Get the size of a file from cluster side.
+ *
+ * This gives the size of a file without having to open it.
+ * This operation is asynchronous and its termination is managed through the
+ * request structure. The path must be kept alive until the request is
+ * finished. pi_cl_fs_wait returns 0 if the size was retrieved or -1 if the
+ * file does not exist.
+ *
+ * \param device    The device structure of the mounted file-system.
+ * \param path      The path of the file.
+ * \param size      Where to store the size of the file.
+ * \param req       The request structure used for termination.
+ */
+void pi_cl_fs_stat(struct pi_device *device, const char *path, uint32_t *size,
+  pi_cl_fs_req_t *req);
+
 /** \brief Wait until the specified fs request has finished.
  *
  * This blocks the calling core until the specified cluster remote copy is
@@ -580,6 +814,10 @@ struct __pi_fs_api_t {
     int32_t (*seek)(pi_fs_file_t *file, unsigned int offset);
     int32_t (*copy)(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, int32_t ext2loc, pi_task_t *task);
     int32_t (*copy_2d)(pi_fs_file_t *file, uint32_t index, void *buffer, uint32_t size, uint32_t stride, uint32_t length, int32_t ext2loc, pi_task_t *task);
+    int32_t (*mmap)(pi_fs_file_t *file, void **ptr);
+    int32_t (*mount_async)(struct pi_device *device, pi_task_t *task);
+    uint32_t (*tell)(pi_fs_file_t *file);
+    int32_t (*stat)(struct pi_device *device, const char *file, uint32_t *size);
 };
 
 extern pi_fs_api_t __pi_read_fs_api;
@@ -592,12 +830,22 @@ typedef struct {
   pi_task_t cl_req_task;
 } pi_fs_data_t;
 
+typedef struct pi_fs_readahead_s pi_fs_readahead_t;
+
 typedef struct pi_fs_file_s {
   struct pi_device *fs;
   pi_fs_api_t *api;
   void *data;
   unsigned int size;
   pi_fs_data_t *fs_data;
+  pi_fs_readahead_t *readahead;
+  pi_task_t readv_task;
+  pi_task_t *readv_first;
+  pi_task_t *readv_last;
+  void *mmap_ptr;
+  uint8_t mmap_pinned;
+  pi_cl_fs_req_t *cl_reqs_first;
+  pi_cl_fs_req_t *cl_reqs_last;
 } pi_fs_file_t;
 
 typedef enum {
@@ -611,13 +859,12 @@ typedef struct pi_cl_fs_req_s
 {
   pi_fs_file_t *file;
   pi_callback_t callback;
-#if defined(PMSIS_DRIVERS)
   pi_task_t task;
-#endif
+  uint8_t op;
   union {
     struct {
       uint8_t done;
-      char result;
+      int32_t result;
       unsigned char cid;
       unsigned char direct;
       unsigned char write;
@@ -627,7 +874,7 @@ typedef struct pi_cl_fs_req_s
     } rw;
     struct {
       uint8_t done;
-      char result;
+      int32_t result;
       unsigned char cid;
       unsigned char ext2loc;
       void *buffer;
@@ -636,6 +883,25 @@ typedef struct pi_cl_fs_req_s
       uint32_t stride;
       uint32_t length;
     } copy;
+    struct {
+      uint8_t done;
+      int32_t result;
+      unsigned char cid;
+      pi_fs_iovec_t *iov;
+      uint32_t nb_iov;
+    } readv;
+    struct {
+      uint8_t done;
+      int32_t result;
+      unsigned char cid;
+      int flags;
+      struct pi_device *device;
+      const char *path;
+      const char **paths;
+      uint32_t nb_paths;
+      pi_fs_file_t **files;
+      uint32_t *size;
+    } open;
   };
 } pi_cl_fs_req_t;
 
@@ -295,6 +295,15 @@ struct lfs_file_config {
 };
 
 
+// Extent of file data stored contiguously in a block
+struct lfs_file_extent {
+    lfs_block_t block;  // block containing the data
+    lfs_off_t off;      // offset in the block of the first byte
+    lfs_off_t pos;      // position in the file of the first byte
+    lfs_size_t size;    // number of bytes
+    lfs_size_t index;   // index of the block in the file
+};
+
 /// internal littlefs data structures ///
 typedef struct lfs_cache {
     lfs_block_t block;
@@ -382,6 +391,10 @@ typedef struct lfs {
         uint32_t *buffer;
     } free;
 
+    // number of metadata compactions and relocations since the mount
+    lfs_size_t compactions;
+    lfs_size_t relocations;
+
     const struct lfs_config *cfg;
     lfs_size_t name_max;
     lfs_size_t file_max;
@@ -560,6 +573,22 @@ int lfs_file_rewind(lfs_t *lfs, lfs_file_t *file);
 // Returns the size of the file, or a negative error code on failure.
 lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file);
 
+// Find where the data at the given position of a file is stored on the
+// block device, so that drivers can access it directly
+//
+// The extent describes the data of the block containing the position. The
+// file must not be inline and must not have unflushed writes.
+// Returns a negative error code on failure.
+int lfs_file_extent(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t pos, struct lfs_file_extent *extent);
+
+// Replace an extent with the one of the previous block of the file
+//
+// Returns a negative error code on failure, or if the extent is the
+// first one of the file.
+int lfs_file_extent_prev(lfs_t *lfs, lfs_file_t *file,
+        struct lfs_file_extent *extent);
+
 
 /// Directory operations ///
 
@@ -56,6 +56,62 @@
 struct pi_lfs_conf
 {
   struct pi_fs_conf fs;  /*!< Generic flaFSsh configuration. */
+  uint8_t async;         /*!< If 1, the file operations are queued and
+    executed in order by a worker, a thread on FreeRTOS or an event on other
+    systems, so that asynchronous reads, writes and copies return
+    immediately and can overlap with computation. The number of bytes of a
+    read or a write is returned when it is queued and the actual one through
+    the task. */
+  uint32_t read_size;      /*!< Minimum size of a flash read, 0 for the
+    default of 4 bytes. */
+  uint32_t prog_size;      /*!< Minimum size of a flash program, 0 for the
+    default of 4 bytes. */
+  uint32_t block_size;     /*!< Size of a LittleFS block, which must be a
+    multiple of the flash sector size. 0 to use the sector size given by
+    PI_FLASH_IOCTL_INFO. */
+  uint32_t cache_size;     /*!< Size of the read, program and per-file
+    caches. It must be a multiple of read_size and prog_size and divide
+    block_size. 0 to use 1/64 of the block size, with a minimum of 1KB. */
+  uint32_t lookahead_size; /*!< Size in bytes of the block allocation
+    bitmap, which must be a multiple of 8. 0 to cover the whole partition,
+    between 16 and 64 bytes. */
+  int32_t block_cycles;    /*!< Number of erase cycles before a metadata
+    block is moved for wear leveling, -1 to disable it. 0 for the default of
+    100 cycles. */
+  uint8_t stats;           /*!< If 1, the number of erases of each block is
+    tracked, which takes 4 bytes of L2 memory per block. The global
+    statistics are always tracked. */
+  const char *stats_path;  /*!< Path of the file where the statistics are
+    saved when the file-system is unmounted or when pi_lfs_stats_save is
+    called, and from which they are restored when it is mounted, so that
+    they cover the whole life of the partition. NULL to not save them. The
+    string must be kept alive until the file-system is unmounted. */
+};
+
+/** \struct pi_lfs_stats
+ * \brief LFS statistics.
+ *
+ * Counters accumulated since the file-system was mounted, or since it was
+ * formatted if they are saved, returned by pi_lfs_stats_get. The read and
+ * write amplifications are the ratios between the flash and the application
+ * amounts of bytes.
+ */
+struct pi_lfs_stats
+{
+  uint64_t read_bytes;          /*!< Number of bytes read by the
+    application. */
+  uint64_t write_bytes;         /*!< Number of bytes written by the
+    application. */
+  uint64_t flash_read_bytes;    /*!< Number of bytes read from the flash. */
+  uint64_t flash_program_bytes; /*!< Number of bytes programmed to the
+    flash. */
+  uint32_t nb_erases;           /*!< Number of erased blocks. */
+  uint32_t max_block_erases;    /*!< Highest erase count of a block, only
+    tracked if enabled in the configuration. */
+  uint32_t nb_compactions;      /*!< Number of compactions of metadata
+    blocks. */
+  uint32_t nb_relocations;      /*!< Number of metadata blocks moved, either
+    for wear leveling or because they went bad. */
 };
 
 /** \brief Initialize a LFS configuration with default values.
@@ -67,8 +123,48 @@ struct pi_lfs_conf
  */
 void pi_lfs_conf_init(struct pi_lfs_conf *conf);
 
+/** \brief Get the native LittleFS instance of a mounted LFS.
+ *
+ * In asynchronous mode, this waits until the queued operations are done.
+ * The instance must not be accessed while asynchronous operations are
+ * on-going.
+ *
+ * \param device The device structure of the mounted LFS.
+ * \return The LittleFS instance.
+ */
 lfs_t *pi_lfs_get_native_lfs(pi_device_t *device);
 
+/** \brief Get the statistics of a mounted LFS.
+ *
+ * In asynchronous mode, this waits until the queued operations are done.
+ *
+ * \param device The device structure of the mounted LFS.
+ * \param stats  Where to store the statistics.
+ */
+void pi_lfs_stats_get(pi_device_t *device, struct pi_lfs_stats *stats);
+
+/** \brief Get the number of times a block has been erased.
+ *
+ * The erase counts are only tracked if enabled in the configuration.
+ *
+ * \param device The device structure of the mounted LFS.
+ * \param block  The LittleFS block number.
+ * \return The erase count of the block, 0 if it is not tracked.
+ */
+uint32_t pi_lfs_block_erase_count(pi_device_t *device, uint32_t block);
+
+/** \brief Save the statistics of a mounted LFS.
+ *
+ * The statistics are written to the file given in the configuration. They
+ * are also saved when the file-system is unmounted, this can be used to
+ * keep them in case of power loss.
+ *
+ * \param device The device structure of the mounted LFS.
+ * \return 0 if the operation is successful, -1 if there was an error or if
+ * no file is configured.
+ */
+int32_t pi_lfs_stats_save(pi_device_t *device);
+
 //!@}
 
 /**
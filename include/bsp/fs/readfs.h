@@ -37,6 +37,20 @@
 
 /**@{*/
 
+/** \enum pi_readfs_header_mode_e
+ * \brief ReadFS header loading mode.
+ *
+ * This can be used to select how the file descriptors are loaded when the
+ * file-system is mounted.
+ */
+typedef enum {
+  PI_READFS_HEADER_EAGER = 0,   /*!< The whole header is loaded in L2 memory
+    when the file-system is mounted. */
+  PI_READFS_HEADER_LAZY  = 1    /*!< Only a compact index of the file paths
+    stays in L2 memory. The descriptors are read from flash when the files are
+    opened and kept in a small cache. */
+} pi_readfs_header_mode_e;
+
 /** \struct readfs_conf
  * \brief ReadFS configuration structure.
  *
@@ -46,6 +60,33 @@
 struct pi_readfs_conf
 {
   struct pi_fs_conf fs;  /*!< Generic flaFSsh configuration. */
+  uint32_t cache_nb_lines;  /*!< Number of lines of the block cache shared by
+    all the files of the file-system. It must be a multiple of
+    cache_nb_ways. */
+  uint32_t cache_line_size; /*!< Size in bytes of a cache line. It must be a
+    power of 2 and at least 8. */
+  uint32_t cache_nb_ways;   /*!< Associativity of the cache. Lines are
+    replaced with a least-recently-used policy inside a set. */
+  uint32_t write_extent_size; /*!< Flash space reserved for each file opened
+    for writing with pi_fs_open. 0 reserves all the remaining space, in which
+    case only one file can be written at a time. */
+  pi_readfs_header_mode_e header_mode; /*!< How the header is loaded. The
+    lazy mode reduces the memory used by file-systems with many files, at the
+    cost of flash accesses when opening files. */
+  uint32_t desc_cache_size; /*!< Number of descriptors kept in memory in lazy
+    mode, with a least-recently-used policy. At least one is used. */
+};
+
+/** \struct pi_readfs_cache_stats
+ * \brief ReadFS cache statistics.
+ *
+ * This structure is used to return the block cache counters.
+ */
+struct pi_readfs_cache_stats
+{
+  uint32_t hits;    /*!< Number of accesses served from the cache. */
+  uint32_t misses;  /*!< Number of accesses which required a line refill
+    from the flash. */
 };
 
 /** \brief Initialize a ReadFS configuration with default values.
@@ -57,6 +98,56 @@ struct pi_readfs_conf
  */
 void pi_readfs_conf_init(struct pi_readfs_conf *conf);
 
+/** \brief Open a file for writing with a given maximum size.
+ *
+ * This reserves an extent of the specified size in the free flash area, so
+ * that several files can be written at the same time. The unused part of
+ * the extent of the last allocated file is released when it is closed.
+ * Written files are only visible once they are closed and committed with
+ * pi_readfs_commit.
+ * They are then added to the file-system all together. The file must be
+ * closed with pi_fs_close.
+ *
+ * \param device   A pointer to the device structure of the mounted
+ *   file-system.
+ * \param file_name The path of the file.
+ * \param max_size  The maximum size of the file, or 0 to reserve all the
+ *   remaining space.
+ * \return          The file handle, or NULL if there is not enough space or
+ *   memory.
+ */
+pi_fs_file_t *pi_readfs_open_write(struct pi_device *device,
+  const char *file_name, uint32_t max_size);
+
+/** \brief Add the written files to the file-system.
+ *
+ * All the files written and closed since the last commit are added to the
+ * file-system at once: if the commit is interrupted, for example by a power
+ * loss, none of them is present after the next mount. The writes still
+ * queued are waited for first. This is also done when the file-system is
+ * unmounted.
+ *
+ * \param device   A pointer to the device structure of the mounted
+ *   file-system.
+ * \return          0 if the operation was successful, -1 otherwise, for
+ *   example if a file is still opened for writing.
+ */
+int32_t pi_readfs_commit(struct pi_device *device);
+
+/** \brief Get the block cache statistics of a mounted ReadFS.
+ *
+ * \param device A pointer to the device structure of the mounted file-system.
+ * \param stats  A pointer to the structure where the counters are returned.
+ */
+void pi_readfs_cache_stats_get(struct pi_device *device,
+  struct pi_readfs_cache_stats *stats);
+
+/** \brief Reset the block cache statistics of a mounted ReadFS.
+ *
+ * \param device A pointer to the device structure of the mounted file-system.
+ */
+void pi_readfs_cache_stats_reset(struct pi_device *device);
+
 //!@}
 
 /**
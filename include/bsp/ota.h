@@ -36,6 +36,13 @@
  */
 const pi_partition_t *ota_get_next_ota_partition(const pi_partition_table_t table);
 
+/**
+ * @brief Get the partition of the stable app, the factory one if no update has been validated.
+ * @param table An instance of partition table to find the stable partition.
+ * @return The stable partition. NULL if partition is not found.
+ */
+const pi_partition_t *ota_get_stable_partition(const pi_partition_table_t table);
+
 /**
  * @brief Fetch OTA information, current OTA state and pending partition.
  *
@@ -88,6 +95,23 @@ pi_err_t ota_mark_app_invalid_rollback_and_reboot(const pi_partition_table_t tab
  */
 pi_err_t ota_set_boot_partition(const pi_partition_table_t table, const pi_partition_t *partition);
 
+/**
+ * @brief Configure OTA data for a new boot partition whose image was verified while it was written
+ *
+ * Same as ota_set_boot_partition, the digest of the image is also recorded in the OTA data. If the bootloader is built
+ * with CONFIG_BOOTLOADER_CHECK_VERIFIED_IMAGE, it checks the partition against it before the first boot of the image,
+ * and aborts the update if they differ.
+ *
+ * @param table  An instance of partition table to write OTA information.
+ * @param partition Pointer to info for partition containing app image to boot.
+ * @param image_size Size of the image.
+ * @param md5 MD5 digest of the image.
+ *
+ * @return The same codes as ota_set_boot_partition.
+ */
+pi_err_t ota_set_boot_partition_verified(const pi_partition_table_t table, const pi_partition_t *partition,
+                                         uint32_t image_size, const uint8_t *md5);
+
 void ota_reboot(void);
 
 
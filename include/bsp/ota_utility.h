@@ -46,6 +46,12 @@ typedef struct {
     uint8_t previous_stable; // Subtype of previous stable app
     uint8_t once; // Partition to boot for the next reboot.
     uint8_t state;
+    // Image verified while it was written, only covered by the digest of the
+    // record if image_subtype is set, erased in records written before it
+    // was added
+    uint32_t image_size;
+    uint8_t image_md5[16];
+    uint8_t image_subtype; // Subtype of the verified app, unknown if none
 } ota_state_t;
 
 pi_err_t ota_utility_get_ota_state_from_partition_table(const pi_partition_table_t table, ota_state_t *ota_state);
@@ -60,5 +66,7 @@ pi_err_t ota_utility_write_ota_data(const flash_partition_table_t *table, ota_st
 
 void ota_utility_init_first_ota_state(ota_state_t *state);
 
+bool ota_utility_image_is_verified(const ota_state_t *state, pi_partition_subtype_t subtype);
+
 #endif //OTA_UTILITY_H
 
@@ -117,6 +117,7 @@ typedef void *pi_partition_table_t;
  * @param flash The flash device in which to fetch the partition table.
  * @param table
  * A reference to the user table variable. if the return code is PI_OK, this pointer contains a reference to the new partition table.
+ * The table is only read from the flash by the first load, the next ones get a reference to the cached table.
  * @return
  * PI_OK on success;
  * PI_ERR_INVALID_ARG if the table pointer is NULL or if the flash device is invalid;
@@ -127,12 +128,35 @@ typedef void *pi_partition_table_t;
  */
 pi_err_t pi_partition_table_load(pi_device_t *flash, const pi_partition_table_t *table);
 
+/**
+ * @brief Open a partition table from a flash device asynchronously.
+ * @param flash The flash device in which to fetch the partition table.
+ * @param table
+ * A reference to the user table variable. if the status is PI_OK when the task is pushed, this pointer contains a reference to the new partition table.
+ * @param status Where the result of the load is stored before the task is pushed, with the same codes as pi_partition_table_load.
+ * @param task The task pushed once the table is loaded.
+ * @return
+ * PI_OK if the load was started, in which case the task is pushed when it is done;
+ * PI_ERR_INVALID_ARG if the table or status pointer is NULL;
+ * PI_ERR_L2_NO_MEM if the allocation of the table in L2 memory fails.
+ */
+pi_err_t pi_partition_table_load_async(pi_device_t *flash, const pi_partition_table_t *table,
+                                       pi_err_t *status, pi_task_t *task);
+
 /**
  * @brief Close an opened partition table from pi_partition_table_load.
+ * The tables are shared between the users of a flash device, the table stays cached once its last user closes it so that the next loads don't read the flash.
  * @param table A reference of the partition table to free.
  */
 void pi_partition_table_free(pi_partition_table_t table);
 
+/**
+ * @brief Drop the cached partition table of a flash device.
+ * This must be called when the partition table is written to the flash, it is done by pi_flash_close when the flash device is closed. The tables which are still opened are freed once they are closed.
+ * @param flash The flash device whose partition table is dropped.
+ */
+void pi_partition_table_invalidate(pi_device_t *flash);
+
 /**
  * @brief Find first partition based on one or more parameters
  *
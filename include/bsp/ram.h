@@ -41,6 +41,20 @@ typedef struct __pi_ram_api_t pi_ram_api_t;
 
 /**@{*/
 
+/** \enum pi_ram_alloc_overflow_e
+ * \brief RAM allocator descriptor pool overflow policy.
+ *
+ * The RAM allocator describes each free chunk of the RAM with a descriptor
+ * taken from a pool allocated when the device is opened. This tells what to
+ * do when a free chunk must be described and the pool is exhausted.
+ */
+typedef enum {
+    PI_RAM_ALLOC_OVERFLOW_L2   = 0, /*!< Allocate the descriptor from the L2
+    heap. */
+    PI_RAM_ALLOC_OVERFLOW_FAIL = 1  /*!< Make the free fail. The chunk is
+    then still owned by the caller. */
+} pi_ram_alloc_overflow_e;
+
 /** \struct pi_ram_conf
  * \brief RAM configuration structure.
  *
@@ -52,6 +66,51 @@ typedef struct __pi_ram_api_t pi_ram_api_t;
 struct pi_ram_conf {
     pi_ram_api_t *api;   /*!< Pointer to specific RAM methods. Reserved for 
     internal runtime usage. */
+    int alloc_nb_chunks; /*!< Number of free chunk descriptors of the
+    allocator pool, 0 for the default. */
+    pi_ram_alloc_overflow_e alloc_overflow; /*!< What to do when the
+    allocator pool is exhausted. */
+};
+
+/** \enum pi_ram_ioctl_e
+ * \brief Command ID for pi_ram_ioctl.
+ *
+ */
+typedef enum {
+    PI_RAM_IOCTL_ALLOC_STATS,      /*!< Command for getting the allocator
+      statistics. The argument must be a pointer to a variable of type
+      struct pi_ram_alloc_stats so that the call is returning them there. */
+    PI_RAM_IOCTL_ALLOC_STATS_RESET /*!< Command for resetting the peak usage
+      and the allocation counters and histogram. The argument is ignored. */
+} pi_ram_ioctl_e;
+
+/** Number of bins of the allocation size histogram. */
+#define PI_RAM_ALLOC_STATS_NB_BINS 16
+
+/** \struct pi_ram_alloc_stats
+ * \brief Parameter for PI_RAM_IOCTL_ALLOC_STATS command.
+ *
+ * This structure is used to return the RAM allocator statistics when
+ * executing the PI_RAM_IOCTL_ALLOC_STATS ioctl command.
+ */
+struct pi_ram_alloc_stats {
+    uint32_t total_free;    /*!< Total size in bytes of the free memory. */
+    uint32_t largest_free;  /*!< Size in bytes of the largest free chunk,
+      which is the biggest allocation which can currently succeed. */
+    uint32_t nb_fragments;  /*!< Number of free chunks. */
+    uint32_t used;          /*!< Size in bytes of the allocated memory. */
+    uint32_t peak_used;     /*!< Highest value reached by used. */
+    uint32_t nb_allocs;     /*!< Number of allocations still not freed. */
+    uint32_t total_allocs;  /*!< Number of successful allocations. */
+    uint32_t failed_allocs; /*!< Number of failed allocations. */
+    uint32_t pool_size;     /*!< Number of free chunk descriptors of the
+      allocator pool. */
+    uint32_t pool_peak;     /*!< Highest number of descriptors used at the
+      same time, including the ones which overflowed to L2. */
+    uint32_t histogram[PI_RAM_ALLOC_STATS_NB_BINS]; /*!< Number of successful
+      allocations per size. Bin 0 counts the allocations smaller than 16
+      bytes, bin i the ones between 2^(i+3) and 2^(i+4)-1 bytes and the last
+      bin all the bigger ones. */
 };
 
 /** \brief RAM cluster copy request structure.
@@ -142,6 +201,21 @@ static inline int pi_ram_alloc(struct pi_device *device, uint32_t *addr,
 static inline int pi_ram_free(struct pi_device *device, uint32_t addr,
   uint32_t size);
 
+/** \brief Dynamically change the device configuration.
+ *
+ * This allows changing the configuration of the device or reading
+ * information from it, see pi_ram_ioctl_e for the available commands.
+ *
+ * \param device    The device structure of the RAM.
+ * \param cmd       The command which specifies which parameters of the driver
+ *   to modify.
+ * \param arg       The argument to the command. The size and meaning of this
+ *   parameter depends on the command which is passed.
+ * \return          0 if the operation was successful, -1 otherwise.
+ */
+static inline int32_t pi_ram_ioctl(struct pi_device *device, uint32_t cmd,
+  void *arg);
+
 /** \brief Enqueue a read copy to the RAM (from RAM to processor).
  *
  * The copy will make a transfer between the RAM and one of the processor
@@ -701,6 +775,7 @@ typedef struct __pi_ram_api_t
     void (*copy_2d_async)(struct pi_device *device, uint32_t pi_ram_addr, void *data, uint32_t size, uint32_t stride, uint32_t length, int ext2loc, pi_task_t *task);
     int (*alloc)(struct pi_device *device, uint32_t *addr, uint32_t size);
     int (*free)(struct pi_device *device, uint32_t addr, uint32_t size);
+    int32_t (*ioctl)(struct pi_device *device, uint32_t cmd, void *arg);
 } pi_ram_api_t;
 
 
@@ -710,6 +785,14 @@ static inline void pi_ram_close(struct pi_device *device)
     api->close(device);
 }
 
+static inline int32_t pi_ram_ioctl(struct pi_device *device, uint32_t cmd, void *arg)
+{
+    pi_ram_api_t *api = (pi_ram_api_t *)device->api;
+    if (api->ioctl == NULL)
+        return -1;
+    return api->ioctl(device, cmd, arg);
+}
+
 static inline void pi_ram_read_async(struct pi_device *device, uint32_t pi_ram_addr, void *data, uint32_t size, pi_task_t *task)
 {
     pi_ram_api_t *api = (pi_ram_api_t *)device->api;
@@ -26,6 +26,96 @@
 #include "bsp/fs.h"
 #include "bsp/fs/readfs.h"
 
+/**
+ * @brief Streaming updater, writing an application image to the next OTA partition.
+ *
+ * The image is pushed by chunks from any source, which are copied into a ring of buffers. The buffers are
+ * programmed in the background while the next chunks are received, and the sectors are erased just ahead of the
+ * programmed area instead of formatting the whole partition first.
+ */
+typedef struct updater_s updater_t;
+
+struct updater_conf
+{
+    uint32_t buffer_size;   /*!< Size of each buffer of the ring, 0 for the default of 2KB. */
+    uint32_t nb_buffers;    /*!< Number of buffers of the ring, 0 for the default of 3. */
+    uint32_t image_size;    /*!< Size of the image if it is known, to stop erasing at its end, 0 otherwise. */
+    const uint8_t *md5;     /*!< If not NULL, expected MD5 digest of the image, from its manifest. The image is hashed
+        while it is received, it is not set as boot partition if the digest differs, and the digest is recorded in
+        the OTA data otherwise. */
+    void (*progress)(void *arg, uint32_t programmed_size, uint32_t image_size); /*!< If not NULL, called each time
+        a buffer is programmed. */
+    void *progress_arg;     /*!< Argument of the progress callback. */
+    uint8_t check_programmed; /*!< If not 0, the programmed image is read back and hashed when the updater is
+        closed, to detect program and erase failures which the flash drivers don't report. This reads the whole
+        partition again, 0 by default. */
+};
+
+struct updater_stats
+{
+    uint32_t received_size;   /*!< Number of bytes pushed to the updater. */
+    uint32_t programmed_size; /*!< Number of bytes programmed. */
+    uint32_t erased_size;     /*!< Number of bytes erased. */
+    uint32_t elapsed_us;      /*!< Time since the updater was opened. */
+    uint32_t throughput;      /*!< Programmed bytes per second since the updater was opened. */
+};
+
+/**
+ * @brief Initialize an updater configuration with default values.
+ * @param conf The configuration to initialize.
+ */
+void updater_conf_init(struct updater_conf *conf);
+
+/**
+ * @brief Start an update of the next OTA partition.
+ * @param updater Where to store the new updater.
+ * @param flash The flash device containing the partitions.
+ * @param conf The updater configuration.
+ * @return PI_OK on success, PI_ERR_NOT_FOUND if there is no OTA partition to update, PI_ERR_INVALID_ARG if the image
+ * does not fit in the partition or PI_ERR_L2_NO_MEM if the updater can't be allocated.
+ */
+pi_err_t updater_open(updater_t **updater, pi_device_t *flash, const struct updater_conf *conf);
+
+/**
+ * @brief Push a chunk of the image asynchronously.
+ *
+ * The task is pushed once the chunk is copied into the ring, so that the data buffer can be reused, which is
+ * immediate if there are enough free buffers. A push must be finished before the next one is started.
+ * @param updater The updater.
+ * @param data The chunk data.
+ * @param size The chunk size.
+ * @param task The task pushed once the data buffer can be reused.
+ * @return PI_OK if the push is started, PI_ERR_INVALID_ARG if the image does not fit in the partition,
+ * PI_ERR_INVALID_STATE if a push is on-going or if a previous error occurred.
+ */
+pi_err_t updater_write_async(updater_t *updater, const void *data, uint32_t size, pi_task_t *task);
+
+/**
+ * @brief Push a chunk of the image, see updater_write_async.
+ * @return PI_OK once the chunk is copied, or the first error of the update.
+ */
+pi_err_t updater_write(updater_t *updater, const void *data, uint32_t size);
+
+/**
+ * @brief Finish an update and free the updater.
+ *
+ * This waits until the whole image is programmed, then checks its size and its digest, which is computed while the
+ * image is received. The image is also read back from the flash if check_programmed is set in the configuration.
+ * @param updater The updater.
+ * @param commit If not 0, the partition is set as boot partition once it is programmed.
+ * @return PI_OK on success, PI_ERR_INVALID_ARG if the received size differs from the image size of the configuration,
+ * PI_ERR_INVALID_CRC if the digest of the image differs from the expected one, PI_FAIL if the programmed image read back
+ * differs from the received one, or the first error of the update.
+ */
+pi_err_t updater_close(updater_t *updater, uint8_t commit);
+
+/**
+ * @brief Get the progress and the throughput of an update.
+ * @param updater The updater.
+ * @param stats Where to store the statistics.
+ */
+void updater_stats_get(updater_t *updater, struct updater_stats *stats);
+
 pi_err_t update_from_fs(pi_device_t *flash, pi_device_t *fs, const char *binary_path);
 
 pi_err_t update_from_readfs(pi_device_t *flash, const char *binary_path);
@@ -0,0 +1,449 @@
+/*
+ * Copyright (C) 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stdio.h"
+#include "stdint.h"
+#include "string.h"
+
+#include "bsp/flash.h"
+#include "bsp/crc/md5.h"
+#include "bsp/ota.h"
+#include "bsp/delta_updater.h"
+
+#define DELTA_BUFF_SIZE 1024
+
+#define DELTA_DEFAULT_BUFFER_SIZE 1024
+
+#define DELTA_STATE_HEADER 0
+#define DELTA_STATE_OP 1
+#define DELTA_STATE_PAYLOAD 2
+
+/*
+ * The patch is parsed as it is received, the header and the operations are
+ * gathered in place until they are complete, the payloads are applied chunk
+ * by chunk.
+ */
+struct delta_updater_s
+{
+    pi_device_t *flash;
+    pi_partition_table_t table;
+    const pi_partition_t *source;
+    updater_t *updater;
+    struct updater_conf updater_conf;
+    
+    uint8_t *buffer;
+    uint32_t buffer_size;
+    
+    uint8_t state;
+    uint32_t fill;
+    delta_header_t header;
+    delta_op_t op;
+    // Number of bytes of the current operation already produced
+    uint32_t op_done;
+    uint32_t target_offset;
+    
+    pi_err_t status;
+    struct delta_updater_stats stats;
+};
+
+// Check that the stable image is the one the patch was made from, the digest
+// recorded when it was written is trusted if it matches the partition
+static pi_err_t delta_check_source(delta_updater_t *delta)
+{
+    pi_err_t rc;
+    ota_state_t ota_state;
+    MD5_CTX context;
+    uint8_t md5[16];
+    uint32_t offset;
+    
+    rc = ota_utility_get_ota_state_from_partition_table(delta->table, &ota_state);
+    if(rc == PI_OK && ota_utility_image_is_verified(&ota_state, delta->source->subtype) &&
+       ota_state.image_size == delta->header.source_size &&
+       !memcmp(ota_state.image_md5, delta->header.source_md5, sizeof(md5)))
+    {
+        PI_LOG_TRC("delta", "Stable image already verified");
+        return PI_OK;
+    }
+    
+    PI_LOG_TRC("delta", "Hash stable image");
+    delta->stats.source_hashed = 1;
+    MD5_Init(&context);
+    for (offset = 0; offset < delta->header.source_size; offset += delta->buffer_size)
+    {
+        uint32_t size = delta->header.source_size - offset;
+        if(size > delta->buffer_size)
+            size = delta->buffer_size;
+        
+        rc = pi_partition_read(delta->source, offset, delta->buffer, size);
+        if(rc != PI_OK)
+            return rc;
+        MD5_Update(&context, delta->buffer, size);
+    }
+    MD5_Final(md5, &context);
+    
+    if(memcmp(md5, delta->header.source_md5, sizeof(md5)))
+    {
+        PI_LOG_ERR("delta", "Stable image differs from the one of the patch.");
+        return PI_ERR_INVALID_CRC;
+    }
+    
+    return PI_OK;
+}
+
+static pi_err_t delta_start(delta_updater_t *delta)
+{
+    pi_err_t rc;
+    
+    if(delta->header.magic != DELTA_MAGIC || delta->header.version != DELTA_VERSION)
+    {
+        PI_LOG_ERR("delta", "Bad patch header, magic 0x%lx version %lu", delta->header.magic,
+                   delta->header.version);
+        return PI_ERR_INVALID_ARG;
+    }
+    
+    if(delta->header.source_size > delta->source->size)
+    {
+        PI_LOG_ERR("delta", "Stable image of %lu bytes does not fit in partition", delta->header.source_size);
+        return PI_ERR_INVALID_ARG;
+    }
+    
+    rc = delta_check_source(delta);
+    if(rc != PI_OK)
+        return rc;
+    
+    delta->updater_conf.image_size = delta->header.target_size;
+    delta->updater_conf.md5 = delta->header.target_md5;
+    rc = updater_open(&delta->updater, delta->flash, &delta->updater_conf);
+    if(rc != PI_OK)
+    {
+        PI_LOG_ERR("delta", "Unable to open updater");
+        return rc;
+    }
+    
+    return PI_OK;
+}
+
+static pi_err_t delta_check_op(delta_updater_t *delta)
+{
+    delta_op_t *op = &delta->op;
+    
+    if(op->size > delta->header.target_size - delta->target_offset)
+    {
+        PI_LOG_ERR("delta", "Operation exceeds new image");
+        return PI_ERR_INVALID_ARG;
+    }
+    
+    switch (op->type)
+    {
+        case DELTA_OP_COPY:
+        case DELTA_OP_ADD:
+            if(op->offset > delta->header.source_size || op->size > delta->header.source_size - op->offset)
+            {
+                PI_LOG_ERR("delta", "Operation exceeds stable image");
+                return PI_ERR_INVALID_ARG;
+            }
+            return PI_OK;
+        
+        case DELTA_OP_DATA:
+            return PI_OK;
+        
+        default:
+            PI_LOG_ERR("delta", "Unknown operation %lu", op->type);
+            return PI_ERR_INVALID_ARG;
+    }
+}
+
+// Produce the next size bytes of the current operation, data is the payload
+// for DELTA_OP_ADD and DELTA_OP_DATA
+static pi_err_t delta_apply(delta_updater_t *delta, const uint8_t *data, uint32_t size)
+{
+    pi_err_t rc;
+    delta_op_t *op = &delta->op;
+    
+    if(op->type == DELTA_OP_DATA)
+    {
+        rc = updater_write(delta->updater, data, size);
+        if(rc != PI_OK)
+            return rc;
+        delta->op_done += size;
+        delta->target_offset += size;
+        delta->stats.data_size += size;
+        return PI_OK;
+    }
+    
+    while (size)
+    {
+        uint32_t chunk = size < delta->buffer_size ? size : delta->buffer_size;
+        
+        rc = pi_partition_read(delta->source, op->offset + delta->op_done, delta->buffer, chunk);
+        if(rc != PI_OK)
+            return rc;
+        
+        if(op->type == DELTA_OP_ADD)
+        {
+            for (uint32_t i = 0; i < chunk; i++)
+                delta->buffer[i] += data[i];
+            data += chunk;
+            delta->stats.added_size += chunk;
+        }
+        else
+        {
+            delta->stats.copied_size += chunk;
+        }
+        
+        // The updater copies the chunk, so the buffer can be reused as soon
+        // as this returns
+        rc = updater_write(delta->updater, delta->buffer, chunk);
+        if(rc != PI_OK)
+            return rc;
+        
+        delta->op_done += chunk;
+        delta->target_offset += chunk;
+        size -= chunk;
+    }
+    
+    return PI_OK;
+}
+
+static pi_err_t delta_parse(delta_updater_t *delta, const uint8_t *data, uint32_t size)
+{
+    pi_err_t rc;
+    
+    while (size)
+    {
+        if(delta->state == DELTA_STATE_PAYLOAD)
+        {
+            uint32_t chunk = delta->op.size - delta->op_done;
+            if(chunk > size)
+                chunk = size;
+            
+            rc = delta_apply(delta, data, chunk);
+            if(rc != PI_OK)
+                return rc;
+            
+            data += chunk;
+            size -= chunk;
+            if(delta->op_done == delta->op.size)
+                delta->state = DELTA_STATE_OP;
+            continue;
+        }
+        
+        // Gather the header or the operation
+        uint8_t *dest = delta->state == DELTA_STATE_HEADER ? (uint8_t *) &delta->header : (uint8_t *) &delta->op;
+        uint32_t total = delta->state == DELTA_STATE_HEADER ? sizeof(delta->header) : sizeof(delta->op);
+        uint32_t chunk = total - delta->fill;
+        if(chunk > size)
+            chunk = size;
+        
+        memcpy(dest + delta->fill, data, chunk);
+        delta->fill += chunk;
+        data += chunk;
+        size -= chunk;
+        if(delta->fill < total)
+            continue;
+        
+        delta->fill = 0;
+        if(delta->state == DELTA_STATE_HEADER)
+        {
+            rc = delta_start(delta);
+            if(rc != PI_OK)
+                return rc;
+            delta->state = DELTA_STATE_OP;
+            continue;
+        }
+        
+        rc = delta_check_op(delta);
+        if(rc != PI_OK)
+            return rc;
+        
+        delta->op_done = 0;
+        if(delta->op.type == DELTA_OP_COPY)
+        {
+            rc = delta_apply(delta, NULL, delta->op.size);
+            if(rc != PI_OK)
+                return rc;
+        }
+        else if(delta->op.size)
+        {
+            delta->state = DELTA_STATE_PAYLOAD;
+        }
+    }
+    
+    return PI_OK;
+}
+
+void delta_updater_conf_init(struct delta_updater_conf *conf)
+{
+    updater_conf_init(&conf->updater);
+    conf->buffer_size = 0;
+}
+
+pi_err_t delta_updater_open(delta_updater_t **delta_ptr, pi_device_t *flash, const struct delta_updater_conf *conf)
+{
+    pi_err_t rc;
+    delta_updater_t *delta;
+    
+    delta = pi_l2_malloc(sizeof(*delta));
+    if(delta == NULL)
+        return PI_ERR_L2_NO_MEM;
+    
+    memset(delta, 0, sizeof(*delta));
+    delta->flash = flash;
+    delta->updater_conf = conf->updater;
+    delta->buffer_size = conf->buffer_size ? conf->buffer_size : DELTA_DEFAULT_BUFFER_SIZE;
+    delta->state = DELTA_STATE_HEADER;
+    
+    PI_LOG_TRC("delta", "Open partition table");
+    rc = pi_partition_table_load(flash, &delta->table);
+    if(rc != PI_OK)
+    {
+        PI_LOG_ERR("delta", "Unable to load partition table");
+        goto free_delta;
+    }
+    
+    delta->source = ota_get_stable_partition(delta->table);
+    if(delta->source == NULL)
+    {
+        PI_LOG_ERR("delta", "Unable to find stable partition");
+        rc = PI_ERR_NOT_FOUND;
+        goto free_table;
+    }
+    
+    PI_LOG_INF("delta", "Stable partition subtype %u", delta->source->subtype);
+    
+    delta->buffer = pi_l2_malloc(delta->buffer_size);
+    if(delta->buffer == NULL)
+    {
+        PI_LOG_ERR("delta", "Unable to allocate buffer into l2.");
+        rc = PI_ERR_L2_NO_MEM;
+        goto free_partition;
+    }
+    
+    delta->status = PI_OK;
+    *delta_ptr = delta;
+    return PI_OK;
+    
+    free_partition:
+    pi_partition_close(delta->source);
+    free_table:
+    pi_partition_table_free(delta->table);
+    free_delta:
+    pi_l2_free(delta, sizeof(*delta));
+    return rc;
+}
+
+pi_err_t delta_updater_write(delta_updater_t *delta, const void *data, uint32_t size)
+{
+    if(delta->status != PI_OK)
+        return delta->status;
+    
+    delta->stats.patch_size += size;
+    delta->status = delta_parse(delta, data, size);
+    return delta->status;
+}
+
+pi_err_t delta_updater_close(delta_updater_t *delta, uint8_t commit)
+{
+    pi_err_t rc = delta->status;
+    
+    if(rc == PI_OK && (delta->state != DELTA_STATE_OP || delta->fill ||
+                       delta->target_offset != delta->header.target_size))
+    {
+        PI_LOG_ERR("delta", "Patch is truncated");
+        rc = PI_ERR_INVALID_ARG;
+    }
+    
+    if(delta->updater)
+    {
+        pi_err_t updater_rc = updater_close(delta->updater, rc == PI_OK && commit);
+        if(rc == PI_OK)
+            rc = updater_rc;
+    }
+    
+    PI_LOG_INF("delta", "Patch of %lu bytes applied, %lu bytes copied, %lu added, %lu from patch",
+               delta->stats.patch_size, delta->stats.copied_size, delta->stats.added_size, delta->stats.data_size);
+    
+    pi_l2_free(delta->buffer, delta->buffer_size);
+    pi_partition_close(delta->source);
+    pi_partition_table_free(delta->table);
+    pi_l2_free(delta, sizeof(*delta));
+    
+    return rc;
+}
+
+void delta_updater_stats_get(delta_updater_t *delta, struct delta_updater_stats *stats)
+{
+    *stats = delta->stats;
+}
+
+pi_err_t delta_update_from_fs(pi_device_t *flash, pi_device_t *fs, const char *patch_path)
+{
+    pi_err_t rc;
+    pi_fs_file_t *file;
+    delta_updater_t *delta;
+    struct delta_updater_conf conf;
+    uint8_t *buff;
+    int32_t read_size;
+    
+    PI_LOG_TRC("delta", "Open file %s", patch_path);
+    file = pi_fs_open(fs, patch_path, 0);
+    if(file == NULL)
+    {
+        PI_LOG_ERR("delta", "Error to open '%s' file", patch_path);
+        return PI_FAIL;
+    }
+    
+    buff = pi_l2_malloc(DELTA_BUFF_SIZE);
+    if(buff == NULL)
+    {
+        PI_LOG_ERR("delta", "Unable to allocate buff into l2.");
+        rc = PI_ERR_L2_NO_MEM;
+        goto close_file_and_return;
+    }
+    
+    delta_updater_conf_init(&conf);
+    rc = delta_updater_open(&delta, flash, &conf);
+    if(rc != PI_OK)
+    {
+        rc = PI_FAIL;
+        goto free_and_return;
+    }
+    
+    PI_LOG_TRC("delta", "Apply patch");
+    while ((read_size = pi_fs_read(file, buff, DELTA_BUFF_SIZE)) > 0)
+    {
+        rc = delta_updater_write(delta, buff, read_size);
+        if(rc != PI_OK)
+            break;
+    }
+    
+    if(read_size < 0)
+    {
+        PI_LOG_ERR("delta", "Unable to read '%s' file", patch_path);
+        rc = PI_FAIL;
+    }
+    
+    rc = delta_updater_close(delta, rc == PI_OK);
+    if(rc != PI_OK)
+        rc = PI_FAIL;
+    
+    free_and_return:
+    pi_l2_free(buff, DELTA_BUFF_SIZE);
+    close_file_and_return:
+    pi_fs_close(file);
+    
+    return rc;
+}
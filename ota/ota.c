@@ -108,6 +108,34 @@ const pi_partition_t *ota_get_next_ota_partition(const pi_partition_table_t tabl
     return next_partition;
 }
 
+const pi_partition_t *ota_get_stable_partition(const pi_partition_table_t table)
+{
+    pi_err_t rc;
+    pi_partition_subtype_t stable_partition_type;
+    const pi_partition_t *stable_partition;
+    ota_state_t ota_state;
+    
+    rc = ota_utility_get_ota_state_from_partition_table(table, &ota_state);
+    if(rc != PI_OK)
+    {
+        ota_utility_init_first_ota_state(&ota_state);
+    }
+    
+    // Same as ota_get_next_free_ota_slot, no stable app means the factory one
+    stable_partition_type = ota_state.stable;
+    if(stable_partition_type == PI_PARTITION_SUBTYPE_UNKNOWN)
+        stable_partition_type = PI_PARTITION_SUBTYPE_APP_FACTORY;
+    
+    stable_partition = pi_partition_find_first(table, PI_PARTITION_TYPE_APP, stable_partition_type, NULL);
+    if(stable_partition == NULL)
+    {
+        PI_LOG_ERR("ota", "Unable to load partition type %d", stable_partition_type);
+        return NULL;
+    }
+    
+    return stable_partition;
+}
+
 pi_err_t ota_set_once_boot_partition(const pi_partition_table_t table, const pi_partition_t *partition)
 {
     pi_err_t rc = PI_OK;
@@ -163,6 +191,12 @@ pi_err_t ota_set_once_boot_partition(const pi_partition_table_t table, const pi_
 }
 
 pi_err_t ota_set_boot_partition(const pi_partition_table_t table, const pi_partition_t *partition)
+{
+    return ota_set_boot_partition_verified(table, partition, 0, NULL);
+}
+
+pi_err_t ota_set_boot_partition_verified(const pi_partition_table_t table, const pi_partition_t *partition,
+                                         uint32_t image_size, const uint8_t *md5)
 {
     pi_err_t rc = PI_OK;
     const pi_partition_t *ota_data_partition = NULL;
@@ -224,6 +258,16 @@ pi_err_t ota_set_boot_partition(const pi_partition_table_t table, const pi_parti
     
     ota_state.state = PI_OTA_IMG_NEW;
     ota_state.once = partition->subtype;
+    
+    // The previous digest doesn't match the new image
+    ota_state.image_subtype = PI_PARTITION_SUBTYPE_UNKNOWN;
+    if(md5)
+    {
+        ota_state.image_subtype = partition->subtype;
+        ota_state.image_size = image_size;
+        memcpy(ota_state.image_md5, md5, sizeof(ota_state.image_md5));
+    }
+    
     rc = ota_utility_write_ota_data(table, &ota_state);
     if(rc != PI_OK)
     {
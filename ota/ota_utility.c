@@ -51,7 +51,7 @@ pi_err_t ota_utility_get_ota_state_from_partition_table(const pi_partition_table
     return ota_utility_get_ota_state(flash_table->flash, ota_data_partition->pos.offset, ota_state);
 }
 
-void ota_utility_compute_md5(const ota_state_t *state, uint8_t *res)
+static void ota_utility_compute_state_md5(const ota_state_t *state, bool with_image, uint8_t *res)
 {
     MD5_CTX context;
     MD5_Init(&context);
@@ -61,10 +61,23 @@ void ota_utility_compute_md5(const ota_state_t *state, uint8_t *res)
     MD5_Update(&context, &state->previous_stable, sizeof(state->previous_stable));
     MD5_Update(&context, &state->once, sizeof(state->once));
     MD5_Update(&context, &state->state, sizeof(state->state));
+    if(with_image)
+    {
+        MD5_Update(&context, &state->image_size, sizeof(state->image_size));
+        MD5_Update(&context, state->image_md5, sizeof(state->image_md5));
+        MD5_Update(&context, &state->image_subtype, sizeof(state->image_subtype));
+    }
     
     MD5_Final(res, &context);
 }
 
+// The image fields are only hashed if an image was verified, so that records
+// without one keep the digest understood by the bootloaders already deployed
+void ota_utility_compute_md5(const ota_state_t *state, uint8_t *res)
+{
+    ota_utility_compute_state_md5(state, state->image_subtype != PI_PARTITION_SUBTYPE_UNKNOWN, res);
+}
+
 bool ota_utility_state_is_valid(ota_state_t *state)
 {
     uint8_t res[16] = {0};
@@ -94,6 +107,12 @@ void ota_utility_init_first_ota_state(ota_state_t *state)
     state->stable = PI_PARTITION_SUBTYPE_UNKNOWN;
     state->previous_stable = PI_PARTITION_SUBTYPE_UNKNOWN;
     state->state = PI_OTA_IMG_UNDEFINED;
+    state->image_subtype = PI_PARTITION_SUBTYPE_UNKNOWN;
+}
+
+bool ota_utility_image_is_verified(const ota_state_t *state, pi_partition_subtype_t subtype)
+{
+    return subtype != PI_PARTITION_SUBTYPE_UNKNOWN && state->image_subtype == subtype;
 }
 
 pi_err_t
@@ -20,19 +20,522 @@
 
 #include "stdio.h"
 #include "stdint.h"
+#include "string.h"
 
+#include "bsp/flash.h"
+#include "bsp/crc/md5.h"
 #include "bsp/ota.h"
 #include "bsp/updater.h"
 
 #define UPDATER_BUFF_SIZE 1024
 
+#define UPDATER_DEFAULT_BUFFER_SIZE 2048
+#define UPDATER_DEFAULT_NB_BUFFERS 3
+
+#define UPDATER_OP_ERASE 0
+#define UPDATER_OP_PROGRAM 1
+
+/*
+ * The buffers from tail to head are full and waiting to be programmed, the
+ * head buffer is being filled. The flash operations are chained from their
+ * completion callbacks. Only the ring and state bookkeeping is done with
+ * interrupts disabled, the data is hashed, copied and programmed outside.
+ */
+struct updater_s
+{
+    pi_device_t *flash;
+    pi_partition_table_t table;
+    const pi_partition_t *partition;
+    uint32_t sector_size;
+    uint32_t image_size;
+    // Erase limit, the end of the image if its size is known
+    uint32_t erase_end;
+    
+    uint8_t *buffers;
+    uint32_t buffer_size;
+    uint32_t nb_buffers;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t nb_full;
+    uint32_t fill;
+    // Size of the last buffer, which is only partially filled
+    uint32_t last_size;
+    // Set while the pending data is copied, by the writer or a flash callback
+    uint8_t filling;
+    
+    uint32_t write_offset;
+    uint32_t erase_offset;
+    uint8_t busy;
+    uint8_t op;
+    uint32_t op_size;
+    pi_task_t flash_task;
+    
+    // Push waiting for free buffers
+    const uint8_t *pending_data;
+    uint32_t pending_size;
+    pi_task_t *pending_task;
+    
+    pi_task_t *flush_task;
+    pi_err_t status;
+    
+    // The image is hashed as it is received
+    MD5_CTX md5_ctx;
+    uint8_t md5[16];
+    uint8_t verify;
+    uint8_t check_programmed;
+    
+    uint32_t received_size;
+    uint32_t erased_size;
+    uint32_t start_us;
+    void (*progress)(void *arg, uint32_t programmed_size, uint32_t image_size);
+    void *progress_arg;
+};
+
+static void updater_flash_done(void *arg);
+
+// Once an error occurred, nothing is programmed anymore and the waiting
+// pushes and flush are released, the error is returned by updater_close
+static void updater_release(updater_t *updater)
+{
+    pi_task_t *task;
+    
+    updater->pending_size = 0;
+    if(updater->pending_task)
+    {
+        task = updater->pending_task;
+        updater->pending_task = NULL;
+        pi_task_push(task);
+    }
+    
+    if(updater->flush_task)
+    {
+        task = updater->flush_task;
+        updater->flush_task = NULL;
+        pi_task_push(task);
+    }
+}
+
+static void updater_kick(updater_t *updater)
+{
+    pi_err_t rc;
+    uint8_t *buffer = NULL;
+    uint32_t offset;
+    uint32_t size = 0;
+    uint32_t erase_ahead;
+    int irq = hal_irq_disable();
+    
+    if(updater->busy)
+        goto unlock;
+    
+    if(updater->status != PI_OK)
+    {
+        updater_release(updater);
+        goto unlock;
+    }
+    
+    if(updater->nb_full)
+    {
+        size = (updater->nb_full == 1 && updater->last_size) ? updater->last_size : updater->buffer_size;
+        
+        if(updater->erase_offset < updater->write_offset + size)
+            goto erase;
+        
+        updater->busy = 1;
+        updater->op = UPDATER_OP_PROGRAM;
+        updater->op_size = size;
+        offset = updater->write_offset;
+        buffer = updater->buffers + updater->tail * updater->buffer_size;
+        goto start;
+    }
+    
+    if(updater->flush_task)
+    {
+        pi_task_t *task = updater->flush_task;
+        updater->flush_task = NULL;
+        pi_task_push(task);
+        goto unlock;
+    }
+    
+    // Nothing to program, erase the sectors which will be needed by the
+    // buffers being received
+    erase_ahead = updater->write_offset + updater->nb_buffers * updater->buffer_size;
+    if(updater->erase_offset >= erase_ahead || updater->erase_offset >= updater->erase_end)
+        goto unlock;
+    
+    erase:
+    updater->busy = 1;
+    updater->op = UPDATER_OP_ERASE;
+    updater->op_size = updater->sector_size;
+    if(updater->op_size > updater->partition->size - updater->erase_offset)
+        updater->op_size = updater->partition->size - updater->erase_offset;
+    offset = updater->erase_offset;
+    
+    // The busy flag keeps the operation and its offsets unchanged until it
+    // is done, it can be started with interrupts enabled
+    start:
+    hal_irq_restore(irq);
+    
+    if(buffer)
+        rc = pi_partition_write_async(updater->partition, offset, buffer, updater->op_size,
+                                      pi_task_callback(&updater->flash_task, updater_flash_done, updater));
+    else
+        rc = pi_partition_erase_async(updater->partition, offset, updater->op_size,
+                                      pi_task_callback(&updater->flash_task, updater_flash_done, updater));
+    if(rc == PI_OK)
+        return;
+    
+    PI_LOG_ERR("updater", "Unable to %s flash at 0x%lx", buffer ? "program" : "erase", offset);
+    irq = hal_irq_disable();
+    updater->busy = 0;
+    updater->status = rc;
+    updater_release(updater);
+    
+    unlock:
+    hal_irq_restore(irq);
+}
+
+// Copy the pending data into the free buffers of the ring
+static void updater_fill(updater_t *updater)
+{
+    int irq = hal_irq_disable();
+    
+    // The writer and the flash callbacks may both try to copy the pending
+    // data, the first one copies everything which fits
+    if(updater->filling)
+    {
+        hal_irq_restore(irq);
+        return;
+    }
+    updater->filling = 1;
+    
+    while (updater->status == PI_OK && updater->pending_size && updater->nb_full < updater->nb_buffers)
+    {
+        uint8_t *dest = updater->buffers + updater->head * updater->buffer_size + updater->fill;
+        const uint8_t *src = updater->pending_data;
+        uint32_t size = updater->buffer_size - updater->fill;
+        if(size > updater->pending_size)
+            size = updater->pending_size;
+        
+        // The head buffer is not full, so it is not being programmed
+        hal_irq_restore(irq);
+        memcpy(dest, src, size);
+        irq = hal_irq_disable();
+        
+        updater->fill += size;
+        updater->pending_data += size;
+        updater->pending_size -= size;
+        
+        if(updater->fill == updater->buffer_size)
+        {
+            updater->nb_full++;
+            updater->head = (updater->head + 1) % updater->nb_buffers;
+            updater->fill = 0;
+        }
+    }
+    
+    updater->filling = 0;
+    
+    if(updater->pending_size == 0 && updater->pending_task)
+    {
+        pi_task_t *task = updater->pending_task;
+        updater->pending_task = NULL;
+        pi_task_push(task);
+    }
+    
+    hal_irq_restore(irq);
+    
+    updater_kick(updater);
+}
+
+static void updater_flash_done(void *arg)
+{
+    updater_t *updater = (updater_t *) arg;
+    int irq = hal_irq_disable();
+    
+    updater->busy = 0;
+    
+    if(updater->op == UPDATER_OP_ERASE)
+    {
+        updater->erase_offset += updater->op_size;
+        updater->erased_size += updater->op_size;
+        hal_irq_restore(irq);
+        updater_kick(updater);
+        return;
+    }
+    
+    updater->write_offset += updater->op_size;
+    updater->tail = (updater->tail + 1) % updater->nb_buffers;
+    updater->nb_full--;
+    hal_irq_restore(irq);
+    
+    if(updater->progress)
+        updater->progress(updater->progress_arg, updater->write_offset, updater->image_size);
+    
+    updater_fill(updater);
+}
+
+void updater_conf_init(struct updater_conf *conf)
+{
+    conf->buffer_size = 0;
+    conf->nb_buffers = 0;
+    conf->image_size = 0;
+    conf->md5 = NULL;
+    conf->progress = NULL;
+    conf->progress_arg = NULL;
+    conf->check_programmed = 0;
+}
+
+pi_err_t updater_open(updater_t **updater_ptr, pi_device_t *flash, const struct updater_conf *conf)
+{
+    pi_err_t rc;
+    updater_t *updater;
+    struct pi_flash_info flash_info;
+    
+    updater = pi_l2_malloc(sizeof(*updater));
+    if(updater == NULL)
+        return PI_ERR_L2_NO_MEM;
+    
+    memset(updater, 0, sizeof(*updater));
+    updater->flash = flash;
+    updater->buffer_size = conf->buffer_size ? conf->buffer_size : UPDATER_DEFAULT_BUFFER_SIZE;
+    updater->nb_buffers = conf->nb_buffers ? conf->nb_buffers : UPDATER_DEFAULT_NB_BUFFERS;
+    updater->image_size = conf->image_size;
+    updater->progress = conf->progress;
+    updater->progress_arg = conf->progress_arg;
+    updater->check_programmed = conf->check_programmed;
+    if(conf->md5)
+    {
+        updater->verify = 1;
+        memcpy(updater->md5, conf->md5, sizeof(updater->md5));
+    }
+    MD5_Init(&updater->md5_ctx);
+    
+    PI_LOG_TRC("updater", "Open partition table");
+    rc = pi_partition_table_load(flash, &updater->table);
+    if(rc != PI_OK)
+    {
+        PI_LOG_ERR("updater", "Unable to load partition table");
+        goto free_updater;
+    }
+    
+    updater->partition = ota_get_next_ota_partition(updater->table);
+    if(updater->partition == NULL)
+    {
+        PI_LOG_ERR("updater", "Unable to find next update partition");
+        rc = PI_ERR_NOT_FOUND;
+        goto free_table;
+    }
+    
+    PI_LOG_INF("updater", "Next partition subtype %u", updater->partition->subtype);
+    
+    updater->erase_end = updater->partition->size;
+    if(updater->image_size)
+    {
+        if(updater->image_size > updater->partition->size)
+        {
+            PI_LOG_ERR("updater", "Image of %lu bytes does not fit in partition", updater->image_size);
+            rc = PI_ERR_INVALID_ARG;
+            goto free_partition;
+        }
+        updater->erase_end = updater->image_size;
+    }
+    
+    pi_flash_ioctl(flash, PI_FLASH_IOCTL_INFO, &flash_info);
+    updater->sector_size = flash_info.sector_size;
+    
+    updater->buffers = pi_l2_malloc(updater->buffer_size * updater->nb_buffers);
+    if(updater->buffers == NULL)
+    {
+        PI_LOG_ERR("updater", "Unable to allocate buffers into l2.");
+        rc = PI_ERR_L2_NO_MEM;
+        goto free_partition;
+    }
+    
+    updater->status = PI_OK;
+    updater->start_us = pi_time_get_us();
+    *updater_ptr = updater;
+    
+    // Start erasing while the first chunks are received
+    updater_kick(updater);
+    
+    return PI_OK;
+    
+    free_partition:
+    pi_partition_close(updater->partition);
+    free_table:
+    pi_partition_table_free(updater->table);
+    free_updater:
+    pi_l2_free(updater, sizeof(*updater));
+    return rc;
+}
+
+pi_err_t updater_write_async(updater_t *updater, const void *data, uint32_t size, pi_task_t *task)
+{
+    pi_err_t rc = PI_OK;
+    int irq = hal_irq_disable();
+    
+    if(updater->status != PI_OK || updater->pending_task)
+    {
+        rc = PI_ERR_INVALID_STATE;
+    }
+    else if(updater->received_size + size > updater->partition->size)
+    {
+        PI_LOG_ERR("updater", "Image does not fit in partition");
+        updater->status = PI_ERR_INVALID_ARG;
+        rc = PI_ERR_INVALID_ARG;
+    }
+    
+    hal_irq_restore(irq);
+    if(rc != PI_OK)
+        return rc;
+    
+    // Only the writer updates the digest, the chunk is hashed before it is
+    // made pending, as it can be released as soon as it is copied
+    MD5_Update(&updater->md5_ctx, data, size);
+    
+    irq = hal_irq_disable();
+    updater->received_size += size;
+    updater->pending_data = data;
+    updater->pending_size = size;
+    updater->pending_task = task;
+    hal_irq_restore(irq);
+    
+    updater_fill(updater);
+    
+    return PI_OK;
+}
+
+pi_err_t updater_write(updater_t *updater, const void *data, uint32_t size)
+{
+    pi_err_t rc;
+    pi_task_t task;
+    
+    rc = updater_write_async(updater, data, size, pi_task_block(&task));
+    if(rc != PI_OK)
+        return rc;
+    
+    pi_task_wait_on(&task);
+    return updater->status;
+}
+
+// The flash drivers don't report program and erase failures, if requested the
+// programmed image is read back and compared with the received one
+static pi_err_t updater_check_programmed(updater_t *updater, const uint8_t *md5)
+{
+    pi_err_t rc;
+    MD5_CTX md5_ctx;
+    uint8_t programmed_md5[16];
+    uint32_t ring_size = updater->buffer_size * updater->nb_buffers;
+    
+    MD5_Init(&md5_ctx);
+    for (uint32_t offset = 0; offset < updater->write_offset; offset += ring_size)
+    {
+        uint32_t size = updater->write_offset - offset;
+        if(size > ring_size)
+            size = ring_size;
+        
+        rc = pi_partition_read(updater->partition, offset, updater->buffers, size);
+        if(rc != PI_OK)
+            return rc;
+        MD5_Update(&md5_ctx, updater->buffers, size);
+    }
+    MD5_Final(programmed_md5, &md5_ctx);
+    
+    if(memcmp(programmed_md5, md5, sizeof(programmed_md5)))
+    {
+        PI_LOG_ERR("updater", "Programmed image differs from the received one.");
+        return PI_FAIL;
+    }
+    
+    return PI_OK;
+}
+
+pi_err_t updater_close(updater_t *updater, uint8_t commit)
+{
+    pi_err_t rc;
+    pi_task_t task;
+    int irq = hal_irq_disable();
+    
+    // The last buffer is programmed even if it is not full
+    if(updater->fill)
+    {
+        updater->last_size = updater->fill;
+        updater->nb_full++;
+        updater->head = (updater->head + 1) % updater->nb_buffers;
+        updater->fill = 0;
+    }
+    
+    updater->flush_task = pi_task_block(&task);
+    hal_irq_restore(irq);
+    
+    updater_kick(updater);
+    pi_task_wait_on(&task);
+    
+    PI_LOG_INF("updater", "Transfered %lu bytes to partition.", updater->write_offset);
+    
+    rc = updater->status;
+    if(rc == PI_OK && updater->image_size && updater->received_size != updater->image_size)
+    {
+        PI_LOG_ERR("updater", "Received %lu bytes instead of %lu.", updater->received_size, updater->image_size);
+        rc = PI_ERR_INVALID_ARG;
+    }
+    
+    if(rc == PI_OK)
+    {
+        uint8_t md5[16];
+        
+        MD5_Final(md5, &updater->md5_ctx);
+        if(updater->verify && memcmp(md5, updater->md5, sizeof(md5)))
+        {
+            PI_LOG_ERR("updater", "Image digest differs from the expected one.");
+            rc = PI_ERR_INVALID_CRC;
+        }
+        
+        if(rc == PI_OK && updater->check_programmed)
+            rc = updater_check_programmed(updater, md5);
+    }
+    
+    if(rc == PI_OK && commit)
+    {
+        PI_LOG_INF("updater", "Set boot partition.");
+        if(updater->verify)
+            rc = ota_set_boot_partition_verified(updater->table, updater->partition, updater->received_size,
+                                                 updater->md5);
+        else
+            rc = ota_set_boot_partition(updater->table, updater->partition);
+        if(rc != PI_OK)
+        {
+            PI_LOG_ERR("updater", "Unable to set next boot partition.");
+        }
+    }
+    
+    pi_l2_free(updater->buffers, updater->buffer_size * updater->nb_buffers);
+    pi_partition_close(updater->partition);
+    pi_partition_table_free(updater->table);
+    pi_l2_free(updater, sizeof(*updater));
+    
+    return rc;
+}
+
+void updater_stats_get(updater_t *updater, struct updater_stats *stats)
+{
+    stats->received_size = updater->received_size;
+    stats->programmed_size = updater->write_offset;
+    stats->erased_size = updater->erased_size;
+    stats->elapsed_us = pi_time_get_us() - updater->start_us;
+    stats->throughput = 0;
+    if(stats->elapsed_us)
+        stats->throughput = (uint64_t) stats->programmed_size * 1000000 / stats->elapsed_us;
+}
+
 pi_err_t update_from_fs(pi_device_t *flash, pi_device_t *fs, const char *binary_path)
 {
     pi_err_t rc;
     pi_fs_file_t *file;
-    const pi_partition_table_t table;
-    const pi_partition_t *ota;
+    updater_t *updater;
+    struct updater_conf conf;
     uint8_t *buff;
+    int32_t read_size;
     
     PI_LOG_TRC("updater", "Open file %s", binary_path);
     file = pi_fs_open(fs, binary_path, 0);
@@ -43,60 +546,44 @@ pi_err_t update_from_fs(pi_device_t *flash, pi_device_t *fs, const char *binary_
         return rc;
     }
     
-    PI_LOG_TRC("updater", "Open partition table");
-    rc = pi_partition_table_load(flash, &table);
-    if(rc != PI_OK)
+    buff = pi_l2_malloc(UPDATER_BUFF_SIZE);
+    if(buff == NULL)
     {
-        PI_LOG_ERR("updater", "Unable to load partition table");
-        rc = PI_FAIL;
+        PI_LOG_ERR("updater", "Unable to allocate buff into l2.");
+        rc = PI_ERR_L2_NO_MEM;
         goto close_file_and_return;
     }
     
-    ota = ota_get_next_ota_partition(table);
-    if(ota == NULL)
+    updater_conf_init(&conf);
+    conf.image_size = file->size;
+    rc = updater_open(&updater, flash, &conf);
+    if(rc != PI_OK)
     {
-        PI_LOG_ERR("updater", "Unable to find next update partition");
         rc = PI_FAIL;
-        goto close_table_and_return;
+        goto free_and_return;
     }
     
-    PI_LOG_INF("updater", "Next partition subtype %u", ota->subtype);
-    PI_LOG_TRC("updater", "Format partition");
-    pi_partition_format(ota);
-    
+    // The file is read while the previous chunks are programmed
     PI_LOG_TRC("updater", "Copy data");
-    buff = pi_l2_malloc(UPDATER_BUFF_SIZE);
-    if(buff == NULL)
+    while ((read_size = pi_fs_read(file, buff, UPDATER_BUFF_SIZE)) > 0)
     {
-        PI_LOG_ERR("updater", "Unable to allocate buff into l2.");
-        rc = PI_ERR_L2_NO_MEM;
-        goto close_partition_and_return;
+        rc = updater_write(updater, buff, read_size);
+        if(rc != PI_OK)
+            break;
     }
     
-    size_t read_size, total_size = 0, i = 0;
-    while ((read_size = pi_fs_read(file, buff, UPDATER_BUFF_SIZE)))
+    if(read_size < 0)
     {
-        pi_partition_write(ota, i * UPDATER_BUFF_SIZE, buff, read_size);
-        total_size += read_size;
-        i++;
+        PI_LOG_ERR("updater", "Unable to read '%s' file", binary_path);
+        rc = PI_FAIL;
     }
-    PI_LOG_INF("updater", "Transfered %lu bytes to partition.", total_size);
     
-    PI_LOG_INF("updater", "Set boot partition.");
-    rc = ota_set_boot_partition(table, ota);
+    rc = updater_close(updater, rc == PI_OK);
     if(rc != PI_OK)
-    {
-        PI_LOG_ERR("updater", "Unable to set next boot partition.");
         rc = PI_FAIL;
-        goto free_and_return;
-    }
     
     free_and_return:
     pi_l2_free(buff, UPDATER_BUFF_SIZE);
-    close_partition_and_return:
-    pi_partition_close(ota);
-    close_table_and_return:
-    pi_partition_table_free(table);
     close_file_and_return:
     pi_fs_close(file);
     
@@ -111,111 +111,194 @@ pi_err_t flash_partition_table_verify(const flash_partition_table_t *table)
     return PI_OK;
 }
 
-pi_err_t flash_partition_table_load(pi_device_t *flash, const flash_partition_table_t **partition_table,
-                                    uint8_t *nbr_of_entries)
+// State of an asynchronous partition table load, allocated for the duration
+// of the load
+typedef struct {
+    pi_device_t *flash;
+    const flash_partition_table_t **partition_table;
+    flash_partition_table_t *table;
+    uint32_t *table_offset_l2;
+    uint32_t table_offset;
+    pi_err_t *status;
+    int step;
+    pi_task_t step_task;
+    pi_task_t *task;
+} flash_partition_table_loader_t;
+
+static void flash_partition_table_load_step(void *arg);
+
+// The next step is set before the flash access is started, as its callback
+// may be executed before the access function returns
+static inline pi_task_t *flash_partition_table_load_task(flash_partition_table_loader_t *loader, int step)
+{
+    loader->step = step;
+    return pi_task_callback(&loader->step_task, flash_partition_table_load_step, loader);
+}
+
+static void flash_partition_table_load_step(void *arg)
 {
+    flash_partition_table_loader_t *loader = (flash_partition_table_loader_t *) arg;
+    flash_partition_table_t *table = loader->table;
     pi_err_t rc = PI_OK;
-    uint32_t *table_offset_l2 = NULL;
-    uint32_t _table_offset;
+
+    switch (loader->step)
+    {
+        case 0:
+            pi_flash_read_async(loader->flash, 0, loader->table_offset_l2, 4,
+                                flash_partition_table_load_task(loader, 1));
+            break;
+
+        case 1:
+            if(*loader->table_offset_l2 == 0)
+            {
+                PARTITION_TRACE_ERR("Partition table offset not found in flash.");
+                rc = PI_ERR_NOT_FOUND;
+                goto mount_error;
+            }
+
+            PARTITION_TRACE_TRC("Partition table offset 0x%lx", *loader->table_offset_l2);
+            loader->table_offset = *loader->table_offset_l2;
+            pi_l2_free(loader->table_offset_l2, sizeof(*loader->table_offset_l2));
+            loader->table_offset_l2 = NULL;
+
+            // Load table header
+            pi_flash_read_async(loader->flash, loader->table_offset, &table->header, sizeof(flash_partition_table_header_t),
+                                flash_partition_table_load_task(loader, 2));
+            break;
+
+        case 2:
+//print_partition_header(&table->header);
+
+            if(table->header.magic_bytes != PI_PARTITION_TABLE_HEADER_MAGIC)
+            {
+                PARTITION_TRACE_ERR("Partition table header magic number error\n");
+                rc = PI_ERR_NOT_FOUND;
+                goto mount_error;
+            }
+
+            if(table->header.format_version != PI_PARTITION_TABLE_FORMAT_VERSION)
+            {
+                PARTITION_TRACE_ERR("Partition table format version missmatch: flash version %u != BSP version %u\n",
+                           table->header.format_version,
+                           PI_PARTITION_TABLE_FORMAT_VERSION);
+                rc = PI_ERR_INVALID_VERSION;
+                goto mount_error;
+            }
+
+            // Alloc partition entries
+            table->partitions = pi_l2_malloc(sizeof(flash_partition_info_t) * table->header.nbr_of_entries);
+            if(table->partitions == NULL)
+            {
+                PARTITION_TRACE_ERR("Unable to allocate partition table entries.");
+                rc = PI_ERR_L2_NO_MEM;
+                goto mount_error;
+            }
+
+            pi_flash_read_async(loader->flash, loader->table_offset + PI_PARTITION_HEADER_SIZE, table->partitions,
+                                sizeof(flash_partition_info_t) * table->header.nbr_of_entries,
+                                flash_partition_table_load_task(loader, 3));
+            break;
+
+        case 3:
+            if(table->header.crc_flags)
+            {
+                rc = flash_partition_table_verify(table);
+                if(rc != PI_OK)
+                {
+                    PARTITION_TRACE_ERR("Partitions table verification failed.\n");
+                    pi_l2_free(table->partitions, sizeof(flash_partition_info_t) * table->header.nbr_of_entries);
+                    goto mount_error;
+                }
+            }
+
+            table->flash = loader->flash;
+            *loader->partition_table = table;
+            goto done;
+    }
+
+    return;
+
+    mount_error:
+    if(loader->table_offset_l2)
+        pi_l2_free(loader->table_offset_l2, sizeof(*loader->table_offset_l2));
+    pi_l2_free(table, sizeof(*table));
+    done:
+    *loader->status = rc;
+    pi_task_push(loader->task);
+    pi_l2_free(loader, sizeof(*loader));
+}
+
+pi_err_t flash_partition_table_load_async(pi_device_t *flash, const flash_partition_table_t **partition_table,
+                                          pi_err_t *status, pi_task_t *task)
+{
+    flash_partition_table_loader_t *loader = NULL;
     flash_partition_table_t *table = NULL;
-    flash_partition_info_t *partitions = NULL;
+    uint32_t *table_offset_l2 = NULL;
 
-    if(partition_table == NULL)
+    if(partition_table == NULL || status == NULL)
     {
         PARTITION_TRACE_ERR("Table argument is NULL");
         return PI_ERR_INVALID_ARG;
     }
 
+    loader = pi_l2_malloc(sizeof(*loader));
+    if(loader == NULL)
+        goto alloc_error;
+
 // Alloc table containing header
     table = pi_l2_malloc(sizeof(*table));
     if(table == NULL)
     {
         PARTITION_TRACE_ERR("Unable to allocate partition table in L2.");
-        rc = PI_ERR_L2_NO_MEM;
-        goto mount_error;
+        goto alloc_error;
     }
 
     table_offset_l2 = pi_l2_malloc(sizeof(*table_offset_l2));
     if(table_offset_l2 == NULL)
     {
         PARTITION_TRACE_ERR("Unable to allocate table offset variable in L2.");
-        rc = PI_ERR_L2_NO_MEM;
-        goto mount_error;
-    }
-
-    pi_flash_read(flash, 0, table_offset_l2, 4);
-    if(*table_offset_l2 == 0)
-    {
-        PARTITION_TRACE_ERR("Partition table offset not found in flash.");
-        rc = PI_ERR_NOT_FOUND;
-        goto mount_error;
+        goto alloc_error;
     }
 
-    PARTITION_TRACE_TRC("Partition table offset 0x%lx", *table_offset_l2);
-    _table_offset = *table_offset_l2;
-    pi_l2_free(table_offset_l2, sizeof(*table_offset_l2));
-    table_offset_l2 = NULL;
-
-
-    // Load table header
-    pi_flash_read(flash, _table_offset, &table->header, sizeof(flash_partition_table_header_t));
+    loader->flash = flash;
+    loader->partition_table = partition_table;
+    loader->table = table;
+    loader->table_offset_l2 = table_offset_l2;
+    loader->status = status;
+    loader->step = 0;
+    loader->task = task;
 
-//print_partition_header(&table->header);
-
-    if(table->header.magic_bytes != PI_PARTITION_TABLE_HEADER_MAGIC)
-    {
-        PARTITION_TRACE_ERR("Partition table header magic number error\n");
-        rc = PI_ERR_NOT_FOUND;
-        goto mount_error;
-    }
-
-    if(table->header.format_version != PI_PARTITION_TABLE_FORMAT_VERSION)
-    {
-        PARTITION_TRACE_ERR("Partition table format version missmatch: flash version %u != BSP version %u\n",
-                   table->header.format_version,
-                   PI_PARTITION_TABLE_FORMAT_VERSION);
-        rc = PI_ERR_INVALID_VERSION;
-        goto mount_error;
-    }
+    flash_partition_table_load_step(loader);
 
-    // Alloc partition entries
-    table->partitions = pi_l2_malloc(sizeof(flash_partition_info_t) * table->header.nbr_of_entries);
-    if(table->partitions == NULL)
-    {
-        PARTITION_TRACE_ERR("Unable to allocate partition table entries.");
-        rc = PI_ERR_L2_NO_MEM;
-        goto mount_error;
-    }
+    return PI_OK;
 
-    pi_flash_read(flash, _table_offset + PI_PARTITION_HEADER_SIZE, table->partitions,
-                  sizeof(flash_partition_info_t) * table->header.nbr_of_entries);
+    alloc_error:
+    if(table)
+        pi_l2_free(table, sizeof(*table));
+    if(loader)
+        pi_l2_free(loader, sizeof(*loader));
+    return PI_ERR_L2_NO_MEM;
+}
 
+pi_err_t flash_partition_table_load(pi_device_t *flash, const flash_partition_table_t **partition_table,
+                                    uint8_t *nbr_of_entries)
+{
+    pi_err_t rc;
+    pi_err_t status;
+    pi_task_t task;
 
-    if(table->header.crc_flags)
-    {
-        rc = flash_partition_table_verify(table);
-        if(rc != PI_OK)
-        {
-            PARTITION_TRACE_ERR("Partitions table verification failed.\n");
-            pi_l2_free(table->partitions, sizeof(flash_partition_info_t) * table->header.nbr_of_entries);
-            goto mount_error;
-        }
-    }
+    rc = flash_partition_table_load_async(flash, partition_table, &status, pi_task_block(&task));
+    if(rc != PI_OK)
+        return rc;
 
-    table->flash = flash;
+    pi_task_wait_on(&task);
+    if(status != PI_OK)
+        return status;
 
-    *partition_table = table;
     if(nbr_of_entries)
-        *nbr_of_entries = table->header.nbr_of_entries;
+        *nbr_of_entries = (*partition_table)->header.nbr_of_entries;
 
     return PI_OK;
-
-    mount_error:
-    if(table_offset_l2)
-        pi_l2_free(table_offset_l2, sizeof(*table_offset_l2));
-    if(table)
-        pi_l2_free(table, sizeof(*table));
-    return rc;
 }
 
 void flash_partition_table_free(const flash_partition_table_t *table)
@@ -43,21 +43,205 @@ uint32_t pi_partition_get_flash_offset(const pi_partition_t *partition)
         return UINT32_MAX;
 }
 
+/*
+ * Partition tables are cached per flash device and shared by reference, so
+ * that they are read and verified only by the first load. A cached table
+ * stays in memory once released so that the next loads don't access the
+ * flash, until it is invalidated.
+ */
+
+// Load waiting for a table which is being read from the flash
+typedef struct pi_partition_table_waiter_s {
+    struct pi_partition_table_waiter_s *next;
+    const pi_partition_table_t *table;
+    pi_err_t *status;
+    pi_task_t *task;
+} pi_partition_table_waiter_t;
+
+typedef struct pi_partition_table_cache_s {
+    struct pi_partition_table_cache_s *next;
+    pi_device_t *flash;
+    const flash_partition_table_t *table;
+    uint32_t refcount;
+    uint8_t loading;
+    // Invalidated, it is freed once its last reference is released
+    uint8_t invalid;
+    pi_err_t status;
+    pi_task_t task;
+    pi_partition_table_waiter_t *waiters;
+} pi_partition_table_cache_t;
+
+static pi_partition_table_cache_t *partition_table_cache = NULL;
+
+static void pi_partition_table_cache_remove(pi_partition_table_cache_t *entry)
+{
+    pi_partition_table_cache_t **prev = &partition_table_cache;
+    
+    while (*prev != entry)
+        prev = &(*prev)->next;
+    *prev = entry->next;
+}
+
+static void pi_partition_table_loaded(void *arg)
+{
+    pi_partition_table_cache_t *entry = (pi_partition_table_cache_t *) arg;
+    pi_partition_table_waiter_t *waiter = entry->waiters;
+    pi_err_t status = entry->status;
+    
+    entry->loading = 0;
+    entry->waiters = NULL;
+    
+    if(status != PI_OK)
+        pi_partition_table_cache_remove(entry);
+    
+    while (waiter)
+    {
+        pi_partition_table_waiter_t *next = waiter->next;
+        
+        if(status == PI_OK)
+        {
+            entry->refcount++;
+            *(const flash_partition_table_t **) waiter->table = entry->table;
+        }
+        *waiter->status = status;
+        pi_task_push(waiter->task);
+        pi_l2_free(waiter, sizeof(*waiter));
+        
+        waiter = next;
+    }
+    
+    if(status != PI_OK)
+        pi_l2_free(entry, sizeof(*entry));
+}
+
 void pi_partition_table_free(pi_partition_table_t table)
 {
-    flash_partition_table_free((flash_partition_table_t *) table);
+    pi_partition_table_cache_t *entry = partition_table_cache;
+    
+    while (entry && entry->table != table)
+        entry = entry->next;
+    
+    if(entry == NULL)
+    {
+        flash_partition_table_free((flash_partition_table_t *) table);
+        return;
+    }
+    
+    entry->refcount--;
+    if(entry->refcount == 0 && entry->invalid)
+    {
+        pi_partition_table_cache_remove(entry);
+        flash_partition_table_free(entry->table);
+        pi_l2_free(entry, sizeof(*entry));
+    }
+}
+
+void pi_partition_table_invalidate(pi_device_t *flash)
+{
+    pi_partition_table_cache_t *entry = partition_table_cache;
+    
+    while (entry)
+    {
+        pi_partition_table_cache_t *next = entry->next;
+        
+        if(entry->flash == flash)
+        {
+            entry->invalid = 1;
+            if(entry->refcount == 0 && !entry->loading)
+            {
+                pi_partition_table_cache_remove(entry);
+                flash_partition_table_free(entry->table);
+                pi_l2_free(entry, sizeof(*entry));
+            }
+        }
+        
+        entry = next;
+    }
 }
 
 pi_err_t pi_partition_table_load(pi_device_t *flash, const pi_partition_table_t *table)
 {
     pi_err_t rc;
+    pi_err_t status;
+    pi_task_t task;
+    
+    rc = pi_partition_table_load_async(flash, table, &status, pi_task_block(&task));
+    if(rc != PI_OK)
+        return rc;
     
-    rc = flash_partition_table_load(flash, (const flash_partition_table_t **) table, NULL);
-//    if (rc == PI_OK)
+    pi_task_wait_on(&task);
+//    if (status == PI_OK)
 //    {
 //    flash_partition_print_partition_table((flash_partition_table_t *) *table);
 //    }
     
+    return status;
+}
+
+pi_err_t pi_partition_table_load_async(pi_device_t *flash, const pi_partition_table_t *table,
+                                      pi_err_t *status, pi_task_t *task)
+{
+    pi_partition_table_cache_t *entry = partition_table_cache;
+    pi_partition_table_waiter_t *waiter;
+    pi_err_t rc;
+    
+    if(table == NULL || status == NULL)
+        return PI_ERR_INVALID_ARG;
+    
+    while (entry && (entry->flash != flash || entry->invalid))
+        entry = entry->next;
+    
+    if(entry && !entry->loading)
+    {
+        entry->refcount++;
+        *(const flash_partition_table_t **) table = entry->table;
+        *status = PI_OK;
+        pi_task_push(task);
+        return PI_OK;
+    }
+    
+    waiter = pi_l2_malloc(sizeof(*waiter));
+    if(waiter == NULL)
+        return PI_ERR_L2_NO_MEM;
+    
+    waiter->table = table;
+    waiter->status = status;
+    waiter->task = task;
+    
+    // The table is already being read by another load
+    if(entry)
+    {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        return PI_OK;
+    }
+    
+    entry = pi_l2_malloc(sizeof(*entry));
+    if(entry == NULL)
+    {
+        pi_l2_free(waiter, sizeof(*waiter));
+        return PI_ERR_L2_NO_MEM;
+    }
+    
+    waiter->next = NULL;
+    entry->flash = flash;
+    entry->table = NULL;
+    entry->refcount = 0;
+    entry->loading = 1;
+    entry->invalid = 0;
+    entry->waiters = waiter;
+    entry->next = partition_table_cache;
+    partition_table_cache = entry;
+    
+    rc = flash_partition_table_load_async(flash, &entry->table, &entry->status,
+                                          pi_task_callback(&entry->task, pi_partition_table_loaded, entry));
+    if(rc != PI_OK)
+    {
+        pi_partition_table_cache_remove(entry);
+        pi_l2_free(entry, sizeof(*entry));
+        pi_l2_free(waiter, sizeof(*waiter));
+    }
+    
     return rc;
 }
 
@@ -54,31 +54,219 @@
 /*
   A semi general purpose memory allocator based on the assumption that when something is freed it's size is known.
   The rationnal is to get rid of the usual meta data overhead attached to traditionnal memory allocators.
+
+  Free chunks are kept in segregated lists of power of 2 size classes. An allocation takes the first chunk of the
+  first non-empty class whose chunks are all big enough, which is found from the class bitmap, and only walks the
+  class of the requested size if no bigger class is available.
+  A free looks for the free chunks ending and starting exactly at the freed area through the address hash tables
+  in order to coalesce them.
 */
 
-static inline void __free_chunk(alloc_chunk_extern_t *pt)
+static inline int __chunk_in_pool(extern_alloc_t *a, alloc_chunk_extern_t *pt)
+{
+  return pt >= a->pool && pt < a->pool + a->pool_size;
+}
+
+static inline void __free_chunk(extern_alloc_t *a, alloc_chunk_extern_t *pt)
+{
+  a->pool_used--;
+  if (__chunk_in_pool(a, pt)) {
+    pt->next = a->pool_free;
+    a->pool_free = pt;
+  } else {
+    pmsis_l2_malloc_free((void *)pt, sizeof(alloc_chunk_extern_t));
+  }
+}
+
+static inline alloc_chunk_extern_t *__alloc_chunk(extern_alloc_t *a)
+{
+  alloc_chunk_extern_t *pt = a->pool_free;
+  if (pt) {
+    a->pool_free = pt->next;
+  } else {
+    // Pool is exhausted, only go to the L2 heap if the policy allows it
+    if (a->overflow == EXTERN_ALLOC_OVERFLOW_FAIL) return NULL;
+    pt = (alloc_chunk_extern_t *)pmsis_l2_malloc(sizeof(alloc_chunk_extern_t));
+    if (pt == NULL) return NULL;
+  }
+  a->pool_used++;
+  if (a->pool_used > a->pool_peak) a->pool_peak = a->pool_used;
+  return pt;
+}
+
+// Tell if nb_chunks descriptors can be taken, which is only limited by the
+// pool with the fail overflow policy
+static inline int __chunks_available(extern_alloc_t *a, int nb_chunks)
+{
+  if (a->overflow != EXTERN_ALLOC_OVERFLOW_FAIL) return 1;
+  for (alloc_chunk_extern_t *pt = a->pool_free; pt && nb_chunks > 0; pt = pt->next) nb_chunks--;
+  return nb_chunks <= 0;
+}
+
+static inline int __size_class(int size)
+{
+  return 31 - __builtin_clz((unsigned int)size);
+}
+
+static inline unsigned int __addr_hash(extern_alloc_t *a, unsigned int addr)
+{
+  return ((addr / MIN_CHUNK_SIZE) * 2654435761u) >> (32 - a->hash_bits);
+}
+
+static void __class_insert(extern_alloc_t *a, alloc_chunk_extern_t *chunk)
+{
+  int class = __size_class(chunk->size);
+  chunk->prev = NULL;
+  chunk->next = a->free_lists[class];
+  if (chunk->next) chunk->next->prev = chunk;
+  a->free_lists[class] = chunk;
+  a->free_bitmap |= 1u << class;
+}
+
+static void __class_remove(extern_alloc_t *a, alloc_chunk_extern_t *chunk)
+{
+  int class = __size_class(chunk->size);
+  if (chunk->prev) chunk->prev->next = chunk->next; else a->free_lists[class] = chunk->next;
+  if (chunk->next) chunk->next->prev = chunk->prev;
+  if (a->free_lists[class] == NULL) a->free_bitmap &= ~(1u << class);
+}
+
+static void __start_hash_insert(extern_alloc_t *a, alloc_chunk_extern_t *chunk)
+{
+  unsigned int hash = __addr_hash(a, chunk->addr);
+  chunk->next_start = a->start_hash[hash];
+  a->start_hash[hash] = chunk;
+}
+
+static void __start_hash_remove(extern_alloc_t *a, alloc_chunk_extern_t *chunk)
+{
+  alloc_chunk_extern_t **pt = &a->start_hash[__addr_hash(a, chunk->addr)];
+  while (*pt != chunk) pt = &(*pt)->next_start;
+  *pt = chunk->next_start;
+}
+
+static alloc_chunk_extern_t *__start_hash_find(extern_alloc_t *a, unsigned int addr)
 {
-  pmsis_l2_malloc_free((void *)pt, sizeof(alloc_chunk_extern_t));
+  alloc_chunk_extern_t *pt = a->start_hash[__addr_hash(a, addr)];
+  while (pt && pt->addr != addr) pt = pt->next_start;
+  return pt;
 }
 
-static inline alloc_chunk_extern_t *__alloc_chunk()
+static void __end_hash_insert(extern_alloc_t *a, alloc_chunk_extern_t *chunk)
 {
-  return (alloc_chunk_extern_t *)pmsis_l2_malloc(sizeof(alloc_chunk_extern_t));
+  unsigned int hash = __addr_hash(a, chunk->addr + chunk->size);
+  chunk->next_end = a->end_hash[hash];
+  a->end_hash[hash] = chunk;
+}
+
+static void __end_hash_remove(extern_alloc_t *a, alloc_chunk_extern_t *chunk)
+{
+  alloc_chunk_extern_t **pt = &a->end_hash[__addr_hash(a, chunk->addr + chunk->size)];
+  while (*pt != chunk) pt = &(*pt)->next_end;
+  *pt = chunk->next_end;
+}
+
+static alloc_chunk_extern_t *__end_hash_find(extern_alloc_t *a, unsigned int addr)
+{
+  alloc_chunk_extern_t *pt = a->end_hash[__addr_hash(a, addr)];
+  while (pt && pt->addr + pt->size != addr) pt = pt->next_end;
+  return pt;
+}
+
+static int __hash_alloc(extern_alloc_t *a, int hash_bits)
+{
+  int hash_size = 1 << hash_bits;
+  alloc_chunk_extern_t **hash = (alloc_chunk_extern_t **)pmsis_l2_malloc(hash_size * 2 * sizeof(alloc_chunk_extern_t *));
+  if (hash == NULL) return -1;
+  memset(hash, 0, hash_size * 2 * sizeof(alloc_chunk_extern_t *));
+  a->start_hash = hash;
+  a->end_hash = hash + hash_size;
+  a->hash_bits = hash_bits;
+  return 0;
+}
+
+static inline void __hash_free(alloc_chunk_extern_t **hash, int hash_bits)
+{
+  pmsis_l2_malloc_free((void *)hash, (1 << hash_bits) * 2 * sizeof(alloc_chunk_extern_t *));
+}
+
+// Double the hash tables once there are more free chunks than buckets, to keep
+// the lookups in constant time. With the fail overflow policy, the number of
+// free chunks is bounded by the pool, which the tables are sized for, and the L2
+// heap is not used. If the tables can't be allocated, the current ones are
+// kept, which is still correct but slower.
+static void __hash_grow(extern_alloc_t *a)
+{
+  if (a->overflow == EXTERN_ALLOC_OVERFLOW_FAIL || a->nb_free_chunks <= (1u << a->hash_bits) || a->hash_bits >= 24)
+    return;
+
+  alloc_chunk_extern_t **hash = a->start_hash;
+  int hash_bits = a->hash_bits;
+
+  if (__hash_alloc(a, hash_bits + 1))
+    return;
+
+  __hash_free(hash, hash_bits);
+
+  for (int i = 0; i < EXTERN_ALLOC_NB_CLASSES; i++) {
+    for (alloc_chunk_extern_t *pt = a->free_lists[i]; pt; pt = pt->next) {
+      __start_hash_insert(a, pt);
+      __end_hash_insert(a, pt);
+    }
+  }
+}
+
+static void __chunk_insert(extern_alloc_t *a, alloc_chunk_extern_t *chunk)
+{
+  a->nb_free_chunks++;
+  __hash_grow(a);
+  __class_insert(a, chunk);
+  __start_hash_insert(a, chunk);
+  __end_hash_insert(a, chunk);
+}
+
+static void __chunk_remove(extern_alloc_t *a, alloc_chunk_extern_t *chunk)
+{
+  a->nb_free_chunks--;
+  __class_remove(a, chunk);
+  __start_hash_remove(a, chunk);
+  __end_hash_remove(a, chunk);
+}
+
+static void __alloc_account(extern_alloc_t *a, int size, int err)
+{
+  if (err) {
+    a->failed_allocs++;
+    return;
+  }
+
+  a->used += size;
+  if (a->used > a->peak_used) a->peak_used = a->used;
+  a->nb_allocs++;
+  a->total_allocs++;
+
+  int bin = __size_class(size) - 3;
+  if (bin < 0) bin = 0;
+  if (bin >= PI_RAM_ALLOC_STATS_NB_BINS) bin = PI_RAM_ALLOC_STATS_NB_BINS - 1;
+  a->histogram[bin]++;
 }
 
 void extern_alloc_info(extern_alloc_t *a, int *_size, void **first_chunk, int *_nb_chunks)
 {
-  if (first_chunk) *first_chunk = a->first_free;
+  if (first_chunk) {
+    *first_chunk = NULL;
+    if (a->free_bitmap) *first_chunk = a->free_lists[__builtin_ctz(a->free_bitmap)];
+  }
 
   if (_size || _nb_chunks) {
     int size = 0;
     int nb_chunks = 0;
 
-    alloc_chunk_extern_t *pt = a->first_free;
-
-    for (pt = a->first_free; pt; pt = pt->next) {
-      size += pt->size;
-      nb_chunks++;
+    for (int i = 0; i < EXTERN_ALLOC_NB_CLASSES; i++) {
+      for (alloc_chunk_extern_t *pt = a->free_lists[i]; pt; pt = pt->next) {
+        size += pt->size;
+        nb_chunks++;
+      }
     }
 
     if (_size) *_size = size;
@@ -88,38 +276,59 @@ void extern_alloc_info(extern_alloc_t *a, int *_size, void **first_chunk, int *_
 
 void extern_alloc_dump(extern_alloc_t *a)
 {
-  alloc_chunk_extern_t *pt = a->first_free;
-
   printf("======== Memory allocator state: ============\n");
-  for (pt = a->first_free; pt; pt = pt->next) {
-    printf("DUMP CHUNK %p ALLOC %p\n", pt, a);
-    printf("Free Block at %8X, size: %5d, Next: %8X ", pt->addr, pt->size, (unsigned int) pt->next);
-    if (pt == pt->next) {
-      printf(" CORRUPTED\n"); break;
-    } else printf("\n");
+  for (int i = 0; i < EXTERN_ALLOC_NB_CLASSES; i++) {
+    for (alloc_chunk_extern_t *pt = a->free_lists[i]; pt; pt = pt->next) {
+      printf("DUMP CHUNK %p ALLOC %p CLASS %d\n", pt, a, i);
+      printf("Free Block at %8X, size: %5d, Next: %8X ", pt->addr, pt->size, (unsigned int) pt->next);
+      if (pt == pt->next) {
+        printf(" CORRUPTED\n"); break;
+      } else printf("\n");
+    }
   }
   printf("=============================================\n");
 }
 
-int extern_alloc_init(extern_alloc_t *a, void *addr, int size)
+int extern_alloc_init(extern_alloc_t *a, void *addr, int size, int nb_chunks, int overflow)
 {
+  memset(a, 0, sizeof(extern_alloc_t));
+
+  if (nb_chunks <= 0) nb_chunks = EXTERN_ALLOC_DEFAULT_NB_CHUNKS;
+
+  a->pool = (alloc_chunk_extern_t *)pmsis_l2_malloc(nb_chunks * sizeof(alloc_chunk_extern_t));
+  if (a->pool == NULL) return -1;
+  a->pool_size = nb_chunks;
+  a->overflow = overflow;
+
+  for (int i = 0; i < nb_chunks; i++) {
+    a->pool[i].next = i == nb_chunks - 1 ? NULL : &a->pool[i + 1];
+  }
+  a->pool_free = a->pool;
+
+  // Size the hash tables for the pool, so that they don't need to grow as long
+  // as it is not exhausted
+  int hash_bits = EXTERN_ALLOC_HASH_BITS;
+  while ((1 << hash_bits) < nb_chunks && hash_bits < 24) hash_bits++;
+
+  if (__hash_alloc(a, hash_bits)) {
+    pmsis_l2_malloc_free((void *)a->pool, nb_chunks * sizeof(alloc_chunk_extern_t));
+    a->pool = NULL;
+    return -1;
+  }
+
   if (size)
   {
     unsigned int staaddr = ALIGN_UP((int)addr, MIN_CHUNK_SIZE);
-    alloc_chunk_extern_t *chunk = __alloc_chunk();
-    if (chunk == NULL) return -1;
     size = size - (staaddr - (unsigned int)addr);
+    size = ALIGN_DOWN(size, MIN_CHUNK_SIZE);
     if (size > 0) {
-      a->first_free = chunk;
-      chunk->size = ALIGN_DOWN(size, MIN_CHUNK_SIZE);
-      chunk->next = NULL;
+      alloc_chunk_extern_t *chunk = __alloc_chunk(a);
+      chunk->size = size;
       chunk->addr = staaddr;
+      __chunk_insert(a, chunk);
+      a->total_size = size;
     }
   }
-  else
-  {
-    a->first_free = NULL;
-  }
   return 0;
 }
 
@@ -127,33 +336,80 @@ int extern_alloc_init(extern_alloc_t *a, void *addr, int size)
 
 void extern_alloc_deinit(extern_alloc_t *a)
 {
-  __free_chunk(a->first_free);
+  for (int i = 0; i < EXTERN_ALLOC_NB_CLASSES; i++) {
+    alloc_chunk_extern_t *pt = a->free_lists[i];
+    while (pt) {
+      alloc_chunk_extern_t *next = pt->next;
+      if (!__chunk_in_pool(a, pt)) pmsis_l2_malloc_free((void *)pt, sizeof(alloc_chunk_extern_t));
+      pt = next;
+    }
+    a->free_lists[i] = NULL;
+  }
+  a->free_bitmap = 0;
+
+  if (a->pool) pmsis_l2_malloc_free((void *)a->pool, a->pool_size * sizeof(alloc_chunk_extern_t));
+  a->pool = NULL;
+  a->pool_free = NULL;
+  a->pool_size = 0;
+  a->pool_used = 0;
+
+  if (a->start_hash) __hash_free(a->start_hash, a->hash_bits);
+  a->start_hash = NULL;
+  a->end_hash = NULL;
 }
 
 
 
-int extern_alloc(extern_alloc_t *a, int size, void **chunk)
+void extern_alloc_pool_info(extern_alloc_t *a, int *size, int *used, int *peak)
 {
-  alloc_chunk_extern_t *pt = a->first_free, *prev = 0;
+  if (size) *size = a->pool_size;
+  if (used) *used = a->pool_used;
+  if (peak) *peak = a->pool_peak;
+}
+
+
 
+static int __extern_alloc(extern_alloc_t *a, int size, void **chunk)
+{
+  alloc_chunk_extern_t *pt = NULL;
+
+  if (size <= 0) size = MIN_CHUNK_SIZE;
   size = ALIGN_UP(size, MIN_CHUNK_SIZE);
 
-  while (pt && (pt->size < size)) { prev = pt; pt = pt->next; }
+  int class = __size_class(size);
+
+  if ((size & (size - 1)) == 0 && a->free_lists[class]) {
+    // Power of 2, all the chunks of its own class are big enough
+    pt = a->free_lists[class];
+  } else {
+    // Otherwise take the first chunk of the first bigger class, they are all big enough
+    uint32_t bigger = class < EXTERN_ALLOC_NB_CLASSES - 1 ? a->free_bitmap & (~0u << (class + 1)) : 0;
+    if (bigger) {
+      pt = a->free_lists[__builtin_ctz(bigger)];
+    } else {
+      // Last chance, look for a big enough chunk in its own class
+      for (pt = a->free_lists[class]; pt && pt->size < size; pt = pt->next);
+    }
+  }
 
   if (pt) {
     if (pt->size == size) {
       // Special case where the whole block disappears
       // This special case is interesting to support when we allocate aligned pages, to limit fragmentation
-      if (prev) prev->next = pt->next; else a->first_free = pt->next;
+      __chunk_remove(a, pt);
       void *addr = (void *)pt->addr;
-      __free_chunk(pt);
+      __free_chunk(a, pt);
       *chunk = addr;
       return 0;
     } else {
       // The free block is bigger than needed
       // Return the end of the block in order to just update the free block size
       void *result = (void *)((char *)pt->addr + pt->size - size);
+      __class_remove(a, pt);
+      __end_hash_remove(a, pt);
       pt->size = pt->size - size;
+      __class_insert(a, pt);
+      __end_hash_insert(a, pt);
       *chunk = result;
       return 0;
     }
@@ -164,77 +420,155 @@ int extern_alloc(extern_alloc_t *a, int size, void **chunk)
   }
 }
 
+static int __extern_free(extern_alloc_t *a, int size, void *addr);
+
 int extern_alloc_align(extern_alloc_t *a, int size, int align, void **chunk)
 {
 
-  if (align < (int)sizeof(alloc_chunk_extern_t)) return extern_alloc(a, size, chunk);
+  if (align <= MIN_CHUNK_SIZE) return extern_alloc(a, size, chunk);
+
+  int err = -1;
 
   // As the user must give back the size of the allocated chunk when freeing it, we must allocate
   // an aligned chunk with exactly the right size
   // To do so, we allocate a bigger chunk and we free what is before and what is after
+  size = ALIGN_UP(size, MIN_CHUNK_SIZE);
 
   // We reserve enough space to free the remaining room before and after the aligned chunk
-  int size_align = size + align + sizeof(alloc_chunk_extern_t) * 2;
+  int size_align = size + align + MIN_CHUNK_SIZE * 2;
   unsigned int result;
-  if (extern_alloc(a, size_align, (void **)&result))
-    return -1;
+  if (__extern_alloc(a, size_align, (void **)&result))
+    goto end;
 
   unsigned int result_align = (result + align - 1) & -align;
   unsigned int headersize = result_align - result;
 
+  // Each part freed before and after the aligned chunk needs a descriptor if it can't be merged with a free
+  // neighbour. If they can't all be taken, the whole chunk is given back, which only merges it back or reuses the
+  // descriptor it released, instead of leaking the part whose free would fail.
+  int needed = (headersize != 0 && !__end_hash_find(a, result)) + !__start_hash_find(a, result + size_align);
+  if (!__chunks_available(a, needed)) {
+    __extern_free(a, size_align, (void *)result);
+    *chunk = (void *)0xffffffff;
+    goto end;
+  }
+
   // In case we don't get an aligned chunk at first, we must free the room before the first aligned one
   if (headersize != 0) {
-
-    // If we don't have enough room before the aligned chunk for freeing the header, take the next aligned one
-    if (result_align - result < sizeof(alloc_chunk_extern_t)) result_align += align;
-
     // Free the header
-    extern_free(a, headersize, (void *)result);
+    __extern_free(a, headersize, (void *)result);
   }
 
   // Now free what remains after
-  extern_free(a, size_align - headersize - size, (unsigned char *)(result_align + size));
+  __extern_free(a, size_align - headersize - size, (unsigned char *)(result_align + size));
 
   *chunk = (void *)result_align;
-  return 0;
+  err = 0;
+
+end:
+  __alloc_account(a, size, err);
+  return err;
 }
 
-int __attribute__((noinline)) extern_free(extern_alloc_t *a, int size, void *addr)
+static int __extern_free(extern_alloc_t *a, int size, void *addr)
 
 {
-  alloc_chunk_extern_t *chunk;
-  alloc_chunk_extern_t *next = a->first_free, *prev = 0;
   size = ALIGN_UP(size, MIN_CHUNK_SIZE);
 
-  while (next && next->addr < (unsigned int)addr) {
-    prev = next; next = next->next; 
-  }
-
-  if (next && ((char *)addr + size) == (char *)next->addr) {
+  if (size == 0) return 0;
+
+  alloc_chunk_extern_t *prev = __end_hash_find(a, (unsigned int)addr);
+  alloc_chunk_extern_t *next = __start_hash_find(a, (unsigned int)addr + size);
+
+  if (prev && next) {
+    /* Coalesce with both, next descriptor is not needed anymore */
+    __chunk_remove(a, next);
+    __class_remove(a, prev);
+    __end_hash_remove(a, prev);
+    prev->size += size + next->size;
+    __class_insert(a, prev);
+    __end_hash_insert(a, prev);
+    __free_chunk(a, next);
+  } else if (prev) {
+    /* Coalesce with previous */
+    __class_remove(a, prev);
+    __end_hash_remove(a, prev);
+    prev->size += size;
+    __class_insert(a, prev);
+    __end_hash_insert(a, prev);
+  } else if (next) {
     /* Coalesce with next */
-    next->size = size + next->size;
+    __class_remove(a, next);
+    __start_hash_remove(a, next);
+    next->size += size;
     next->addr = (unsigned int)addr;
-    chunk = next;
+    __class_insert(a, next);
+    __start_hash_insert(a, next);
   } else {
-    chunk = __alloc_chunk();
+    alloc_chunk_extern_t *chunk = __alloc_chunk(a);
     if (chunk == NULL) return -1;
     chunk->size = size;
-    chunk->next = next;
     chunk->addr = (unsigned int)addr;
+    __chunk_insert(a, chunk);
   }
 
-  if (prev) {
-    if (((char *)prev->addr + prev->size) == (char *)addr) {
-      /* Coalesce with previous */
-      prev->size += chunk->size;
-      prev->next = chunk->next;
-      __free_chunk(chunk);
-    } else {
-      prev->next = chunk;
+  return 0;
+}
+
+
+
+int extern_alloc(extern_alloc_t *a, int size, void **chunk)
+{
+  if (size <= 0) size = MIN_CHUNK_SIZE;
+  int err = __extern_alloc(a, size, chunk);
+  __alloc_account(a, ALIGN_UP(size, MIN_CHUNK_SIZE), err);
+  return err;
+}
+
+
+
+int __attribute__((noinline)) extern_free(extern_alloc_t *a, int size, void *addr)
+{
+  int err = __extern_free(a, size, addr);
+  if (!err) {
+    a->used -= ALIGN_UP(size, MIN_CHUNK_SIZE);
+    if (a->nb_allocs) a->nb_allocs--;
+  }
+  return err;
+}
+
+
+
+void extern_alloc_stats(extern_alloc_t *a, struct pi_ram_alloc_stats *stats)
+{
+  stats->total_free = a->total_size - a->used;
+  stats->largest_free = 0;
+  stats->nb_fragments = a->nb_free_chunks;
+  stats->used = a->used;
+  stats->peak_used = a->peak_used;
+  stats->nb_allocs = a->nb_allocs;
+  stats->total_allocs = a->total_allocs;
+  stats->failed_allocs = a->failed_allocs;
+  stats->pool_size = a->pool_size;
+  stats->pool_peak = a->pool_peak;
+  memcpy(stats->histogram, a->histogram, sizeof(a->histogram));
+
+  // The largest chunk is in the highest non-empty class
+  if (a->free_bitmap) {
+    int class = 31 - __builtin_clz(a->free_bitmap);
+    for (alloc_chunk_extern_t *pt = a->free_lists[class]; pt; pt = pt->next) {
+      if ((uint32_t)pt->size > stats->largest_free) stats->largest_free = pt->size;
     }
-  } else {
-    a->first_free = chunk;
   }
+}
 
-  return 0;
+
+
+void extern_alloc_stats_reset(extern_alloc_t *a)
+{
+  a->peak_used = a->used;
+  a->pool_peak = a->pool_used;
+  a->total_allocs = 0;
+  a->failed_allocs = 0;
+  memset(a->histogram, 0, sizeof(a->histogram));
 }
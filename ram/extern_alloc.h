@@ -17,21 +17,69 @@
 #ifndef __EXTERN_ALLOC_H__
 #define __EXTERN_ALLOC_H__
 
+#include <stdint.h>
+#include "bsp/ram.h"
+
+
+// Number of size classes. Class i contains the free chunks whose size is in
+// [2^i, 2^(i+1)[.
+#define EXTERN_ALLOC_NB_CLASSES 32
+
+// Minimum number of buckets of the hash tables used to find the free
+// neighbours of a chunk when it is freed. The tables are sized for the pool
+// and doubled when there are more free chunks than buckets.
+#define EXTERN_ALLOC_HASH_BITS  6
 
 typedef struct alloc_block_extern_s {
   int                      size;
   struct alloc_block_extern_s *next;
   unsigned int             addr;
+  struct alloc_block_extern_s *prev;
+  struct alloc_block_extern_s *next_start;
+  struct alloc_block_extern_s *next_end;
 } alloc_chunk_extern_t;
 
+// Default number of descriptors of the allocator pool.
+#define EXTERN_ALLOC_DEFAULT_NB_CHUNKS 64
+
+// What to do when a free chunk must be described and the pool is exhausted.
+#define EXTERN_ALLOC_OVERFLOW_L2   0  // Allocate the descriptor from the L2 heap.
+#define EXTERN_ALLOC_OVERFLOW_FAIL 1  // Make the free fail.
+
+// As the external memory cannot be directly accessed, the free chunks are
+// described by descriptors taken from a pool allocated in L2 when the
+// allocator is initialized, so that allocations and frees do not use the L2
+// heap as long as the pool is big enough. They are sorted into segregated
+// lists, one per power of 2 size class, with a bitmap of the non-empty
+// classes, and are also hashed by start and end address so that they can be
+// coalesced in constant time. The start and end hash tables are allocated
+// together in L2.
 typedef struct {
-  alloc_chunk_extern_t *first_free;
+  alloc_chunk_extern_t *free_lists[EXTERN_ALLOC_NB_CLASSES];
+  uint32_t free_bitmap;
+  alloc_chunk_extern_t **start_hash;
+  alloc_chunk_extern_t **end_hash;
+  int hash_bits;
+  alloc_chunk_extern_t *pool;
+  alloc_chunk_extern_t *pool_free;
+  int pool_size;
+  int pool_used;
+  int pool_peak;
+  int overflow;
+  uint32_t total_size;
+  uint32_t nb_free_chunks;
+  uint32_t used;
+  uint32_t peak_used;
+  uint32_t nb_allocs;
+  uint32_t total_allocs;
+  uint32_t failed_allocs;
+  uint32_t histogram[PI_RAM_ALLOC_STATS_NB_BINS];
 } extern_alloc_t;
 
 
 /// @cond IMPLEM
 
-int extern_alloc_init(extern_alloc_t *a, void *_chunk, int size);
+int extern_alloc_init(extern_alloc_t *a, void *_chunk, int size, int nb_chunks, int overflow);
 
 void extern_alloc_deinit(extern_alloc_t *a);
 
@@ -45,6 +93,12 @@ void extern_alloc_info(extern_alloc_t *a, int *size, void **first_chunk, int *nb
 
 void extern_alloc_dump(extern_alloc_t *a);
 
+void extern_alloc_pool_info(extern_alloc_t *a, int *size, int *used, int *peak);
+
+void extern_alloc_stats(extern_alloc_t *a, struct pi_ram_alloc_stats *stats);
+
+void extern_alloc_stats_reset(extern_alloc_t *a);
+
 
 /// @endcond
 
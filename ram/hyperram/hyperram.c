@@ -58,7 +58,7 @@ static int hyperram_open(struct pi_device *device)
     start_addr = 4;
   }
 
-  if (extern_alloc_init(&hyperram->alloc, (void *)start_addr, size))
+  if (extern_alloc_init(&hyperram->alloc, (void *)start_addr, size, conf->ram.alloc_nb_chunks, conf->ram.alloc_overflow))
   {
       goto error;
   }
@@ -167,6 +167,25 @@ int hyperram_free(struct pi_device *device, uint32_t addr, uint32_t size)
 }
 
 
+
+static int32_t hyperram_ioctl(struct pi_device *device, uint32_t cmd, void *arg)
+{
+  hyperram_t *hyperram = (hyperram_t *)device->data;
+
+  switch (cmd)
+  {
+    case PI_RAM_IOCTL_ALLOC_STATS:
+      extern_alloc_stats(&hyperram->alloc, (struct pi_ram_alloc_stats *)arg);
+      return 0;
+
+    case PI_RAM_IOCTL_ALLOC_STATS_RESET:
+      extern_alloc_stats_reset(&hyperram->alloc);
+      return 0;
+  }
+  return -1;
+}
+
+
 #if 0
 
 void __pi_hyperram_alloc_cluster_req(void *_req)
@@ -223,12 +242,14 @@ static pi_ram_api_t hyperram_api = {
   .copy_2d_async        = &hyperram_copy_2d_async,
   .alloc                = &hyperram_alloc,
   .free                 = &hyperram_free,
+  .ioctl                = &hyperram_ioctl,
 };
 
 
 void pi_hyperram_conf_init(struct pi_hyperram_conf *conf)
 {
   conf->ram.api = &hyperram_api;
+  __pi_ram_conf_init(&conf->ram);
   conf->baudrate = 0;
   conf->xip_en = 0;
   conf->reserve_addr_0 = 1;
@@ -31,6 +31,8 @@ int32_t pi_ram_open(struct pi_device *device)
 
 void __pi_ram_conf_init(struct pi_ram_conf *conf)
 {
+    conf->alloc_nb_chunks = 0;
+    conf->alloc_overflow = PI_RAM_ALLOC_OVERFLOW_L2;
 }
 
 
@@ -66,7 +66,7 @@ static int aps25xxxn_open(struct pi_device *device)
     start_addr = 4;
   }
 
-  if (extern_alloc_init(&aps25xxxn->alloc, (void *)start_addr, size))
+  if (extern_alloc_init(&aps25xxxn->alloc, (void *)start_addr, size, conf->ram.alloc_nb_chunks, conf->ram.alloc_overflow))
   {
       goto error;
   }
@@ -170,6 +170,25 @@ int aps25xxxn_free(struct pi_device *device, uint32_t addr, uint32_t size)
 }
 
 
+
+static int32_t aps25xxxn_ioctl(struct pi_device *device, uint32_t cmd, void *arg)
+{
+  aps25xxxn_t *aps25xxxn = (aps25xxxn_t *)device->data;
+
+  switch (cmd)
+  {
+    case PI_RAM_IOCTL_ALLOC_STATS:
+      extern_alloc_stats(&aps25xxxn->alloc, (struct pi_ram_alloc_stats *)arg);
+      return 0;
+
+    case PI_RAM_IOCTL_ALLOC_STATS_RESET:
+      extern_alloc_stats_reset(&aps25xxxn->alloc);
+      return 0;
+  }
+  return -1;
+}
+
+
 static pi_ram_api_t aps25xxxn_api = {
   .open                 = &aps25xxxn_open,
   .close                = &aps25xxxn_close,
@@ -177,12 +196,14 @@ static pi_ram_api_t aps25xxxn_api = {
   .copy_2d_async        = &aps25xxxn_copy_2d_async,
   .alloc                = &aps25xxxn_alloc,
   .free                 = &aps25xxxn_free,
+  .ioctl                = &aps25xxxn_ioctl,
 };
 
 
 void pi_aps25xxxn_conf_init(struct pi_aps25xxxn_conf *conf)
 {
   conf->ram.api = &aps25xxxn_api;
+  __pi_ram_conf_init(&conf->ram);
   conf->baudrate = 0;
   conf->xip_en = 0;
   conf->reserve_addr_0 = 1;
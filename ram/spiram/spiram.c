@@ -78,7 +78,7 @@ static int spiram_open(struct pi_device *device)
 
     device->data = (void *)spiram;
 
-    if (extern_alloc_init(&spiram->alloc, 0, conf->ram_size))
+    if (extern_alloc_init(&spiram->alloc, 0, conf->ram_size, conf->ram.alloc_nb_chunks, conf->ram.alloc_overflow))
     {
         POS_WARNING("[SPIRAM] Error during driver opening: failed to allocate memory for internal structure\n");
         goto error2;
@@ -233,6 +233,25 @@ int spiram_free(struct pi_device *device, uint32_t addr, uint32_t size)
 }
 
 
+
+static int32_t spiram_ioctl(struct pi_device *device, uint32_t cmd, void *arg)
+{
+    spiram_t *spiram = (spiram_t *)device->data;
+
+    switch (cmd)
+    {
+        case PI_RAM_IOCTL_ALLOC_STATS:
+            extern_alloc_stats(&spiram->alloc, (struct pi_ram_alloc_stats *)arg);
+            return 0;
+
+        case PI_RAM_IOCTL_ALLOC_STATS_RESET:
+            extern_alloc_stats_reset(&spiram->alloc);
+            return 0;
+    }
+    return -1;
+}
+
+
 #if 0
 
 void __pi_spiram_alloc_cluster_req(void *_req)
@@ -289,12 +308,14 @@ static pi_ram_api_t spiram_api = {
     .copy_2d_async        = &spiram_copy_2d_async,
     .alloc                = &spiram_alloc,
     .free                 = &spiram_free,
+    .ioctl                = &spiram_ioctl,
 };
 
 
 void pi_spiram_conf_init(struct pi_spiram_conf *conf)
 {
     conf->ram.api = &spiram_api;
+    __pi_ram_conf_init(&conf->ram);
     conf->baudrate = 24000000;
     bsp_spiram_conf_init(conf);
 }
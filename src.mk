@@ -9,13 +9,17 @@ BSP_SPIFLASH_SRC = flash/spiflash/spiflash.c
 BSP_HYPERRAM_SRC = ram/hyperram/hyperram.c
 BSP_SPIRAM_SRC = ram/spiram/spiram.c
 BSP_RAM_SRC = ram/ram.c ram/alloc_extern.c
-BSP_OTA_SRC = ota/ota.c ota/ota_utility.c ota/updater.c
+BSP_OTA_SRC = ota/ota.c ota/ota_utility.c ota/updater.c ota/delta_updater.c
 BSP_BOOTLOADER_SRC = bootloader/bootloader_utility.c
 BSP_NINA_SRC = transport/transport.c transport/nina_w10/nina_w10.c
 BSP_24XX1025_SRC = eeprom/24XX1025.c
 BSP_VIRTUAL_EEPROM_SRC = eeprom/virtual_eeprom.c
 BSP_MRAM_SRC = flash/mram/mram-v2.c
 
+# Host only sources, they need a POSIX system and must not be added to the
+# target source lists
+BSP_SIMFLASH_SRC = flash/simflash/simflash.c
+
 COMMON_SRC = \
   $(BSP_FLASH_SRC) \
   $(BSP_FS_SRC) \